@@ -0,0 +1,445 @@
+// offline benchmark, drives the estimator from a dataset on disk without ros.
+//
+// usage: benchmark <config.yaml> <kitti|euroc> <dataset> [options]
+//   --rate N              play at N times real time, 0 is as fast as the pipeline accepts (default)
+//   --ground_truth FILE   kitti poses, tum or euroc csv, to compute ATE and RPE
+//   --result FILE         write keyframe poses (time,x,y,z,qx,qy,qz,qw)
+//   --metrics FILE        write per-stage latency as csv
+//   --timeout S           max seconds to wait for the backend after the last frame (default 30)
+//
+// kitti: <dataset>/times.txt, image_0/, image_1/, velodyne/ (if use_lidar)
+// euroc: <dataset>/mav0/cam0/data.csv, cam1/data.csv, imu0/data.csv
+// both:  <dataset>/navsat.csv (if use_navsat), time,x,y,z,cov_x,cov_y,cov_z in a local frame
+
+#include "lvio_fusion/estimator.h"
+#include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+using namespace lvio_fusion;
+
+enum class InputType
+{
+    IMAGE,
+    IMU,
+    LIDAR,
+    NAVSAT
+};
+
+struct Input
+{
+    double time;
+    InputType type;
+    std::string left, right; // image files or lidar file
+    Vector3d v1, v2;         // acc and gyr, or position and covariance of navsat
+};
+
+struct PoseStamped
+{
+    double time;
+    Vector3d t;
+};
+
+// read lines of a csv or space separated file, skip comments
+std::vector<std::vector<std::string>> read_table(const std::string &path)
+{
+    std::vector<std::vector<std::string>> table;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::stringstream ss(line);
+        std::vector<std::string> row;
+        std::string item;
+        while (ss >> item)
+        {
+            row.push_back(item);
+        }
+        if (!row.empty())
+        {
+            table.push_back(row);
+        }
+    }
+    return table;
+}
+
+std::string kitti_file(const std::string &dir, int i, const std::string &ext)
+{
+    std::stringstream ss;
+    ss << dir << "/" << std::setfill('0') << std::setw(6) << i << ext;
+    return ss.str();
+}
+
+bool load_kitti(const std::string &dataset, bool use_lidar, std::vector<Input> &inputs)
+{
+    auto times = read_table(dataset + "/times.txt");
+    if (times.empty())
+    {
+        LOG(ERROR) << "Can not read " << dataset << "/times.txt";
+        return false;
+    }
+    for (int i = 0; i < (int)times.size(); i++)
+    {
+        Input input;
+        input.time = std::stod(times[i][0]);
+        input.type = InputType::IMAGE;
+        input.left = kitti_file(dataset + "/image_0", i, ".png");
+        input.right = kitti_file(dataset + "/image_1", i, ".png");
+        inputs.push_back(input);
+        if (use_lidar)
+        {
+            input.type = InputType::LIDAR;
+            input.left = kitti_file(dataset + "/velodyne", i, ".bin");
+            inputs.push_back(input);
+        }
+    }
+    return true;
+}
+
+bool load_euroc(const std::string &dataset, bool use_imu, std::vector<Input> &inputs)
+{
+    auto cam0 = read_table(dataset + "/mav0/cam0/data.csv");
+    auto cam1 = read_table(dataset + "/mav0/cam1/data.csv");
+    if (cam0.empty() || cam0.size() != cam1.size())
+    {
+        LOG(ERROR) << "Can not read stereo images in " << dataset << "/mav0";
+        return false;
+    }
+    for (int i = 0; i < (int)cam0.size(); i++)
+    {
+        Input input;
+        input.time = std::stod(cam0[i][0]) * 1e-9;
+        input.type = InputType::IMAGE;
+        input.left = dataset + "/mav0/cam0/data/" + cam0[i][1];
+        input.right = dataset + "/mav0/cam1/data/" + cam1[i][1];
+        inputs.push_back(input);
+    }
+    if (use_imu)
+    {
+        for (auto &row : read_table(dataset + "/mav0/imu0/data.csv"))
+        {
+            Input input;
+            input.time = std::stod(row[0]) * 1e-9;
+            input.type = InputType::IMU;
+            input.v2 = Vector3d(std::stod(row[1]), std::stod(row[2]), std::stod(row[3]));
+            input.v1 = Vector3d(std::stod(row[4]), std::stod(row[5]), std::stod(row[6]));
+            inputs.push_back(input);
+        }
+    }
+    return true;
+}
+
+void load_navsat(const std::string &dataset, std::vector<Input> &inputs)
+{
+    for (auto &row : read_table(dataset + "/navsat.csv"))
+    {
+        Input input;
+        input.time = std::stod(row[0]);
+        input.type = InputType::NAVSAT;
+        input.v1 = Vector3d(std::stod(row[1]), std::stod(row[2]), std::stod(row[3]));
+        input.v2 = Vector3d(std::stod(row[4]), std::stod(row[5]), std::stod(row[6]));
+        inputs.push_back(input);
+    }
+}
+
+// kitti poses (12 columns, one line per image), tum (8 columns) or euroc csv (ns, p, q, ...)
+std::vector<PoseStamped> load_ground_truth(const std::string &path, const std::vector<double> &image_times)
+{
+    std::vector<PoseStamped> poses;
+    auto table = read_table(path);
+    for (int i = 0; i < (int)table.size(); i++)
+    {
+        auto &row = table[i];
+        PoseStamped pose;
+        if (row.size() == 12)
+        {
+            if (i >= (int)image_times.size())
+                break;
+            pose.time = image_times[i];
+            pose.t = Vector3d(std::stod(row[3]), std::stod(row[7]), std::stod(row[11]));
+        }
+        else if (row.size() == 8)
+        {
+            pose.time = std::stod(row[0]);
+            pose.t = Vector3d(std::stod(row[1]), std::stod(row[2]), std::stod(row[3]));
+        }
+        else if (row.size() > 8)
+        {
+            pose.time = std::stod(row[0]) * 1e-9;
+            pose.t = Vector3d(std::stod(row[1]), std::stod(row[2]), std::stod(row[3]));
+        }
+        else
+        {
+            continue;
+        }
+        poses.push_back(pose);
+    }
+    return poses;
+}
+
+// linear interpolation of the ground truth position
+bool interpolate(const std::vector<PoseStamped> &poses, double time, Vector3d &t)
+{
+    auto iter = std::lower_bound(poses.begin(), poses.end(), time,
+                                 [](const PoseStamped &pose, double time) { return pose.time < time; });
+    if (iter == poses.end() || iter == poses.begin() && iter->time - time > epsilon)
+        return false;
+    if (iter->time - time < epsilon)
+    {
+        t = iter->t;
+        return true;
+    }
+    auto prev = iter - 1;
+    if (iter->time - prev->time > 0.2)
+        return false;
+    double s = (time - prev->time) / (iter->time - prev->time);
+    t = (1 - s) * prev->t + s * iter->t;
+    return true;
+}
+
+// ATE after aligning the trajectory, and RPE between consecutive keyframes
+void evaluate(const std::vector<PoseStamped> &ground_truth)
+{
+    std::vector<Vector3d> estimated, expected;
+    for (auto &pair : *lvio_fusion::Map::Instance().GetSnapshot())
+    {
+        Vector3d t;
+        if (interpolate(ground_truth, pair.first, t))
+        {
+            estimated.push_back(pair.second->t());
+            expected.push_back(t);
+        }
+    }
+    if (estimated.size() < 3)
+    {
+        LOG(WARNING) << "Too few keyframes are covered by the ground truth.";
+        return;
+    }
+    int n = estimated.size();
+    Eigen::Matrix3Xd src(3, n), dst(3, n);
+    for (int i = 0; i < n; i++)
+    {
+        src.col(i) = estimated[i];
+        dst.col(i) = expected[i];
+    }
+    Matrix4d T = Eigen::umeyama(src, dst, false);
+    Matrix3d R = T.block<3, 3>(0, 0);
+    Vector3d t = T.block<3, 1>(0, 3);
+    double ate = 0, rpe = 0;
+    for (int i = 0; i < n; i++)
+    {
+        ate += (R * estimated[i] + t - expected[i]).squaredNorm();
+        if (i > 0)
+        {
+            rpe += (R * (estimated[i] - estimated[i - 1]) - (expected[i] - expected[i - 1])).squaredNorm();
+        }
+    }
+    std::cout << "ATE (rmse): " << std::sqrt(ate / n) << " m, RPE (rmse, consecutive keyframes): "
+              << std::sqrt(rpe / (n - 1)) << " m, over " << n << " keyframes" << std::endl;
+}
+
+void write_result(const std::string &path)
+{
+    std::ofstream out(path, std::ios::out);
+    out.setf(std::ios::fixed, std::ios::floatfield);
+    out.precision(5);
+    for (auto &pair : *lvio_fusion::Map::Instance().GetSnapshot())
+    {
+        Vector3d t = pair.second->pose.translation();
+        Quaterniond q = pair.second->pose.unit_quaternion();
+        out << pair.first << "," << t.x() << "," << t.y() << "," << t.z() << ","
+            << q.x() << "," << q.y() << "," << q.z() << "," << q.w() << std::endl;
+    }
+}
+
+Point3Cloud::Ptr read_velodyne(const std::string &path)
+{
+    Point3Cloud::Ptr points(new Point3Cloud);
+    std::ifstream in(path, std::ios::binary);
+    float data[4];
+    while (in.read((char *)data, sizeof(data)))
+    {
+        points->push_back(Point3(data[0], data[1], data[2]));
+    }
+    return points;
+}
+
+cv::Mat read_image(const std::string &path)
+{
+    cv::Mat image = cv::imread(path, cv::IMREAD_GRAYSCALE);
+    if (!image.empty())
+    {
+        cv::equalizeHist(image, image);
+    }
+    return image;
+}
+
+int main(int argc, char **argv)
+{
+    google::InitGoogleLogging(argv[0]);
+    if (argc < 4)
+    {
+        std::cerr << "usage: benchmark <config.yaml> <kitti|euroc> <dataset> [--rate N] [--ground_truth FILE] "
+                     "[--result FILE] [--metrics FILE] [--timeout S]"
+                  << std::endl;
+        return 1;
+    }
+    std::string config_file = argv[1], format = argv[2], dataset = argv[3];
+    std::string ground_truth_path, result_path, metrics_path;
+    double rate = 0, timeout = 30;
+    for (int i = 4; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        if (key == "--rate")
+            rate = std::stod(argv[i + 1]);
+        else if (key == "--ground_truth")
+            ground_truth_path = argv[i + 1];
+        else if (key == "--result")
+            result_path = argv[i + 1];
+        else if (key == "--metrics")
+            metrics_path = argv[i + 1];
+        else if (key == "--timeout")
+            timeout = std::stod(argv[i + 1]);
+        else
+            LOG(WARNING) << "Unknown option " << key;
+    }
+
+    cv::FileStorage settings(config_file, cv::FileStorage::READ);
+    if (!settings.isOpened())
+    {
+        LOG(ERROR) << "Can not open " << config_file;
+        return 1;
+    }
+    int use_imu = settings["use_imu"], use_lidar = settings["use_lidar"], use_navsat = settings["use_navsat"],
+        use_loop = settings["use_loop"], use_adapt = settings["use_adapt"];
+    double window_size = settings["windows_size"];
+    settings.release();
+
+    std::vector<Input> inputs;
+    bool success = format == "kitti" ? load_kitti(dataset, use_lidar, inputs) : load_euroc(dataset, use_imu, inputs);
+    if (!success)
+        return 1;
+    if (use_navsat)
+    {
+        load_navsat(dataset, inputs);
+    }
+    // sensors are fed in time order, imu before the image of the same time
+    std::stable_sort(inputs.begin(), inputs.end(), [](const Input &a, const Input &b) {
+        return a.time < b.time || (a.time == b.time && a.type == InputType::IMU && b.type != InputType::IMU);
+    });
+    std::vector<double> image_times;
+    for (auto &input : inputs)
+    {
+        if (input.type == InputType::IMAGE)
+        {
+            image_times.push_back(input.time);
+        }
+    }
+
+    Estimator::Ptr estimator(new Estimator(config_file));
+    if (!estimator->Init(use_imu, use_lidar, use_navsat, use_loop, use_adapt))
+    {
+        LOG(ERROR) << "Can not init the estimator.";
+        return 1;
+    }
+
+    // feed
+    auto start = std::chrono::steady_clock::now();
+    double start_time = inputs.front().time;
+    int num_images = 0;
+    for (auto &input : inputs)
+    {
+        if (rate > 0)
+        {
+            std::this_thread::sleep_until(start + std::chrono::duration<double>((input.time - start_time) / rate));
+        }
+        switch (input.type)
+        {
+        case InputType::IMAGE:
+        {
+            cv::Mat left = read_image(input.left), right = read_image(input.right);
+            if (left.empty() || right.empty())
+            {
+                LOG(WARNING) << "Can not read " << input.left;
+                continue;
+            }
+            estimator->InputImage(input.time, left, right, SE3d());
+            num_images++;
+            break;
+        }
+        case InputType::IMU:
+            estimator->InputImu(input.time, input.v1, input.v2);
+            break;
+        case InputType::LIDAR:
+            estimator->InputPointCloud(input.time, read_velodyne(input.left));
+            break;
+        case InputType::NAVSAT:
+            estimator->InputNavSat(input.time, input.v1.x(), input.v1.y(), input.v1.z(), input.v2);
+            break;
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+
+    // wait for the backend to optimize the last keyframe, keyframes after finished are in the window
+    double last_time = image_times.back();
+    while (std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - t1).count() < timeout)
+    {
+        {
+            std::unique_lock<std::mutex> lock(estimator->backend->mutex);
+            auto keyframes = lvio_fusion::Map::Instance().GetSnapshot();
+            if (keyframes->empty() || estimator->backend->finished + window_size >= keyframes->rbegin()->first)
+                break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    auto feed_time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t1 - start);
+    auto total_time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - start);
+
+    std::unique_lock<std::mutex> lock(estimator->backend->mutex);
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "Frames: " << num_images << ", keyframes: " << lvio_fusion::Map::Instance().size()
+              << ", dataset: " << last_time - start_time << " s" << std::endl;
+    std::cout << "Throughput: " << num_images / feed_time_used.count() << " fps (tracking), "
+              << num_images / total_time_used.count() << " fps (with backend), total " << total_time_used.count() << " s" << std::endl;
+    std::cout << std::setw(24) << std::left << "stage" << std::right << std::setw(10) << "count" << std::setw(12) << "mean(ms)"
+              << std::setw(12) << "p50(ms)" << std::setw(12) << "p99(ms)" << std::setw(12) << "max(ms)" << std::endl;
+    for (auto &stat : Metrics::Instance().GetStats())
+    {
+        std::cout << std::setw(24) << std::left << stat.name << std::right << std::setw(10) << stat.count
+                  << std::setw(12) << stat.mean * 1e3 << std::setw(12) << stat.p50 * 1e3
+                  << std::setw(12) << stat.p99 * 1e3 << std::setw(12) << stat.max * 1e3 << std::endl;
+    }
+    for (auto &pair : Metrics::Instance().GetCounters())
+    {
+        std::cout << pair.first << ": " << pair.second << std::endl;
+    }
+    for (auto &stat : Metrics::Instance().GetMemoryStats())
+    {
+        std::cout << "memory " << stat.name << ": " << stat.bytes / 1024 << " KiB, " << stat.objects << " objects" << std::endl;
+    }
+    if (!ground_truth_path.empty())
+    {
+        evaluate(load_ground_truth(ground_truth_path, image_times));
+    }
+    if (!result_path.empty())
+    {
+        write_result(result_path);
+    }
+    if (!metrics_path.empty())
+    {
+        Metrics::Instance().Dump(metrics_path);
+    }
+    std::cout.flush();
+    google::FlushLogFiles(google::GLOG_INFO);
+    // the threads of backend never stop, leave without running static destructors
+    std::quick_exit(0);
+}
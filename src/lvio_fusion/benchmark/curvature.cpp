@@ -0,0 +1,73 @@
+// microbenchmark of lidar::compute_curvatures against the per-point loop it replaces,
+// on synthetic scans of 64 and 128 beams.
+//
+// usage: curvature [horizon_scan] [repeats]
+
+#include "lvio_fusion/lidar/association.h"
+
+#include <iostream>
+#include <random>
+
+using namespace lvio_fusion;
+
+// the former FeatureAssociation::CalculateSmoothness
+void curvatures_reference(const std::vector<float> &range, int size, std::vector<float> &curvatures)
+{
+    for (int i = 5; i < size - 5; i++)
+    {
+        float dr = (range[i + 5] - range[i - 5]) / 10;
+        float r1 = range[i + 4] - range[i - 5] - 9 * dr;
+        float r2 = range[i + 3] - range[i - 5] - 8 * dr;
+        float r3 = range[i + 2] - range[i - 5] - 7 * dr;
+        float r4 = range[i + 1] - range[i - 5] - 6 * dr;
+        float r5 = range[i] - range[i - 5] - 5 * dr;
+        float r6 = range[i - 1] - range[i - 5] - 4 * dr;
+        float r7 = range[i - 2] - range[i - 5] - 3 * dr;
+        float r8 = range[i - 3] - range[i - 5] - 2 * dr;
+        float r9 = range[i - 4] - range[i - 5] - 1 * dr;
+        float cov = (r1 * r1 + r2 * r2 + r3 * r3 + r4 * r4 + r5 * r5 + r6 * r6 + r7 * r7 + r8 * r8 + r9 * r9) / 9;
+        curvatures[i] = cov * 10 / range[i];
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int horizon_scan = argc > 1 ? std::stoi(argv[1]) : 1800;
+    int repeats = argc > 2 ? std::stoi(argv[2]) : 100;
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<float> distribution(1, 80);
+    for (int num_scans : {64, 128})
+    {
+        int size = num_scans * horizon_scan;
+        std::vector<float> range(size);
+        for (auto &r : range)
+        {
+            r = distribution(rng);
+        }
+        std::vector<float> expected(size, 0);
+        Eigen::ArrayXf curvatures = Eigen::ArrayXf::Zero(size);
+
+        auto t1 = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; i++)
+        {
+            curvatures_reference(range, size, expected);
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        for (int i = 0; i < repeats; i++)
+        {
+            lidar::compute_curvatures(range, size, curvatures);
+        }
+        auto t3 = std::chrono::steady_clock::now();
+
+        float max_error = 0;
+        for (int i = 5; i < size - 5; i++)
+        {
+            max_error = std::max(max_error, std::abs(curvatures[i] - expected[i]) / std::max(1.0f, std::abs(expected[i])));
+        }
+        double reference_time = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count() / repeats;
+        double kernel_time = std::chrono::duration_cast<std::chrono::duration<double>>(t3 - t2).count() / repeats;
+        std::cout << num_scans << " beams x " << horizon_scan << ": per-point " << reference_time * 1e3 << " ms, kernel "
+                  << kernel_time * 1e3 << " ms, speedup " << reference_time / kernel_time << ", max relative error " << max_error << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,229 @@
+// check the analytic jacobians of the hot cost functions against autodiff on random poses,
+// and compare the evaluation time of both,
+// the batched lidar planes error is checked against autodiff blocks of every point.
+//
+// usage: jacobians [repeats]
+
+#include "lvio_fusion/ceres/lidar_error.hpp"
+#include "lvio_fusion/ceres/pose_error.hpp"
+#include "lvio_fusion/ceres/visual_error.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+
+using namespace lvio_fusion;
+
+std::mt19937 rng(0);
+std::uniform_real_distribution<double> uniform(-1, 1);
+
+SE3d random_pose(double angle)
+{
+    Vector3d axis(uniform(rng), uniform(rng), uniform(rng));
+    return SE3d(Quaterniond(AngleAxisd(angle * uniform(rng), axis.normalized())), Vector3d(uniform(rng), uniform(rng), uniform(rng)));
+}
+
+// largest difference of residuals and jacobians in the tangent space of the pose parameterization
+double compare(ceres::CostFunction *analytic, ceres::CostFunction *autodiff, std::vector<double *> parameters)
+{
+    static ceres::LocalParameterization *local_parameterization = new ceres::ProductParameterization(
+        new ceres::EigenQuaternionParameterization(),
+        new ceres::IdentityParameterization(3));
+    int num_residuals = analytic->num_residuals();
+    const std::vector<int32_t> &sizes = analytic->parameter_block_sizes();
+    std::vector<double> r1(num_residuals), r2(num_residuals);
+    std::vector<std::vector<double>> j1, j2;
+    std::vector<double *> p1, p2;
+    for (int size : sizes)
+    {
+        j1.emplace_back(num_residuals * size);
+        j2.emplace_back(num_residuals * size);
+    }
+    for (int i = 0; i < sizes.size(); i++)
+    {
+        p1.push_back(j1[i].data());
+        p2.push_back(j2[i].data());
+    }
+    analytic->Evaluate(parameters.data(), r1.data(), p1.data());
+    autodiff->Evaluate(parameters.data(), r2.data(), p2.data());
+
+    double error = 0;
+    for (int k = 0; k < num_residuals; k++)
+    {
+        error = std::max(error, std::abs(r1[k] - r2[k]));
+    }
+    for (int i = 0; i < sizes.size(); i++)
+    {
+        typedef Matrix<double, Dynamic, Dynamic, RowMajor> MatrixXdRow;
+        MatrixXd J1 = Eigen::Map<MatrixXdRow>(j1[i].data(), num_residuals, sizes[i]);
+        MatrixXd J2 = Eigen::Map<MatrixXdRow>(j2[i].data(), num_residuals, sizes[i]);
+        if (sizes[i] == SE3d::num_parameters)
+        {
+            MatrixXdRow plus(SE3d::num_parameters, 6);
+            local_parameterization->ComputeJacobian(parameters[i], plus.data());
+            J1 = J1 * plus;
+            J2 = J2 * plus;
+        }
+        error = std::max(error, ((J1 - J2).array().abs() / (1 + J2.array().abs())).maxCoeff());
+    }
+    return error;
+}
+
+// seconds of evaluating residuals and jacobians
+double evaluate_time(ceres::CostFunction *cost_function, std::vector<double *> parameters, int repeats)
+{
+    int num_residuals = cost_function->num_residuals();
+    std::vector<std::vector<double>> jacobians;
+    std::vector<double *> pointers;
+    for (int size : cost_function->parameter_block_sizes())
+    {
+        jacobians.emplace_back(num_residuals * size);
+    }
+    for (auto &jacobian : jacobians)
+    {
+        pointers.push_back(jacobian.data());
+    }
+    std::vector<double> residuals(num_residuals);
+    auto t1 = std::chrono::steady_clock::now();
+    for (int i = 0; i < repeats; i++)
+    {
+        cost_function->Evaluate(parameters.data(), residuals.data(), pointers.data());
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count();
+}
+
+// largest difference of the batched lidar planes error and the blocks of every point, and the evaluation time of both
+double compare_planes(int num_points, int repeats, double &batched_time, double &blocks_time)
+{
+    Matrix3Xd points(3, num_points), points_a(3, num_points), normals(3, num_points);
+    std::vector<ceres::CostFunction *> blocks;
+    SE3d Twc1 = random_pose(M_PI);
+    double rpyxyz[6] = {uniform(rng), 0.5 * uniform(rng), uniform(rng), uniform(rng), uniform(rng), uniform(rng)};
+    for (int i = 0; i < num_points; i++)
+    {
+        Vector3d p(uniform(rng), uniform(rng), uniform(rng)), pa(uniform(rng), uniform(rng), uniform(rng)),
+            pb(uniform(rng), uniform(rng), uniform(rng)), pc(uniform(rng), uniform(rng), uniform(rng));
+        points.col(i) = 10 * p;
+        points_a.col(i) = pa;
+        normals.col(i) = (pa - pb).cross(pa - pc).normalized();
+        blocks.push_back(LidarPlaneErrorRPZ::Create(10 * p, pa, pb, pc, Twc1, rpyxyz, 0.7));
+    }
+    ceres::CostFunction *batched = LidarPlanesError::Create(points, points_a, normals, Twc1, rpyxyz, {1, 2, 5}, 0.7, 0);
+    std::vector<double *> parameters = {rpyxyz + 1, rpyxyz + 2, rpyxyz + 5};
+
+    VectorXd r(num_points);
+    Matrix<double, Dynamic, 3> J(num_points, 3);
+    std::vector<double *> jacobians = {J.col(0).data(), J.col(1).data(), J.col(2).data()};
+    batched->Evaluate(parameters.data(), r.data(), jacobians.data());
+    double error = 0;
+    for (int i = 0; i < num_points; i++)
+    {
+        double r_i, j_i[3];
+        std::vector<double *> jacobians_i = {j_i, j_i + 1, j_i + 2};
+        blocks[i]->Evaluate(parameters.data(), &r_i, jacobians_i.data());
+        error = std::max(error, std::abs(r[i] - r_i));
+        for (int k = 0; k < 3; k++)
+        {
+            error = std::max(error, std::abs(J(i, k) - j_i[k]) / (1 + std::abs(j_i[k])));
+        }
+    }
+
+    int batched_repeats = std::max(1, repeats / num_points);
+    batched_time = evaluate_time(batched, parameters, batched_repeats) / batched_repeats;
+    auto t1 = std::chrono::steady_clock::now();
+    for (int i = 0; i < batched_repeats; i++)
+    {
+        double r_i, j_i[3];
+        std::vector<double *> jacobians_i = {j_i, j_i + 1, j_i + 2};
+        for (auto block : blocks)
+        {
+            block->Evaluate(parameters.data(), &r_i, jacobians_i.data());
+        }
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    blocks_time = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1).count() / batched_repeats;
+    delete batched;
+    for (auto block : blocks)
+    {
+        delete block;
+    }
+    return error;
+}
+
+struct Case
+{
+    std::string name;
+    double error = 0, analytic = 0, autodiff = 0;
+};
+
+int main(int argc, char **argv)
+{
+    int repeats = argc > 1 ? std::stoi(argv[1]) : 100000;
+    SE3d left_extrinsic = random_pose(0.1);
+    Camera::Create(400, 410, 320, 240, left_extrinsic);
+    Camera::Create(400, 410, 320, 240, left_extrinsic * SE3d(Quaterniond::Identity(), Vector3d(0.5, 0, 0)));
+    Camera::Ptr left = Camera::Get(0), right = Camera::Get(1);
+
+    std::vector<Case> cases(4);
+    cases[0].name = "PoseOnlyReprojectionError";
+    cases[1].name = "TwoFrameReprojectionError";
+    cases[2].name = "PoseGraphError";
+    cases[3].name = "LidarPlaneError";
+    const int num_trials = 100;
+    for (int trial = 0; trial < num_trials; trial++)
+    {
+        SE3d Twc1 = random_pose(M_PI), Twc2 = Twc1 * random_pose(0.2);
+        Vector3d pw = Twc1 * (left->extrinsic * Vector3d(uniform(rng), uniform(rng), 10 + uniform(rng)));
+        Vector2d ob(320 + 50 * uniform(rng), 240 + 50 * uniform(rng)), first_ob(320 + 50 * uniform(rng), 240 + 50 * uniform(rng));
+        double inv_d = 0.1;
+        Vector3d p(uniform(rng), uniform(rng), uniform(rng)), pa(uniform(rng), uniform(rng), uniform(rng)),
+            pb(uniform(rng), uniform(rng), uniform(rng)), pc(uniform(rng), uniform(rng), uniform(rng));
+        SE3d relative = random_pose(0.3);
+
+        std::vector<ceres::CostFunction *> analytic(4), autodiff(4);
+        std::vector<std::vector<double *>> parameters(4);
+        for (int k = 0; k < 2; k++)
+        {
+            analytic_jacobians = k == 0;
+            auto &cost_functions = k == 0 ? analytic : autodiff;
+            cost_functions[0] = PoseOnlyReprojectionError::Create(ob, pw, left, 0.7);
+            cost_functions[1] = TwoFrameReprojectionError::Create(first_ob, ob, left, right, 1.3);
+            cost_functions[2] = PoseGraphError::Create(relative, 2, 3);
+            cost_functions[3] = LidarPlaneError::Create(p, pa, pb, pc);
+        }
+        parameters[0] = {Twc1.data()};
+        parameters[1] = {&inv_d, Twc1.data(), Twc2.data()};
+        parameters[2] = {Twc1.data(), Twc2.data()};
+        parameters[3] = {Twc2.data()};
+        for (int i = 0; i < cases.size(); i++)
+        {
+            cases[i].error = std::max(cases[i].error, compare(analytic[i], autodiff[i], parameters[i]));
+            if (trial == 0)
+            {
+                cases[i].analytic = evaluate_time(analytic[i], parameters[i], repeats);
+                cases[i].autodiff = evaluate_time(autodiff[i], parameters[i], repeats);
+            }
+            delete analytic[i];
+            delete autodiff[i];
+        }
+    }
+
+    bool ok = true;
+    for (auto &c : cases)
+    {
+        std::cout << c.name << ": max error " << c.error
+                  << ", analytic " << c.analytic / repeats * 1e9 << " ns, autodiff " << c.autodiff / repeats * 1e9
+                  << " ns, speedup " << c.autodiff / c.analytic << std::endl;
+        ok = ok && c.error < 1e-6;
+    }
+
+    const int num_points = 1000;
+    double batched_time, blocks_time;
+    double error = compare_planes(num_points, repeats, batched_time, blocks_time);
+    std::cout << "LidarPlanesError of " << num_points << " points: max error " << error
+              << ", batched " << batched_time * 1e6 << " us, blocks " << blocks_time * 1e6
+              << " us, speedup " << blocks_time / batched_time << std::endl;
+    ok = ok && error < 1e-6;
+    return ok ? 0 : 1;
+}
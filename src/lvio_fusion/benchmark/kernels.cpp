@@ -0,0 +1,499 @@
+// microbenchmarks of the core kernels on canned data, built on google benchmark,
+// the results are printed as json, so that they can be compared between revisions.
+// the canned data is synthetic: a textured stereo pair, a 16 ring scan of a box, and a window of keyframes.
+//
+// usage: lvio_fusion_bench [--benchmark_filter=REGEX] [--benchmark_out=FILE] [--benchmark_format=json|console]
+
+#include "lvio_fusion/backend.h"
+#include "lvio_fusion/frontend.h"
+#include "lvio_fusion/imu/imu.h"
+#include "lvio_fusion/imu/preintegration.h"
+#include "lvio_fusion/lidar/association.h"
+#include "lvio_fusion/lidar/lidar.h"
+#include "lvio_fusion/lidar/mapping.h"
+#include "lvio_fusion/lidar/projection.h"
+#include "lvio_fusion/map.h"
+#include "lvio_fusion/utility.h"
+#include "lvio_fusion/visual/camera.h"
+#include "lvio_fusion/visual/extractor.h"
+#include "lvio_fusion/visual/hamming.h"
+#include "lvio_fusion/visual/landmark.h"
+#include "lvio_fusion/visual/local_map.h"
+
+#include <benchmark/benchmark.h>
+#include <deque>
+#include <random>
+
+using namespace lvio_fusion;
+
+const int width = 752, height = 480, disparity = 8;
+const double fx = 460, cx = 376, cy = 240, stereo_baseline = 0.11;
+const int num_scans = 16, horizon_scan = 1800;
+
+std::mt19937 rng(0);
+std::uniform_real_distribution<double> uniform(-1, 1);
+std::normal_distribution<double> noise(0, 0.5);
+
+void create_sensors()
+{
+    Camera::Create(fx, fx, cx, cy, SE3d());
+    Camera::Create(fx, fx, cx, cy, SE3d(Quaterniond::Identity(), Vector3d(stereo_baseline, 0, 0)));
+    Camera::baseline = stereo_baseline;
+    Imu::Create(SE3d(), 0.08, 0.00004, 0.004, 2.0e-6, 9.81);
+    Lidar::Create(0.2, SE3d());
+}
+
+struct StereoImages
+{
+    cv::Mat left, right;
+};
+
+// random rectangles give corners at every scale, the right image is the left one shifted by the disparity
+StereoImages stereo_images()
+{
+    cv::Mat left(height, width, CV_8UC1, cv::Scalar(128));
+    for (int i = 0; i < 600; i++)
+    {
+        cv::Point p(rng() % width, rng() % height);
+        cv::rectangle(left, p, p + cv::Point(6 + rng() % 40, 6 + rng() % 40), cv::Scalar(rng() % 256), cv::FILLED);
+    }
+    cv::GaussianBlur(left, left, cv::Size(3, 3), 0);
+    cv::Mat right(height, width, CV_8UC1, cv::Scalar(128));
+    left(cv::Rect(disparity, 0, width - disparity, height)).copyTo(right(cv::Rect(0, 0, width - disparity, height)));
+    return {left, right};
+}
+
+const StereoImages &images()
+{
+    static StereoImages instance = stereo_images();
+    return instance;
+}
+
+// a 16 ring scan inside a box of walls on a flat ground
+const PointICloud &scan(std::vector<int16_t> *rings = nullptr)
+{
+    static PointICloud points;
+    static std::vector<int16_t> ids;
+    if (points.empty())
+    {
+        for (int r = 0; r < num_scans; r++)
+        {
+            double elevation = (-15 + 2 * r) / 180.0 * M_PI;
+            for (int c = 0; c < horizon_scan; c++)
+            {
+                double azimuth = c * 2 * M_PI / horizon_scan;
+                Vector3d ray(std::cos(elevation) * std::cos(azimuth), std::cos(elevation) * std::sin(azimuth), std::sin(elevation));
+                double range = std::min(std::abs(15 / ray.x()), std::abs(10 / ray.y()));
+                if (ray.z() < 0)
+                {
+                    range = std::min(range, 1.7 / -ray.z());
+                }
+                range = std::min(range, 90.0) + 0.01 * uniform(rng);
+                PointI point;
+                point.getVector3fMap() = (range * ray).cast<float>();
+                point.intensity = r + (float)c / horizon_scan;
+                points.push_back(point);
+                ids.push_back(r);
+            }
+        }
+    }
+    if (rings)
+    {
+        *rings = ids;
+    }
+    return points;
+}
+
+void BM_ExtractorDetect(benchmark::State &state)
+{
+    Extractor extractor(state.range(0));
+    std::vector<std::vector<cv::KeyPoint>> keypoints;
+    for (auto _ : state)
+    {
+        extractor.Detect(images().left, keypoints);
+    }
+    int num_keypoints = 0;
+    for (auto &level : keypoints)
+    {
+        num_keypoints += level.size();
+    }
+    state.counters["keypoints"] = num_keypoints;
+}
+BENCHMARK(BM_ExtractorDetect)->Arg(150)->Arg(500)->Unit(benchmark::kMillisecond);
+
+void BM_ExtractorCompute(benchmark::State &state)
+{
+    Extractor extractor(state.range(0));
+    std::vector<std::vector<cv::KeyPoint>> detected, keypoints;
+    extractor.Detect(images().left, detected);
+    for (auto _ : state)
+    {
+        keypoints = detected;
+        cv::Mat descriptors = extractor.Compute(keypoints);
+        benchmark::DoNotOptimize(descriptors.data);
+    }
+}
+BENCHMARK(BM_ExtractorCompute)->Arg(150)->Arg(500)->Unit(benchmark::kMillisecond);
+
+void BM_OpticalFlow(benchmark::State &state)
+{
+    std::vector<cv::Mat> pyramid_left, pyramid_right;
+    build_pyramid(images().left, pyramid_left);
+    build_pyramid(images().right, pyramid_right);
+    std::vector<cv::Point2f> points_left, points_right;
+    for (int i = 0; i < state.range(0); i++)
+    {
+        points_left.push_back(cv::Point2f(disparity + 20 + rng() % (width - disparity - 40), 20 + rng() % (height - 40)));
+    }
+    std::vector<uchar> status;
+    int num_tracked = 0;
+    for (auto _ : state)
+    {
+        points_right.clear();
+        for (auto &p : points_left)
+        {
+            points_right.push_back(p - cv::Point2f(disparity / 2, 0));
+        }
+        optical_flow(pyramid_left, pyramid_right, points_left, points_right, status);
+        num_tracked = std::count(status.begin(), status.end(), 1);
+    }
+    state.counters["tracked"] = num_tracked;
+    state.SetItemsProcessed(state.iterations() * points_left.size());
+}
+BENCHMARK(BM_OpticalFlow)->Arg(150)->Arg(500)->Unit(benchmark::kMillisecond);
+
+// candidates of the search of a feature in the radius, one of them is the feature with a few flipped bits
+struct CannedBriefs
+{
+    std::vector<BRIEF> queries;
+    std::vector<std::vector<BRIEF>> candidates;
+};
+
+CannedBriefs canned_briefs(int num_candidates)
+{
+    const int num_queries = 500;
+    CannedBriefs canned;
+    for (int i = 0; i < num_queries; i++)
+    {
+        BRIEF query;
+        for (int k = 0; k < 256; k++)
+        {
+            query[k] = rng() % 2;
+        }
+        std::vector<BRIEF> candidates(num_candidates);
+        for (int j = 0; j < num_candidates; j++)
+        {
+            for (int k = 0; k < 256; k++)
+            {
+                candidates[j][k] = rng() % 2;
+            }
+        }
+        BRIEF &similar = candidates[rng() % num_candidates];
+        similar = query;
+        for (int k = 0; k < 20; k++)
+        {
+            similar.flip(rng() % 256);
+        }
+        canned.queries.push_back(query);
+        canned.candidates.push_back(candidates);
+    }
+    return canned;
+}
+
+void BM_MatchBriefs(benchmark::State &state)
+{
+    CannedBriefs canned = canned_briefs(state.range(0));
+    std::vector<std::vector<const BRIEF *>> candidates(canned.queries.size());
+    for (int i = 0; i < canned.queries.size(); i++)
+    {
+        for (auto &brief : canned.candidates[i])
+        {
+            candidates[i].push_back(&brief);
+        }
+    }
+    int num_matched = 0;
+    for (auto _ : state)
+    {
+        num_matched = 0;
+        for (int i = 0; i < canned.queries.size(); i++)
+        {
+            int best, second;
+            match_briefs(canned.queries[i], candidates[i], best, second);
+            if (candidates[i].size() >= 2 && best < 50 && best < 0.8 * second)
+            {
+                num_matched++;
+            }
+        }
+    }
+    state.counters["matched"] = num_matched;
+    state.SetItemsProcessed(state.iterations() * canned.queries.size());
+}
+BENCHMARK(BM_MatchBriefs)->Arg(8)->Arg(32)->Arg(128)->Unit(benchmark::kMicrosecond);
+
+// the path replaced by match_briefs: both sides are packed into cv::Mat for knnMatch
+void BM_MatchBriefsKnn(benchmark::State &state)
+{
+    CannedBriefs canned = canned_briefs(state.range(0));
+    cv::Ptr<cv::DescriptorMatcher> matcher = cv::DescriptorMatcher::create("BruteForce-Hamming");
+    auto briefs2mat = [](std::vector<BRIEF> &briefs) {
+        cv::Mat descriptors(briefs.size(), 32, CV_8U);
+        for (int i = 0; i < briefs.size(); i++)
+        {
+            cv::Mat(1, 32, CV_8U, reinterpret_cast<uchar *>(&briefs[i])).copyTo(descriptors.row(i));
+        }
+        return descriptors;
+    };
+    int num_matched = 0;
+    for (auto _ : state)
+    {
+        num_matched = 0;
+        for (int i = 0; i < canned.queries.size(); i++)
+        {
+            cv::Mat descriptors_last = briefs2mat(canned.candidates[i]);
+            cv::Mat descriptors_current(1, 32, CV_8U, reinterpret_cast<uchar *>(&canned.queries[i]));
+            std::vector<std::vector<cv::DMatch>> knn_matches;
+            matcher->knnMatch(descriptors_current, descriptors_last, knn_matches, 2);
+            if (!knn_matches.empty() && knn_matches[0].size() == 2 &&
+                knn_matches[0][0].distance < 50 &&
+                knn_matches[0][0].distance < 0.8 * knn_matches[0][1].distance)
+            {
+                num_matched++;
+            }
+        }
+    }
+    state.counters["matched"] = num_matched;
+    state.SetItemsProcessed(state.iterations() * canned.queries.size());
+}
+BENCHMARK(BM_MatchBriefsKnn)->Arg(8)->Arg(32)->Arg(128)->Unit(benchmark::kMicrosecond);
+
+// a keyframe interval of 200 hz samples
+void BM_PreintegrationPropagate(benchmark::State &state)
+{
+    const int num_samples = 200;
+    Vector3d acc(0.1, 0.2, 9.81), gyr(0.01, 0.02, 0.3);
+    for (auto _ : state)
+    {
+        auto preintegration = imu::Preintegration::Create(Bias());
+        preintegration->acc0 = acc;
+        preintegration->gyr0 = gyr;
+        for (int i = 0; i < num_samples; i++)
+        {
+            preintegration->Propagate(0.005, acc, gyr);
+        }
+        benchmark::DoNotOptimize(preintegration->delta_p.data());
+    }
+    state.SetItemsProcessed(state.iterations() * num_samples);
+}
+BENCHMARK(BM_PreintegrationPropagate)->Unit(benchmark::kMicrosecond);
+
+void BM_PreintegrationRepropagate(benchmark::State &state)
+{
+    const int num_samples = 200;
+    imu::Samples samples;
+    Vector3d acc(0.1, 0.2, 9.81), gyr(0.01, 0.02, 0.3);
+    auto preintegration = imu::Preintegration::Create(Bias());
+    for (int i = 0; i < num_samples; i++)
+    {
+        preintegration->Append(samples.Push(0.005, acc, gyr), acc, gyr);
+    }
+    Vector3d ba(0.01, 0.01, 0.01), bg(0.001, 0.001, 0.001);
+    for (auto _ : state)
+    {
+        preintegration->Repropagate(ba, bg);
+        benchmark::DoNotOptimize(preintegration->delta_p.data());
+    }
+    state.SetItemsProcessed(state.iterations() * num_samples);
+}
+BENCHMARK(BM_PreintegrationRepropagate)->Unit(benchmark::kMicrosecond);
+
+void BM_ImageProjection(benchmark::State &state)
+{
+    ImageProjection projection(num_scans, horizon_scan, 2, 15, 7);
+    std::vector<int16_t> rings;
+    const PointICloud &points = scan(state.range(0) ? &rings : nullptr);
+    PointICloud in, points_segmented;
+    for (auto _ : state)
+    {
+        in = points;
+        points_segmented.clear();
+        projection.Process(in, rings, points_segmented);
+    }
+    state.counters["segmented"] = points_segmented.size();
+    state.SetItemsProcessed(state.iterations() * points.size());
+}
+BENCHMARK(BM_ImageProjection)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+void BM_FeatureAssociationProcess(benchmark::State &state)
+{
+    FeatureAssociation::Ptr association(new FeatureAssociation(num_scans, horizon_scan, 2, 15, 7, 0.1, 1, 100, 0));
+    Frame::Ptr frame = Frame::Create();
+    frame->time = 1;
+    PointICloud in;
+    for (auto _ : state)
+    {
+        in = scan();
+        association->Process(in, frame);
+    }
+    state.counters["surf"] = frame->feature_lidar->points_surf.size();
+    state.counters["ground"] = frame->feature_lidar->points_ground.size();
+    state.SetItemsProcessed(state.iterations() * scan().size());
+}
+BENCHMARK(BM_FeatureAssociationProcess)->Unit(benchmark::kMillisecond);
+
+void BM_MappingMergeScan(benchmark::State &state)
+{
+    Mapping mapping;
+    SE3d pose(SO3d::exp(Vector3d(0.01, 0.02, 0.3)), Vector3d(1, 2, 0.1));
+    PointICloud out;
+    for (auto _ : state)
+    {
+        out.clear();
+        mapping.MergeScan(scan(), pose, out);
+    }
+    state.SetItemsProcessed(state.iterations() * scan().size());
+}
+BENCHMARK(BM_MappingMergeScan)->Unit(benchmark::kMillisecond);
+
+// a new keyframe is detected, triangulated and searched against the keyframes of the local map,
+// the search is private, so it is measured with the rest of the keyframe
+void BM_LocalMapAddKeyFrame(benchmark::State &state)
+{
+    LocalMap local_map(state.range(0));
+    std::deque<Frame::Ptr> frames;
+    auto new_keyframe = [&](double time) {
+        Frame::Ptr frame = Frame::Create();
+        Frame::current_frame_id++;
+        frame->time = time;
+        frame->pose = SE3d(Quaterniond::Identity(), Vector3d(0, 0, 0.02 * time));
+        frame->image_left = images().left;
+        frame->image_right = images().right;
+        frames.push_back(frame);
+        if (frames.size() > 8)
+        {
+            frames.pop_front();
+        }
+        return frame;
+    };
+    local_map.Init(new_keyframe(0));
+    double time = 1;
+    for (auto _ : state)
+    {
+        local_map.AddKeyFrame(new_keyframe(time++));
+    }
+    state.counters["landmarks"] = local_map.landmarks.size();
+}
+BENCHMARK(BM_LocalMapAddKeyFrame)->Arg(150)->Arg(500)->Unit(benchmark::kMillisecond);
+
+// a window of stereo keyframes moving forward, each landmark is seen by a few of them
+struct CannedWindow
+{
+    std::vector<Frame::Ptr> frames;
+    std::vector<SE3d> poses; // perturbed
+    std::vector<visual::Landmark::Ptr> landmarks;
+    std::vector<double> inv_depths;
+};
+
+CannedWindow &canned_window()
+{
+    static CannedWindow window;
+    if (!window.frames.empty())
+        return window;
+
+    const int num_keyframes = 10, num_landmarks = 2000, num_observations = 4;
+    lvio_fusion::Map::Instance().Reset();
+    for (int i = 0; i < num_keyframes; i++)
+    {
+        Frame::Ptr frame = Frame::Create();
+        frame->time = 1 + 0.5 * i;
+        frame->pose = SE3d(Quaterniond::Identity(), Vector3d(0.02 * uniform(rng), 0.02 * uniform(rng), 0.5 * i));
+        frame->last_keyframe = i > 0 ? window.frames.back() : nullptr;
+        lvio_fusion::Map::Instance().InsertKeyFrame(frame);
+        window.frames.push_back(frame);
+    }
+    for (int i = 0; i < num_landmarks; i++)
+    {
+        int first = rng() % (num_keyframes - 1);
+        Frame::Ptr first_frame = window.frames[first];
+        Vector3d pw = first_frame->pose * Vector3d(4 * uniform(rng), 3 * uniform(rng), 8 + 4 * uniform(rng));
+        Vector3d pc = Camera::Get(1)->World2Sensor(pw, first_frame->pose);
+        auto landmark = visual::Landmark::Create(1 / pc.z());
+        for (int k = first; k < std::min(first + num_observations, num_keyframes); k++)
+        {
+            Vector2d pixel = Camera::Get()->World2Pixel(pw, window.frames[k]->pose) + Vector2d(noise(rng), noise(rng));
+            auto feature = visual::Feature::Create(window.frames[k], cv::KeyPoint(eigen2cv(pixel), 1), landmark);
+            landmark->AddObservation(feature);
+            window.frames[k]->AddFeature(feature);
+        }
+        Vector2d pixel = Camera::Get(1)->Sensor2Pixel(pc) + Vector2d(noise(rng), noise(rng));
+        auto right_feature = visual::Feature::Create(first_frame, cv::KeyPoint(eigen2cv(pixel), 1), landmark);
+        right_feature->is_on_left_image = false;
+        landmark->AddObservation(right_feature);
+        first_frame->AddFeature(right_feature);
+        lvio_fusion::Map::Instance().InsertLandmark(landmark);
+        window.landmarks.push_back(landmark);
+        window.inv_depths.push_back(landmark->inv_depth * (1 + 0.05 * uniform(rng)));
+    }
+    for (auto &frame : window.frames)
+    {
+        window.poses.push_back(frame->pose * SE3d(SO3d::exp(0.005 * Vector3d(uniform(rng), uniform(rng), uniform(rng))),
+                                                  0.05 * Vector3d(uniform(rng), uniform(rng), uniform(rng))));
+    }
+    return window;
+}
+
+// the optimization runs in the backend thread, it is started after the window is perturbed again,
+// so the time includes the build of the blocks which the sliding problem does not keep
+void BM_BackendOptimize(benchmark::State &state)
+{
+    CannedWindow &window = canned_window();
+    // the threads of backend never stop
+    static Backend *backend = new Backend(3, false, true, false, 0);
+    static Frontend::Ptr frontend(new Frontend(150, 100, 50, 20));
+    frontend->last_frame = frontend->last_keyframe = window.frames.back();
+    backend->SetFrontend(frontend);
+    for (auto _ : state)
+    {
+        {
+            std::unique_lock<std::mutex> lock(backend->mutex);
+            for (int i = 0; i < window.frames.size(); i++)
+            {
+                window.frames[i]->pose = window.poses[i];
+            }
+            for (int i = 0; i < window.landmarks.size(); i++)
+            {
+                window.landmarks[i]->inv_depth = window.inv_depths[i];
+            }
+            backend->finished = 0;
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        while (true)
+        {
+            backend->UpdateMap();
+            std::this_thread::yield();
+            std::unique_lock<std::mutex> lock(backend->mutex);
+            if (backend->finished > 0)
+                break;
+        }
+        auto t2 = std::chrono::steady_clock::now();
+        state.SetIterationTime(std::chrono::duration<double>(t2 - t1).count());
+    }
+    state.counters["keyframes"] = window.frames.size();
+    state.counters["landmarks"] = window.landmarks.size();
+}
+BENCHMARK(BM_BackendOptimize)->UseManualTime()->Unit(benchmark::kMillisecond);
+
+int main(int argc, char **argv)
+{
+    google::InitGoogleLogging(argv[0]);
+    create_sensors();
+    // json unless another format is asked for, later flags win
+    std::vector<char *> args = {argv[0], (char *)"--benchmark_format=json"};
+    args.insert(args.end(), argv + 1, argv + argc);
+    int num_args = args.size();
+    benchmark::Initialize(&num_args, args.data());
+    if (benchmark::ReportUnrecognizedArguments(num_args, args.data()))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    // the threads of backend never stop, leave without running static destructors
+    std::quick_exit(0);
+}
@@ -0,0 +1,119 @@
+// merge map files of several sessions into one map, and cut it into tiles for localization.
+// the loops between sessions can be detected by several machines, each of them takes a shard of the pairs
+// and writes its loops, then one machine reads the loops of all shards and merges.
+//
+// usage: merge <session.map>... [--output FILE] [--tiles DIR] [--tile_size M]
+//                               [--vocabulary FILE] [--resolution R] [--threads N]
+//                               [--shard K/N --loops_out FILE] [--loops FILE]...
+
+#include "lvio_fusion/loop/map_merger.h"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+using namespace lvio_fusion;
+
+int main(int argc, char **argv)
+{
+    google::InitGoogleLogging(argv[0]);
+    std::vector<std::string> sessions, loops_in;
+    std::string output, tiles, vocabulary, loops_out;
+    double tile_size = 200, resolution = 0.2;
+    int num_threads = std::thread::hardware_concurrency(), shard = 0, num_shards = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            sessions.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            LOG(ERROR) << "No value of " << arg;
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--output")
+            output = value;
+        else if (arg == "--tiles")
+            tiles = value;
+        else if (arg == "--tile_size")
+            tile_size = std::stod(value);
+        else if (arg == "--vocabulary")
+            vocabulary = value;
+        else if (arg == "--resolution")
+            resolution = std::stod(value);
+        else if (arg == "--threads")
+            num_threads = std::stoi(value);
+        else if (arg == "--shard")
+        {
+            if (sscanf(value.c_str(), "%d/%d", &shard, &num_shards) != 2 || shard < 0 || shard >= num_shards)
+            {
+                LOG(ERROR) << "Invalid shard " << value;
+                return 1;
+            }
+        }
+        else if (arg == "--loops_out")
+            loops_out = value;
+        else if (arg == "--loops")
+            loops_in.push_back(value);
+        else
+            LOG(WARNING) << "Unknown option " << arg << " " << value;
+    }
+    if (sessions.size() < 2 || (num_shards > 1 && loops_out.empty()))
+    {
+        std::cerr << "usage: merge <session.map>... [--output FILE] [--tiles DIR] [--tile_size M]" << std::endl
+                  << "                             [--vocabulary FILE] [--resolution R] [--threads N]" << std::endl
+                  << "                             [--shard K/N --loops_out FILE] [--loops FILE]..." << std::endl;
+        return 1;
+    }
+
+    auto t1 = std::chrono::steady_clock::now();
+    MapMerger merger(vocabulary, resolution, num_threads);
+    if (!merger.Load(sessions))
+        return 1;
+    auto t2 = std::chrono::steady_clock::now();
+
+    // the loops of the other shards are read, or all pairs are searched here
+    if (loops_in.empty())
+    {
+        merger.DetectLoops(shard, num_shards);
+    }
+    for (auto &path : loops_in)
+    {
+        if (!merger.ReadLoops(path))
+            return 1;
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    std::cout << "Sessions: " << sessions.size() << ", loops: " << merger.Loops().size()
+              << ", load " << std::chrono::duration<double>(t2 - t1).count() << " s"
+              << ", detect " << std::chrono::duration<double>(t3 - t2).count() << " s" << std::endl;
+    if (!loops_out.empty())
+    {
+        return merger.WriteLoops(loops_out) ? 0 : 1;
+    }
+
+    int num_merged = merger.Optimize();
+    for (int i = 0; i < sessions.size(); i++)
+    {
+        std::cout << (merger.Merged()[i] ? "merged: " : "not merged: ") << sessions[i] << std::endl;
+    }
+    if (num_merged < 2)
+    {
+        LOG(ERROR) << "No session is connected to " << sessions[0];
+        return 1;
+    }
+    if (!output.empty() && !merger.Save(output))
+        return 1;
+    if (!tiles.empty())
+    {
+        auto paths = merger.SaveTiles(tiles, tile_size);
+        std::cout << "Tiles: " << paths.size() << " in " << tiles << std::endl;
+    }
+    auto t4 = std::chrono::steady_clock::now();
+    std::cout << "Total " << std::chrono::duration<double>(t4 - t1).count() << " s" << std::endl;
+    return 0;
+}
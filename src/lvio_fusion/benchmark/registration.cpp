@@ -0,0 +1,118 @@
+// compare the relocation by scan to map with the relocation by vgicp on a synthetic scene,
+// a flat ground and four walls are scanned by an old keyframe,
+// and the current frame is relocated from perturbed initial poses.
+//
+// usage: registration [trials] [meters] [radians]
+
+#include "lvio_fusion/lidar/association.h"
+#include "lvio_fusion/lidar/lidar.h"
+#include "lvio_fusion/lidar/mapping.h"
+#include "lvio_fusion/map.h"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+using namespace lvio_fusion;
+
+std::mt19937 rng(0);
+std::uniform_real_distribution<double> uniform(-1, 1);
+std::normal_distribution<double> noise(0, 0.02);
+
+void add_point(PointICloud &cloud, const Vector3d &p)
+{
+    PointI point;
+    point.getVector3fMap() = p.cast<float>();
+    point.intensity = 0;
+    cloud.push_back(point);
+}
+
+void scene(PointICloud &ground, PointICloud &surf)
+{
+    for (int i = 0; i < 20000; i++)
+    {
+        add_point(ground, Vector3d(30 * uniform(rng), 30 * uniform(rng), noise(rng)));
+    }
+    for (int i = 0; i < 20000; i++)
+    {
+        double a = 30 * uniform(rng), h = 1 + uniform(rng);
+        Vector3d walls[4] = {Vector3d(a, 10, h), Vector3d(-12, a, h), Vector3d(a, -8, h), Vector3d(15, a, h)};
+        add_point(surf, walls[i % 4] + Vector3d(noise(rng), noise(rng), noise(rng)));
+    }
+}
+
+// points of the world seen by a frame at pose
+void observe(const PointICloud &in, const SE3d &pose, int step, PointICloud &out)
+{
+    SE3d inverse = pose.inverse();
+    for (int i = rng() % step; i < in.size(); i += step)
+    {
+        add_point(out, inverse * in[i].getVector3fMap().cast<double>());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    google::InitGoogleLogging(argv[0]);
+    int num_trials = argc > 1 ? std::stoi(argv[1]) : 20;
+    double meters = argc > 2 ? std::stod(argv[2]) : 1;
+    double radians = argc > 3 ? std::stod(argv[3]) : 0.1;
+
+    Lidar::Create(0.2, SE3d());
+    FeatureAssociation::Ptr association(new FeatureAssociation(16, 1800, 2, 15, 7, 0.1, 1, 100, 0));
+    Mapping::Ptr mapping(new Mapping());
+    mapping->SetFeatureAssociation(association);
+
+    PointICloud ground, surf;
+    scene(ground, surf);
+    Frame::Ptr old_frame = Frame::Create();
+    old_frame->time = 1;
+    old_frame->feature_lidar = lidar::Feature::Create();
+    old_frame->feature_lidar->points_ground = ground;
+    old_frame->feature_lidar->points_surf = surf;
+    lvio_fusion::Map::Instance().InsertKeyFrame(old_frame);
+
+    const char *names[2] = {"scan to map", "vgicp"};
+    int num_success[2] = {0, 0};
+    double seconds[2] = {0, 0}, errors[2] = {0, 0};
+    for (int i = 0; i < num_trials; i++)
+    {
+        SE3d truth(SO3d::exp(Vector3d(0, 0, 0.3 * uniform(rng))), Vector3d(3 * uniform(rng), 3 * uniform(rng), 0));
+        Frame::Ptr frame = Frame::Create();
+        frame->time = 2 + i;
+        frame->weights.lidar_ground = frame->weights.lidar_surf = 1;
+        frame->feature_lidar = lidar::Feature::Create();
+        observe(ground, truth, 4, frame->feature_lidar->points_ground);
+        observe(surf, truth, 3, frame->feature_lidar->points_surf);
+        Vector3d axis(uniform(rng), uniform(rng), uniform(rng));
+        SE3d perturbation(SO3d::exp(radians * uniform(rng) * axis.normalized()),
+                          meters * Vector3d(uniform(rng), uniform(rng), 0.1 * uniform(rng)));
+        frame->loop_closure = loop::LoopClosure::Ptr(new loop::LoopClosure());
+        frame->loop_closure->frame_old = old_frame;
+        frame->loop_closure->relative_o_c = old_frame->pose.inverse() * truth * perturbation;
+
+        for (int k = 0; k < 2; k++)
+        {
+            mapping->SetRegistration((lidar::RegistrationMethod)k);
+            SE3d relative_o_c;
+            auto t1 = std::chrono::steady_clock::now();
+            mapping->Relocate(old_frame, frame, relative_o_c);
+            auto t2 = std::chrono::steady_clock::now();
+            seconds[k] += std::chrono::duration<double>(t2 - t1).count();
+            SE3d error = truth.inverse() * old_frame->pose * relative_o_c;
+            double error_t = error.translation().norm(), error_r = error.so3().log().norm();
+            errors[k] += error_t;
+            num_success[k] += error_t < 0.1 && error_r < 0.01;
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    for (int k = 0; k < 2; k++)
+    {
+        std::cout << std::setw(12) << names[k] << ": success " << num_success[k] << "/" << num_trials
+                  << ", mean error " << errors[k] / num_trials << " m"
+                  << ", mean time " << seconds[k] / num_trials * 1000 << " ms" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,222 @@
+// replay a trace recorded with trace_path, the estimator gets exactly the same inputs in the same order,
+// so a run of the node can be reproduced without ros.
+// speed 0 feeds the inputs back to back, N honours the recorded intervals N times faster.
+// lockstep 1 tracks every frame in the caller, and waits for the backend and the lidar thread before the next input,
+// so the same trace gives the same scheduling.
+//
+// usage: replay <config.yaml> <trace> [--speed N] [--lockstep 1] [--result FILE] [--metrics FILE] [--timeout S]
+
+#include "lvio_fusion/estimator.h"
+#include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/trace.h"
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+using namespace lvio_fusion;
+
+void write_result(const std::string &path)
+{
+    std::ofstream out(path, std::ios::out);
+    out.setf(std::ios::fixed, std::ios::floatfield);
+    out.precision(5);
+    for (auto &pair : *lvio_fusion::Map::Instance().GetSnapshot())
+    {
+        Vector3d t = pair.second->pose.translation();
+        Quaterniond q = pair.second->pose.unit_quaternion();
+        out << pair.first << "," << t.x() << "," << t.y() << "," << t.z() << ","
+            << q.x() << "," << q.y() << "," << q.z() << "," << q.w() << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    google::InitGoogleLogging(argv[0]);
+    if (argc < 3)
+    {
+        std::cerr << "usage: replay <config.yaml> <trace> [--speed N] [--lockstep 1] [--result FILE] [--metrics FILE] [--timeout S]" << std::endl;
+        return 1;
+    }
+    std::string config_file = argv[1], trace_path = argv[2];
+    std::string result_path, metrics_path;
+    double speed = 0, timeout = 30;
+    bool lockstep = false;
+    for (int i = 3; i + 1 < argc; i += 2)
+    {
+        std::string key = argv[i];
+        if (key == "--speed")
+            speed = std::stod(argv[i + 1]);
+        else if (key == "--lockstep")
+            lockstep = std::stoi(argv[i + 1]);
+        else if (key == "--result")
+            result_path = argv[i + 1];
+        else if (key == "--metrics")
+            metrics_path = argv[i + 1];
+        else if (key == "--timeout")
+            timeout = std::stod(argv[i + 1]);
+        else
+            LOG(WARNING) << "Unknown option " << key;
+    }
+
+    cv::FileStorage settings(config_file, cv::FileStorage::READ);
+    if (!settings.isOpened())
+    {
+        LOG(ERROR) << "Can not open " << config_file;
+        return 1;
+    }
+    int use_imu = settings["use_imu"], use_lidar = settings["use_lidar"], use_navsat = settings["use_navsat"],
+        use_loop = settings["use_loop"], use_adapt = settings["use_adapt"];
+    double window_size = settings["windows_size"], cycle_time = settings["cycle_time"];
+    std::string recording = settings["trace_path"];
+    settings.release();
+    // recording is opened with truncation, it must not be the trace being read
+    if (recording == trace_path)
+    {
+        LOG(ERROR) << "trace_path of " << config_file << " is the trace to replay.";
+        return 1;
+    }
+
+    TraceReader reader;
+    if (!reader.Open(trace_path))
+        return 1;
+
+    Estimator::Ptr estimator(new Estimator(config_file));
+    if (lockstep)
+    {
+        // the frames are tracked before InputImage returns
+        estimator->force_pipeline = 0;
+    }
+    if (!estimator->Init(use_imu, use_lidar, use_navsat, use_loop, use_adapt))
+    {
+        LOG(ERROR) << "Can not init the estimator.";
+        return 1;
+    }
+
+    // backend has optimized the newest keyframe, keyframes after finished are in the window
+    auto backend_done = [&] {
+        std::unique_lock<std::mutex> lock(estimator->backend->mutex);
+        auto keyframes = lvio_fusion::Map::Instance().GetSnapshot();
+        return keyframes->empty() || estimator->backend->finished + window_size >= keyframes->rbegin()->first;
+    };
+    // a lost wake up of the backend must not hang the replay
+    int num_stalls = 0;
+    auto wait = [&](std::function<bool()> done) {
+        auto t0 = std::chrono::steady_clock::now();
+        while (!done())
+        {
+            if (std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - t0).count() > timeout)
+            {
+                LOG(WARNING) << "Lockstep: stalled for " << timeout << " s, go on.";
+                num_stalls++;
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    };
+
+    // feed
+    auto start = std::chrono::steady_clock::now();
+    int num_records = 0, num_images = 0;
+    double first_time = 0, last_time = 0;
+    TraceRecord record;
+    while (reader.Next(record))
+    {
+        if (speed > 0)
+        {
+            std::this_thread::sleep_until(start + std::chrono::duration<double>(record.offset / speed));
+        }
+        switch (record.type)
+        {
+        case TraceType::Image:
+            estimator->InputImage(record.time, record.left, record.right, record.init_odom);
+            if (num_images++ == 0)
+            {
+                first_time = record.time;
+            }
+            last_time = record.time;
+            if (lockstep)
+            {
+                wait(backend_done);
+            }
+            break;
+        case TraceType::Imu:
+            estimator->InputImu(record.time, record.v1, record.v2);
+            break;
+        case TraceType::PointCloud:
+            estimator->InputPointCloud(record.time, record.point_cloud);
+            if (lockstep && estimator->association)
+            {
+                // the lidar thread has taken the scan, keyframes one cycle before it are processed
+                wait([&] { return estimator->association->Processed() >= record.time - cycle_time; });
+            }
+            break;
+        case TraceType::Scan:
+            estimator->InputPointCloud(record.scan);
+            if (lockstep && estimator->association)
+            {
+                wait([&] { return estimator->association->Processed() >= record.scan.time - cycle_time; });
+            }
+            break;
+        case TraceType::Navsat:
+            estimator->InputNavSat(record.time, record.v1.x(), record.v1.y(), record.v1.z(), record.v2);
+            break;
+        }
+        num_records++;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+
+    // wait for the backend to optimize the last keyframe
+    while (std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - t1).count() < timeout)
+    {
+        if (backend_done())
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    auto feed_time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t1 - start);
+    auto total_time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - start);
+
+    std::unique_lock<std::mutex> lock(estimator->backend->mutex);
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "Records: " << num_records << ", frames: " << num_images << ", keyframes: " << lvio_fusion::Map::Instance().size()
+              << ", trace: " << last_time - first_time << " s" << std::endl;
+    if (lockstep)
+    {
+        std::cout << "Lockstep stalls: " << num_stalls << std::endl;
+    }
+    std::cout << "Throughput: " << num_images / feed_time_used.count() << " fps (tracking), "
+              << num_images / total_time_used.count() << " fps (with backend), total " << total_time_used.count() << " s" << std::endl;
+    std::cout << std::setw(24) << std::left << "stage" << std::right << std::setw(10) << "count" << std::setw(12) << "mean(ms)"
+              << std::setw(12) << "p50(ms)" << std::setw(12) << "p99(ms)" << std::setw(12) << "max(ms)" << std::endl;
+    for (auto &stat : Metrics::Instance().GetStats())
+    {
+        std::cout << std::setw(24) << std::left << stat.name << std::right << std::setw(10) << stat.count
+                  << std::setw(12) << stat.mean * 1e3 << std::setw(12) << stat.p50 * 1e3
+                  << std::setw(12) << stat.p99 * 1e3 << std::setw(12) << stat.max * 1e3 << std::endl;
+    }
+    for (auto &pair : Metrics::Instance().GetCounters())
+    {
+        std::cout << pair.first << ": " << pair.second << std::endl;
+    }
+    for (auto &stat : Metrics::Instance().GetMemoryStats())
+    {
+        std::cout << "memory " << stat.name << ": " << stat.bytes / 1024 << " KiB, " << stat.objects << " objects" << std::endl;
+    }
+    if (!result_path.empty())
+    {
+        write_result(result_path);
+    }
+    if (!metrics_path.empty())
+    {
+        Metrics::Instance().Dump(metrics_path);
+    }
+    std::cout.flush();
+    google::FlushLogFiles(google::GLOG_INFO);
+    // the threads of backend never stop, leave without running static destructors
+    std::quick_exit(0);
+}
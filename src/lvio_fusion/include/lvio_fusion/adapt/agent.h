@@ -12,14 +12,31 @@ class Core
 {
 public:
     virtual void UpdateWeights(Observation &obs, Weights &weights){};
+
+    // infer the weights of a batch of keyframes in one call, a core with a batched model should override it
+    virtual void UpdateWeights(std::vector<Observation> &batch, std::vector<Weights> &weights)
+    {
+        for (int i = 0; i < batch.size(); i++)
+        {
+            UpdateWeights(batch[i], weights[i]);
+        }
+    }
 };
 
+// infer the weights of new keyframes out of the frontend and backend threads,
+// keyframes inserted together are sent to the core as one batch, the core runs in its own thread,
+// weights later than the deadline are dropped, and the keyframes keep the weights they have.
 class Agent
 {
 public:
-    static void SetCore(Core *core)
+    /**
+     * @param core          inference of weights
+     * @param deadline      max latency (s) of the inference of a batch, 0 is unlimited
+     * @param max_batch     max keyframes in a batch
+     */
+    static void SetCore(Core *core, double deadline = 0, int max_batch = 16)
     {
-        Agent::instance_ = new Agent(core);
+        Agent::instance_ = new Agent(core, deadline, max_batch);
     }
 
     static Agent *Instance()
@@ -29,15 +46,31 @@ public:
 
     void AgentLoop();
 
-    void UpdateWeights(Frame::Ptr frame);
+    void UpdateWeights(const std::vector<Frame::Ptr> &frames);
 
 private:
-    Agent(Core *core);
+    Agent(Core *core, double deadline, int max_batch);
     Agent(const Agent &);
     Agent &operator=(const Agent &);
 
+    struct Request
+    {
+        std::vector<Observation> batch;
+        std::vector<Weights> weights;
+        bool done = false;
+    };
+
+    // the only caller of the core, so a core needs not be thread safe
+    void InferenceLoop();
+
     Core *core_;
+    double deadline_;
+    int max_batch_;
     std::thread thread_;
+    std::thread thread_inference_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<Request>> requests_; // batches waiting for the core
     static Agent *instance_;
 };
 
@@ -13,6 +13,15 @@
 namespace lvio_fusion
 {
 
+// the result of one step
+struct Transition
+{
+    Observation obs;
+    float reward = 0;
+    bool done = false;
+};
+
+// environments only read the keyframes of the map, so different environments can step at the same time.
 class Environment
 {
 public:
@@ -20,9 +29,17 @@ public:
 
     static void Step(int id, Weights &weights, Observation &obs, float *reward, bool *done)
     {
-        environments_[id]->Step(weights, obs, reward, done);
+        Environment::Ptr environment;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            environment = environments_[id];
+        }
+        environment->Step(weights, obs, reward, done);
     }
 
+    // step different environments in parallel, steps of the same environment are serialized
+    static void Step(const std::vector<int> &ids, std::vector<Weights> &weights, std::vector<Transition> &transitions);
+
     static void Init(Estimator::Ptr estimator)
     {
         if (!ground_truths.empty() && estimator)
@@ -30,7 +47,8 @@ public:
             estimator_ = estimator;
 
             // initialize map with ground turth
-            for (auto &pair : Map::Instance().keyframes)
+            auto keyframes = Map::Instance().GetSnapshot();
+            for (auto &pair : *keyframes)
             {
                 pair.second->pose = GetGroundTruth(pair.first);
                 if (estimator->mapping)
@@ -40,8 +58,8 @@ public:
             }
 
             // initialize random distribution
-            double start_time = (++Map::Instance().keyframes.begin())->first;
-            double end_time = (--Map::Instance().keyframes.end())->first;
+            double start_time = (++keyframes->begin())->first;
+            double end_time = keyframes->rbegin()->first;
             u_ = std::uniform_real_distribution<double>(start_time, end_time);
             initialized_ = true;
         }
@@ -99,7 +117,7 @@ private:
 
     void Step(Weights &weights, Observation &obs, float *reward, bool *done);
 
-    SE3d Optimize();
+    SE3d Optimize(Frame::Ptr frame, const Weights &weights);
 
     static std::uniform_real_distribution<double> u_;
     static std::default_random_engine e_;
@@ -108,6 +126,7 @@ private:
     static int num_frames_per_env_;
     static bool initialized_;
 
+    std::mutex mutex_;
     Frames frames_;
     Frames::iterator state_;
 };
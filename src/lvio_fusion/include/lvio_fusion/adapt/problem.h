@@ -34,8 +34,12 @@ namespace adapt
 class Problem : public ceres::Problem
 {
 public:
+    Problem() {}
+
+    Problem(const ceres::Problem::Options &options) : ceres::Problem(options) {}
+
     template <typename... Ts>
-    void AddResidualBlock(
+    ceres::ResidualBlockId AddResidualBlock(
         ProblemType type,
         ceres::CostFunction *cost_function,
         ceres::LossFunction *loss_function,
@@ -43,7 +47,28 @@ public:
     {
         ceres::ResidualBlockId id = ceres::Problem::AddResidualBlock(cost_function, loss_function, x0, xs...);
         types[id] = type;
+        functions[id] = std::make_pair(cost_function, loss_function);
+        num_types[type]++;
+        return id;
+    }
+
+    ceres::ResidualBlockId AddResidualBlock(
+        ProblemType type,
+        ceres::CostFunction *cost_function,
+        ceres::LossFunction *loss_function,
+        const std::vector<double *> &parameter_blocks)
+    {
+        ceres::ResidualBlockId id = ceres::Problem::AddResidualBlock(cost_function, loss_function, parameter_blocks);
+        types[id] = type;
+        functions[id] = std::make_pair(cost_function, loss_function);
         num_types[type]++;
+        return id;
+    }
+
+    void RemoveResidualBlock(ceres::ResidualBlockId id)
+    {
+        Forget(id);
+        ceres::Problem::RemoveResidualBlock(id);
     }
 
     void AddParameterBlock(double *values, int size)
@@ -62,6 +87,22 @@ public:
         ceres::Problem::AddParameterBlock(values, size, local_parameterization);
     }
 
+    // residual blocks depending on it are removed too
+    void RemoveParameterBlock(double *values)
+    {
+        std::vector<ceres::ResidualBlockId> residual_blocks;
+        GetResidualBlocksForParameterBlock(values, &residual_blocks);
+        for (auto id : residual_blocks)
+        {
+            Forget(id);
+        }
+        if (ParameterBlockSize(values) == SE3d::num_parameters && GetParameterization(values))
+        {
+            num_frames--;
+        }
+        ceres::Problem::RemoveParameterBlock(values);
+    }
+
     std::map<ProblemType, int> GetTypes(double *para)
     {
         std::vector<ceres::ResidualBlockId> residual_blocks;
@@ -77,7 +118,16 @@ public:
 
     int num_frames = 0;
     std::unordered_map<ceres::ResidualBlockId, ProblemType> types;
+    std::unordered_map<ceres::ResidualBlockId, std::pair<ceres::CostFunction *, ceres::LossFunction *>> functions;
     std::map<ProblemType, int> num_types = init_num_types;
+
+private:
+    void Forget(ceres::ResidualBlockId id)
+    {
+        num_types[types[id]]--;
+        types.erase(id);
+        functions.erase(id);
+    }
 };
 
 inline void Solve(const ceres::Solver::Options &options,
@@ -2,29 +2,67 @@
 #define lvio_fusion_BACKEND_H
 
 #include "lvio_fusion/adapt/problem.h"
+#include "lvio_fusion/ceres/marginalization_error.hpp"
 #include "lvio_fusion/common.h"
+#include "lvio_fusion/event.h"
 #include "lvio_fusion/frame.h"
 #include "lvio_fusion/imu/initializer.h"
+#include "lvio_fusion/keyframe_policy.h"
 #include "lvio_fusion/lidar/mapping.h"
+#include "lvio_fusion/suite.h"
+#include "lvio_fusion/visual/landmark.h"
 
 namespace lvio_fusion
 {
 
 class Frontend;
 
+// visual residual block kept in the sliding problem
+struct VisualBlock
+{
+    ceres::ResidualBlockId id;
+    visual::Feature::Ptr feature;
+    Frame::Ptr first_frame;
+    ProblemType type;
+    double weight;
+};
+
+// blocks of a keyframe kept in the sliding problem across optimizations
+struct WindowFrame
+{
+    Frame::Ptr frame;
+    std::unordered_map<unsigned long, VisualBlock> visual;      // landmark id -> block
+    std::unordered_map<double *, visual::Landmark::Ptr> depths; // inverse depths of landmarks first observed in it
+    ceres::ResidualBlockId imu_error = nullptr;
+    imu::Preintegration::Ptr preintegration;
+    Frame::Ptr last_frame;
+};
+
+struct Window
+{
+    std::map<double, WindowFrame> frames;
+    std::vector<ceres::ResidualBlockId> transients; // rebuilt at every optimization
+};
+
 class Backend
 {
 public:
     typedef std::shared_ptr<Backend> Ptr;
 
-    Backend(double window_size, bool update_weights);
+    Backend(double window_size, bool update_weights, bool parallel_build, bool marginalize, double latency, int min_covisible = 0, int suite = StereoOnly);
 
     void SetFrontend(std::shared_ptr<Frontend> frontend) { frontend_ = frontend; }
 
     void SetMapping(Mapping::Ptr mapping) { mapping_ = mapping; }
 
+    // the lag is reported to the policy after every optimization
+    void SetKeyframePolicy(KeyframePolicy::Ptr policy) { keyframe_policy_ = policy; }
+
     void SetInitializer(Initializer::Ptr initializer) { initializer_ = initializer; }
 
+    // the prior map is fixed, no global optimization
+    void SetLocalization(bool localization) { localization_ = localization; }
+
     void UpdateMap();
 
     std::mutex mutex;
@@ -39,18 +77,57 @@ private:
 
     void UpdateFrontend(SE3d transform, double time);
 
-    double BuildProblem(Frames &active_kfs, adapt::Problem &problem);
+    /**
+     * add residual blocks of keyframes into the problem
+     * @param active_kfs    keyframes
+     * @param problem       problem
+     * @param window        blocks already in the problem are reused and new blocks are recorded, nullptr for a new problem
+     * @return              global end
+     */
+    double BuildProblem(Frames &active_kfs, adapt::Problem &problem, Window *window = nullptr);
+
+    // BuildProblem specialized for the sensors of suite
+    template <int suite>
+    double BuildSuiteProblem(Frames &active_kfs, adapt::Problem &problem, Window *window);
+
+    // remove the blocks of the sliding problem which are out of the new window or out of date
+    void Slide(Frames &active_kfs);
+
+    ceres::Problem::Options ProblemOptions();
+
+    // marginalize keyframes before finished into a prior of the next window
+    void Marginalize(Frames &active_kfs, adapt::Problem &problem, double finished, double end);
+
+    // give up accuracy step by step while the backend lags behind the newest keyframe more than the target
+    void UpdateLevel(double lag);
 
     std::weak_ptr<Frontend> frontend_;
     Mapping::Ptr mapping_;
+    KeyframePolicy::Ptr keyframe_policy_;
     Initializer::Ptr initializer_;
 
     std::thread thread_, thread_global_;
     std::mutex mutex_optimize_;
     std::condition_variable map_update_;
+    Subscriber::Ptr global_events_;
+    std::unique_ptr<ceres::LossFunction> loss_function_;
+    std::unique_ptr<ceres::LocalParameterization> local_parameterization_;
+    std::unique_ptr<adapt::Problem> problem_; // sliding problem
+    Window window_;
     double global_end_ = 0;
+    Marginalization::Ptr marginalization_;
+    std::map<double, double> marginalized_; // time of marginalized keyframe -> end of window at that time
+    int level_ = 0;                         // 0 = full problem
+    int num_good_ = 0;                      // optimizations in a row meeting the target
+    double mapped_ = 0;                     // lidar mapping is done before it
+    bool localization_ = false;
+    const double latency_;                  // target lag (s), 0 = no target
     const double window_size_;
+    const int min_covisible_;               // keep keyframes sharing enough landmarks with the newest one, 0 = fixed window
     const bool update_weights_;
+    const bool parallel_build_;
+    const bool marginalize_;
+    const int suite_;
 };
 
 } // namespace lvio_fusion
@@ -0,0 +1,67 @@
+#ifndef lvio_fusion_BUFFER_H
+#define lvio_fusion_BUFFER_H
+
+#include "lvio_fusion/common.h"
+
+#include <cstring>
+
+namespace lvio_fusion
+{
+
+// serialize data into a byte buffer and read it back from raw memory,
+// the reader is used on memory-mapped files, so it never copies more than needed.
+
+inline size_t mat_bytes(const cv::Mat &mat)
+{
+    return mat.total() * mat.elemSize();
+}
+
+template <typename T>
+inline void write_pod(std::vector<char> &buffer, const T &value)
+{
+    buffer.insert(buffer.end(), (const char *)&value, (const char *)&value + sizeof(T));
+}
+
+template <typename T>
+inline const char *read_pod(const char *p, T &value)
+{
+    memcpy(&value, p, sizeof(T));
+    return p + sizeof(T);
+}
+
+inline void write_mat(std::vector<char> &buffer, const cv::Mat &mat)
+{
+    int header[3] = {mat.rows, mat.cols, mat.type()};
+    buffer.insert(buffer.end(), (char *)header, (char *)header + sizeof(header));
+    cv::Mat continuous = mat.isContinuous() ? mat : mat.clone();
+    buffer.insert(buffer.end(), (char *)continuous.data, (char *)continuous.data + mat_bytes(continuous));
+}
+
+inline const char *read_mat(const char *p, cv::Mat &mat)
+{
+    const int *header = (const int *)p;
+    p += 3 * sizeof(int);
+    mat = cv::Mat(header[0], header[1], header[2]);
+    memcpy(mat.data, p, mat_bytes(mat));
+    return p + mat_bytes(mat);
+}
+
+inline void write_points(std::vector<char> &buffer, const PointICloud &points)
+{
+    size_t size = points.size();
+    buffer.insert(buffer.end(), (char *)&size, (char *)&size + sizeof(size));
+    buffer.insert(buffer.end(), (char *)points.points.data(), (char *)points.points.data() + size * sizeof(PointI));
+}
+
+inline const char *read_points(const char *p, PointICloud &points)
+{
+    size_t size = *(const size_t *)p;
+    p += sizeof(size);
+    points.resize(size);
+    memcpy(points.points.data(), p, size * sizeof(PointI));
+    return p + size * sizeof(PointI);
+}
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_BUFFER_H
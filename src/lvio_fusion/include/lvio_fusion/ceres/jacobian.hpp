@@ -0,0 +1,47 @@
+#ifndef lvio_fusion_JACOBIAN_H
+#define lvio_fusion_JACOBIAN_H
+
+#include "lvio_fusion/common.h"
+
+namespace lvio_fusion
+{
+
+// hot cost functions use analytic jacobians instead of autodiff
+extern bool analytic_jacobians;
+
+/**
+ * chain a jacobian of the left perturbation theta, R <- exp(theta) * R,
+ * to the quaternion (x, y, z, w) of a pose, which is parameterized by ceres::EigenQuaternionParameterization,
+ * so that it is the same as autodiff after the parameterization.
+ * @param q         unit quaternion (x, y, z, w)
+ * @return          d(theta) / d(q)
+ */
+inline Matrix<double, 3, 4> quaternion_jacobian(const double *q)
+{
+    // 2 * transpose of the jacobian of the parameterization, whose columns are orthonormal
+    Matrix<double, 3, 4> jacobian;
+    jacobian << q[3], -q[2], q[1], -q[0],
+        q[2], q[3], -q[0], -q[1],
+        -q[1], q[0], q[3], -q[2];
+    return 2 * jacobian;
+}
+
+/**
+ * d(yaw, pitch, roll) / d(theta) of R = Rz(yaw) * Ry(pitch) * Rx(roll), with the left perturbation theta
+ * @param yaw       yaw
+ * @param pitch     pitch
+ * @return          jacobian
+ */
+inline Matrix3d ypr_jacobian(double yaw, double pitch)
+{
+    double cy = cos(yaw), sy = sin(yaw), cp = cos(pitch), tp = tan(pitch);
+    Matrix3d jacobian;
+    jacobian << cy * tp, sy * tp, 1,
+        -sy, cy, 0,
+        cy / cp, sy / cp, 0;
+    return jacobian;
+}
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_JACOBIAN_H
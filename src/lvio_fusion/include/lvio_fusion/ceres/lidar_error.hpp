@@ -2,11 +2,40 @@
 #define lvio_fusion_LIDAR_ERROR_H
 
 #include "lvio_fusion/ceres/base.hpp"
+#include "lvio_fusion/ceres/jacobian.hpp"
 #include "lvio_fusion/common.h"
 
+#include <array>
+
 namespace lvio_fusion
 {
 
+// LidarPlaneError with analytic jacobians
+class LidarPlaneAnalyticError : public ceres::SizedCostFunction<1, 7>
+{
+public:
+    LidarPlaneAnalyticError(Vector3d p, Vector3d pa, Vector3d abc_norm)
+        : p_(p), pa_(pa), abc_norm_(abc_norm) {}
+
+    virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
+    {
+        Quaterniond q = Eigen::Map<const Quaterniond>(parameters[0]).normalized();
+        Eigen::Map<const Vector3d> t(parameters[0] + 4);
+        Vector3d R_p = q * p_;
+        residuals[0] = abc_norm_.dot(R_p + t - pa_);
+        if (jacobians && jacobians[0])
+        {
+            Eigen::Map<Matrix<double, 1, 7, RowMajor>> jacobian(jacobians[0]);
+            jacobian.leftCols<4>() = R_p.cross(abc_norm_).transpose() * quaternion_jacobian(q.coeffs().data());
+            jacobian.rightCols<3>() = abc_norm_.transpose();
+        }
+        return true;
+    }
+
+private:
+    Vector3d p_, pa_, abc_norm_;
+};
+
 class LidarPlaneError
 {
 public:
@@ -32,6 +61,11 @@ public:
 
     static ceres::CostFunction *Create(Vector3d p, Vector3d pa, Vector3d pb, Vector3d pc)
     {
+        if (analytic_jacobians)
+        {
+            LidarPlaneError error(p, pa, pb, pc);
+            return new LidarPlaneAnalyticError(p, pa, error.abc_norm_);
+        }
         return (new ceres::AutoDiffCostFunction<LidarPlaneError, 1, 7>(new LidarPlaneError(p, pa, pb, pc)));
     }
 
@@ -109,6 +143,113 @@ private:
     double *rpyxyz_;
 };
 
+// all point to plane correspondences of a scan in one block, the same as LidarPlaneErrorRPZ or LidarPlaneErrorYXY of each point,
+// the parameters are 3 of the relative pose rpyxyz to Twc1, the others are fixed,
+// residuals are robustified one by one by a huber loss inside, as the loss of ceres is applied to the whole block.
+class LidarPlanesError : public ceres::CostFunction
+{
+public:
+    /**
+     * @param points    points in the scan
+     * @param points_a  a point of the plane of each point in the map
+     * @param normals   unit normal of the plane of each point
+     * @param Twc1      pose of the map frame
+     * @param rpyxyz    relative pose to the map frame
+     * @param indices   indices of the parameters in rpyxyz
+     * @param weight    weight
+     * @param delta     huber loss, 0 = no loss
+     */
+    LidarPlanesError(const Matrix3Xd &points, const Matrix3Xd &points_a, const Matrix3Xd &normals,
+                     SE3d Twc1, double *rpyxyz, std::array<int, 3> indices, double weight, double delta)
+        : points_(points), points_a_(points_a), normals_(normals), Twc1_(Twc1), rpyxyz_(rpyxyz), indices_(indices), weight_(weight), delta_(delta)
+    {
+        set_num_residuals(points.cols());
+        for (int i = 0; i < 3; i++)
+        {
+            mutable_parameter_block_sizes()->push_back(1);
+        }
+    }
+
+    virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
+    {
+        double rpyxyz[6], relative_i_j[7];
+        std::copy(rpyxyz_, rpyxyz_ + 6, rpyxyz);
+        for (int i = 0; i < 3; i++)
+        {
+            rpyxyz[indices_[i]] = parameters[i][0];
+        }
+        ceres::RpyxyzToSE3(rpyxyz, relative_i_j);
+        Matrix3d R = Eigen::Map<const Quaterniond>(relative_i_j).toRotationMatrix();
+        Matrix3d R1 = Twc1_.rotationMatrix();
+        Vector3d t = R1 * Eigen::Map<const Vector3d>(relative_i_j + 4) + Twc1_.translation();
+
+        int n = points_.cols();
+        Matrix3Xd R_p = R * points_;
+        Matrix3Xd pw = (R1 * R_p).colwise() + t;
+        Eigen::Map<VectorXd> r(residuals, n);
+        r = weight_ * (normals_.array() * (pw - points_a_).array()).colwise().sum().transpose();
+
+        // huber loss, r^2 -> 2 * delta * |r| - delta^2 out of delta
+        VectorXd scales = VectorXd::Ones(n);
+        if (delta_ > 0)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                double abs_r = std::abs(r[i]);
+                if (abs_r > delta_)
+                {
+                    double robust = std::sqrt(2 * delta_ * abs_r - delta_ * delta_);
+                    scales[i] = delta_ / robust;
+                    r[i] = r[i] > 0 ? robust : -robust;
+                }
+            }
+        }
+
+        if (jacobians)
+        {
+            // d(r) / d(t) = normal in the relative frame, d(r) / d(angle) = axis . (R_p x normal)
+            // axes of yaw, pitch and roll of R = Rz(yaw) * Ry(pitch) * Rx(roll)
+            Matrix3Xd B = R1.transpose() * normals_;
+            Matrix3Xd C(3, n);
+            C.row(0) = R_p.row(1).cwiseProduct(B.row(2)) - R_p.row(2).cwiseProduct(B.row(1));
+            C.row(1) = R_p.row(2).cwiseProduct(B.row(0)) - R_p.row(0).cwiseProduct(B.row(2));
+            C.row(2) = R_p.row(0).cwiseProduct(B.row(1)) - R_p.row(1).cwiseProduct(B.row(0));
+            double cy = cos(rpyxyz[0]), sy = sin(rpyxyz[0]), cp = cos(rpyxyz[1]), sp = sin(rpyxyz[1]);
+            Vector3d axes[3] = {Vector3d(0, 0, 1), Vector3d(-sy, cy, 0), Vector3d(cy * cp, sy * cp, -sp)};
+            for (int i = 0; i < 3; i++)
+            {
+                if (!jacobians[i])
+                    continue;
+                Eigen::Map<VectorXd> jacobian(jacobians[i], n);
+                int index = indices_[i];
+                if (index < 3)
+                {
+                    jacobian = (axes[index].transpose() * C).transpose();
+                }
+                else
+                {
+                    jacobian = B.row(index - 3).transpose();
+                }
+                jacobian = weight_ * scales.cwiseProduct(jacobian);
+            }
+        }
+        return true;
+    }
+
+    static ceres::CostFunction *Create(const Matrix3Xd &points, const Matrix3Xd &points_a, const Matrix3Xd &normals,
+                                       SE3d Twc1, double *rpyxyz, std::array<int, 3> indices, double weight, double delta)
+    {
+        return new LidarPlanesError(points, points_a, normals, Twc1, rpyxyz, indices, weight, delta);
+    }
+
+private:
+    Matrix3Xd points_, points_a_, normals_;
+    SE3d Twc1_;
+    double *rpyxyz_;
+    std::array<int, 3> indices_;
+    double weight_, delta_;
+};
+
 } // namespace lvio_fusion
 
 #endif // lvio_fusion_LIDAR_ERROR_H
@@ -0,0 +1,335 @@
+#ifndef lvio_fusion_MARGINALIZATION_ERROR_H
+#define lvio_fusion_MARGINALIZATION_ERROR_H
+
+#include "lvio_fusion/adapt/problem.h"
+#include "lvio_fusion/ceres/base.hpp"
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/utility.h"
+
+#include <unordered_set>
+
+namespace lvio_fusion
+{
+
+// linearized prior of the parameters marginalized out of the sliding window,
+// the local parameter of a pose is [left perturbation of rotation, translation], same as the local parameterization.
+class Marginalization
+{
+public:
+    typedef std::shared_ptr<Marginalization> Ptr;
+
+    /**
+     * marginalize parameters out of a solved problem by schur complement
+     * @param problem   solved problem
+     * @param drops     parameter blocks to marginalize, one-dimensional blocks must not be connected to each other
+     * @return          prior of the parameters connected to drops, nullptr if nothing is kept
+     */
+    static Marginalization::Ptr Create(adapt::Problem &problem, const std::unordered_set<double *> &drops)
+    {
+        // residuals connected to the dropped parameters
+        std::vector<ceres::ResidualBlockId> residual_blocks;
+        std::unordered_set<ceres::ResidualBlockId> visited;
+        for (auto para : drops)
+        {
+            if (!problem.HasParameterBlock(para))
+                continue;
+            std::vector<ceres::ResidualBlockId> ids;
+            problem.GetResidualBlocksForParameterBlock(para, &ids);
+            for (auto id : ids)
+            {
+                if (visited.insert(id).second)
+                {
+                    residual_blocks.push_back(id);
+                }
+            }
+        }
+
+        // order parameters: dropped landmarks, other dropped parameters, kept parameters
+        std::vector<double *> landmarks, others, kept;
+        std::unordered_map<double *, int> index;
+        for (auto id : residual_blocks)
+        {
+            std::vector<double *> paras;
+            problem.GetParameterBlocksForResidualBlock(id, &paras);
+            for (auto para : paras)
+            {
+                if (index.find(para) != index.end())
+                    continue;
+                index[para] = 0;
+                if (drops.find(para) == drops.end())
+                    kept.push_back(para);
+                else if (problem.ParameterBlockLocalSize(para) == 1)
+                    landmarks.push_back(para);
+                else
+                    others.push_back(para);
+            }
+        }
+        if (kept.empty())
+            return nullptr;
+
+        Marginalization::Ptr marginalization(new Marginalization);
+        std::unordered_map<double *, int> offsets;
+        int size = 0;
+        for (auto &blocks : {landmarks, others, kept})
+        {
+            for (auto para : blocks)
+            {
+                offsets[para] = size;
+                size += problem.ParameterBlockLocalSize(para);
+            }
+        }
+        int m_landmarks = landmarks.size(), m = offsets[kept.front()] - m_landmarks, n = size - offsets[kept.front()];
+        for (auto para : kept)
+        {
+            marginalization->blocks.push_back(para);
+            marginalization->sizes.push_back(problem.ParameterBlockSize(para));
+            marginalization->local_sizes.push_back(problem.ParameterBlockLocalSize(para));
+            marginalization->offsets.push_back(offsets[para] - offsets[kept.front()]);
+            marginalization->x0.push_back(std::vector<double>(para, para + problem.ParameterBlockSize(para)));
+        }
+        marginalization->local_size = n;
+
+        // build the normal equation at the current values
+        MatrixXd H = MatrixXd::Zero(size, size);
+        VectorXd g = VectorXd::Zero(size);
+        for (auto id : residual_blocks)
+        {
+            std::vector<double *> paras;
+            problem.GetParameterBlocksForResidualBlock(id, &paras);
+            auto cost_function = problem.functions[id].first;
+            auto loss_function = problem.functions[id].second;
+            int num_residuals = cost_function->num_residuals();
+            VectorXd residual(num_residuals);
+            std::vector<Matrix<double, Dynamic, Dynamic, RowMajor>> jacobians(paras.size());
+            std::vector<double *> raw_jacobians(paras.size());
+            for (int i = 0; i < paras.size(); i++)
+            {
+                jacobians[i].resize(num_residuals, problem.ParameterBlockSize(paras[i]));
+                raw_jacobians[i] = jacobians[i].data();
+            }
+            if (!cost_function->Evaluate(paras.data(), residual.data(), raw_jacobians.data()))
+                continue;
+
+            // jacobians of local parameters
+            std::vector<MatrixXd> local_jacobians(paras.size());
+            for (int i = 0; i < paras.size(); i++)
+            {
+                auto local_parameterization = problem.GetParameterization(paras[i]);
+                if (local_parameterization)
+                {
+                    Matrix<double, Dynamic, Dynamic, RowMajor> plus_jacobian(local_parameterization->GlobalSize(), local_parameterization->LocalSize());
+                    local_parameterization->ComputeJacobian(paras[i], plus_jacobian.data());
+                    local_jacobians[i] = jacobians[i] * plus_jacobian;
+                }
+                else
+                {
+                    local_jacobians[i] = jacobians[i];
+                }
+            }
+
+            // robust loss, same as the corrector of ceres
+            if (loss_function)
+            {
+                double sq_norm = residual.squaredNorm(), rho[3];
+                loss_function->Evaluate(sq_norm, rho);
+                double sqrt_rho1 = std::sqrt(rho[1]);
+                double residual_scaling, alpha_sq_norm;
+                if (sq_norm == 0.0 || rho[2] <= 0.0)
+                {
+                    residual_scaling = sqrt_rho1;
+                    alpha_sq_norm = 0.0;
+                }
+                else
+                {
+                    double D = 1.0 + 2.0 * sq_norm * rho[2] / rho[1];
+                    double alpha = 1.0 - std::sqrt(D);
+                    residual_scaling = sqrt_rho1 / (1 - alpha);
+                    alpha_sq_norm = alpha / sq_norm;
+                }
+                for (auto &jacobian : local_jacobians)
+                {
+                    jacobian = sqrt_rho1 * (jacobian - alpha_sq_norm * residual * (residual.transpose() * jacobian));
+                }
+                residual *= residual_scaling;
+            }
+
+            for (int i = 0; i < paras.size(); i++)
+            {
+                int index_i = offsets[paras[i]], size_i = local_jacobians[i].cols();
+                for (int j = i; j < paras.size(); j++)
+                {
+                    int index_j = offsets[paras[j]], size_j = local_jacobians[j].cols();
+                    MatrixXd block = local_jacobians[i].transpose() * local_jacobians[j];
+                    H.block(index_i, index_j, size_i, size_j) += block;
+                    if (i != j)
+                    {
+                        H.block(index_j, index_i, size_j, size_i) += block.transpose();
+                    }
+                }
+                g.segment(index_i, size_i) += local_jacobians[i].transpose() * residual;
+            }
+        }
+
+        // schur complement of landmarks, their block is diagonal
+        const double eps = 1e-8;
+        int r = size - m_landmarks;
+        VectorXd inv_diagonal(m_landmarks);
+        for (int i = 0; i < m_landmarks; i++)
+        {
+            inv_diagonal[i] = H(i, i) > eps ? 1.0 / H(i, i) : 0;
+        }
+        MatrixXd H_rl = H.block(m_landmarks, 0, r, m_landmarks);
+        MatrixXd H_rl_inv = H_rl * inv_diagonal.asDiagonal();
+        MatrixXd H_r = H.block(m_landmarks, m_landmarks, r, r) - H_rl_inv * H_rl.transpose();
+        VectorXd g_r = g.segment(m_landmarks, r) - H_rl_inv * g.head(m_landmarks);
+
+        // schur complement of the other dropped parameters
+        MatrixXd A;
+        VectorXd b;
+        if (m > 0)
+        {
+            MatrixXd H_mm = 0.5 * (H_r.topLeftCorner(m, m) + H_r.topLeftCorner(m, m).transpose());
+            SelfAdjointEigenSolver<MatrixXd> saes(H_mm);
+            MatrixXd H_mm_inv = saes.eigenvectors() * VectorXd((saes.eigenvalues().array() > eps).select(saes.eigenvalues().array().inverse(), 0)).asDiagonal() * saes.eigenvectors().transpose();
+            MatrixXd H_nm = H_r.bottomLeftCorner(n, m);
+            A = H_r.bottomRightCorner(n, n) - H_nm * H_mm_inv * H_nm.transpose();
+            b = g_r.tail(n) - H_nm * H_mm_inv * g_r.head(m);
+        }
+        else
+        {
+            A = H_r;
+            b = g_r;
+        }
+
+        // A = J^T * J, b = J^T * r
+        SelfAdjointEigenSolver<MatrixXd> saes(0.5 * (A + A.transpose()));
+        VectorXd S = (saes.eigenvalues().array() > eps).select(saes.eigenvalues().array(), 0);
+        VectorXd S_inv = (saes.eigenvalues().array() > eps).select(saes.eigenvalues().array().inverse(), 0);
+        marginalization->jacobian = S.cwiseSqrt().asDiagonal() * saes.eigenvectors().transpose();
+        marginalization->residual = S_inv.cwiseSqrt().asDiagonal() * saes.eigenvectors().transpose() * b;
+        return marginalization;
+    }
+
+    // local difference between values and the linearization point of the i-th block
+    VectorXd Minus(int i, const double *values) const
+    {
+        const std::vector<double> &x0 = this->x0[i];
+        VectorXd dx(local_sizes[i]);
+        if (sizes[i] == SE3d::num_parameters && local_sizes[i] == 6)
+        {
+            Quaterniond q(values[3], values[0], values[1], values[2]);
+            Quaterniond q0(x0[3], x0[0], x0[1], x0[2]);
+            Quaterniond dq = q * q0.inverse();
+            dx.head<3>() = dq.w() >= 0 ? dq.vec() : Vector3d(-dq.vec());
+            dx.tail<3>() = Vector3d(values[4] - x0[4], values[5] - x0[5], values[6] - x0[6]);
+        }
+        else
+        {
+            for (int j = 0; j < local_sizes[i]; j++)
+            {
+                dx[j] = values[j] - x0[j];
+            }
+        }
+        return dx;
+    }
+
+    // derivative of Minus with respect to the values of the i-th block
+    MatrixXd MinusJacobian(int i, const double *values) const
+    {
+        if (sizes[i] == SE3d::num_parameters && local_sizes[i] == 6)
+        {
+            const std::vector<double> &x0 = this->x0[i];
+            Quaterniond q(values[3], values[0], values[1], values[2]);
+            Quaterniond p = Quaterniond(x0[3], x0[0], x0[1], x0[2]).inverse();
+            MatrixXd jacobian = MatrixXd::Zero(6, 7);
+            jacobian.block<3, 3>(0, 0) = p.w() * Matrix3d::Identity() - skew_symmetric(p.vec());
+            jacobian.block<3, 1>(0, 3) = p.vec();
+            if ((q * p).w() < 0)
+            {
+                jacobian = -jacobian;
+            }
+            jacobian.block<3, 3>(3, 4) = Matrix3d::Identity();
+            return jacobian;
+        }
+        return MatrixXd::Identity(local_sizes[i], sizes[i]);
+    }
+
+    // the prior is usable only if all blocks are still in the problem, and no pose jumped since linearization
+    bool Check(adapt::Problem &problem, double max_translation = 1, double max_rotation = 0.1) const
+    {
+        for (int i = 0; i < blocks.size(); i++)
+        {
+            if (!problem.HasParameterBlock(blocks[i]))
+                return false;
+            if (sizes[i] == SE3d::num_parameters && local_sizes[i] == 6)
+            {
+                VectorXd dx = Minus(i, blocks[i]);
+                if (dx.tail<3>().norm() > max_translation || 2 * dx.head<3>().norm() > max_rotation)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<double *> blocks;         // kept parameter blocks
+    std::vector<int> sizes;               // global sizes of blocks
+    std::vector<int> local_sizes;         // local sizes of blocks
+    std::vector<int> offsets;             // offsets of blocks in the local vector
+    std::vector<std::vector<double>> x0;  // linearization point
+    MatrixXd jacobian;
+    VectorXd residual;
+    int local_size = 0;
+
+private:
+    Marginalization() {}
+};
+
+class MarginalizationError : public ceres::CostFunction
+{
+public:
+    MarginalizationError(Marginalization::Ptr marginalization) : marginalization_(marginalization)
+    {
+        for (auto size : marginalization_->sizes)
+        {
+            mutable_parameter_block_sizes()->push_back(size);
+        }
+        set_num_residuals(marginalization_->local_size);
+    }
+
+    virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
+    {
+        int n = marginalization_->local_size;
+        VectorXd dx(n);
+        for (int i = 0; i < marginalization_->blocks.size(); i++)
+        {
+            dx.segment(marginalization_->offsets[i], marginalization_->local_sizes[i]) = marginalization_->Minus(i, parameters[i]);
+        }
+        Eigen::Map<VectorXd> residual(residuals, n);
+        residual = marginalization_->residual + marginalization_->jacobian * dx;
+        if (jacobians)
+        {
+            for (int i = 0; i < marginalization_->blocks.size(); i++)
+            {
+                if (jacobians[i])
+                {
+                    Eigen::Map<Matrix<double, Dynamic, Dynamic, RowMajor>> jacobian(jacobians[i], n, marginalization_->sizes[i]);
+                    jacobian = marginalization_->jacobian.middleCols(marginalization_->offsets[i], marginalization_->local_sizes[i]) *
+                               marginalization_->MinusJacobian(i, parameters[i]);
+                }
+            }
+        }
+        return true;
+    }
+
+    static ceres::CostFunction *Create(Marginalization::Ptr marginalization)
+    {
+        return new MarginalizationError(marginalization);
+    }
+
+private:
+    Marginalization::Ptr marginalization_;
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_MARGINALIZATION_ERROR_H
@@ -2,11 +2,67 @@
 #define lvio_fusion_POSE_ERROR_H
 
 #include "lvio_fusion/ceres/base.hpp"
+#include "lvio_fusion/ceres/jacobian.hpp"
 #include "lvio_fusion/common.h"
+#include "lvio_fusion/utility.h"
 
 namespace lvio_fusion
 {
 
+// PoseGraphError with analytic jacobians
+class PoseGraphAnalyticError : public ceres::SizedCostFunction<6, 7, 7>, public ceres::Error
+{
+public:
+    PoseGraphAnalyticError(const double *rpyxyz, double weight, double v) : Error(weight)
+    {
+        std::copy(rpyxyz, rpyxyz + 6, rpyxyz_);
+        scales_ << v * weight, v * weight, v * weight, weight, 10 * weight, 10 * weight;
+    }
+
+    virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
+    {
+        Quaterniond q1 = Eigen::Map<const Quaterniond>(parameters[0]).normalized();
+        Eigen::Map<const Vector3d> t1(parameters[0] + 4);
+        Quaterniond q2 = Eigen::Map<const Quaterniond>(parameters[1]).normalized();
+        Eigen::Map<const Vector3d> t2(parameters[1] + 4);
+        Matrix3d R1_inverse = q1.conjugate().toRotationMatrix();
+        Quaterniond q = q1.conjugate() * q2;
+        Vector3d b = t2 - t1;
+        double rpyxyz[6];
+        ceres::EigenQuaternionToRPY(q.coeffs().data(), rpyxyz);
+        Eigen::Map<Vector3d>(rpyxyz + 3) = R1_inverse * b;
+        Eigen::Map<Matrix<double, 6, 1>> residual(residuals);
+        residual = scales_.cwiseProduct(Eigen::Map<const Matrix<double, 6, 1>>(rpyxyz_) - Eigen::Map<Matrix<double, 6, 1>>(rpyxyz));
+        if (jacobians)
+        {
+            // relative rotation is perturbed by R1^-1 * theta2 - R1^-1 * theta1
+            Matrix3d dypr_dtheta = ypr_jacobian(rpyxyz[0], rpyxyz[1]) * R1_inverse;
+            if (jacobians[0])
+            {
+                Eigen::Map<Matrix<double, 6, 7, RowMajor>> jacobian(jacobians[0]);
+                jacobian.setZero();
+                jacobian.block<3, 4>(0, 0) = -dypr_dtheta * quaternion_jacobian(q1.coeffs().data());
+                jacobian.block<3, 4>(3, 0) = R1_inverse * skew_symmetric(b) * quaternion_jacobian(q1.coeffs().data());
+                jacobian.block<3, 3>(3, 4) = -R1_inverse;
+                jacobian = -(scales_.asDiagonal() * jacobian);
+            }
+            if (jacobians[1])
+            {
+                Eigen::Map<Matrix<double, 6, 7, RowMajor>> jacobian(jacobians[1]);
+                jacobian.setZero();
+                jacobian.block<3, 4>(0, 0) = dypr_dtheta * quaternion_jacobian(q2.coeffs().data());
+                jacobian.block<3, 3>(3, 4) = R1_inverse;
+                jacobian = -(scales_.asDiagonal() * jacobian);
+            }
+        }
+        return true;
+    }
+
+private:
+    double rpyxyz_[6];
+    Matrix<double, 6, 1> scales_;
+};
+
 class PoseGraphError : public ceres::Error
 {
 public:
@@ -39,11 +95,17 @@ public:
 
     static ceres::CostFunction *Create(SE3d last_pose, SE3d pose, double weight = 1, double v = 1)
     {
-        return (new ceres::AutoDiffCostFunction<PoseGraphError, 6, 7, 7>(new PoseGraphError(last_pose, pose, weight, v)));
+        return Create(last_pose.inverse() * pose, weight, v);
     }
 
     static ceres::CostFunction *Create(SE3d relative_i_j, double weight = 1, double v = 1)
     {
+        if (analytic_jacobians)
+        {
+            double rpyxyz[6];
+            ceres::SE3ToRpyxyz(relative_i_j.data(), rpyxyz);
+            return new PoseGraphAnalyticError(rpyxyz, weight, v);
+        }
         return (new ceres::AutoDiffCostFunction<PoseGraphError, 6, 7, 7>(new PoseGraphError(relative_i_j, weight, v)));
     }
 
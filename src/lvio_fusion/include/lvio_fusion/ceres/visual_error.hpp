@@ -2,6 +2,8 @@
 #define lvio_fusion_VISUAL_ERROR_H
 
 #include "lvio_fusion/ceres/base.hpp"
+#include "lvio_fusion/ceres/jacobian.hpp"
+#include "lvio_fusion/utility.h"
 #include "lvio_fusion/visual/camera.h"
 
 namespace lvio_fusion
@@ -45,6 +47,49 @@ inline void Robot2Pixel(const T *pb, Camera::Ptr camera, T *result)
     result[1] = camera->fy * yp + camera->cy;
 }
 
+// d(pixel) / d(pc)
+inline Matrix<double, 2, 3> projection_jacobian(Camera::Ptr camera, const Vector3d &pc)
+{
+    double z_inv = 1 / pc.z();
+    Matrix<double, 2, 3> jacobian;
+    jacobian << camera->fx * z_inv, 0, -camera->fx * pc.x() * z_inv * z_inv,
+        0, camera->fy * z_inv, -camera->fy * pc.y() * z_inv * z_inv;
+    return jacobian;
+}
+
+// PoseOnlyReprojectionError with analytic jacobians
+class PoseOnlyReprojectionAnalyticError : public ceres::SizedCostFunction<2, 7>, public ceres::Error
+{
+public:
+    PoseOnlyReprojectionAnalyticError(Vector2d ob, Vector3d pw, Camera::Ptr camera, double weight)
+        : ob_(ob), pw_(pw), camera_(camera), Error(weight) {}
+
+    virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
+    {
+        Quaterniond q = Eigen::Map<const Quaterniond>(parameters[0]).normalized();
+        Eigen::Map<const Vector3d> t(parameters[0] + 4);
+        Matrix3d R = q.toRotationMatrix();
+        Matrix3d Re = camera_->extrinsic.rotationMatrix();
+        Vector3d a = pw_ - t;
+        Vector3d pc = Re.transpose() * (R.transpose() * a - camera_->extrinsic.translation());
+        Eigen::Map<Vector2d> residual(residuals);
+        residual = weight_ * (Vector2d(camera_->fx * pc.x() / pc.z() + camera_->cx, camera_->fy * pc.y() / pc.z() + camera_->cy) - ob_);
+        if (jacobians && jacobians[0])
+        {
+            Matrix<double, 2, 3> dr_dpw = weight_ * projection_jacobian(camera_, pc) * Re.transpose() * R.transpose();
+            Eigen::Map<Matrix<double, 2, 7, RowMajor>> jacobian(jacobians[0]);
+            jacobian.leftCols<4>() = dr_dpw * skew_symmetric(a) * quaternion_jacobian(q.coeffs().data());
+            jacobian.rightCols<3>() = -dr_dpw;
+        }
+        return true;
+    }
+
+private:
+    Vector2d ob_;
+    Vector3d pw_;
+    Camera::Ptr camera_;
+};
+
 class PoseOnlyReprojectionError : public ceres::Error
 {
 public:
@@ -65,6 +110,8 @@ public:
 
     static ceres::CostFunction *Create(Vector2d ob, Vector3d pw, Camera::Ptr camera, double weight)
     {
+        if (analytic_jacobians)
+            return new PoseOnlyReprojectionAnalyticError(ob, pw, camera, weight);
         return (new ceres::AutoDiffCostFunction<PoseOnlyReprojectionError, 2, 7>(
             new PoseOnlyReprojectionError(ob, pw, camera, weight)));
     }
@@ -75,6 +122,59 @@ private:
     Camera::Ptr camera_;
 };
 
+// TwoFrameReprojectionError with analytic jacobians
+class TwoFrameReprojectionAnalyticError : public ceres::SizedCostFunction<2, 1, 7, 7>, public ceres::Error
+{
+public:
+    TwoFrameReprojectionAnalyticError(Vector2d first_ob, Vector2d ob, Camera::Ptr left, Camera::Ptr right, double weight)
+        : first_ob_(first_ob), ob_(ob), left_(left), right_(right), Error(weight) {}
+
+    virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const
+    {
+        double d = 1 / parameters[0][0];
+        Quaterniond q1 = Eigen::Map<const Quaterniond>(parameters[1]).normalized();
+        Eigen::Map<const Vector3d> t1(parameters[1] + 4);
+        Quaterniond q2 = Eigen::Map<const Quaterniond>(parameters[2]).normalized();
+        Eigen::Map<const Vector3d> t2(parameters[2] + 4);
+        Matrix3d R1 = q1.toRotationMatrix(), R2 = q2.toRotationMatrix();
+        Matrix3d Rr = right_->extrinsic.rotationMatrix(), Rl = left_->extrinsic.rotationMatrix();
+        // first observation -> robot 1 -> world -> robot 2 -> left camera
+        Vector3d pn((first_ob_.x() - right_->cx) / right_->fx, (first_ob_.y() - right_->cy) / right_->fy, 1);
+        Vector3d pb = Rr * (pn * d) + right_->extrinsic.translation();
+        Vector3d R1_pb = R1 * pb;
+        Vector3d a = R1_pb + t1 - t2;
+        Vector3d pc = Rl.transpose() * (R2.transpose() * a - left_->extrinsic.translation());
+        Eigen::Map<Vector2d> residual(residuals);
+        residual = weight_ * (Vector2d(left_->fx * pc.x() / pc.z() + left_->cx, left_->fy * pc.y() / pc.z() + left_->cy) - ob_);
+        if (jacobians)
+        {
+            Matrix<double, 2, 3> dr_dpw = weight_ * projection_jacobian(left_, pc) * Rl.transpose() * R2.transpose();
+            if (jacobians[0])
+            {
+                Eigen::Map<Vector2d> jacobian(jacobians[0]);
+                jacobian = dr_dpw * R1 * Rr * pn * (-d * d);
+            }
+            if (jacobians[1])
+            {
+                Eigen::Map<Matrix<double, 2, 7, RowMajor>> jacobian(jacobians[1]);
+                jacobian.leftCols<4>() = -dr_dpw * skew_symmetric(R1_pb) * quaternion_jacobian(q1.coeffs().data());
+                jacobian.rightCols<3>() = dr_dpw;
+            }
+            if (jacobians[2])
+            {
+                Eigen::Map<Matrix<double, 2, 7, RowMajor>> jacobian(jacobians[2]);
+                jacobian.leftCols<4>() = dr_dpw * skew_symmetric(a) * quaternion_jacobian(q2.coeffs().data());
+                jacobian.rightCols<3>() = -dr_dpw;
+            }
+        }
+        return true;
+    }
+
+private:
+    Vector2d first_ob_, ob_;
+    Camera::Ptr left_, right_;
+};
+
 class TwoFrameReprojectionError : public ceres::Error
 {
 public:
@@ -97,6 +197,8 @@ public:
 
     static ceres::CostFunction *Create(Vector2d first_ob, Vector2d ob, Camera::Ptr left, Camera::Ptr right, double weight)
     {
+        if (analytic_jacobians)
+            return new TwoFrameReprojectionAnalyticError(first_ob, ob, left, right, weight);
         return (new ceres::AutoDiffCostFunction<TwoFrameReprojectionError, 2, 1, 7, 7>(
             new TwoFrameReprojectionError(first_ob, ob, left, right, weight)));
     }
@@ -0,0 +1,114 @@
+#ifndef lvio_fusion_CHUNKED_FRAMES_H
+#define lvio_fusion_CHUNKED_FRAMES_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/frame.h"
+
+#include <iterator>
+
+namespace lvio_fusion
+{
+
+// sorted keyframes in immutable chunks which are shared between copies,
+// an insert into a copy only copies the chunks it goes into and the list of chunks,
+// so a new version of n keyframes costs O(chunk_size + n / chunk_size) instead of O(n).
+class ChunkedFrames
+{
+public:
+    typedef std::shared_ptr<const Frames> Chunk;
+    typedef Frames::value_type value_type;
+    static const int chunk_size = 128;
+
+    // all but the last chunk are not empty, so the end of a chunk is only reached in the last one
+    class const_iterator
+    {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef Frames::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type *pointer;
+        typedef const value_type &reference;
+
+        const_iterator() {}
+        const_iterator(const std::vector<Chunk> *chunks, int chunk, Frames::const_iterator iter)
+            : chunks_(chunks), chunk_(chunk), iter_(iter) {}
+
+        reference operator*() const { return *iter_; }
+        pointer operator->() const { return &*iter_; }
+
+        const_iterator &operator++()
+        {
+            if (++iter_ == (*chunks_)[chunk_]->end() && chunk_ + 1 < (int)chunks_->size())
+            {
+                iter_ = (*chunks_)[++chunk_]->begin();
+            }
+            return *this;
+        }
+
+        const_iterator &operator--()
+        {
+            if (iter_ == (*chunks_)[chunk_]->begin())
+            {
+                iter_ = (*chunks_)[--chunk_]->end();
+            }
+            --iter_;
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        const_iterator operator--(int)
+        {
+            const_iterator old = *this;
+            --*this;
+            return old;
+        }
+
+        bool operator==(const const_iterator &other) const { return chunk_ == other.chunk_ && iter_ == other.iter_; }
+        bool operator!=(const const_iterator &other) const { return !(*this == other); }
+
+    private:
+        const std::vector<Chunk> *chunks_ = nullptr;
+        int chunk_ = 0;
+        Frames::const_iterator iter_;
+    };
+    typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+    ChunkedFrames() : chunks_{Chunk(new Frames)} {}
+
+    const_iterator begin() const { return const_iterator(&chunks_, 0, chunks_.front()->begin()); }
+    const_iterator end() const { return const_iterator(&chunks_, chunks_.size() - 1, chunks_.back()->end()); }
+    const_reverse_iterator rbegin() const { return const_reverse_iterator(end()); }
+    const_reverse_iterator rend() const { return const_reverse_iterator(begin()); }
+
+    const_iterator lower_bound(double time) const;
+    const_iterator upper_bound(double time) const;
+    const_iterator find(double time) const;
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    /**
+     * insert keyframes, the chunks shared with other copies are not changed
+     * @param frames    new keyframes
+     * @param replace   replace the keyframes at the same time
+     * @return          number of new keyframes
+     */
+    int Insert(const Frames &frames, bool replace);
+
+private:
+    // the first chunk which may contain time, the last one if time is after all keyframes
+    int ChunkOf(double time, bool upper) const;
+
+    std::vector<Chunk> chunks_;
+    size_t size_ = 0;
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_CHUNKED_FRAMES_H
@@ -11,6 +11,7 @@
 #include "lvio_fusion/loop/relocator.h"
 #include "lvio_fusion/loop/pose_graph.h"
 #include "lvio_fusion/navsat/navsat.h"
+#include "lvio_fusion/trace.h"
 
 namespace lvio_fusion
 {
@@ -33,25 +34,47 @@ public:
 
     Estimator(std::string &config_path);
 
+    ~Estimator();
+
     void InputImage(double time, cv::Mat &left_image, cv::Mat &right_image, SE3d init_odom);
 
     void InputNavSat(double time, double latitude, double longitude, double altitude, Vector3d cov);
 
     void InputPointCloud(double time, Point3Cloud::Ptr point_cloud);
 
+    // the raw buffer of the driver is decoded in the lidar thread without copying it here
+    void InputPointCloud(const lidar::RawScan &scan);
+
     void InputImu(double time, Vector3d acc, Vector3d gyr);
 
     bool Init(int use_imu, int use_lidar, int use_navsat, int use_loop, int use_adapt);
 
+    // save the state of imu for the warm start of the next session, if imu_state is set
+    void SaveImuState();
+
     Frontend::Ptr frontend;
     Backend::Ptr backend;
+    KeyframePolicy::Ptr keyframe_policy;
     Relocator::Ptr relocator;
     FeatureAssociation::Ptr association;
     Mapping::Ptr mapping;
     Initializer::Ptr initializer;
+    imu::Propagator::Ptr propagator; // pose at the imu rate, only with imu
+    TraceWriter::Ptr trace;          // records every input, only with trace_path
+    int force_pipeline = -1;         // replaces pipeline of the config if it is not negative, set before Init
 
 private:
+    void TrackingLoop();
+
     std::string config_file_path_;
+    std::thread thread_tracking_;
+    std::mutex mutex_frames_;
+    std::condition_variable cv_frames_;
+    std::queue<Frame::Ptr> frames_; // undistorted frames waiting for tracking
+    int pipeline_ = 0;              // max size of frames_, 0 = track in the caller thread
+    int num_dropped_ = 0;
+    bool running_ = true;
+    std::string imu_state_;         // warm start file of imu, empty = none
 };
 } // namespace lvio_fusion
 
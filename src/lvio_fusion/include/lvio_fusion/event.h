@@ -0,0 +1,67 @@
+#ifndef lvio_fusion_EVENT_H
+#define lvio_fusion_EVENT_H
+
+#include "lvio_fusion/common.h"
+
+namespace lvio_fusion
+{
+
+// events between subsystems, the payload is the time of the keyframe
+enum class Event
+{
+    KeyFrameFinished = 0, // backend will not change keyframes before it
+    SectionClosed,        // a new section of the pose graph ends at it
+    NavsatFixed,          // a new fix is associated to the keyframe
+    Num
+};
+
+// wakes a loop up when its inputs are ready,
+// events published while the loop is busy are merged, only the latest payload is kept.
+class Subscriber
+{
+public:
+    typedef std::shared_ptr<Subscriber> Ptr;
+
+    // block until an event is published, timeout (s) = 0 is forever, return false if timed out
+    bool Wait(double timeout = 0);
+
+    // whether the event is published since the last take
+    bool Take(Event event);
+
+    // payload of the latest event
+    double Time(Event event);
+
+    void Notify(Event event, double time);
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool pending_[(int)Event::Num] = {};
+    double times_[(int)Event::Num] = {};
+};
+
+class EventBus
+{
+public:
+    static EventBus &Instance()
+    {
+        static EventBus instance;
+        return instance;
+    }
+
+    Subscriber::Ptr Subscribe(std::initializer_list<Event> events);
+
+    void Publish(Event event, double time);
+
+private:
+    EventBus() {}
+    EventBus(const EventBus &);
+    EventBus &operator=(const EventBus &);
+
+    std::mutex mutex_;
+    std::vector<Subscriber::Ptr> subscribers_[(int)Event::Num];
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_EVENT_H
@@ -0,0 +1,113 @@
+#ifndef lvio_fusion_FLAT_MAP_H
+#define lvio_fusion_FLAT_MAP_H
+
+#include "lvio_fusion/common.h"
+
+namespace lvio_fusion
+{
+
+// sorted vector with the interface of std::map, elements are contiguous,
+// so iteration is a linear sweep of memory, lookups are binary searches.
+// keys are mostly inserted in increasing order, which is an append.
+// NOTE: inserting or erasing invalidates iterators.
+template <typename Key, typename Value>
+class FlatMap
+{
+public:
+    typedef std::pair<Key, Value> value_type;
+    typedef typename std::vector<value_type>::iterator iterator;
+    typedef typename std::vector<value_type>::const_iterator const_iterator;
+
+    iterator begin() { return data_.begin(); }
+    iterator end() { return data_.end(); }
+    const_iterator begin() const { return data_.begin(); }
+    const_iterator end() const { return data_.end(); }
+
+    size_t size() const { return data_.size(); }
+    bool empty() const { return data_.empty(); }
+    void clear() { data_.clear(); }
+    void reserve(size_t size) { data_.reserve(size); }
+
+    iterator find(const Key &key)
+    {
+        auto iter = lower_bound(key);
+        return (iter != data_.end() && iter->first == key) ? iter : data_.end();
+    }
+
+    const_iterator find(const Key &key) const
+    {
+        auto iter = lower_bound(key);
+        return (iter != data_.end() && iter->first == key) ? iter : data_.end();
+    }
+
+    size_t count(const Key &key) const
+    {
+        return find(key) != data_.end();
+    }
+
+    iterator lower_bound(const Key &key)
+    {
+        return std::lower_bound(data_.begin(), data_.end(), key, compare);
+    }
+
+    const_iterator lower_bound(const Key &key) const
+    {
+        return std::lower_bound(data_.begin(), data_.end(), key, compare);
+    }
+
+    iterator upper_bound(const Key &key)
+    {
+        return std::upper_bound(data_.begin(), data_.end(), key, compare_key);
+    }
+
+    const_iterator upper_bound(const Key &key) const
+    {
+        return std::upper_bound(data_.begin(), data_.end(), key, compare_key);
+    }
+
+    Value &operator[](const Key &key)
+    {
+        if (data_.empty() || data_.back().first < key)
+        {
+            data_.emplace_back(key, Value());
+            return data_.back().second;
+        }
+        auto iter = lower_bound(key);
+        if (iter == data_.end() || iter->first != key)
+        {
+            iter = data_.emplace(iter, key, Value());
+        }
+        return iter->second;
+    }
+
+    iterator erase(iterator iter)
+    {
+        return data_.erase(iter);
+    }
+
+    size_t erase(const Key &key)
+    {
+        auto iter = find(key);
+        if (iter == data_.end())
+            return 0;
+        data_.erase(iter);
+        return 1;
+    }
+
+private:
+    static bool compare(const value_type &a, const Key &b)
+    {
+        return a.first < b;
+    }
+
+    static bool compare_key(const Key &a, const value_type &b)
+    {
+        return a < b.first;
+    }
+
+    std::vector<value_type> data_;
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_FLAT_MAP_H
@@ -35,6 +35,8 @@ public:
     double time;
     Frame::Ptr last_keyframe;
     cv::Mat image_left, image_right;
+    std::vector<cv::Mat> pyramid_left, pyramid_right; // lk pyramids, only kept while the frame is tracked
+    cv::UMat device_left, device_right;               // images on the opencl device instead of the lk pyramids
     visual::Features features_left;               // extracted features in left image
     visual::Features features_right;              // new landmarks features in right image 
     lidar::Feature::Ptr feature_lidar;            // extracted features in lidar point cloud
@@ -42,6 +44,7 @@ public:
     imu::Preintegration::Ptr preintegration_last; // imu pre integration from last frame
     navsat::Feature::Ptr feature_navsat;          // navsat point
     cv::Mat descriptors;                          // orb descriptors
+    std::vector<unsigned long> descriptor_ids;    // landmark id of each descriptor
     loop::LoopClosure::Ptr loop_closure;          // loop closure
     Weights weights;                              // weights of different factors
     SE3d pose;
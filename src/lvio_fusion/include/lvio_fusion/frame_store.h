@@ -0,0 +1,129 @@
+#ifndef lvio_fusion_FRAME_STORE_H
+#define lvio_fusion_FRAME_STORE_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/frame.h"
+
+#include <set>
+
+namespace lvio_fusion
+{
+
+enum class ImagePolicy
+{
+    Keep = 0,     // keep raw images
+    Compress = 1, // compress left image in memory, release right image
+    Release = 2   // release both images
+};
+
+// keep the memory of old keyframes under a ceiling,
+// images, descriptors and lidar features are spilled into a memory-mapped file,
+// and loaded back when they are needed.
+// images of keyframes out of the window are retained according to a policy,
+// and their buffers are recycled for new frames.
+class FrameStore
+{
+public:
+    static FrameStore &Instance()
+    {
+        static FrameStore instance;
+        return instance;
+    }
+
+    ~FrameStore();
+
+    // the data of a keyframe is not evicted or recycled while its pin is alive
+    class Pin
+    {
+    public:
+        Pin(double time) : time_(time) {}
+        Pin(Pin &&other) : time_(other.time_), pinned_(other.pinned_) { other.pinned_ = false; }
+        ~Pin();
+
+    private:
+        Pin(const Pin &);
+        Pin &operator=(const Pin &);
+
+        double time_;
+        bool pinned_ = true;
+    };
+
+    /**
+     * open the spill file
+     * @param path          spill file
+     * @param max_memory    memory ceiling of old keyframes (MB), 0 is unlimited
+     * @param radius        keyframes within the radius can be loop candidates, keep them in memory
+     * @param images        retention policy of images out of the window
+     * @return              success
+     */
+    bool Open(const std::string &path, double max_memory, double radius, ImagePolicy images = ImagePolicy::Keep);
+
+    // spill keyframes before end which are far from position, until memory is under the ceiling
+    void Compact(double end, const Vector3d &position);
+
+    // keyframes from time on still wait for the relocator to compute their descriptors,
+    // compaction does not retain or spill them until the time is moved on
+    void Hold(double time);
+
+    // time from which keyframes are held, DBL_MAX if nothing is held
+    double Held();
+
+    // make sure frame's data is in memory, compressed images are decoded,
+    // the data may only be used while the returned pin is alive
+    Pin Load(Frame::Ptr frame);
+
+    // allocate image, reuse a buffer of released images if possible
+    void Acquire(cv::Mat &image, cv::Size size, int type);
+
+    // memory of old keyframes (MB)
+    double Memory();
+
+    int num_evicted = 0;
+    int num_loaded = 0;
+
+private:
+    struct Record
+    {
+        size_t offset;
+        size_t size;
+        bool lidar;
+    };
+
+    FrameStore() {}
+    FrameStore(const FrameStore &);
+    FrameStore &operator=(const FrameStore &);
+
+    bool Evict(Frame::Ptr frame);
+
+    bool Remap(size_t size);
+
+    void Retain(Frame::Ptr frame);
+
+    void Recycle(cv::Mat &image);
+
+    void Unpin(double time);
+
+    std::mutex mutex_;
+    std::map<double, int> pinned_;      // time -> number of pins
+    std::map<double, size_t> resident_; // time -> bytes
+    std::map<double, Record> records_;  // time -> position in file
+    std::string path_;
+    int fd_ = -1;
+    char *data_ = nullptr;
+    size_t mapped_size_ = 0;
+    size_t file_size_ = 0;
+    size_t memory_ = 0;
+    size_t max_memory_ = 0;
+    double radius_ = 0;
+    double scanned_ = 0;
+    double held_ = DBL_MAX;
+    ImagePolicy images_ = ImagePolicy::Keep;
+    std::map<double, std::vector<uchar>> compressed_; // time -> png
+    std::set<double> decoded_;                        // compressed images in memory
+    std::vector<cv::Mat> free_images_;
+    size_t compressed_size_ = 0;
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_FRAME_STORE_H
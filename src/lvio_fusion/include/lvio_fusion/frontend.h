@@ -2,6 +2,9 @@
 #define lvio_fusion_FRONTEND_H
 
 #include "lvio_fusion/common.h"
+#include "lvio_fusion/imu/propagator.h"
+#include "lvio_fusion/keyframe_policy.h"
+#include "lvio_fusion/spsc_queue.h"
 #include "lvio_fusion/visual/local_map.h"
 
 namespace lvio_fusion
@@ -17,12 +20,22 @@ enum class FrontendStatus
     LOST
 };
 
+// features of the last frame for the debug image, it is drawn out of the frontend
+struct Tracking
+{
+    double time = 0;
+    cv::Mat image;                                              // left image, shared with the frame
+    std::vector<cv::Point2f> near, far, rejected;               // tracked from the last frame
+    std::vector<cv::Point2f> matched;                           // matched to old landmarks by a new keyframe
+    std::vector<std::pair<cv::Point2f, cv::Point2f>> deviations; // from the average flow
+};
+
 class Frontend
 {
 public:
     typedef std::shared_ptr<Frontend> Ptr;
 
-    Frontend(int num_features, int init, int tracking, int tracking_bad, int need_for_keyframe);
+    Frontend(int num_features, int init, int tracking, int tracking_bad, bool opencl = false, bool record_tracking = false, bool async_keyframe = false);
 
     bool AddFrame(Frame::Ptr frame);
 
@@ -30,10 +43,19 @@ public:
 
     void SetBackend(std::shared_ptr<Backend> backend) { backend_ = backend; }
 
-    void UpdateCache();
+    void SetKeyframePolicy(KeyframePolicy::Ptr policy) { keyframe_policy_ = policy; }
+
+    // anchored to the state of the last frame whenever it is tracked or corrected
+    void SetPropagator(imu::Propagator::Ptr propagator) { propagator_ = propagator; }
+
+    // landmarks = false if only the poses of keyframes are corrected
+    void UpdateCache(bool landmarks = true);
 
     void UpdateImu(const Bias &bias_);
 
+    // features of the last frame, empty if the tracking is not recorded
+    Tracking GetTracking();
+
     std::mutex mutex;
     FrontendStatus status = FrontendStatus::BUILDING;
     Frame::Ptr current_frame;
@@ -63,18 +85,36 @@ private:
 
     void PredictState();
 
+    void AnchorPropagator();
+
+    // build the lk pyramid or upload the image of the current frame, into the buffers of released frames
+    void AcquireFlowImages();
+
+    // give the buffers of the frames which are not tracked any more back
+    void ReleaseFlowImages();
+
     // data
     std::weak_ptr<Backend> backend_;
-    std::queue<ImuData> imu_buf_;
+    KeyframePolicy::Ptr keyframe_policy_;
+    imu::Propagator::Ptr propagator_;
+    SPSCQueue<ImuData> imu_buf_{1 << 14};
+    imu::Samples imu_samples_;
     imu::Preintegration::Ptr preintegration_last_kf_; // imu pre integration from last key frame
     SE3d last_frame_pose_cache_;
+    Frame::Ptr untracked_kf_;               // keyframe whose new landmarks are not tracked yet
+    std::vector<cv::Mat> free_pyramids_[2]; // buffers of the lk pyramids of released frames, left and right
+    cv::UMat free_devices_[2];              // buffers of the device images of released frames, left and right
+    Tracking tracking_;                     // of the current frame
+    Tracking tracking_last_;
+    std::mutex mutex_tracking_;
     SE3d relative_i_j_;
     double dt_ = 0;
 
     // params
     int num_features_init_;
     int num_features_tracking_bad_;
-    int num_features_needed_for_keyframe_;
+    const bool opencl_;
+    const bool record_tracking_;
 };
 
 } // namespace lvio_fusion
@@ -8,21 +8,61 @@
 namespace lvio_fusion
 {
 
+// the initialization runs in the background on copies of the keyframes,
+// the estimated gravity, velocities and bias are applied at once when it is finished,
+// so the backend is not blocked meanwhile.
 class Initializer
 {
 public:
     typedef std::shared_ptr<Initializer> Ptr;
 
+    ~Initializer();
+
+    // apply the finished initialization, or start a new one if it is needed
     void Initialize(double init_time, double end_time);
 
+    /**
+     * warm start from the state of a previous session on the same hardware,
+     * the bias is the initial value, the gravity is the initial guess if the attitude at start is similar,
+     * and the initialization needs fewer keyframes and steps.
+     * @param path      file saved by Save()
+     * @return          success
+     */
+    bool Load(const std::string &path);
+
+    // save the bias and the gravity in the first keyframe, only if imu is initialized
+    bool Save(const std::string &path);
+
     int step = 1;   // 1,2,3: next step 1,2,3; 4: finish;
 
 private:
     void EstimateVelAndRwg(Frames keyframes);
 
-    bool Initialize(Frames frames, double prior_a, double prior_g);
+    // run in the background
+    void Estimate(double prior_a, double prior_g);
+
+    // the caller holds the mutex of frontend
+    void Apply();
+
+    // velocity and bias of a keyframe when the job started
+    struct State
+    {
+        Vector3d Vw;
+        Bias bias;
+    };
 
     Matrix3d Rwg_;  // R of gravity in world frame
+    Frames frames_; // keyframes being initialized
+    Frames copies_; // copies of the keyframes for the background
+    std::map<double, State> starts_;
+    std::thread thread_;
+    std::atomic<bool> done_{false};
+    bool success_ = false;
+    bool initialized_ = false; // imu was initialized when the job started
+    bool warm_ = false;
+    Bias prior_bias_;
+    Vector3d prior_up_;        // up in the first keyframe
+    Vector3d guess_up_;        // up in the world, by prior_up_
     const int num_frames_init = 10;
 };
 
@@ -3,6 +3,7 @@
 
 #include "lvio_fusion/common.h"
 #include "lvio_fusion/imu/imu.h"
+#include "lvio_fusion/metrics.h"
 
 namespace lvio_fusion
 {
@@ -12,6 +13,56 @@ namespace imu
 
 extern int O_T, O_R, O_V, O_BA, O_BG, O_PR, O_PT;
 extern Vector3d g;
+extern double bias_threshold; // max change of bias for first-order correction
+
+// structure-of-arrays storage of imu samples, written once by the frontend,
+// preintegrations reference contiguous slices of it instead of owning copies.
+class Samples
+{
+public:
+    static const int block_size = 512;
+
+    struct Block
+    {
+        typedef std::shared_ptr<Block> Ptr;
+        double dt[block_size];
+        Vector3d acc[block_size];
+        Vector3d gyr[block_size];
+
+        Block() { Memory().Add(sizeof(Block)); }
+        ~Block() { Memory().Remove(sizeof(Block)); }
+    };
+
+    struct Ref
+    {
+        Block::Ptr block;
+        int index;
+    };
+
+    Ref Push(double dt, const Vector3d &acc, const Vector3d &gyr)
+    {
+        if (!block_ || index_ == block_size)
+        {
+            // blocks are released when no preintegration references them
+            block_ = Block::Ptr(new Block);
+            index_ = 0;
+        }
+        block_->dt[index_] = dt;
+        block_->acc[index_] = acc;
+        block_->gyr[index_] = gyr;
+        return {block_, index_++};
+    }
+
+private:
+    static MemoryAccount &Memory()
+    {
+        static MemoryAccount &memory = Metrics::Instance().GetMemory("imu_samples");
+        return memory;
+    }
+
+    Block::Ptr block_;
+    int index_ = 0;
+};
 
 class Preintegration
 {
@@ -24,21 +75,30 @@ public:
         return new_preintegration;
     }
 
-    void Append(double dt, const Vector3d &acc, const Vector3d &gyr, const Vector3d &acc0_, const Vector3d &gyr0_)
+    // the samples of a preintegration must be pushed in order
+    void Append(const Samples::Ref &sample, const Vector3d &acc0_, const Vector3d &gyr0_)
     {
-        if (dt_buf.size() == 0)
+        if (size_ == 0)
         {
             acc0 = acc0_;
             gyr0 = gyr0_;
             linearized_acc = acc0_;
             linearized_gyr = gyr0_;
+            blocks_.clear();
+            blocks_.push_back(sample.block);
+            begin_ = sample.index;
+        }
+        else if (sample.block != blocks_.back())
+        {
+            blocks_.push_back(sample.block);
         }
-        dt_buf.push_back(dt);
-        acc_buf.push_back(acc);
-        gyr_buf.push_back(gyr);
-        Propagate(dt, acc, gyr);
+        assert((begin_ + size_) % Samples::block_size == sample.index);
+        size_++;
+        Propagate(sample.block->dt[sample.index], sample.block->acc[sample.index], sample.block->gyr[sample.index]);
     }
 
+    int Size() const { return size_; }
+
     void MidPointIntegration(
         double _dt,
         const Vector3d &_acc_0, const Vector3d &_gyr_0,
@@ -50,6 +110,8 @@ public:
 
     void Propagate(double _dt, const Vector3d &_acc_1, const Vector3d &_gyr_1);
     void Repropagate(const Vector3d &_linearized_ba, const Vector3d &_linearized_bg);
+    // move the linearization point, correct by the jacobian if the change of bias from the last propagation is small, else repropagate
+    void Relinearize(const Vector3d &_linearized_ba, const Vector3d &_linearized_bg);
 
     Matrix<double, 15, 1> Evaluate(
         const Vector3d &Pi, const Quaterniond &Qi, const Vector3d &Vi, const Vector3d &Bai, const Vector3d &Bgi,
@@ -69,8 +131,6 @@ public:
 
     double dt;
     double sum_dt;
-    std::vector<double> dt_buf;
-    std::vector<Vector3d> acc_buf, gyr_buf;
     Vector3d acc0, gyr0;
     Vector3d acc1, gyr1;
     Vector3d linearized_acc, linearized_gyr;
@@ -88,6 +148,14 @@ public:
 private:
     Preintegration() = default;
     Preintegration(const Vector3d &_linearized_ba, const Vector3d &_linearized_bg);
+
+    std::vector<Samples::Block::Ptr> blocks_; // blocks of the slice
+    int begin_ = 0;                           // index of the first sample in the first block
+    int size_ = 0;
+    // deltas and bias of the last propagation, corrections are always made from them
+    Vector3d propagated_ba, propagated_bg;
+    Vector3d propagated_delta_p, propagated_delta_v;
+    Quaterniond propagated_delta_q;
 };
 
 typedef std::map<double, Preintegration::Ptr> PreIntegrations;
@@ -0,0 +1,60 @@
+#ifndef lvio_fusion_PROPAGATOR_H
+#define lvio_fusion_PROPAGATOR_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/imu/imu.h"
+#include "lvio_fusion/imu/preintegration.h"
+
+#include <deque>
+
+namespace lvio_fusion
+{
+
+namespace imu
+{
+
+// pose and velocity at the imu rate between frames,
+// the state of the newest frame is integrated forward with every imu sample,
+// and it is anchored again when the frontend tracks a frame or the poses are corrected.
+class Propagator
+{
+public:
+    typedef std::shared_ptr<Propagator> Ptr;
+
+    struct State
+    {
+        double time = 0;
+        SE3d pose;
+        Vector3d Vw = Vector3d::Zero();
+    };
+
+    // restart from the state of a frame, the buffered samples after it are integrated again
+    void Anchor(double time, const SE3d &pose, const Vector3d &Vw, const Bias &bias);
+
+    // integrate a new sample, return false if there is no anchor yet
+    bool Push(double time, const Vector3d &acc, const Vector3d &gyr);
+
+    // the latest state, return false if there is no anchor yet
+    bool Get(State &state);
+
+private:
+    // the caller holds mutex_
+    void Integrate(const ImuData &sample);
+
+    std::mutex mutex_;
+    bool anchored_ = false;
+    State anchor_;
+    State state_;
+    Bias bias_;
+    Preintegration::Ptr integration_; // only its mid point integration is used
+    Vector3d delta_p_, delta_v_;
+    Quaterniond delta_q_;
+    ImuData last_sample_;
+    std::deque<ImuData> samples_; // after the anchor
+};
+
+} // namespace imu
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_PROPAGATOR_H
@@ -10,9 +10,8 @@ namespace imu
 
 void RePredictVel(Frames &frames, Frame::Ptr &prior_frame);
 
-bool InertialOptimization(Frames &frames, Matrix3d &Rwg, double prior_a, double prior_g);
-
-void FullBA(Frames &frames, double prior_a, double prior_g);
+// gravity = false keeps the direction of gravity
+bool InertialOptimization(Frames &frames, Matrix3d &Rwg, double prior_a, double prior_g, bool gravity = true);
 
 void RecoverBias(Frames &frames);
 
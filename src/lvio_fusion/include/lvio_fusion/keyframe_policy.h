@@ -0,0 +1,63 @@
+#ifndef lvio_fusion_KEYFRAME_POLICY_H
+#define lvio_fusion_KEYFRAME_POLICY_H
+
+#include "lvio_fusion/common.h"
+
+#include <atomic>
+
+namespace lvio_fusion
+{
+
+// what a keyframe decision is based on, relative to the last keyframe of the same kind
+struct KeyframeState
+{
+    double dt = 0;       // seconds
+    double distance = 0; // meters
+    double angle = 0;    // radians
+    int num_tracked = 0; // features tracked by the current frame
+};
+
+// decide visual keyframes in the frontend and lidar keyframes in the lidar thread,
+// both are spaced out while the backend lags behind its target, so that the cost follows the motion instead of the frame rate.
+// override the decisions to change the policy.
+class KeyframePolicy
+{
+public:
+    typedef std::shared_ptr<KeyframePolicy> Ptr;
+
+    /**
+     * @param num_features  a visual keyframe is needed if fewer features are tracked
+     * @param max_interval  max seconds between visual keyframes
+     * @param max_angle     a visual keyframe is needed if it rotates more (degree), 0 = disabled
+     * @param spacing       min distance between lidar keyframes (m)
+     * @param latency       target lag of the backend (s), 0 = no target
+     */
+    KeyframePolicy(int num_features, double max_interval, double max_angle, double spacing, double latency)
+        : num_features_(num_features), max_interval_(max_interval), max_angle_(max_angle / 180 * M_PI), spacing_(spacing), latency_(latency) {}
+
+    virtual ~KeyframePolicy() {}
+
+    // whether the current frame becomes a keyframe
+    virtual bool NeedVisual(const KeyframeState &state);
+
+    // whether the lidar features of a keyframe are extracted
+    virtual bool NeedLidar(const KeyframeState &state);
+
+    // the backend reports its lag behind the newest keyframe
+    void SetLag(double lag) { lag_ = lag; }
+
+protected:
+    // >= 1, how much keyframes are spaced out, bigger while the backend lags behind the target
+    double Scale();
+
+    std::atomic<double> lag_{0};
+    const int num_features_;
+    const double max_interval_;
+    const double max_angle_;
+    const double spacing_;
+    const double latency_;
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_KEYFRAME_POLICY_H
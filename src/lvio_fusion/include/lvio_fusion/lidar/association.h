@@ -4,7 +4,12 @@
 #include "lvio_fusion/adapt/problem.h"
 #include "lvio_fusion/common.h"
 #include "lvio_fusion/frame.h"
+#include "lvio_fusion/keyframe_policy.h"
 #include "lvio_fusion/lidar/projection.h"
+#include "lvio_fusion/lidar/scan_buffer.h"
+#include "lvio_fusion/lidar/voxel_map.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/spsc_queue.h"
 
 #include <ceres/ceres.h>
 
@@ -13,33 +18,73 @@ namespace lvio_fusion
 
 class Frontend;
 
+namespace lidar
+{
+
+// smoothness of each point in [5, size - 5) from the ranges of its 10 neighbours,
+// computed 8 points at a time with avx2 if the cpu supports it.
+void compute_curvatures(const std::vector<float> &ranges, int size, Eigen::ArrayXf &curvatures);
+
+/**
+ * downsample points to the centroids of voxels, and remove the centroids with few neighbours.
+ * points are hashed only once, the centroids are transformed and appended to out.
+ * @param leaf_size         size of voxels
+ * @param radius            neighbours of a centroid are the other centroids within it, 0 = keep all
+ * @param min_neighbors     centroids with less neighbours are outliers
+ * @param tf                transform of the centroids
+ */
+void voxel_filter(const PointICloud &in, float leaf_size, float radius, int min_neighbors, const Sophus::SE3f &tf, PointICloud &out);
+
+} // namespace lidar
+
 class FeatureAssociation
 {
 public:
     typedef std::shared_ptr<FeatureAssociation> Ptr;
 
-    FeatureAssociation(int num_scans, int horizon_scan, double ang_res_y, double ang_bottom, int ground_rows, double cycle_time, double min_range, double max_range, double deskew, double spacing)
-        : num_scans_(num_scans), cycle_time_(cycle_time), min_range_(min_range), max_range_(max_range), deskew_(deskew), spacing_(spacing)
+    FeatureAssociation(int num_scans, int horizon_scan, double ang_res_y, double ang_bottom, int ground_rows, double cycle_time, double min_range, double max_range, double deskew)
+        : scans_(cycle_time), num_scans_(num_scans), cycle_time_(cycle_time), min_range_(min_range), max_range_(max_range), deskew_(deskew)
     {
-        curvatures = new float[num_scans * horizon_scan];
+        curvatures_.resize(num_scans * horizon_scan);
+        Metrics::Instance().GetMemory("lidar_curvatures").Add(curvatures_.size() * sizeof(float));
         projection_ = ImageProjection::Ptr(new ImageProjection(num_scans, horizon_scan, ang_res_y, ang_bottom, ground_rows));
+        thread_ = std::thread(std::bind(&FeatureAssociation::ProcessLoop, this));
     }
 
+    ~FeatureAssociation();
+
+    // decide which keyframes have lidar features, all of them if no policy is set
+    void SetKeyframePolicy(KeyframePolicy::Ptr policy) { keyframe_policy_ = policy; }
+
+    // queue a new scan, the features are extracted in the lidar thread
+    void AddScan(const lidar::RawScan &new_scan);
     void AddScan(double time, Point3Cloud::Ptr new_scan);
 
-    void ScanToMapWithGround(Frame::Ptr frame, Frame::Ptr map_frame, double *para, adapt::Problem &problem, bool relocate = false);
+    // keyframes before it have been processed or skipped by the lidar thread
+    double Processed();
+
+    // match to points of the frames within [start, end] in the map
+    void ScanToMapWithGround(Frame::Ptr frame, Frame::Ptr map_frame, lidar::VoxelMap &map_ground, double start, double end, double *para, adapt::Problem &problem, bool relocate = false);
 
-    void ScanToMapWithSegmented(Frame::Ptr frame, Frame::Ptr map_frame, double *para, adapt::Problem &problem, bool relocate = false);
+    void ScanToMapWithSegmented(Frame::Ptr frame, Frame::Ptr map_frame, lidar::VoxelMap &map_surf, double start, double end, double *para, adapt::Problem &problem, bool relocate = false);
     
     void SegmentGround(PointICloud &points_ground);
 
+    // extract the features of a scan which is aligned to frame, the rings of the scan are used if they are kept
+    void Process(PointICloud &points, Frame::Ptr frame);
+
 private:
-    void UndistortPoint(PointI &point, Frame::Ptr frame);
-    void UndistortPointCloud(PointICloud &points, Frame::Ptr frame);
+    void ProcessLoop();
 
-    bool AlignScan(double time, PointICloud &out);
+    void ProcessScan(const lidar::RawScan &new_scan);
 
-    void Process(PointICloud &points, Frame::Ptr frame);
+    // sample the relative poses of the lidar during the scan of frame once
+    void BuildDeskewTable(Frame::Ptr frame);
+
+    // move every point to the lidar pose at frame->time, blending the two nearest table entries
+    void Deskew(PointICloud &points);
+
+    bool AlignScan(double time, PointICloud &out);
 
     void Preprocess(PointICloud &points);
 
@@ -51,11 +96,22 @@ private:
 
     void ExtractFeatures(PointICloud &points_segmented, SegmentedInfo &segemented_info, Frame::Ptr frame);
 
-    void Sensor2Robot(PointICloud &in, PointICloud &out);
+    bool NeedLidar(Frame::Ptr frame);
 
     ImageProjection::Ptr projection_;
-    std::map<double, Point3Cloud::Ptr> raw_point_clouds_;
-    float *curvatures;
+    KeyframePolicy::Ptr keyframe_policy_;
+    SPSCQueue<lidar::RawScan> queue_{16}; // scans waiting for the lidar thread
+    std::thread thread_;
+    std::atomic<bool> running_{true};
+    std::mutex mutex_processed_;
+    double processed_ = 0; // keyframes before it have been processed or skipped
+    double finished_ = 0;
+    Frame::Ptr last_frame_;
+    lidar::ScanBuffer scans_;
+    std::vector<int16_t> rings_; // of the points being processed, empty if the lidar has no rings
+    Eigen::ArrayXf curvatures_;
+    std::vector<Eigen::Matrix<float, 3, 4>, Eigen::aligned_allocator<Eigen::Matrix<float, 3, 4>>> deskew_table_; // [R|t] of T_frame_lidar(t)
+    float deskew_step_ = 0;
 
     // params
     const double num_scans_;
@@ -63,7 +119,6 @@ private:
     const double min_range_;
     const double max_range_;
     const bool deskew_;
-    const double spacing_;
 };
 
 } // namespace lvio_fusion
@@ -25,6 +25,8 @@ public:
     PointICloud points_surf;
     PointICloud points_ground;
     // PointICloud points_full;
+    Eigen::MatrixXf context;  // scan context, rings x sectors
+    Eigen::VectorXf ring_key; // mean of each ring
 };
 
 } // namespace lidar
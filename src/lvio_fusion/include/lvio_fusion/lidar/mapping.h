@@ -3,6 +3,12 @@
 
 #include "lvio_fusion/common.h"
 #include "lvio_fusion/lidar/association.h"
+#include "lvio_fusion/lidar/lidar.h"
+#include "lvio_fusion/lidar/registration.h"
+#include "lvio_fusion/lidar/voxel_map.h"
+
+#include <list>
+#include <set>
 
 namespace lvio_fusion
 {
@@ -12,33 +18,99 @@ class Mapping
 public:
     typedef std::shared_ptr<Mapping> Ptr;
 
-    Mapping() {}
+    // max_tiles: world points are kept for the recently used tiles, 0 is unlimited
+    // parallel: keyframes of a batch are registered concurrently, against the map before the batch,
+    //           it is an approximation, a keyframe is not aligned to the keyframes optimized before it in the batch,
+    //           so the poses differ from the sequential mapping
+    Mapping(int max_tiles = 0, bool parallel = false) : map_surf(Lidar::Get()->resolution * 5), map_ground(Lidar::Get()->resolution * 10), global_map(Lidar::Get()->resolution * 2), max_tiles_(max_tiles), parallel_(parallel) {}
 
     void SetFeatureAssociation(FeatureAssociation::Ptr association) { association_ = association; }
 
-    void Optimize(Frames &active_kfs);
+    void SetRegistration(lidar::RegistrationMethod registration) { registration_ = registration; }
+
+    // register the keyframes whose lidar features are ready, without waiting for the lidar thread,
+    // return the time before which the keyframes are processed, the later ones are left for the next call
+    double Optimize(Frames &active_kfs);
 
-    void BuildOldMapFrame(Frame::Ptr old_frame, Frame::Ptr map_frame);
+    void BuildOldMapFrame(Frame::Ptr old_frame, Frame::Ptr map_frame, lidar::VoxelMap &old_map_surf, lidar::VoxelMap &old_map_ground);
 
     void MergeScan(const PointICloud &in, SE3d from_pose, PointICloud &out);
 
+    // keep the last lidar frames before frame in the local map, the window ends at map_frame->time
     void BuildMapFrame(Frame::Ptr frame, Frame::Ptr map_frame);
 
+    // the pose of frame is changed, world points are computed again lazily
     void ToWorld(Frame::Ptr frame);
     void ToWorld(double start);
 
+    // align current frame to the map around last frame, return the score
     int Relocate(Frame::Ptr last_frame, Frame::Ptr current_frame, SE3d &relative_o_c);
 
     PointRGBCloud GetGlobalMap();
 
-    std::map<double, PointRGBCloud> pointclouds_color;
-    std::map<double, PointICloud> pointclouds_surf;
-    std::map<double, PointICloud> pointclouds_ground;
+    // the chunks of the global map changed since the last call, with all their points
+    std::vector<lidar::GlobalMap::ChunkUpdate> GetGlobalMapUpdate();
+
+    // local map of world points, updated incrementally
+    lidar::VoxelMap map_surf;
+    lidar::VoxelMap map_ground;
+    std::mutex mutex;
+
+    // colored map of all keyframes, updated incrementally
+    lidar::GlobalMap global_map;
 
 private:
+    // world points of a keyframe, cached with the pose they are computed from
+    struct WorldCloud
+    {
+        SE3d pose;
+        PointICloud surf, ground;
+        bool valid = false;
+        long long tile = 0;
+    };
+
+    // keyframes whose world points are in memory, grouped by their position
+    struct Tile
+    {
+        std::list<long long>::iterator lru;
+        std::set<double> frames;
+    };
+
+    WorldCloud &GetWorldCloud(Frame::Ptr frame);
+
+    // the lidar keyframes in the local map of frame
+    Frames GetLastFrames(Frame::Ptr frame);
+
+    // align frame to the map around map_frame, the pose of frame is the initial value and the result
+    void Register(Frame::Ptr frame, Frame::Ptr map_frame, lidar::VoxelMap &surf, lidar::VoxelMap &ground, int num_threads);
+
+    // register the keyframes concurrently, then apply the corrections in time order,
+    // each map is built from the poses before the batch, so it approximates the sequential mapping
+    void OptimizeParallel(const std::vector<Frame::Ptr> &frames);
+
+    // the lidar keyframes around old frame
+    Frames GetOldFrames(Frame::Ptr old_frame);
+
+    int RelocateByRegistration(Frame::Ptr last_frame, Frame::Ptr current_frame, SE3d &relative_o_c);
+
+    // mark the tile as the most recently used, and evict the least recently used tiles
+    void TouchTile(double time, WorldCloud &cloud, const Vector3d &position);
+
+    void UpdateGlobalMap();
+
+    void AddToMap(Frame::Ptr frame, lidar::VoxelMap &surf, lidar::VoxelMap &ground);
+
     void Color(const PointICloud &points_ground, const PointICloud &points_surf, Frame::Ptr frame, PointRGBCloud &out);
 
     FeatureAssociation::Ptr association_;
+    std::mutex mutex_clouds_;
+    std::map<double, WorldCloud> world_clouds_;
+    std::map<double, Frame::Ptr> moved_; // frames not updated in the global map
+    std::unordered_map<long long, Tile> tiles_;
+    std::list<long long> lru_; // most recently used first
+    const int max_tiles_;
+    const bool parallel_;
+    lidar::RegistrationMethod registration_ = lidar::RegistrationMethod::ScanToMap;
 };
 
 } // namespace lvio_fusion
@@ -39,21 +39,31 @@ public:
           segment_alpha_x_(ang_res_x_ / 180.0 * M_PI), segment_alpha_y_(ang_res_y_ / 180.0 * M_PI)
     {
         points_full.points.resize(num_scans_ * horizon_scan);
+        parent_.resize(num_scans_ * horizon_scan);
+        num_points_.resize(num_scans_ * horizon_scan);
+        num_lines_.resize(num_scans_ * horizon_scan);
+        last_row_.resize(num_scans_ * horizon_scan);
+        num_first_row_.resize(num_scans_ * horizon_scan);
         Clear();
     }
 
-    SegmentedInfo Process(PointICloud &points, PointICloud &points_segmented);
+    // rings of points from the driver are used as rows if they have the same size, -1 = unknown
+    SegmentedInfo Process(PointICloud &points, const std::vector<int16_t> &rings, PointICloud &points_segmented);
 
 private:
     void FindStartEndAngle(SegmentedInfo &segmented_info, PointICloud& points);
 
-    void ProjectPointCloud(SegmentedInfo &segmented_info, PointICloud& points);
+    void ProjectPointCloud(SegmentedInfo &segmented_info, PointICloud& points, const std::vector<int16_t> &rings);
+
+    // whether ring 0 is the lowest or the highest beam, found by the vertical angles of the first scan
+    void FindRingOrder(PointICloud &points, const std::vector<int16_t> &rings);
 
     void RemoveGround(SegmentedInfo &segmented_info);
 
     void Segment(SegmentedInfo &segmented_info, PointICloud &points_segmented);
 
-    void LabelComponents(int row, int col);
+    // label the connected components of the range image by union find in two passes
+    void LabelComponents();
 
     void Clear();
 
@@ -63,6 +73,14 @@ private:
     cv::Mat label_mat;  // label matrix for segmentaiton marking
     cv::Mat ground_mat; // ground matrix for ground cloud marking
     int label_count;
+    int ring_order_ = 0; // 1 = ring 0 is the lowest, -1 = ring 0 is the highest, 0 = unknown
+
+    // buffers of labelling, indexed by cells, the statistics are valid at the roots
+    std::vector<int> parent_;
+    std::vector<int> num_points_;
+    std::vector<int> num_lines_;
+    std::vector<int> last_row_;
+    std::vector<int> num_first_row_;
 
     // params
     const int num_scans_;
@@ -0,0 +1,92 @@
+#ifndef lvio_fusion_REGISTRATION_H
+#define lvio_fusion_REGISTRATION_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/lidar/voxel_map.h"
+
+namespace lvio_fusion
+{
+
+namespace lidar
+{
+
+enum class RegistrationMethod
+{
+    ScanToMap = 0, // ceres problems of ground and surface points in turn
+    VGICP = 1      // voxelized generalized icp
+};
+
+// voxelized generalized icp, target points are grouped into voxels,
+// the distribution of each voxel is computed once and regularized as a plane,
+// then source points are aligned to the distributions of their voxels by gauss newton with all threads,
+// from coarse voxels to fine voxels to enlarge the convergence region.
+class Registration
+{
+public:
+    /**
+     * add a kind of target points, e.g. ground or surface
+     * @param target        points in the world
+     * @param resolution    size of the finest voxels
+     * @param weight        weight of the kind
+     * @param delta         huber loss of weighted point to plane distances, 0 = no loss
+     */
+    void AddTarget(const PointICloud &target, double resolution, double weight, double delta);
+
+    /**
+     * align the sources of all kinds to their targets at the same time
+     * @param sources           points in the frame, one cloud of each target
+     * @param pose              initial pose of the frame, and the result
+     * @param num_threads       threads
+     * @param max_iterations    max iterations of gauss newton of each level
+     * @return                  converged at the finest level
+     */
+    bool Align(const std::vector<const PointICloud *> &sources, SE3d &pose, int num_threads, int max_iterations = 20);
+
+    /**
+     * point to plane matches of a kind at the finest level
+     * @param i         index of the target
+     * @param source    points in the frame
+     * @param pose      pose of the frame
+     * @param cost      0.5 * sum of squared weighted distances, with the huber loss
+     * @return          number of matched points
+     */
+    int Match(int i, const PointICloud &source, const SE3d &pose, double &cost);
+
+private:
+    struct Distribution
+    {
+        Vector3d mean;
+        Vector3d normal;
+        Matrix3d information;
+    };
+
+    struct Level
+    {
+        double resolution;
+        std::unordered_map<VoxelKey, Distribution, VoxelKeyHash> voxels;
+
+        const Distribution *Find(const Vector3d &p) const
+        {
+            double inv_resolution = 1 / resolution;
+            auto iter = voxels.find(VoxelKey(std::floor(p.x() * inv_resolution), std::floor(p.y() * inv_resolution), std::floor(p.z() * inv_resolution)));
+            return iter == voxels.end() ? nullptr : &iter->second;
+        }
+    };
+
+    struct Target
+    {
+        double weight, delta;
+        std::vector<Level> levels; // finest first
+    };
+
+    // one step of gauss newton at a level, return the step
+    double Step(const std::vector<const PointICloud *> &sources, SE3d &pose, int level, int num_threads);
+
+    std::vector<Target> targets_;
+};
+
+} // namespace lidar
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_REGISTRATION_H
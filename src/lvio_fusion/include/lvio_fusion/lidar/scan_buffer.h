@@ -0,0 +1,96 @@
+#ifndef lvio_fusion_SCAN_BUFFER_H
+#define lvio_fusion_SCAN_BUFFER_H
+
+#include "lvio_fusion/common.h"
+
+namespace lvio_fusion
+{
+
+namespace lidar
+{
+
+// the same values as sensor_msgs::PointField
+enum class FieldType : uint8_t
+{
+    None = 0,
+    Int8 = 1,
+    Uint8 = 2,
+    Int16 = 3,
+    Uint16 = 4,
+    Int32 = 5,
+    Uint32 = 6,
+    Float32 = 7,
+    Float64 = 8
+};
+
+struct Field
+{
+    int offset = 0;
+    FieldType type = FieldType::None;
+};
+
+// layout of a point in the raw buffer of a driver, ring and time are optional
+struct ScanLayout
+{
+    Field x, y, z;
+    Field ring;
+    Field time;             // any epoch, only the differences between points are used
+    double time_scale = 1;  // seconds of a unit of time
+    int point_step = 0;
+};
+
+// a scan still in the buffer of the driver, e.g. the data of sensor_msgs::PointCloud2,
+// the buffer is kept alive by data until the scan is pushed into the ring buffer.
+struct RawScan
+{
+    double time = 0;
+    std::shared_ptr<const uint8_t> data;
+    size_t size = 0; // number of points
+    ScanLayout layout;
+};
+
+// contiguous ring buffer of raw lidar points, every point has its own timestamp,
+// so that the window of a keyframe is sliced out with a single copy.
+class ScanBuffer
+{
+public:
+    // capacity is rounded up to a power of 2, and grows when needed
+    ScanBuffer(double cycle_time, size_t capacity = 1 << 18);
+
+    ~ScanBuffer();
+
+    // the points of a scan are decoded from the raw buffer, and placed in [time - cycle_time / 2, time + cycle_time / 2),
+    // by their own time if the layout has it, else spread evenly. invalid points are dropped.
+    void Push(const RawScan &scan);
+
+    // copy the points within [start, end) into out, and their rings (-1 = unknown) if needed,
+    // return false if the buffer doesn't cover the window
+    bool Slice(double start, double end, PointICloud &out, std::vector<int16_t> *rings = nullptr);
+
+    // drop the points before time
+    void DropBefore(double time);
+
+    size_t Size() const { return tail_ - head_; }
+
+private:
+    // first index whose time >= time
+    size_t LowerBound(double time);
+
+    void Grow(size_t size);
+
+    std::vector<PointI> points_;
+    std::vector<double> times_;
+    std::vector<int16_t> rings_;
+    std::vector<double> offsets_; // times of the points in the scan being pushed
+    std::vector<uint32_t> order_;
+    size_t mask_;
+    size_t head_ = 0, tail_ = 0; // indices keep increasing, the slot is index & mask_
+    double end_ = 0;             // end of the last scan
+    const double cycle_time_;
+};
+
+} // namespace lidar
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_SCAN_BUFFER_H
@@ -0,0 +1,50 @@
+#ifndef lvio_fusion_SCAN_CONTEXT_H
+#define lvio_fusion_SCAN_CONTEXT_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/lidar/feature.h"
+
+namespace lvio_fusion
+{
+
+namespace lidar
+{
+
+// scan context (Kim and Kim, 2018): the max height above the ground of the points in each polar bin,
+// computed once when the features of a keyframe are extracted.
+void make_scan_context(Feature &feature);
+
+/**
+ * distance between two scan contexts, the columns of b are shifted to find the best yaw
+ * @param a     scan context of the current frame
+ * @param b     scan context of the old frame
+ * @param yaw   rotation of a relative to b around z
+ * @return      distance in [0, 1], 1 if no column can be compared
+ */
+double scan_context_distance(const Eigen::MatrixXf &a, const Eigen::MatrixXf &b, double &yaw);
+
+// kd index of ring keys, the tree is rebuilt every few insertions and the newest keys are searched linearly.
+class ScanContextIndex
+{
+public:
+    void Insert(double time, const Eigen::VectorXf &ring_key);
+
+    // times of the k nearest ring keys, nearest first
+    int Search(const Eigen::VectorXf &ring_key, int k, std::vector<double> &times);
+
+    size_t Size() { return times_.size(); }
+
+private:
+    void Rebuild();
+
+    cv::Mat keys_;
+    std::vector<double> times_;
+    std::shared_ptr<cv::flann::Index> tree_;
+    int num_indexed_ = 0;
+};
+
+} // namespace lidar
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_SCAN_CONTEXT_H
@@ -0,0 +1,168 @@
+#ifndef lvio_fusion_VOXEL_MAP_H
+#define lvio_fusion_VOXEL_MAP_H
+
+#include "lvio_fusion/common.h"
+
+#include <unordered_set>
+
+namespace lvio_fusion
+{
+
+namespace lidar
+{
+
+struct VoxelKey
+{
+    VoxelKey(int x, int y, int z) : x(x), y(y), z(z) {}
+
+    bool operator==(const VoxelKey &other) const
+    {
+        return x == other.x && y == other.y && z == other.z;
+    }
+
+    int x, y, z;
+};
+
+struct VoxelKeyHash
+{
+    size_t operator()(const VoxelKey &key) const
+    {
+        return ((size_t)key.x * 73856093) ^ ((size_t)key.y * 19349663) ^ ((size_t)key.z * 83492791);
+    }
+};
+
+// persistent spatial index of world points, points are tagged with the keyframe they come from,
+// so that frames can be replaced or removed without rebuilding the whole index.
+class VoxelMap
+{
+public:
+    typedef std::shared_ptr<VoxelMap> Ptr;
+
+    // resolution is also the search radius
+    VoxelMap(double resolution) : resolution(resolution), inv_resolution_(1.0 / resolution) {}
+
+    void Insert(double time, const PointICloud &points);
+
+    void Erase(double time);
+
+    // erase all frames before time
+    void EraseBefore(double time);
+
+    bool Contains(double time) { return frames_.find(time) != frames_.end(); }
+
+    bool Empty() { return frames_.empty(); }
+
+    double Latest() { return frames_.empty() ? 0 : (--frames_.end())->first; }
+
+    // number of points of frames within [start, end], end = 0 means no limit
+    int Size(double start = 0, double end = 0);
+
+    // find up to k nearest points (ascending) within resolution, only in frames in [start, end]
+    int Search(const PointI &point, int k, std::vector<PointI> &result, double start = 0, double end = 0);
+
+    /**
+     * find up to k nearest points of each point, points in the same voxel share the candidates of their neighbourhood
+     * @param points    points
+     * @param k         k
+     * @param nums      number of the nearest points of each point
+     * @param nearest   nearest points (ascending) of the i-th point start at i * k
+     * @param start     start time of frames
+     * @param end       end time of frames, 0 means no limit
+     */
+    void Search(const PointICloud &points, int k, std::vector<int> &nums, std::vector<PointI> &nearest, double start = 0, double end = 0);
+
+    const double resolution;
+
+private:
+    struct Entry
+    {
+        PointI point;
+        double time;
+    };
+
+    VoxelKey Key(const float *p)
+    {
+        return VoxelKey(std::floor(p[0] * inv_resolution_), std::floor(p[1] * inv_resolution_), std::floor(p[2] * inv_resolution_));
+    }
+
+    const double inv_resolution_;
+    std::unordered_map<VoxelKey, std::vector<Entry>, VoxelKeyHash> voxels_;
+    std::map<double, std::pair<std::vector<VoxelKey>, int>> frames_; // time -> (voxels, number of points)
+};
+
+// downsampled colored map of all keyframes, one point per voxel (the centroid),
+// keyframes can be replaced when they are moved, voxels are grouped into chunks,
+// so that only the chunks changed since the last publish need to be sent.
+class GlobalMap
+{
+public:
+    // all points of a chunk, empty if the chunk has no voxel any more
+    struct ChunkUpdate
+    {
+        VoxelKey chunk;
+        PointRGBCloud points;
+    };
+
+    GlobalMap(double resolution, int chunk_size = 16)
+        : resolution(resolution), inv_resolution_(1.0 / resolution), chunk_size_(chunk_size) {}
+
+    // insert or replace the points of a keyframe
+    void Insert(double time, const PointRGBCloud &points);
+
+    void Erase(double time);
+
+    // the whole map
+    PointRGBCloud Get();
+
+    // the chunks changed since the last call, each one replaces the old points of the chunk, and mark them clean
+    std::vector<ChunkUpdate> GetDirty();
+
+    bool Dirty();
+
+    // edge of a chunk (m)
+    double ChunkSize() { return chunk_size_ * resolution; }
+
+    const double resolution;
+
+private:
+    // sum of the points of one keyframe in one voxel
+    struct Cell
+    {
+        double time;
+        float x, y, z, r, g, b;
+        int n;
+    };
+
+    VoxelKey Key(const PointRGB &p)
+    {
+        return VoxelKey(std::floor(p.x * inv_resolution_), std::floor(p.y * inv_resolution_), std::floor(p.z * inv_resolution_));
+    }
+
+    VoxelKey Chunk(const VoxelKey &key)
+    {
+        return VoxelKey(floor_div(key.x), floor_div(key.y), floor_div(key.z));
+    }
+
+    int floor_div(int a)
+    {
+        return a >= 0 ? a / chunk_size_ : (a - chunk_size_ + 1) / chunk_size_;
+    }
+
+    void EraseUnlocked(double time);
+
+    void Centroid(const std::vector<Cell> &cells, PointRGBCloud &out);
+
+    const double inv_resolution_;
+    const int chunk_size_;
+    std::mutex mutex_;
+    std::unordered_map<VoxelKey, std::vector<Cell>, VoxelKeyHash> voxels_;
+    std::unordered_map<VoxelKey, std::unordered_set<VoxelKey, VoxelKeyHash>, VoxelKeyHash> chunks_; // chunk -> voxels
+    std::unordered_set<VoxelKey, VoxelKeyHash> dirty_;                                            // dirty chunks
+    std::map<double, std::vector<VoxelKey>> frames_;                                            // time -> voxels
+};
+
+} // namespace lidar
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_VOXEL_MAP_H
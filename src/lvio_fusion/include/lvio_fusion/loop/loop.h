@@ -17,6 +17,7 @@ public:
     typedef std::shared_ptr<LoopClosure> Ptr;
 
     bool relocated = false;
+    bool appearance = false; // found by appearance, not by position
     double score = 0;
     std::shared_ptr<Frame> frame_old;
     SE3d relative_o_c;
@@ -0,0 +1,98 @@
+#ifndef lvio_fusion_MAP_MERGER_H
+#define lvio_fusion_MAP_MERGER_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/lidar/scan_context.h"
+#include "lvio_fusion/loop/vocabulary.h"
+#include "lvio_fusion/map_file.h"
+
+namespace lvio_fusion
+{
+
+// merge sessions saved by MapFile offline, without the singletons of a running session.
+// loops between sessions are found with the place recognition indices and verified by registration,
+// then the sessions are aligned and a pose graph of the sections of all sessions is optimized.
+// the sessions are indexed in parallel, and the pairs of sessions can be split into shards,
+// so that several machines detect the loops and one of them merges.
+class MapMerger
+{
+public:
+    typedef std::shared_ptr<MapMerger> Ptr;
+
+    /**
+     * @param vocabulary    DBoW2 orb vocabulary, empty = train with the sessions
+     * @param resolution    resolution of lidar points
+     * @param num_threads   threads
+     */
+    MapMerger(const std::string &vocabulary, double resolution, int num_threads);
+
+    // read the sessions and build their indices in parallel, the first session is the reference
+    bool Load(const std::vector<std::string> &paths);
+
+    // find the loops between the pairs of sessions in a shard, pair k is in shard k % num_shards
+    int DetectLoops(int shard = 0, int num_shards = 1);
+
+    // loops found by other shards, the sessions are in the same order
+    bool ReadLoops(const std::string &path);
+    bool WriteLoops(const std::string &path);
+
+    // align the sessions connected to the first one by loops, and optimize the sections of them,
+    // return the number of merged sessions
+    int Optimize();
+
+    // write the merged sessions into a map file
+    bool Save(const std::string &path);
+
+    /**
+     * write the merged sessions into tiles for localization, tile_<x>_<y>.map
+     * @param directory     of tiles
+     * @param size          size of tiles in meters
+     * @param overlap       keyframes within it around a tile are also in the tile
+     * @return              paths of the tiles
+     */
+    std::vector<std::string> SaveTiles(const std::string &directory, double size, double overlap = 20);
+
+    const std::vector<Session> &Sessions() const { return sessions_; }
+    const std::vector<SessionLoop> &Loops() const { return loops_; }
+    const std::vector<bool> &Merged() const { return merged_; }
+
+private:
+    struct Index
+    {
+        loop::Database database;
+        std::map<double, loop::BowVector> bows;
+        lidar::ScanContextIndex contexts;
+    };
+
+    // run tasks [0, num_tasks) with all threads
+    void Parallel(int num_tasks, const std::function<void(int)> &task);
+
+    void BuildIndex(int i);
+
+    // loops of the keyframes of session i against the old session, only one thread uses an index
+    void DetectLoops(int old_session, int i, std::vector<SessionLoop> &loops);
+
+    // register the keyframe to the old keyframe and its neighbours, from a yaw between them
+    bool Verify(int old_session, double old_time, int i, double time, double yaw, SessionLoop &loop);
+
+    // transform of a session of the loop into the reference, from the transform of the other session
+    SE3d Align(const SessionLoop &loop, int session, const std::vector<SE3d> &transforms);
+
+    // the loop agrees with the transform of a session of it
+    bool Agree(const SessionLoop &loop, int session, const SE3d &transform, const std::vector<SE3d> &transforms);
+
+    // merge the merged sessions with their offsets
+    int Write(const std::string &path, const std::function<bool(const Vector3d &)> &inside);
+
+    std::vector<Session> sessions_;
+    std::vector<Index> indices_;
+    std::vector<SessionLoop> loops_;
+    std::vector<bool> merged_;
+    loop::Vocabulary vocabulary_;
+    double resolution_;
+    int num_threads_;
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_MAP_MERGER_H
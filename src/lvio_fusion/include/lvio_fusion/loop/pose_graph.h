@@ -23,6 +23,14 @@ struct Section
 
 typedef std::map<double, Section> Atlas;
 
+// keyframes in [start, end] are moved rigidly, new pose = transform * old pose
+struct Correction
+{
+    double start = 0;
+    double end = 0;
+    SE3d transform;
+};
+
 inline double frames_distance(double A, double B)
 {
     Vector3d a = Map::Instance().GetKeyFrame(A)->t(),
@@ -60,6 +68,20 @@ public:
 
     void ForwardUpdate(SE3d transfrom, const Frames &forward_kfs);
 
+    // the poses of keyframes after the returned time are corrected since the last call
+    double TakeCorrected();
+
+    // keyframes after time are moved by an optimization, not by a rigid transform
+    void Moved(double time);
+
+    // the rigid corrections since the last call,
+    // the poses of keyframes after the returned time are also moved non-rigidly
+    double TakeCorrections(std::vector<Correction> &corrections);
+
+    // all sections and submaps, for map files
+    void GetAtlas(Atlas &sections, Atlas &submaps);
+    void SetAtlas(const Atlas &sections, const Atlas &submaps);
+
     std::mutex mutex;
     Section current_section;
     bool turning = false;
@@ -74,6 +96,11 @@ private:
 
     Atlas submaps_;  // loop submaps [end : {old, start, end}]
     Atlas sections_; // sections [A : {A, B, C}]
+    std::mutex mutex_corrected_;
+    double corrected_ = DBL_MAX;
+    std::mutex mutex_corrections_;
+    std::vector<Correction> corrections_;
+    double moved_ = DBL_MAX;
 };
 
 } // namespace lvio_fusion
@@ -4,12 +4,16 @@
 #include "lvio_fusion/adapt/problem.h"
 #include "lvio_fusion/backend.h"
 #include "lvio_fusion/common.h"
+#include "lvio_fusion/event.h"
 #include "lvio_fusion/frame.h"
 #include "lvio_fusion/frontend.h"
 #include "lvio_fusion/lidar/association.h"
 #include "lvio_fusion/lidar/mapping.h"
+#include "lvio_fusion/lidar/scan_context.h"
 #include "lvio_fusion/loop/loop.h"
 #include "lvio_fusion/loop/pose_graph.h"
+#include "lvio_fusion/loop/spatial_index.h"
+#include "lvio_fusion/loop/vocabulary.h"
 
 namespace lvio_fusion
 {
@@ -19,12 +23,19 @@ class Relocator
 public:
     typedef std::shared_ptr<Relocator> Ptr;
 
-    Relocator(int mode, double threshold);
+    Relocator(int mode, double threshold, const std::string &vocabulary, lidar::RegistrationMethod registration = lidar::RegistrationMethod::ScanToMap);
 
-    void SetMapping(Mapping::Ptr mapping) { mapping_ = mapping; }
+    void SetMapping(Mapping::Ptr mapping)
+    {
+        mapping_ = mapping;
+        mapping_->SetRegistration(registration_);
+    }
 
     void SetBackend(Backend::Ptr backend) { backend_ = backend; }
 
+    // only relocalize against the prior map, new keyframes are not loop candidates
+    void SetLocalization(bool localization) { localization_ = localization; }
+
 private:
     enum Mode
     {
@@ -34,10 +45,25 @@ private:
         VisualAndLidar = 3
     };
 
+    // the tracked features of a keyframe, descriptors are in frame->descriptors
+    struct Place
+    {
+        loop::BowVector bow;
+    };
+
     void DetectorLoop();
 
     bool DetectLoop(Frame::Ptr frame, Frame::Ptr &old_frame);
 
+    // compute the orb descriptors of the tracked features, and add the keyframe to the database
+    void AddPlace(Frame::Ptr frame);
+
+    // the old keyframe which looks most like frame, regardless of the poses
+    Frame::Ptr QueryPlace(Frame::Ptr frame);
+
+    // the old keyframe with the most similar scan context
+    Frame::Ptr QueryContext(Frame::Ptr frame);
+
     bool Relocate(Frame::Ptr frame, Frame::Ptr old_frame);
 
     bool RelocateByImage(Frame::Ptr frame, Frame::Ptr old_frame);
@@ -45,14 +71,28 @@ private:
     bool RelocateByPoints(Frame::Ptr frame, Frame::Ptr old_frame);
     void CorrectLoop(double old_time, double start_time, double end_time);
 
+    // move the keyframes after frame onto the prior map, the prior map is fixed
+    void Relocalize(Frame::Ptr frame);
+
     void UpdateNewSubmap(Frame::Ptr best_frame, Frames &new_submap_kfs);
 
     Mapping::Ptr mapping_;
     Backend::Ptr backend_;
 
     std::thread thread_;
+    Subscriber::Ptr events_;
+    loop::SpatialIndex index_; // positions of keyframes 30s ago
+    double indexed_ = 0;
+    loop::Vocabulary vocabulary_;
+    loop::Database database_;
+    lidar::ScanContextIndex contexts_;
+    std::map<double, Place> places_;
+    std::vector<std::pair<double, std::vector<BRIEF>>> training_; // keyframes waiting for the vocabulary
+    int num_training_ = 0;
     Mode mode_;
+    lidar::RegistrationMethod registration_; // of relocating by points
     double threshold_;
+    bool localization_ = false;
 };
 
 } // namespace lvio_fusion
@@ -0,0 +1,57 @@
+#ifndef lvio_fusion_SPATIAL_INDEX_H
+#define lvio_fusion_SPATIAL_INDEX_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/frame.h"
+
+namespace lvio_fusion
+{
+
+namespace loop
+{
+
+// 2d grid hash of keyframe positions to find loop candidates,
+// keyframes moved by corrections are hashed again instead of rebuilding the whole index.
+class SpatialIndex
+{
+public:
+    SpatialIndex(double cell_size) : cell_size_(cell_size) {}
+
+    void Insert(Frame::Ptr frame);
+
+    // the poses of keyframes after start are changed
+    void Update(double start);
+
+    /**
+     * search the nearest keyframes in the xy plane
+     * @param position  query position
+     * @param k         max number of keyframes
+     * @param radius    max distance
+     * @param result    keyframes, nearest first
+     * @return          number of keyframes found
+     */
+    int Search(const Vector3d &position, int k, double radius, std::vector<Frame::Ptr> &result);
+
+    size_t Size() { return entries_.size(); }
+
+private:
+    struct Entry
+    {
+        Frame::Ptr frame;
+        long long key;
+    };
+
+    long long Key(int x, int y) { return ((long long)x << 32) | (unsigned int)y; }
+    int Cell(double v) { return (int)std::floor(v / cell_size_); }
+
+    void Remove(double time, long long key);
+
+    const double cell_size_;
+    std::map<double, Entry> entries_;                            // time -> entry
+    std::unordered_map<long long, std::vector<double>> cells_; // cell -> times
+};
+
+} // namespace loop
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_SPATIAL_INDEX_H
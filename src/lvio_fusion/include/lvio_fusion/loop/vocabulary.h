@@ -0,0 +1,83 @@
+#ifndef lvio_fusion_VOCABULARY_H
+#define lvio_fusion_VOCABULARY_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/visual/feature.h"
+
+namespace lvio_fusion
+{
+
+namespace loop
+{
+
+typedef std::map<int, double> BowVector; // word -> weight
+
+// hierarchical k-medians tree of orb descriptors (DBoW2 style), the leaves are the words.
+class Vocabulary
+{
+public:
+    // load a DBoW2 text vocabulary, such as ORBvoc.txt
+    bool Load(const std::string &path);
+
+    /**
+     * build the tree by k-medians clustering level by level
+     * @param images    descriptors of the training images
+     * @param k         branching factor
+     * @param levels    depth of the tree
+     */
+    void Train(const std::vector<std::vector<BRIEF>> &images, int k = 10, int levels = 3);
+
+    bool Empty() const { return words_.empty(); }
+
+    size_t Size() const { return words_.size(); }
+
+    int Word(const BRIEF &descriptor) const;
+
+    // tf-idf weighted and L1 normalized
+    void Transform(const std::vector<BRIEF> &descriptors, BowVector &bow) const;
+
+    // L1 score in [0, 1]
+    static double Score(const BowVector &a, const BowVector &b);
+
+private:
+    struct Node
+    {
+        BRIEF descriptor;
+        std::vector<int> children;
+        int word = -1;
+    };
+
+    void Cluster(int parent, const std::vector<const BRIEF *> &descriptors, int k, int level, int levels);
+
+    std::vector<Node> nodes_;     // nodes_[0] is the root
+    std::vector<int> words_;      // word -> node
+    std::vector<double> weights_; // word -> idf
+};
+
+// inverted index from words to keyframes, a query only visits the keyframes sharing words with it.
+class Database
+{
+public:
+    void Add(double time, const BowVector &bow);
+
+    /**
+     * find the most similar keyframes
+     * @param bow       query
+     * @param max_time  only keyframes before it
+     * @param k         max number of results
+     * @param results   (score, time), best first
+     * @return          number of results
+     */
+    int Query(const BowVector &bow, double max_time, int k, std::vector<std::pair<double, double>> &results) const;
+
+    size_t Size() const { return size_; }
+
+private:
+    std::unordered_map<int, std::vector<std::pair<double, double>>> index_; // word -> (time, weight)
+    size_t size_ = 0;
+};
+
+} // namespace loop
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_VOCABULARY_H
@@ -1,9 +1,14 @@
 #ifndef lvio_fusion_MAP_H
 #define lvio_fusion_MAP_H
 
+#include "lvio_fusion/chunked_frames.h"
 #include "lvio_fusion/common.h"
 #include "lvio_fusion/frame.h"
+#include "lvio_fusion/visual/covisibility.h"
 #include "lvio_fusion/visual/landmark.h"
+#include "lvio_fusion/visual/landmark_archive.h"
+
+#include <atomic>
 
 namespace lvio_fusion
 {
@@ -19,39 +24,91 @@ public:
         return instance;
     }
 
+    // immutable view of all keyframes, iterate it without locks or copies,
+    // inserts replace the whole view and never change the old one, the views share unchanged chunks.
+    typedef std::shared_ptr<const ChunkedFrames> Snapshot;
+
+    Snapshot GetSnapshot()
+    {
+        return std::atomic_load(&keyframes_);
+    }
+
+    // increased by every insert
+    long Version()
+    {
+        return version_.load();
+    }
+
     int size()
     {
-        return keyframes.size();
+        return GetSnapshot()->size();
     }
 
+    // keyframes of a snapshot between two iterators, iterate it without copying
+    class Range
+    {
+    public:
+        Range(Snapshot snapshot, ChunkedFrames::const_iterator begin, ChunkedFrames::const_iterator end)
+            : snapshot_(snapshot), begin_(begin), end_(end) {}
+
+        ChunkedFrames::const_iterator begin() const { return begin_; }
+        ChunkedFrames::const_iterator end() const { return end_; }
+        bool empty() const { return begin_ == end_; }
+
+    private:
+        Snapshot snapshot_; // keep the iterators valid
+        ChunkedFrames::const_iterator begin_, end_;
+    };
+
     Frame::Ptr GetKeyFrame(double time);
     Frames GetKeyFrames(double start, double end = 0, int num = 0);
+    Range GetRange(double start, double end = 0);
+
+    // keyframes with lidar features, same as GetKeyFrames
+    Frames GetLidarKeyFrames(double start, double end = 0, int num = 0);
+
+    // called after the lidar features of a keyframe are ready
+    void InsertLidarKeyFrame(Frame::Ptr frame);
 
     void InsertKeyFrame(Frame::Ptr frame);
 
+    // insert many keyframes with one copy, frame ids are kept
+    void InsertKeyFrames(const Frames &frames);
+
     void InsertLandmark(visual::Landmark::Ptr landmark);
 
     void RemoveLandmark(visual::Landmark::Ptr landmark);
 
+    /**
+     * archive the landmarks which are not observed after end, and free their features
+     * @param end       keyframes before end are out of the window
+     * @return          number of archived landmarks
+     */
+    int CompactLandmarks(double end);
+
+    // world position of an archived landmark, the caller holds mutex_local_kfs
+    bool GetArchivedPosition(unsigned long id, Vector3d &pw);
+
     SE3d ComputePose(double time);
 
-    void ApplyGravityRotation(const Matrix3d &R);
+    void Reset();
 
-    void Reset()
-    {
-        landmarks.clear();
-        keyframes.clear();
-    }
-    
-    std::mutex mutex_local_kfs;
-    Frames keyframes;
+    std::mutex mutex_local_kfs; // guards landmarks, archive and the features of old keyframes
     visual::Landmarks landmarks;
+    visual::LandmarkArchive archive;
+    bool compact_landmarks = false;
     bool end = false;
+    double prior = 0; // keyframes before it are loaded from a map file
 
 private:
-    Map() {}
+    Map() : keyframes_(new ChunkedFrames) {}
     Map(const Map &);
     Map &operator=(const Map &);
+
+    std::mutex mutex_keyframes_; // serializes writers
+    Snapshot keyframes_;
+    std::atomic<long> version_{0};
+    std::vector<std::pair<double, Frame::Ptr>> lidar_kfs_; // sorted by time, guarded by mutex_keyframes_
 };
 } // namespace lvio_fusion
 
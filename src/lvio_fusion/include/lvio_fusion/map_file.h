@@ -0,0 +1,91 @@
+#ifndef lvio_fusion_MAP_FILE_H
+#define lvio_fusion_MAP_FILE_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/lidar/feature.h"
+#include "lvio_fusion/visual/feature.h"
+
+#include <functional>
+
+namespace lvio_fusion
+{
+
+// a keyframe of a session file, read without touching the map
+struct SessionFrame
+{
+    double time = 0;
+    SE3d pose;
+    std::vector<BRIEF> briefs;         // descriptors of the tracked features
+    lidar::Feature::Ptr feature_lidar; // with the scan context, null = no lidar
+};
+
+// a session file read for merging, the poses of the frames are written into the merged file
+struct Session
+{
+    std::string path;
+    std::map<double, SessionFrame> frames;
+    std::vector<double> sections; // A of the sections
+    double offset = 0;            // added to the times of the session in the merged file
+};
+
+// a loop between keyframes of two sessions
+struct SessionLoop
+{
+    int session = 0;     // of the current keyframe
+    double time = 0;     // of the current keyframe
+    int old_session = 0; // of the old keyframe
+    double old_time = 0; // of the old keyframe
+    SE3d relative_o_c;   // pose of the current keyframe in the old keyframe
+    double score = 0;
+};
+
+// versioned binary file of a whole session: keyframes, landmarks, descriptors,
+// lidar features, sections, submaps and raw navsat points.
+// data is laid out in chunks, the file is memory-mapped when loading,
+// and the data of keyframes out of the loaded region is never touched.
+class MapFile
+{
+public:
+    static const unsigned int version = 2;
+
+    /**
+     * save the current session
+     * @param path      map file
+     * @return          success
+     */
+    static bool Save(const std::string &path);
+
+    /**
+     * load a session into an empty map, as the prior of Map
+     * @param path      map file
+     * @param center    center of the loaded region
+     * @param radius    keyframes within the radius are loaded, 0 is all
+     * @return          time of the last loaded keyframe, 0 if failed
+     */
+    static double Load(const std::string &path, const Vector3d &center = Vector3d::Zero(), double radius = 0);
+
+    /**
+     * read the keyframes of a session without the map, for merging sessions offline
+     * @param path      map file
+     * @param session   poses, descriptors, lidar features and sections
+     * @return          success
+     */
+    static bool Read(const std::string &path, Session &session);
+
+    /**
+     * write sessions as one map file with the poses of session frames,
+     * ids of landmarks and keyframes are renumbered, and the loops between sessions become loop closures.
+     * raw navsat points are only kept for the first session, the others are in other local frames.
+     * @param path      merged map file
+     * @param sessions  sessions with corrected poses and disjoint times after offsets
+     * @param loops     loops between the sessions, by the indices in sessions
+     * @param inside    keyframes at positions inside it are written, null = all
+     * @return          number of written keyframes
+     */
+    static int Merge(const std::string &path, const std::vector<const Session *> &sessions, const std::vector<SessionLoop> &loops,
+                     const std::function<bool(const Vector3d &)> &inside = nullptr);
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_MAP_FILE_H
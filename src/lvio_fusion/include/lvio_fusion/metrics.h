@@ -0,0 +1,131 @@
+#ifndef lvio_fusion_METRICS_H
+#define lvio_fusion_METRICS_H
+
+#include "lvio_fusion/common.h"
+
+#include <atomic>
+
+namespace lvio_fusion
+{
+
+// lock-free latency histogram, buckets are logarithmic with 16 sub-buckets per power of 2 (about 6% error),
+// from 1 us to about 30 minutes.
+class Histogram
+{
+public:
+    Histogram();
+
+    void Record(double seconds);
+
+    long Count() const { return count_.load(std::memory_order_relaxed); }
+
+    // seconds
+    double Mean() const;
+    double Max() const { return max_.load(std::memory_order_relaxed) * 1e-6; }
+    double Percentile(double p) const;
+
+private:
+    Histogram(const Histogram &);
+    Histogram &operator=(const Histogram &);
+
+    static const int num_sub_buckets = 16;
+    static const int num_buckets = 32 * num_sub_buckets;
+
+    std::atomic<long> buckets_[num_buckets];
+    std::atomic<long> count_{0};
+    std::atomic<long> sum_{0}; // us
+    std::atomic<long> max_{0}; // us
+};
+
+// bytes and objects held by a container, the owner updates it where it inserts and erases,
+// so that reading it never walks the container.
+class MemoryAccount
+{
+public:
+    void Add(long bytes, long objects = 1)
+    {
+        bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        objects_.fetch_add(objects, std::memory_order_relaxed);
+    }
+
+    void Remove(long bytes, long objects = 1) { Add(-bytes, -objects); }
+
+    long Bytes() const { return bytes_.load(std::memory_order_relaxed); }
+    long Objects() const { return objects_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<long> bytes_{0};
+    std::atomic<long> objects_{0};
+};
+
+// registry of histograms, counters and memory accounts, they live until the end of the program,
+// so call sites can keep references and record without locks.
+class Metrics
+{
+public:
+    // never destroyed, memory accounts are updated by the destructors of other singletons at exit
+    static Metrics &Instance()
+    {
+        static Metrics *instance = new Metrics;
+        return *instance;
+    }
+
+    Histogram &GetHistogram(const std::string &name);
+
+    std::atomic<long> &GetCounter(const std::string &name);
+
+    MemoryAccount &GetMemory(const std::string &name);
+
+    struct Stat
+    {
+        std::string name;
+        long count;
+        double mean, p50, p99, max; // seconds
+    };
+
+    std::vector<Stat> GetStats();
+
+    std::map<std::string, long> GetCounters();
+
+    struct MemoryStat
+    {
+        std::string name;
+        long bytes, objects;
+    };
+
+    std::vector<MemoryStat> GetMemoryStats();
+
+    // write all histograms, counters and memory accounts into a csv file
+    bool Dump(const std::string &path);
+
+private:
+    Metrics() {}
+    Metrics(const Metrics &);
+    Metrics &operator=(const Metrics &);
+
+    std::mutex mutex_;
+    std::map<std::string, std::unique_ptr<Histogram>> histograms_;
+    std::map<std::string, std::unique_ptr<std::atomic<long>>> counters_;
+    std::map<std::string, std::unique_ptr<MemoryAccount>> memory_;
+};
+
+// record the lifetime of a scope
+class ScopedTimer
+{
+public:
+    ScopedTimer(Histogram &histogram) : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+
+    ~ScopedTimer()
+    {
+        auto time_used = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - start_);
+        histogram_.Record(time_used.count());
+    }
+
+private:
+    Histogram &histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_METRICS_H
@@ -2,6 +2,7 @@
 #define lvio_fusion_NAVSAT_H
 
 #include "lvio_fusion/common.h"
+#include "lvio_fusion/flat_map.h"
 #include "lvio_fusion/frame.h"
 #include "lvio_fusion/loop/pose_graph.h"
 #include "lvio_fusion/sensor.h"
@@ -37,11 +38,15 @@ public:
     Vector3d GetPoint(double time);
     Vector3d GetAroundPoint(double time);
 
-    void Optimize(const Section &section);
-    void QuickFix(double start, double end);
+    // raw points after start, copied under the lock
+    std::vector<std::pair<double, Vector3d>> GetRawPoints(double start);
+
+    // return the time of the first moved keyframe, keyframes after it are moved too, 0 if nothing moved
+    double Optimize(const Section &section);
+    double QuickFix(double start, double end);
 
     bool initialized = false;
-    std::map<double, Vector3d> raw;
+    FlatMap<double, Vector3d> raw; // fixes sorted by time, points of keyframes are interpolated
     Vector3d fix = Vector3d::Zero();
     bool navsat_v;
 
@@ -58,10 +63,15 @@ private:
 
     bool EstimatePose(double time, SE3d &pose);
 
+    // associate new keyframes to fixes
+    void Associate(const Vector3d &cov);
+
     void Initialize();
 
     // mode: y p r x y z;
     void OptimizeBC(Frame::Ptr frame, double end, unsigned char mode);
+
+    void Moved(double time);
     void OptimizeAB();
 
     static std::vector<Navsat::Ptr> devices_;
@@ -70,6 +80,10 @@ private:
     double trust_distance_pitch_;
     double trust_distance_z_;
     // data
+    std::mutex mutex_;
+    double finished_ = 0;
+    bool dirty_ = false; // new fixes since the last quick fix
+    double moved_ = 0;
     Frame::Ptr A, B, C;
     Section current_section;
 };
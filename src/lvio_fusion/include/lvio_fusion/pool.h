@@ -0,0 +1,128 @@
+#ifndef lvio_fusion_POOL_H
+#define lvio_fusion_POOL_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/metrics.h"
+
+#include <cstddef>
+
+namespace lvio_fusion
+{
+
+// thread-safe pool of fixed-size blocks, memory is allocated in slabs and never returned to the system,
+// freed blocks are reused by the next allocation, so millions of small objects don't fragment the heap.
+template <size_t Size>
+class BlockPool
+{
+public:
+    // never destroyed, objects may be freed by other singletons at exit
+    static BlockPool &Instance()
+    {
+        static BlockPool *instance = new BlockPool;
+        return *instance;
+    }
+
+    void *Allocate()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!free_)
+        {
+            Grow();
+        }
+        Block *block = free_;
+        free_ = block->next;
+        memory_.Add(0);
+        return block;
+    }
+
+    void Deallocate(void *p)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        Block *block = static_cast<Block *>(p);
+        block->next = free_;
+        free_ = block;
+        memory_.Remove(0);
+    }
+
+private:
+    union Block
+    {
+        Block *next;
+        alignas(std::max_align_t) char data[Size];
+    };
+
+    static const int slab_size = 1024;
+
+    // bytes are the reserved slabs, objects are the blocks in use
+    BlockPool() : memory_(Metrics::Instance().GetMemory("pool_" + std::to_string(Size))) {}
+    BlockPool(const BlockPool &);
+    BlockPool &operator=(const BlockPool &);
+
+    void Grow()
+    {
+        Block *slab = new Block[slab_size];
+        for (int i = 0; i < slab_size - 1; i++)
+        {
+            slab[i].next = &slab[i + 1];
+        }
+        slab[slab_size - 1].next = free_;
+        free_ = slab;
+        slabs_.push_back(slab);
+        memory_.Add(slab_size * sizeof(Block), 0);
+    }
+
+    std::mutex mutex_;
+    Block *free_ = nullptr;
+    std::vector<Block *> slabs_;
+    MemoryAccount &memory_;
+};
+
+// allocator of single objects from BlockPool, for std::allocate_shared
+template <typename T>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+
+    PoolAllocator() {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        if (n != 1)
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        return static_cast<T *>(BlockPool<sizeof(T)>::Instance().Allocate());
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        if (n != 1)
+        {
+            ::operator delete(p);
+            return;
+        }
+        BlockPool<sizeof(T)>::Instance().Deallocate(p);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) { return false; }
+
+// deleter of objects placed in BlockPool
+template <typename T>
+struct PoolDeleter
+{
+    void operator()(T *p) const
+    {
+        p->~T();
+        BlockPool<sizeof(T)>::Instance().Deallocate(p);
+    }
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_POOL_H
@@ -0,0 +1,85 @@
+#ifndef lvio_fusion_SCHEDULER_H
+#define lvio_fusion_SCHEDULER_H
+
+#include "lvio_fusion/common.h"
+
+#include <pthread.h>
+
+namespace lvio_fusion
+{
+
+// subsystems, in the order of priority
+enum class Task
+{
+    Frontend = 0,
+    Backend,
+    Mapping,
+    Relocator,
+    Navsat,
+    Lidar,
+    Num
+};
+
+// share the threads of the optimizers between subsystems, and pin the threads of subsystems to cpus.
+// frontend and backend always have some threads reserved, so the global optimizations can not starve them.
+// a solve waits while no thread is free for it, released threads go to the waiting task of the highest priority.
+class Scheduler
+{
+public:
+    static Scheduler &Instance()
+    {
+        static Scheduler instance;
+        return instance;
+    }
+
+    /**
+     * @param num_threads   threads of all optimizers
+     * @param affinity      cpus of subsystems, e.g. "frontend:0-1,backend:2-3,mapping:4", empty = no pinning
+     */
+    void Init(int num_threads, const std::string &affinity);
+
+    // pin the calling thread to the cpus of task, it is applied again if Init comes later
+    void Pin(Task task);
+
+    // threads granted to a solve, held until it is destroyed, leases must not be nested
+    class Lease
+    {
+    public:
+        Lease(Task task);
+        ~Lease();
+
+        const Task task;
+        int threads;
+
+    private:
+        Lease(const Lease &);
+        Lease &operator=(const Lease &);
+    };
+
+private:
+    Scheduler() {}
+    Scheduler(const Scheduler &);
+    Scheduler &operator=(const Scheduler &);
+
+    int Acquire(Task task);
+    void Release(Task task, int threads);
+
+    // threads which can be granted to task now, 0 if a task of higher priority is waiting
+    int Available(Task task);
+
+    void Apply(pthread_t thread, Task task);
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    int total_ = num_threads;
+    int reserved_ = num_threads / 2; // for frontend and backend, none if there is only one thread
+    int in_use_ = 0;
+    int critical_in_use_ = 0;
+    int waiting_[(int)Task::Num] = {};
+    std::vector<int> cpus_[(int)Task::Num];
+    std::vector<pthread_t> threads_[(int)Task::Num];
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_SCHEDULER_H
@@ -0,0 +1,106 @@
+#ifndef lvio_fusion_SPSC_QUEUE_H
+#define lvio_fusion_SPSC_QUEUE_H
+
+#include "lvio_fusion/common.h"
+
+#include <atomic>
+
+namespace lvio_fusion
+{
+
+// lock-free ring buffer with one producer thread and one consumer thread,
+// the consumer can sleep until new data arrives instead of polling.
+template <typename T>
+class SPSCQueue
+{
+public:
+    // capacity is rounded up to a power of 2
+    SPSCQueue(size_t capacity = 1024)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        buffer_.resize(size);
+        mask_ = size - 1;
+    }
+
+    // producer, return false if the queue is full
+    bool Push(const T &value)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) > mask_)
+            return false;
+        buffer_[tail & mask_] = value;
+        tail_.store(tail + 1);
+        if (waiting_.load())
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.notify_one();
+        }
+        return true;
+    }
+
+    // consumer, the front element, only valid if not empty
+    T &Front()
+    {
+        return buffer_[head_.load(std::memory_order_relaxed) & mask_];
+    }
+
+    // consumer
+    void Pop()
+    {
+        Front() = T(); // release the resource held by the slot
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // consumer
+    bool Pop(T &value)
+    {
+        if (Empty())
+            return false;
+        value = Front();
+        Pop();
+        return true;
+    }
+
+    // consumer, block until not empty or timeout, return false if timeout
+    template <typename Rep, typename Period>
+    bool Wait(const std::chrono::duration<Rep, Period> &timeout)
+    {
+        if (!Empty())
+            return true;
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiting_.store(true);
+        bool result = cv_.wait_for(lock, timeout, [this] { return !Empty(); });
+        waiting_.store(false);
+        return result;
+    }
+
+    bool Empty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load();
+    }
+
+    size_t Size() const
+    {
+        return tail_.load() - head_.load(std::memory_order_acquire);
+    }
+
+private:
+    SPSCQueue(const SPSCQueue &);
+    SPSCQueue &operator=(const SPSCQueue &);
+
+    std::vector<T> buffer_;
+    size_t mask_;
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+    std::atomic<bool> waiting_{false};
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_SPSC_QUEUE_H
@@ -0,0 +1,37 @@
+#ifndef lvio_fusion_SUITE_H
+#define lvio_fusion_SUITE_H
+
+namespace lvio_fusion
+{
+
+// sensors of the estimator, fixed when it is initialized, the stereo camera is always used
+enum Suite
+{
+    StereoOnly = 0,
+    WithImu = 1 << 0,
+    WithLidar = 1 << 1,
+    WithNavsat = 1 << 2,
+    WithLoop = 1 << 3,
+    NumSuites = 1 << 4
+};
+
+constexpr int make_suite(bool imu, bool lidar, bool navsat, bool loop)
+{
+    return (imu ? WithImu : 0) | (lidar ? WithLidar : 0) | (navsat ? WithNavsat : 0) | (loop ? WithLoop : 0);
+}
+
+// hot paths are instantiated per suite, so the branches of unused sensors are compiled out
+template <int suite>
+struct SuiteTraits
+{
+    static constexpr bool imu = suite & WithImu;
+    static constexpr bool lidar = suite & WithLidar;
+    static constexpr bool navsat = suite & WithNavsat;
+    static constexpr bool loop = suite & WithLoop;
+    // the global loop only runs the navsat optimization and closes the sections of the pose graph
+    static constexpr bool global = navsat || loop;
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_SUITE_H
@@ -0,0 +1,79 @@
+#ifndef lvio_fusion_TRACE_H
+#define lvio_fusion_TRACE_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/lidar/scan_buffer.h"
+
+#include <fstream>
+
+namespace lvio_fusion
+{
+
+enum class TraceType : uint8_t
+{
+    Image = 0,
+    Imu = 1,
+    PointCloud = 2,
+    Scan = 3,
+    Navsat = 4
+};
+
+// an input of the estimator, and when it was called since the first one
+struct TraceRecord
+{
+    TraceType type;
+    double offset = 0; // s
+    double time = 0;
+    cv::Mat left, right;
+    SE3d init_odom;
+    Vector3d v1, v2;   // acc and gyr, or position and covariance of navsat
+    Point3Cloud::Ptr point_cloud;
+    lidar::RawScan scan;
+};
+
+// every input of the estimator in the order of the calls, in a compact binary file,
+// a record is its size (uint32), then type, offset, time and the payload.
+class TraceWriter
+{
+public:
+    typedef std::shared_ptr<TraceWriter> Ptr;
+
+    bool Open(const std::string &path);
+
+    void WriteImage(double time, const cv::Mat &left, const cv::Mat &right, const SE3d &init_odom);
+
+    void WriteImu(double time, const Vector3d &acc, const Vector3d &gyr);
+
+    void WritePointCloud(double time, const Point3Cloud &point_cloud);
+
+    // the raw buffer of the driver is written as it is
+    void WriteScan(const lidar::RawScan &scan);
+
+    void WriteNavsat(double time, const Vector3d &position, const Vector3d &cov);
+
+private:
+    // the header is filled in, the inputs come from many threads
+    void Write(TraceType type, double time, std::vector<char> &buffer);
+
+    std::mutex mutex_;
+    std::ofstream out_;
+    std::chrono::steady_clock::time_point start_;
+    bool started_ = false;
+};
+
+class TraceReader
+{
+public:
+    bool Open(const std::string &path);
+
+    // false at the end of the trace
+    bool Next(TraceRecord &record);
+
+private:
+    std::ifstream in_;
+    std::vector<char> buffer_;
+};
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_TRACE_H
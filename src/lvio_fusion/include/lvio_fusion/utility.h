@@ -4,6 +4,7 @@
 // utilities used in lvio_fusion
 #include "lvio_fusion/common.h"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 
 #include <opencv2/core/eigen.hpp>
@@ -22,17 +23,35 @@ namespace lvio_fusion
  */
 void triangulate(const SE3d &pose0, const SE3d &pose1, const Vector3d &p0, const Vector3d &p1, Vector3d &p_3d);
 
+/**
+ * midpoint triangulation of many points in closed form, each point is a column
+ * @param pose0     pose,
+ * @param pose1     pose,
+ * @param p0        points in normalized plane
+ * @param p1        points in normalized plane
+ * @param p_3d      triangulated points in the world, parallel rays are put at the center of camera 0
+ */
+void triangulate(const SE3d &pose0, const SE3d &pose1, const Matrix3Xd &p0, const Matrix3Xd &p1, Matrix3Xd &p_3d);
+
 double cv_distance(cv::Point2f pt1, cv::Point2f pt2 = cv::Point2f(0, 0));
 
+// build the lk pyramid of image with derivatives, the buffers of pyramid are reused if the size is the same
+void build_pyramid(const cv::Mat &image, std::vector<cv::Mat> &pyramid);
+
 /**
  * double calculate optical flow
- * @param prevImg     prev image,
- * @param nextImg     next image,
+ * @param prevPyr     lk pyramid of prev image, see build_pyramid
+ * @param nextPyr     lk pyramid of next image, see build_pyramid
  * @param prevPts     point in prev image
  * @param nextPts     point in next image
  * @param status      status
  */
-void optical_flow(cv::Mat &prevImg, cv::Mat &nextImg,
+void optical_flow(const std::vector<cv::Mat> &prevPyr, const std::vector<cv::Mat> &nextPyr,
+                  std::vector<cv::Point2f> &prevPts, std::vector<cv::Point2f> &nextPts,
+                  std::vector<uchar> &status);
+
+// the same on images on the opencl device, the pyramids are built on the device
+void optical_flow(const cv::UMat &prevImg, const cv::UMat &nextImg,
                   std::vector<cv::Point2f> &prevPts, std::vector<cv::Point2f> &nextPts,
                   std::vector<uchar> &status);
 
@@ -204,6 +223,32 @@ inline T normalize_angle(const T &angle_degrees)
 
 double vectors_degree_angle(Vector3d v1, Vector3d v2);
 
+// atan2 from a table of atan in [0, 1] with linear interpolation, the error is less than 2e-6 rad
+inline float fast_atan2(float y, float x)
+{
+    const int size = 256;
+    static const std::vector<float> table = [] {
+        std::vector<float> table(size + 2);
+        for (int i = 0; i < size + 2; i++)
+        {
+            table[i] = std::atan((double)i / size);
+        }
+        return table;
+    }();
+    float ax = std::abs(x), ay = std::abs(y);
+    if (ax == 0 && ay == 0)
+        return 0;
+    bool steep = ay > ax;
+    float index = (steep ? ax / ay : ay / ax) * size;
+    int k = (int)index;
+    float angle = table[k] + (index - k) * (table[k + 1] - table[k]);
+    if (steep)
+        angle = M_PI_2 - angle;
+    if (x < 0)
+        angle = M_PI - angle;
+    return y < 0 ? -angle : angle;
+}
+
 // SE3d slerp, the bigger s(0,1) is, the closer the result is to b
 SE3d se3_slerp(const SE3d &a, const SE3d &b, double s);
 
@@ -224,6 +269,43 @@ inline bool operator==(SE3d &a, SE3d &b)
     Quaterniond qa = a.unit_quaternion(), qb = b.unit_quaternion();
     return a.translation() == b.translation() && qa == qb;
 }
+
+// *******************************System*******************************
+/**
+ * run func(i) for every i in [begin, end) with num_threads threads
+ * @param begin     first index
+ * @param end       last index + 1
+ * @param func      task, must be thread safe
+ */
+template <typename Func>
+inline void parallel_for(int begin, int end, Func func)
+{
+    int num = std::min(num_threads, end - begin);
+    if (num <= 1)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            func(i);
+        }
+        return;
+    }
+
+    std::atomic<int> next(begin);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num; i++)
+    {
+        threads.push_back(std::thread([&]() {
+            for (int j = next++; j < end; j = next++)
+            {
+                func(j);
+            }
+        }));
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+}
 } // namespace lvio_fusion
 
 #endif // lvio_fusion_UTILITY_H
@@ -76,6 +76,22 @@ public:
         return Sensor2Pixel(Robot2Sensor(pw));
     }
 
+    // same as cv::undistort, but the remap tables are only built at the first call
+    void Undistort(const cv::Mat &src, cv::Mat &dst)
+    {
+        if (k1 == 0 && k2 == 0 && p1 == 0 && p2 == 0)
+        {
+            src.copyTo(dst);
+            return;
+        }
+        if (map1_.empty() || map_size_ != src.size())
+        {
+            cv::initUndistortRectifyMap(K, D, cv::Mat(), K, src.size(), CV_16SC2, map1_, map2_);
+            map_size_ = src.size();
+        }
+        cv::remap(src, dst, map1_, map2_, cv::INTER_LINEAR);
+    }
+
     static double baseline;
     double fx = 0, fy = 0, cx = 0, cy = 0; // Camera intrinsics
     double k1 = 0, k2 = 0, p1 = 0, p2 = 0; // Camera intrinsics
@@ -91,6 +107,8 @@ private:
     Camera(const Camera &);
     Camera &operator=(const Camera &);
 
+    cv::Mat map1_, map2_; // fixed-point remap tables
+    cv::Size map_size_;
     static std::vector<Camera::Ptr> devices_;
 };
 
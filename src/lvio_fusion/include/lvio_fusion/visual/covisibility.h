@@ -0,0 +1,52 @@
+#ifndef lvio_fusion_COVISIBILITY_H
+#define lvio_fusion_COVISIBILITY_H
+
+#include "lvio_fusion/common.h"
+
+#include <unordered_map>
+
+namespace lvio_fusion
+{
+
+namespace visual
+{
+
+// weighted graph of keyframes, the weight of an edge is the number of landmarks observed by both keyframes,
+// it is updated when landmarks gain or lose observations.
+class Covisibility
+{
+public:
+    static Covisibility &Instance()
+    {
+        static Covisibility instance;
+        return instance;
+    }
+
+    void Add(double a, double b);
+
+    void Remove(double a, double b);
+
+    int Weight(double a, double b);
+
+    // neighbours of a keyframe with at least min_weight shared landmarks, sorted by weight descending
+    std::vector<std::pair<double, int>> GetNeighbors(double time, int min_weight = 1);
+
+    // the oldest keyframe after start which shares at least min_weight landmarks with the keyframe, 0 if none
+    double Oldest(double time, int min_weight, double start);
+
+    void Reset();
+
+private:
+    Covisibility() {}
+    Covisibility(const Covisibility &);
+    Covisibility &operator=(const Covisibility &);
+
+    std::mutex mutex_;
+    std::unordered_map<double, std::map<double, int>> edges_; // time -> {time -> weight}
+};
+
+} // namespace visual
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_COVISIBILITY_H
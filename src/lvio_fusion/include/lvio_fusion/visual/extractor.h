@@ -40,6 +40,7 @@ public:
     const int patch_size;
     const int half_patch_size;
     const int edge_thershold;
+    bool opencl = false; // detect FAST on the opencl device
 
 private:
     void ComputePyramid(cv::Mat image);
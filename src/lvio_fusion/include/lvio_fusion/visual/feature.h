@@ -2,6 +2,8 @@
 #define lvio_fusion_VISUAL_FEATURE_H
 
 #include "lvio_fusion/common.h"
+#include "lvio_fusion/flat_map.h"
+#include "lvio_fusion/pool.h"
 
 namespace lvio_fusion
 {
@@ -24,7 +26,7 @@ public:
 
     static Feature::Ptr Create(std::shared_ptr<Frame> frame, const cv::KeyPoint &keypoint, std::shared_ptr<Landmark> landmark = nullptr)
     {
-        Feature::Ptr new_feature(new Feature);
+        Feature::Ptr new_feature = std::allocate_shared<Feature>(PoolAllocator<Feature>());
         new_feature->frame = frame;
         new_feature->keypoint = keypoint;
         if (landmark)
@@ -43,7 +45,7 @@ public:
     bool is_on_left_image = true;
 };
 
-typedef std::map<unsigned long, Feature::Ptr> Features;
+typedef FlatMap<unsigned long, Feature::Ptr> Features;
 } // namespace visual
 
 } // namespace lvio_fusion
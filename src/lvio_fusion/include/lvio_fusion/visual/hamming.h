@@ -0,0 +1,24 @@
+#ifndef lvio_fusion_HAMMING_H
+#define lvio_fusion_HAMMING_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/visual/feature.h"
+
+namespace lvio_fusion
+{
+
+int hamming_distance(const BRIEF &a, const BRIEF &b);
+
+/**
+ * find the two nearest briefs in one pass, use AVX2/NEON if the cpu supports
+ * @param query     query brief
+ * @param briefs    candidates
+ * @param best      distance of the nearest one
+ * @param second    distance of the second nearest one, INT_MAX if only one candidate
+ * @return          index of the nearest one, -1 if no candidate
+ */
+int match_briefs(const BRIEF &query, const std::vector<const BRIEF *> &briefs, int &best, int &second);
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_HAMMING_H
@@ -24,6 +24,9 @@ public:
 
     void RemoveObservation(Feature::Ptr feature);
 
+    // remove the edges of the covisibility graph between the keyframes which observe it
+    void RemoveCovisibility();
+
     static Landmark::Ptr Create(double depth);
 
     static unsigned long current_landmark_id;
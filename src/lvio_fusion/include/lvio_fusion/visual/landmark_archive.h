@@ -0,0 +1,71 @@
+#ifndef lvio_fusion_LANDMARK_ARCHIVE_H
+#define lvio_fusion_LANDMARK_ARCHIVE_H
+
+#include "lvio_fusion/common.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/visual/feature.h"
+
+namespace lvio_fusion
+{
+
+namespace visual
+{
+
+// immutable landmarks which left the window, only kept for relocalization.
+// the columns are stored separately, positions are in the body frame of the anchor keyframe,
+// so they follow the corrections of keyframes without being updated.
+class LandmarkArchive
+{
+public:
+    void Insert(unsigned long id, const Vector3d &pb, const BRIEF &brief, double anchor)
+    {
+        index_[id] = ids.size();
+        ids.push_back(id);
+        positions.push_back(pb.cast<float>());
+        briefs.push_back(brief);
+        anchors.push_back(anchor);
+        Memory().Add(entry_bytes);
+    }
+
+    // index of the landmark, -1 means it is not archived
+    int Find(unsigned long id) const
+    {
+        auto iter = index_.find(id);
+        return iter == index_.end() ? -1 : iter->second;
+    }
+
+    size_t size() const { return ids.size(); }
+
+    void Clear()
+    {
+        Memory().Remove(ids.size() * entry_bytes, ids.size());
+        index_.clear();
+        ids.clear();
+        positions.clear();
+        briefs.clear();
+        anchors.clear();
+    }
+
+    std::vector<unsigned long> ids;
+    std::vector<Vector3f> positions; // in the body frame of the anchor
+    std::vector<BRIEF> briefs;       // of the first left observation
+    std::vector<double> anchors;     // time of the first keyframe
+
+private:
+    // the columns and the index, without the spare capacity of vectors
+    static const size_t entry_bytes = 2 * sizeof(unsigned long) + sizeof(int) + sizeof(Vector3f) + sizeof(BRIEF) + sizeof(double);
+
+    static MemoryAccount &Memory()
+    {
+        static MemoryAccount &memory = Metrics::Instance().GetMemory("landmark_archive");
+        return memory;
+    }
+
+    std::unordered_map<unsigned long, int> index_;
+};
+
+} // namespace visual
+
+} // namespace lvio_fusion
+
+#endif // lvio_fusion_LANDMARK_ARCHIVE_H
@@ -7,72 +7,167 @@
 #include "lvio_fusion/visual/feature.h"
 #include "lvio_fusion/visual/landmark.h"
 
+#include <deque>
+
 namespace lvio_fusion
 {
 
 typedef std::vector<visual::Feature::Ptr> Level;
 typedef std::vector<Level> Pyramid;
 
-extern cv::Mat img_track;
+// image-space buckets of a level, a radius query only visits the neighbouring cells
+class Grid
+{
+public:
+    Grid() {}
+
+    // cell size should not be less than the search radius
+    Grid(const Level &features, double cell_size, int width, int height);
+
+    // indices (ascending) of features in the cells around p
+    void Query(const cv::Point2f &p, std::vector<int> &indices) const;
+
+private:
+    double cell_size_ = 1;
+    int cols_ = 0, rows_ = 0;
+    std::vector<std::vector<int>> cells_;
+};
+typedef std::vector<Grid> Grids;
 
+// features of the keyframes are detected and triangulated in a worker thread if async,
+// the results are merged by the frontend between frames, so tracking never sees a half-built keyframe.
 class LocalMap
 {
 public:
-    LocalMap(int num_features) : num_features_(num_features),
-                                 extractor_(num_features),
-                                 matcher_(cv::DescriptorMatcher::create("BruteForce-Hamming")),
-                                 num_levels_(extractor_.num_levels)
+    LocalMap(int num_features, bool opencl = false, bool async = false) : num_features_(num_features),
+                                                                          extractor_(num_features),
+                                                                          num_levels_(extractor_.num_levels),
+                                                                          async_(async)
     {
+        extractor_.opencl = opencl;
         double current_factor = 1;
         for (int i = 0; i < num_levels_; i++)
         {
             scale_factors_.push_back(current_factor);
             current_factor *= extractor_.scale_factor;
         }
+        if (async_)
+        {
+            thread_ = std::thread(std::bind(&LocalMap::KeyFrameLoop, this));
+        }
     }
 
+    ~LocalMap();
+
     int Init(Frame::Ptr new_kf);
 
+    // pending keyframes of the worker are dropped
     void Reset();
 
-    void AddKeyFrame(Frame::Ptr new_kf);
+    // return true if new landmarks of the keyframe are in the local map, otherwise they come from Merge()
+    bool AddKeyFrame(Frame::Ptr new_kf);
+
+    // merge the keyframes finished by the worker, return the newest one, nullptr if none
+    Frame::Ptr Merge();
 
     Level GetFeatures(double time);
 
     PointRGBCloud GetLocalLandmarks();
 
-    void UpdateCache();
+    /**
+     * read the poses of the anchor keyframes again
+     * @param landmarks     depths of landmarks are changed too, landmarks are anchored again
+     */
+    void UpdateCache(bool landmarks = true);
+
+    // cache a landmark which is not in the local map, until the landmarks are anchored again
+    void Anchor(visual::Landmark::Ptr landmark);
+
+    bool Anchored(unsigned long id) { return anchors_.find(id) != anchors_.end(); }
+
+    // time of the oldest keyframe whose landmarks can be matched again
+    double Oldest()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return local_features_.empty() ? DBL_MAX : local_features_.begin()->first;
+    }
+
+    // world position of a landmark from the cached pose of its anchor keyframe
+    Vector3d Position(unsigned long id)
+    {
+        auto iter = anchors_.find(id);
+        if (iter == anchors_.end())
+            return Vector3d::Zero();
+        return pose_cache[iter->second.time] * iter->second.pb;
+    }
 
-    std::unordered_map<unsigned long, Vector3d> position_cache;
     std::unordered_map<double, SE3d> pose_cache;
     visual::Landmarks landmarks;
 
 private:
-    Vector3d ToWorld(visual::Feature::Ptr feature);
+    // landmarks are kept relative to their first keyframes,
+    // so that a correction of poses only costs O(keyframes)
+    struct AnchoredPoint
+    {
+        double time;
+        Vector3d pb;
+    };
+
+    struct Job
+    {
+        Frame::Ptr frame;
+        Pyramid pyramid;
+        Grids grids;
+        visual::Landmarks landmarks; // features only refer to them, so they are kept here until merged
+    };
+
+    // the caller holds mutex_
+    void AnchorFrame(Frame::Ptr frame);
+    void AnchorLandmark(visual::Landmark::Ptr landmark);
+    void MergeKeyFrame(Job &job);
+
+    void KeyFrameLoop();
 
     void LocalBA(Frame::Ptr frame);
 
     void GetFeaturePyramid(Frame::Ptr frame, Pyramid &pyramid);
 
-    void GetNewLandmarks(Frame::Ptr frame, Pyramid &pyramid);
+    // only touch the new keyframe, so it does not need the lock
+    void GetNewLandmarks(Frame::Ptr frame, Pyramid &pyramid, Grids &grids, visual::Landmarks &new_landmarks);
+
+    void Triangulate(Frame::Ptr frame, Level &featrues, visual::Landmarks &new_landmarks);
 
-    void Triangulate(Frame::Ptr frame, Level &featrues);
+    void InsertNewLandmarks(const visual::Landmarks &new_landmarks);
 
+    // keyframes sharing more landmarks with frame go first
     std::vector<double> GetCovisibilityKeyFrames(Frame::Ptr frame);
 
+    // stop when half of the new features are matched
     void Search(std::vector<double> kfs, Frame::Ptr frame);
-    void Search(Pyramid &last_pyramid, SE3d last_pose, Pyramid &current_pyramid, Frame::Ptr frame);
-    void Search(Pyramid &last_pyramid, SE3d last_pose, visual::Feature::Ptr feature, Frame::Ptr frame);
+    // return the number of new matches
+    int Search(Pyramid &last_pyramid, Grids &last_grids, SE3d last_pose, Pyramid &current_pyramid, Frame::Ptr frame);
+    bool Search(Pyramid &last_pyramid, Grids &last_grids, SE3d last_pose, visual::Feature::Ptr feature, Frame::Ptr frame);
 
     std::mutex mutex_;
     Extractor extractor_;
-    cv::Ptr<cv::DescriptorMatcher> matcher_;
+    std::unordered_map<unsigned long, AnchoredPoint> anchors_;
+    std::unordered_map<double, std::weak_ptr<Frame>> anchor_frames_; // keyframes in pose_cache
     std::map<double, Pyramid> local_features_;
+    std::map<double, Grids> local_grids_;
     std::vector<double> scale_factors_;
 
+    std::thread thread_;
+    std::mutex mutex_jobs_;
+    std::condition_variable cv_jobs_;
+    std::deque<Frame::Ptr> jobs_; // keyframes waiting for the worker
+    std::deque<Job> done_;        // keyframes waiting to be merged
+    bool busy_ = false;
+    bool running_ = true;
+
     const int num_levels_;
     const int windows_size_ = 4;
     const int num_features_;
+    const bool async_;
 };
 } // namespace lvio_fusion
 
@@ -1,13 +1,38 @@
 #include "lvio_fusion/adapt/agent.h"
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
+
+#include <algorithm>
 
 namespace lvio_fusion
 {
 Agent *Agent::instance_ = nullptr;
 
-Agent::Agent(Core *core) : core_(core)
+Agent::Agent(Core *core, double deadline, int max_batch)
+    : core_(core), deadline_(deadline), max_batch_(std::max(1, max_batch))
 {
     thread_ = std::thread(std::bind(&Agent::AgentLoop, this));
+    thread_inference_ = std::thread(std::bind(&Agent::InferenceLoop, this));
+}
+
+void Agent::InferenceLoop()
+{
+    while (true)
+    {
+        std::shared_ptr<Request> request;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return !requests_.empty(); });
+            request = requests_.front();
+            requests_.pop_front();
+        }
+        core_->UpdateWeights(request->batch, request->weights);
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            request->done = true;
+        }
+        cv_.notify_all();
+    }
 }
 
 void Agent::AgentLoop()
@@ -16,25 +41,82 @@ void Agent::AgentLoop()
     while (true)
     {
         std::this_thread::sleep_for(std::chrono::milliseconds(10));
-        auto new_kfs = Map::Instance().GetKeyFrames(finished);
+        auto new_kfs = Map::Instance().GetRange(finished);
         if (!new_kfs.empty())
         {
+            std::vector<Frame::Ptr> frames;
             for (auto &pair : new_kfs)
             {
-                UpdateWeights(pair.second);
+                frames.push_back(pair.second);
+                if (frames.size() == max_batch_)
+                {
+                    UpdateWeights(frames);
+                    frames.clear();
+                }
+            }
+            if (!frames.empty())
+            {
+                UpdateWeights(frames);
             }
             finished = (--new_kfs.end())->first + epsilon;
         }
     }
 }
 
-void Agent::UpdateWeights(Frame::Ptr frame)
+void Agent::UpdateWeights(const std::vector<Frame::Ptr> &frames)
 {
-    Observation obs = frame->GetObservation();
-    if (!obs.empty())
+    static Histogram &histogram = Metrics::Instance().GetHistogram("weights_inference");
+    static std::atomic<long> &num_late = Metrics::Instance().GetCounter("weights_late");
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<Frame::Ptr> batch_frames;
+    std::vector<Observation> batch;
+    for (auto &frame : frames)
+    {
+        Observation obs = frame->GetObservation();
+        if (!obs.empty())
+        {
+            batch_frames.push_back(frame);
+            batch.push_back(obs);
+        }
+    }
+    if (batch.empty())
+        return;
+
+    auto request = std::make_shared<Request>();
+    request->batch = std::move(batch);
+    for (auto &frame : batch_frames)
+    {
+        request->weights.push_back(frame->weights);
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    requests_.push_back(request);
+    cv_.notify_all();
+    auto done = [&request] { return request->done; };
+    if (deadline_ > 0)
+    {
+        cv_.wait_until(lock, t0 + std::chrono::duration<double>(deadline_), done);
+    }
+    else
+    {
+        cv_.wait(lock, done);
+    }
+    histogram.Record(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    // the backend may have optimized the keyframes with the old weights, changing them now is inconsistent,
+    // a late batch which has not been started is not inferred at all
+    if (!request->done)
+    {
+        auto iter = std::find(requests_.begin(), requests_.end(), request);
+        if (iter != requests_.end())
+        {
+            requests_.erase(iter);
+        }
+        num_late += request->weights.size();
+        return;
+    }
+    for (int i = 0; i < batch_frames.size(); i++)
     {
-        core_->UpdateWeights(obs, frame->weights);
-        frame->weights.updated = true;
+        batch_frames[i]->weights = request->weights[i];
+        batch_frames[i]->weights.updated = true;
     }
 }
 
@@ -2,107 +2,246 @@
 #include "lvio_fusion/adapt/problem.h"
 #include "lvio_fusion/ceres/lidar_error.hpp"
 #include "lvio_fusion/ceres/pose_error.hpp"
+#include "lvio_fusion/imu/imu.h"
 #include "lvio_fusion/lidar/feature.h"
 #include "lvio_fusion/lidar/lidar.h"
+#include "lvio_fusion/lidar/scan_context.h"
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/scheduler.h"
 #include "lvio_fusion/utility.h"
 
-#include <pcl/filters/extract_indices.h>
-#include <pcl/filters/radius_outlier_removal.h>
-#include <pcl/filters/voxel_grid.h>
-#include <pcl/kdtree/kdtree_flann.h>
-#include <pcl/sample_consensus/method_types.h>
-#include <pcl/sample_consensus/model_types.h>
-#include <pcl/segmentation/sac_segmentation.h>
+#include <Eigen/Eigenvalues>
+#include <numeric>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 namespace lvio_fusion
 {
 
+FeatureAssociation::~FeatureAssociation()
+{
+    // the lidar thread wakes up at least every 100 ms
+    running_ = false;
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+}
+
 void FeatureAssociation::AddScan(double time, Point3Cloud::Ptr new_scan)
 {
-    static double finished = 0;
-    static Frame::Ptr last_frame;
-    raw_point_clouds_[time] = new_scan;
+    // the cloud itself is the raw buffer
+    lidar::RawScan scan;
+    Point3 first;
+    scan.time = time;
+    scan.data = std::shared_ptr<const uint8_t>((const uint8_t *)new_scan->points.data(), [new_scan](const uint8_t *) {});
+    scan.size = new_scan->size();
+    scan.layout.x = {0, lidar::FieldType::Float32};
+    scan.layout.y = {int((uint8_t *)&first.y - (uint8_t *)&first.x), lidar::FieldType::Float32};
+    scan.layout.z = {int((uint8_t *)&first.z - (uint8_t *)&first.x), lidar::FieldType::Float32};
+    scan.layout.point_step = sizeof(Point3);
+    AddScan(scan);
+}
+
+void FeatureAssociation::AddScan(const lidar::RawScan &new_scan)
+{
+    if (!queue_.Push(new_scan))
+    {
+        static std::atomic<long> &num_dropped = Metrics::Instance().GetCounter("scans_dropped");
+        LOG_EVERY_N(WARNING, 10) << "Lidar processing falls behind, dropped " << ++num_dropped << " scans.";
+    }
+}
+
+double FeatureAssociation::Processed()
+{
+    std::unique_lock<std::mutex> lock(mutex_processed_);
+    return processed_;
+}
 
-    Frames new_kfs = Map::Instance().GetKeyFrames(finished, time);
+void FeatureAssociation::ProcessLoop()
+{
+    Scheduler::Instance().Pin(Task::Lidar);
+    while (running_)
+    {
+        lidar::RawScan scan;
+        if (queue_.Wait(std::chrono::milliseconds(100)) && queue_.Pop(scan))
+        {
+            ProcessScan(scan);
+        }
+    }
+}
+
+void FeatureAssociation::ProcessScan(const lidar::RawScan &new_scan)
+{
+    double time = new_scan.time;
+    scans_.Push(new_scan);
+
+    auto new_kfs = Map::Instance().GetRange(finished_, time);
     for (auto &pair : new_kfs)
     {
         PointICloud point_cloud;
-        if ((!last_frame || (pair.second->t() - last_frame->t()).norm() > spacing_) && AlignScan(pair.first, point_cloud))
+        if (NeedLidar(pair.second) && AlignScan(pair.first, point_cloud))
         {
             Process(point_cloud, pair.second);
-            finished = pair.first + epsilon;
-            last_frame = pair.second;
+            finished_ = pair.first + epsilon;
+            last_frame_ = pair.second;
         }
     }
+
+    // keyframes one cycle before this scan will not be aligned any more
+    {
+        std::unique_lock<std::mutex> lock(mutex_processed_);
+        processed_ = std::max(processed_, time - cycle_time_);
+    }
+}
+
+bool FeatureAssociation::NeedLidar(Frame::Ptr frame)
+{
+    if (!last_frame_ || !keyframe_policy_)
+        return true;
+    KeyframeState state;
+    SE3d relative = last_frame_->pose.inverse() * frame->pose;
+    state.dt = frame->time - last_frame_->time;
+    state.distance = relative.translation().norm();
+    state.angle = relative.so3().log().norm();
+    state.num_tracked = frame->features_left.size();
+    return keyframe_policy_->NeedLidar(state);
 }
 
 bool FeatureAssociation::AlignScan(double time, PointICloud &out)
 {
-    auto iter = raw_point_clouds_.upper_bound(time);
-    if (iter == raw_point_clouds_.begin())
-        return false;
-    Point3Cloud &pc2 = *(iter->second);
-    double end_time = iter->first + cycle_time_ / 2;
-    Point3Cloud &pc1 = *((--iter)->second);
-    double start_time = iter->first - cycle_time_ / 2;
-    Point3Cloud pc = pc1 + pc2;
-    int size = pc.size();
-    if (time - cycle_time_ / 2 < start_time || time + cycle_time_ / 2 > end_time)
-    {
+    double start = time - cycle_time_ / 2, end = time + cycle_time_ / 2;
+    if (!scans_.Slice(start, end, out, &rings_))
         return false;
-    }
-    auto start_iter = pc.begin() + size * (time - start_time - cycle_time_ / 2) / (end_time - start_time);
-    auto end_iter = pc.begin() + size * (time - start_time + cycle_time_ / 2) / (end_time - start_time);
-    Point3Cloud out3;
-    out3.clear();
-    out3.insert(out3.begin(), start_iter, end_iter);
-    pcl::copyPointCloud(out3, out);
-    raw_point_clouds_.erase(raw_point_clouds_.begin(), iter);
+    scans_.DropBefore(start);
     return true;
 }
 
-void FeatureAssociation::UndistortPoint(PointI &point, Frame::Ptr frame)
+const int num_deskew_steps = 32;
+
+inline SE3d interpolate_pose(const SE3d &a, const SE3d &b, double s)
 {
-    double time_delta = (point.intensity - int(point.intensity));
-    double time = frame->time - cycle_time_ * 0.5 + time_delta;
-    SE3d pose = Map::Instance().ComputePose(time);
-    auto p1 = Lidar::Get()->Sensor2World(Vector3d(point.x, point.y, point.z), pose);
-    auto p2 = Lidar::Get()->World2Sensor(p1, frame->pose);
-    point.x = p2.x();
-    point.y = p2.y();
-    point.z = p2.z();
+    Quaterniond q = a.unit_quaternion().slerp(s, b.unit_quaternion());
+    return SE3d(q, (1 - s) * a.translation() + s * b.translation());
 }
 
-inline void FeatureAssociation::UndistortPointCloud(PointICloud &points, Frame::Ptr frame)
+void FeatureAssociation::BuildDeskewTable(Frame::Ptr frame)
 {
-    for (auto &p : points)
+    // the keyframes around frame, looked up once instead of once per point
+    Frame::Ptr prev, next;
     {
-        UndistortPoint(p, frame);
+        auto keyframes = Map::Instance().GetSnapshot();
+        auto iter = keyframes->lower_bound(frame->time);
+        if (iter != keyframes->begin())
+        {
+            prev = std::prev(iter)->second;
+        }
+        iter = keyframes->upper_bound(frame->time);
+        if (iter != keyframes->end())
+        {
+            next = iter->second;
+        }
+    }
+
+    // beyond the keyframes, extrapolate with the velocity from imu, or from the last keyframe
+    Vector3d w = Vector3d::Zero(), v = Vector3d::Zero();
+    if (Imu::Num() && Imu::Get()->initialized && frame->preintegration_last && frame->preintegration_last->sum_dt > 0)
+    {
+        w = SO3d(frame->preintegration_last->delta_q.normalized()).log() / frame->preintegration_last->sum_dt;
+        v = frame->Vw;
+    }
+    else if (prev && frame->time - prev->time > epsilon)
+    {
+        double dt = frame->time - prev->time;
+        w = (prev->pose.so3().inverse() * frame->pose.so3()).log() / dt;
+        v = (frame->t() - prev->t()) / dt;
+    }
+
+    const SE3d &extrinsic = Lidar::Get()->extrinsic;
+    SE3d Tlw = (frame->pose * extrinsic).inverse();
+    double start = frame->time - cycle_time_ / 2;
+    deskew_step_ = cycle_time_ / num_deskew_steps;
+    deskew_table_.resize(num_deskew_steps + 1);
+    for (int k = 0; k <= num_deskew_steps; k++)
+    {
+        double time = start + k * deskew_step_, dt = time - frame->time;
+        Frame::Ptr other = dt < 0 ? prev : next;
+        SE3d pose;
+        if (other)
+        {
+            pose = interpolate_pose(frame->pose, other->pose, dt / (other->time - frame->time));
+        }
+        else
+        {
+            pose = SE3d(frame->pose.so3() * SO3d::exp(w * dt), frame->t() + v * dt);
+        }
+        deskew_table_[k] = (Tlw * pose * extrinsic).cast<float>().matrix3x4();
+    }
+}
+
+void FeatureAssociation::Deskew(PointICloud &points)
+{
+    const float max_index = num_deskew_steps - 1e-3f;
+    const float inv_step = 1 / deskew_step_;
+    for (auto &point : points)
+    {
+        // the fractional part of intensity is the time since the start of the scan
+        float index = std::min(std::max((point.intensity - (int)point.intensity) * inv_step, 0.f), max_index);
+        int k = (int)index;
+        float s = index - k;
+        Eigen::Matrix<float, 3, 4> T = (1 - s) * deskew_table_[k] + s * deskew_table_[k + 1];
+        point.getVector3fMap() = T.leftCols<3>() * point.getVector3fMap() + T.col(3);
     }
 }
 
 void FeatureAssociation::Process(PointICloud &points, Frame::Ptr frame)
 {
+    static Histogram &histogram = Metrics::Instance().GetHistogram("lidar_process");
+    ScopedTimer timer(histogram);
     Preprocess(points);
 
     PointICloud points_segmented;
-    auto segmented_info = projection_->Process(points, points_segmented);
+    auto segmented_info = projection_->Process(points, rings_, points_segmented);
 
     Extract(points_segmented, segmented_info, frame);
 }
 
 void FeatureAssociation::Preprocess(PointICloud &points)
 {
-    std::vector<int> indices;
-    pcl::removeNaNFromPointCloud(points, points, indices);
-    filter_points_by_distance(points, points, min_range_, max_range_);
+    // nan points fail the comparisons, rings are filtered with their points
+    bool has_rings = rings_.size() == points.size();
+    float min_range2 = min_range_ * min_range_, max_range2 = max_range_ * max_range_;
+    int j = 0;
+    for (int i = 0; i < points.size(); ++i)
+    {
+        const PointI &point = points[i];
+        float d = point.x * point.x + point.y * point.y + point.z * point.z;
+        if (d > min_range2 && d < max_range2)
+        {
+            points[j] = point;
+            if (has_rings)
+            {
+                rings_[j] = rings_[i];
+            }
+            j++;
+        }
+    }
+    points.resize(j);
+    rings_.resize(has_rings ? j : 0);
 }
 
 void FeatureAssociation::Extract(PointICloud &points_segmented, SegmentedInfo &segemented_info, Frame::Ptr frame)
 {
     AdjustDistortion(points_segmented, segemented_info);
 
+    if (deskew_)
+    {
+        BuildDeskewTable(frame);
+        Deskew(points_segmented);
+    }
+
     CalculateSmoothness(points_segmented, segemented_info);
 
     ExtractFeatures(points_segmented, segemented_info, frame);
@@ -119,7 +258,7 @@ void FeatureAssociation::AdjustDistortion(PointICloud &points_segmented, Segment
         point.y = points_segmented[i].y;
         point.z = points_segmented[i].z;
 
-        float ori = -atan2(point.y, point.x);
+        float ori = -fast_atan2(point.y, point.x);
         if (!half_passed)
         {
             if (ori < segemented_info.start_orientation - M_PI / 2)
@@ -146,37 +285,138 @@ void FeatureAssociation::AdjustDistortion(PointICloud &points_segmented, Segment
     }
 }
 
+// r_k = range[i - 5 + k] - range[i - 5] - k * dr, k = 9...1, same order as the per-point formula
+inline void curvatures_scalar(const float *__restrict range, int begin, int size, float *__restrict curvatures)
+{
+    for (int i = begin; i < size - 5; i++)
+    {
+        float base = range[i - 5];
+        float dr = (range[i + 5] - base) / 10;
+        float cov = 0;
+        for (int k = 9; k >= 1; k--)
+        {
+            float r = range[i - 5 + k] - base - k * dr;
+            cov += r * r;
+        }
+        curvatures[i] = cov / 9 * 10 / range[i];
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 8 points at a time, without fma so that results equal the scalar path
+__attribute__((target("avx2"))) void curvatures_avx2(const float *range, int size, float *curvatures)
+{
+    const __m256 nine = _mm256_set1_ps(9), ten = _mm256_set1_ps(10);
+    int i = 5;
+    for (; i + 8 <= size - 5; i += 8)
+    {
+        __m256 base = _mm256_loadu_ps(range + i - 5);
+        __m256 dr = _mm256_div_ps(_mm256_sub_ps(_mm256_loadu_ps(range + i + 5), base), ten);
+        __m256 cov = _mm256_setzero_ps();
+        for (int k = 9; k >= 1; k--)
+        {
+            __m256 r = _mm256_sub_ps(_mm256_sub_ps(_mm256_loadu_ps(range + i - 5 + k), base), _mm256_mul_ps(_mm256_set1_ps(k), dr));
+            cov = _mm256_add_ps(cov, _mm256_mul_ps(r, r));
+        }
+        cov = _mm256_mul_ps(_mm256_div_ps(cov, nine), ten);
+        _mm256_storeu_ps(curvatures + i, _mm256_div_ps(cov, _mm256_loadu_ps(range + i)));
+    }
+    curvatures_scalar(range, i, size, curvatures);
+}
+#endif
+
+void lidar::compute_curvatures(const std::vector<float> &ranges, int size, Eigen::ArrayXf &curvatures)
+{
+    if (curvatures.size() < size)
+    {
+        curvatures.resize(size);
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+    if (avx2)
+    {
+        curvatures_avx2(ranges.data(), size, curvatures.data());
+        return;
+    }
+#endif
+    curvatures_scalar(ranges.data(), 5, size, curvatures.data());
+}
+
+inline long long voxel_key(int x, int y, int z)
+{
+    return ((long long)(x & 0x1FFFFF) << 42) | ((long long)(y & 0x1FFFFF) << 21) | (long long)(z & 0x1FFFFF);
+}
+
+void lidar::voxel_filter(const PointICloud &in, float leaf_size, float radius, int min_neighbors, const Sophus::SE3f &tf, PointICloud &out)
+{
+    struct Voxel
+    {
+        int x, y, z;
+        Vector3f sum;
+        float intensity;
+        int num;
+    };
+    std::vector<Voxel> voxels;
+    std::unordered_map<long long, int> index;
+    index.reserve(in.size());
+    float inverse = 1 / leaf_size;
+    for (auto &point : in)
+    {
+        if (!std::isfinite(point.x) || !std::isfinite(point.y) || !std::isfinite(point.z))
+            continue;
+        int x = std::floor(point.x * inverse), y = std::floor(point.y * inverse), z = std::floor(point.z * inverse);
+        auto pair = index.emplace(voxel_key(x, y, z), voxels.size());
+        if (pair.second)
+        {
+            voxels.push_back({x, y, z, Vector3f::Zero(), 0, 0});
+        }
+        Voxel &voxel = voxels[pair.first->second];
+        voxel.sum += point.getVector3fMap();
+        voxel.intensity += point.intensity;
+        voxel.num++;
+    }
+    for (auto &voxel : voxels)
+    {
+        voxel.sum /= voxel.num;
+        voxel.intensity /= voxel.num;
+    }
+
+    // the neighbours of a centroid are in the voxels within radius, stop counting at min_neighbors
+    int range = radius > 0 ? std::ceil(radius * inverse) : 0;
+    float radius2 = radius * radius;
+    const float *data = tf.data();
+    out.reserve(out.size() + voxels.size());
+    for (int i = 0; i < voxels.size(); i++)
+    {
+        const Voxel &voxel = voxels[i];
+        int num_neighbors = 0;
+        for (int dx = -range; dx <= range && num_neighbors < min_neighbors; dx++)
+        {
+            for (int dy = -range; dy <= range && num_neighbors < min_neighbors; dy++)
+            {
+                for (int dz = -range; dz <= range && num_neighbors < min_neighbors; dz++)
+                {
+                    auto iter = index.find(voxel_key(voxel.x + dx, voxel.y + dy, voxel.z + dz));
+                    if (iter != index.end() && iter->second != i &&
+                        (voxels[iter->second].sum - voxel.sum).squaredNorm() <= radius2)
+                    {
+                        num_neighbors++;
+                    }
+                }
+            }
+        }
+        if (radius > 0 && num_neighbors < min_neighbors)
+            continue;
+        PointI point;
+        ceres::SE3TransformPoint(data, voxel.sum.data(), point.data);
+        point.intensity = voxel.intensity;
+        out.push_back(point);
+    }
+}
+
 void FeatureAssociation::CalculateSmoothness(PointICloud &points_segmented, SegmentedInfo &segemented_info)
 {
-    int size = points_segmented.size();
-    for (int i = 5; i < size - 5; i++)
-    {
-        float dr = (segemented_info.range[i + 5] - segemented_info.range[i - 5]) / 10;
-        float r1 = segemented_info.range[i + 4] - segemented_info.range[i - 5] - 9 * dr;
-        float r2 = segemented_info.range[i + 3] - segemented_info.range[i - 5] - 8 * dr;
-        float r3 = segemented_info.range[i + 2] - segemented_info.range[i - 5] - 7 * dr;
-        float r4 = segemented_info.range[i + 1] - segemented_info.range[i - 5] - 6 * dr;
-        float r5 = segemented_info.range[i] - segemented_info.range[i - 5] - 5 * dr;
-        float r6 = segemented_info.range[i - 1] - segemented_info.range[i - 5] - 4 * dr;
-        float r7 = segemented_info.range[i - 2] - segemented_info.range[i - 5] - 3 * dr;
-        float r8 = segemented_info.range[i - 3] - segemented_info.range[i - 5] - 2 * dr;
-        float r9 = segemented_info.range[i - 4] - segemented_info.range[i - 5] - 1 * dr;
-        float cov = (r1 * r1 + r2 * r2 + r3 * r3 + r4 * r4 + r5 * r5 + r6 * r6 + r7 * r7 + r8 * r8 + r9 * r9) / 9;
-        curvatures[i] = cov * 10 / segemented_info.range[i];
-    }
-
-    // int cloudSize = points_segmented.size();
-    //     for (int i = 5; i < cloudSize - 5; i++) {
-
-    //         float diffRange = segemented_info.range[i-5] + segemented_info.range[i-4]
-    //                         + segemented_info.range[i-3] + segemented_info.range[i-2]
-    //                         + segemented_info.range[i-1] - segemented_info.range[i] * 10
-    //                         + segemented_info.range[i+1] + segemented_info.range[i+2]
-    //                         + segemented_info.range[i+3] + segemented_info.range[i+4]
-    //                         + segemented_info.range[i+5];            
-
-    //         curvatures[i] = diffRange*diffRange;
-    //     }
+    lidar::compute_curvatures(segemented_info.range, points_segmented.size(), curvatures_);
 }
 
 void FeatureAssociation::ExtractFeatures(PointICloud &points_segmented, SegmentedInfo &segemented_info, Frame::Ptr frame)
@@ -199,7 +439,7 @@ void FeatureAssociation::ExtractFeatures(PointICloud &points_segmented, Segmente
                 {
                     points_ground.push_back(points_segmented[k]);
                 }
-                else if (curvatures[k] < threshold)
+                else if (curvatures_[k] < threshold)
                 {
                     points_surf.push_back(points_segmented[k]);
                 }
@@ -207,178 +447,227 @@ void FeatureAssociation::ExtractFeatures(PointICloud &points_segmented, Segmente
         }
     }
 
-    PointICloud::Ptr temp(new PointICloud());
-    pcl::VoxelGrid<PointI> voxel_filter;
-    voxel_filter.setLeafSize(2 * Lidar::Get()->resolution, 2 * Lidar::Get()->resolution, 2 * Lidar::Get()->resolution);
-    pcl::copyPointCloud(points_surf, *temp);
-    voxel_filter.setInputCloud(temp);
-    voxel_filter.filter(points_surf);
+    // downsample, remove the outliers of surf points, and move them into the robot frame in one pass
+    static Histogram &histogram = Metrics::Instance().GetHistogram("lidar_filter");
+    lidar::Feature::Ptr feature = lidar::Feature::Create();
+    {
+        ScopedTimer timer(histogram);
+        Sophus::SE3f extrinsic = Lidar::Get()->extrinsic.cast<float>();
+        float leaf_size = 2 * Lidar::Get()->resolution;
+        lidar::voxel_filter(points_surf, leaf_size, 4 * Lidar::Get()->resolution, 4, extrinsic, feature->points_surf);
+        lidar::voxel_filter(points_ground, leaf_size, 0, 0, extrinsic, feature->points_ground);
+    }
+    SegmentGround(feature->points_ground);
+    lidar::make_scan_context(*feature);
+    frame->feature_lidar = feature;
+    Map::Instance().InsertLidarKeyFrame(frame);
+}
 
-    pcl::RadiusOutlierRemoval<PointI> ror_filter;
-    ror_filter.setRadiusSearch(4 * Lidar::Get()->resolution);
-    ror_filter.setMinNeighborsInRadius(4);
-    pcl::copyPointCloud(points_surf, *temp);
-    ror_filter.setInputCloud(temp);
-    ror_filter.filter(points_surf);
+// plane of points by pca, return false if the points do not span a plane
+inline bool fit_plane(const PointICloud &points, const std::vector<int> &indices, Vector3f &normal, Vector3f &center, float &thickness)
+{
+    if (indices.size() < 5)
+        return false;
+    center.setZero();
+    for (int i : indices)
+    {
+        center += points[i].getVector3fMap();
+    }
+    center /= indices.size();
+    Matrix3f covariance = Matrix3f::Zero();
+    for (int i : indices)
+    {
+        Vector3f d = points[i].getVector3fMap() - center;
+        covariance += d * d.transpose();
+    }
+    covariance /= indices.size();
+    SelfAdjointEigenSolver<Matrix3f> solver(covariance);
+    // the points on a line, like a single scan ring, have no normal
+    if (solver.eigenvalues()[1] < 0.01 * solver.eigenvalues()[2])
+        return false;
+    normal = solver.eigenvectors().col(0);
+    normal = normal.z() < 0 ? -normal : normal;
+    thickness = std::sqrt(std::max(0.f, solver.eigenvalues()[0]));
+    return true;
+}
 
-    pcl::copyPointCloud(points_ground, *temp);
-    voxel_filter.setInputCloud(temp);
-    voxel_filter.filter(points_ground);
+// fit planes in the cells of a grid on the xy plane, instead of one plane by ransac,
+// it is deterministic, costs O(points), and follows slopes of the ground.
+// cells which are not flat or too small are tested against the dominant plane.
+void FeatureAssociation::SegmentGround(PointICloud &points_ground)
+{
+    static Histogram &histogram = Metrics::Instance().GetHistogram("lidar_segment_ground");
+    ScopedTimer timer(histogram);
+    if (points_ground.empty())
+        return;
+    const float cell_size = 10 * Lidar::Get()->resolution;
+    const float max_distance = 0.1 * Lidar::Get()->resolution;
+    const float min_cos = std::cos(10 * M_PI / 180);
+
+    std::unordered_map<long long, std::vector<int>> cells;
+    for (int i = 0; i < points_ground.size(); i++)
+    {
+        const PointI &point = points_ground[i];
+        // shift the bits of x as unsigned, a negative signed value can not be shifted
+        long long key = (long long)(((unsigned long long)(unsigned int)(int)std::floor(point.x / cell_size) << 32) | (unsigned int)(int)std::floor(point.y / cell_size));
+        cells[key].push_back(i);
+    }
 
-    SegmentGround(points_ground);
+    struct Cell
+    {
+        const std::vector<int> *indices;
+        Vector3f normal, center;
+        float thickness;
+        bool flat;
+    };
+    std::vector<Cell> planes;
+    planes.reserve(cells.size());
+    Vector3f dominant_normal = Vector3f::Zero(), dominant_center = Vector3f::Zero();
+    int num_flat = 0;
+    for (auto &pair : cells)
+    {
+        Cell cell;
+        cell.indices = &pair.second;
+        cell.flat = fit_plane(points_ground, pair.second, cell.normal, cell.center, cell.thickness) && cell.thickness < 2 * max_distance;
+        if (cell.flat)
+        {
+            dominant_normal += pair.second.size() * cell.normal;
+            dominant_center += pair.second.size() * cell.center;
+            num_flat += pair.second.size();
+        }
+        planes.push_back(cell);
+    }
+    if (num_flat == 0)
+    {
+        // no flat cell, fit all points at once
+        std::vector<int> all(points_ground.size());
+        std::iota(all.begin(), all.end(), 0);
+        float thickness;
+        if (!fit_plane(points_ground, all, dominant_normal, dominant_center, thickness))
+            return;
+    }
+    else
+    {
+        dominant_normal.normalize();
+        dominant_center /= num_flat;
+    }
 
-    lidar::Feature::Ptr feature = lidar::Feature::Create();
-    Sensor2Robot(points_ground, feature->points_ground);
-    Sensor2Robot(points_surf, feature->points_surf);
-    frame->feature_lidar = feature;
+    std::vector<bool> inliers(points_ground.size(), false);
+    for (auto &cell : planes)
+    {
+        // tilted cells are not ground, like the roofs of cars
+        bool local = cell.flat && cell.normal.dot(dominant_normal) > min_cos;
+        if (cell.flat && !local)
+            continue;
+        const Vector3f &normal = local ? cell.normal : dominant_normal;
+        const Vector3f &center = local ? cell.center : dominant_center;
+        for (int i : *cell.indices)
+        {
+            inliers[i] = std::fabs(normal.dot(points_ground[i].getVector3fMap() - center)) < max_distance;
+        }
+    }
+    PointICloud result;
+    result.reserve(points_ground.size());
+    for (int i = 0; i < points_ground.size(); i++)
+    {
+        if (inliers[i])
+        {
+            result.push_back(points_ground[i]);
+        }
+    }
+    points_ground.swap(result);
 }
 
-inline void FeatureAssociation::Sensor2Robot(PointICloud &in, PointICloud &out)
+const double min_plane_area = 5e-4; // m^2, triangles of the 3 nearest points smaller than it are not a plane
+
+// match points to the planes of their 3 nearest points in the map, all planes are fitted at once
+ceres::CostFunction *create_planes_error(const PointICloud &points, Frame::Ptr frame, Frame::Ptr map_frame, lidar::VoxelMap &map, double start, double end,
+                                         double *para, std::array<int, 3> indices, double weight, double delta)
 {
-    Sophus::SE3f tf_se3 = Lidar::Get()->extrinsic.cast<float>();
+    //NOTE: Sophus is too slow
+    PointICloud points_world;
+    points_world.resize(points.size());
+    Sophus::SE3f tf_se3 = frame->pose.cast<float>();
     float *tf = tf_se3.data();
-    for (auto &point_in : in)
+    for (int i = 0; i < points.size(); ++i)
     {
-        PointI point_out;
-        ceres::SE3TransformPoint(tf, point_in.data, point_out.data);
-        point_out.intensity = point_in.intensity;
-        out.push_back(point_out);
+        ceres::SE3TransformPoint(tf, points[i].data, points_world[i].data);
+        points_world[i].intensity = points[i].intensity;
     }
-}
+    std::vector<int> nums;
+    std::vector<PointI> points_nearest;
+    map.Search(points_world, 3, nums, points_nearest, start, end);
 
-inline void FeatureAssociation::SegmentGround(PointICloud &points_ground)
-{
-    PointICloud::Ptr pointcloud_seg(new PointICloud());
-    pcl::copyPointCloud(points_ground, *pointcloud_seg);
-    pcl::ModelCoefficients coefficients;
-    pcl::PointIndices::Ptr inliers(new pcl::PointIndices);
-    pcl::SACSegmentation<PointI> seg;
-    seg.setOptimizeCoefficients(true);
-    seg.setModelType(pcl::SACMODEL_PLANE);
-    seg.setMethodType(pcl::SAC_RANSAC);
-    seg.setMaxIterations(100);
-    seg.setDistanceThreshold(0.1 * Lidar::Get()->resolution);
-    seg.setInputCloud(pointcloud_seg);
-    seg.segment(*inliers, coefficients);
-    pcl::ExtractIndices<PointI> extract;
-    extract.setInputCloud(pointcloud_seg);
-    extract.setIndices(inliers);
-    extract.setNegative(false);
-    extract.filter(points_ground);
+    int n = std::count(nums.begin(), nums.end(), 3);
+    Matrix3Xd curr_points(3, n), points_a(3, n), points_b(3, n), points_c(3, n);
+    for (int i = 0, j = 0; i < points.size(); ++i)
+    {
+        if (nums[i] != 3)
+            continue;
+        curr_points.col(j) << points[i].x, points[i].y, points[i].z;
+        points_a.col(j) = points_nearest[i * 3].getVector3fMap().cast<double>();
+        points_b.col(j) = points_nearest[i * 3 + 1].getVector3fMap().cast<double>();
+        points_c.col(j) = points_nearest[i * 3 + 2].getVector3fMap().cast<double>();
+        j++;
+    }
+    Matrix3Xd u = points_a - points_b, v = points_a - points_c, normals(3, n);
+    normals.row(0) = u.row(1).cwiseProduct(v.row(2)) - u.row(2).cwiseProduct(v.row(1));
+    normals.row(1) = u.row(2).cwiseProduct(v.row(0)) - u.row(0).cwiseProduct(v.row(2));
+    normals.row(2) = u.row(0).cwiseProduct(v.row(1)) - u.row(1).cwiseProduct(v.row(0));
+
+    // collinear points are not a plane, the norm of the cross product is twice the area
+    VectorXd norms = normals.colwise().norm().transpose();
+    int m = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (0.5 * norms[i] < min_plane_area)
+            continue;
+        curr_points.col(m) = curr_points.col(i);
+        points_a.col(m) = points_a.col(i);
+        normals.col(m) = normals.col(i) / norms[i];
+        m++;
+    }
+    if (m == 0)
+        return nullptr;
+    return LidarPlanesError::Create(curr_points.leftCols(m), points_a.leftCols(m), normals.leftCols(m), map_frame->pose, para, indices, weight, delta);
 }
 
-void FeatureAssociation::ScanToMapWithGround(Frame::Ptr frame, Frame::Ptr map_frame, double *para, adapt::Problem &problem, bool relocate)
+void FeatureAssociation::ScanToMapWithGround(Frame::Ptr frame, Frame::Ptr map_frame, lidar::VoxelMap &map_ground, double start, double end, double *para, adapt::Problem &problem, bool relocate)
 {
-    ceres::LossFunction *loss_function = new ceres::TrivialLoss();
-    PointICloud &points_ground_last = map_frame->feature_lidar->points_ground;
     problem.AddParameterBlock(para + 1, 1);
     problem.AddParameterBlock(para + 2, 1);
     problem.AddParameterBlock(para + 5, 1);
 
-    pcl::KdTreeFLANN<PointI> kdtree_last;
-    kdtree_last.setInputCloud(boost::make_shared<PointICloud>(points_ground_last));
-
-    PointI point;
-    std::vector<int> points_index;
-    std::vector<float> points_distance;
-
-    static const double distance_threshold = Lidar::Get()->resolution * Lidar::Get()->resolution * 100; // squared
-    int num_points_flat = frame->feature_lidar->points_ground.size();
-    Sophus::SE3f tf_se3 = frame->pose.cast<float>();
-    float *tf = tf_se3.data();
-
     // find correspondence for ground features
-    for (int i = 0; i < num_points_flat; ++i)
-    {
-        //NOTE: Sophus is too slow
-        ceres::SE3TransformPoint(tf, frame->feature_lidar->points_ground[i].data, point.data);
-        point.intensity = frame->feature_lidar->points_ground[i].intensity;
-        kdtree_last.nearestKSearch(point, 3, points_index, points_distance);
-        // clang-format off
-        if (points_index[0] < points_ground_last.size() && points_distance[0] < distance_threshold 
-         && points_index[1] < points_ground_last.size() && points_distance[1] < distance_threshold 
-         && points_index[2] < points_ground_last.size() && points_distance[2] < distance_threshold)
-        // clang-format on
-        {
-            Vector3d curr_point(frame->feature_lidar->points_ground[i].x,
-                                frame->feature_lidar->points_ground[i].y,
-                                frame->feature_lidar->points_ground[i].z);
-            Vector3d last_point_a(points_ground_last[points_index[0]].x,
-                                  points_ground_last[points_index[0]].y,
-                                  points_ground_last[points_index[0]].z);
-            Vector3d last_point_b(points_ground_last[points_index[1]].x,
-                                  points_ground_last[points_index[1]].y,
-                                  points_ground_last[points_index[1]].z);
-            Vector3d last_point_c(points_ground_last[points_index[2]].x,
-                                  points_ground_last[points_index[2]].y,
-                                  points_ground_last[points_index[2]].z);
-            ceres::CostFunction *cost_function;
-            cost_function = LidarPlaneErrorRPZ::Create(curr_point, last_point_a, last_point_b, last_point_c, map_frame->pose, para, frame->weights.lidar_ground);
-            problem.AddResidualBlock(ProblemType::LidarError, cost_function, loss_function, para + 1, para + 2, para + 5);
-        }
+    ceres::CostFunction *cost_function = create_planes_error(frame->feature_lidar->points_ground, frame, map_frame, map_ground, start, end, para, {1, 2, 5}, frame->weights.lidar_ground, 0);
+    if (cost_function)
+    {
+        problem.AddResidualBlock(ProblemType::LidarError, cost_function, NULL, para + 1, para + 2, para + 5);
     }
 
     if (!relocate)
     {
-        ceres::CostFunction *cost_function = PoseErrorRPZ::Create(para, frame->features_left.size() * frame->weights.visual);
+        cost_function = PoseErrorRPZ::Create(para, frame->features_left.size() * frame->weights.visual);
         problem.AddResidualBlock(ProblemType::Other, cost_function, NULL, para + 1, para + 2, para + 5);
     }
 }
 
-void FeatureAssociation::ScanToMapWithSegmented(Frame::Ptr frame, Frame::Ptr map_frame, double *para, adapt::Problem &problem, bool relocate)
+void FeatureAssociation::ScanToMapWithSegmented(Frame::Ptr frame, Frame::Ptr map_frame, lidar::VoxelMap &map_surf, double start, double end, double *para, adapt::Problem &problem, bool relocate)
 {
-    ceres::LossFunction *loss_function = new ceres::HuberLoss(0.1);
-    PointICloud &points_surf_last = map_frame->feature_lidar->points_surf;
     problem.AddParameterBlock(para + 0, 1);
     problem.AddParameterBlock(para + 3, 1);
     problem.AddParameterBlock(para + 4, 1);
 
-    pcl::KdTreeFLANN<PointI> kdtree_last;
-    kdtree_last.setInputCloud(boost::make_shared<PointICloud>(points_surf_last));
-
-    PointI point;
-    std::vector<int> points_index;
-    std::vector<float> points_distance;
-
-    static const double distance_threshold = Lidar::Get()->resolution * Lidar::Get()->resolution * 25; // squared
-    int num_points_flat = frame->feature_lidar->points_surf.size();
-    Sophus::SE3f tf_se3 = frame->pose.cast<float>();
-    float *tf = tf_se3.data();
-
     // find correspondence for plane features
-    for (int i = 0; i < num_points_flat; ++i)
-    {
-        //NOTE: Sophus is too slow
-        ceres::SE3TransformPoint(tf, frame->feature_lidar->points_surf[i].data, point.data);
-        point.intensity = frame->feature_lidar->points_surf[i].intensity;
-        kdtree_last.nearestKSearch(point, 3, points_index, points_distance);
-        // clang-format off
-        if (points_index[0] < points_surf_last.size() && points_distance[0] < distance_threshold 
-         && points_index[1] < points_surf_last.size() && points_distance[1] < distance_threshold 
-         && points_index[2] < points_surf_last.size() && points_distance[2] < distance_threshold)
-        // clang-format on
-        {
-            Vector3d curr_point(frame->feature_lidar->points_surf[i].x,
-                                frame->feature_lidar->points_surf[i].y,
-                                frame->feature_lidar->points_surf[i].z);
-            Vector3d last_point_a(points_surf_last[points_index[0]].x,
-                                  points_surf_last[points_index[0]].y,
-                                  points_surf_last[points_index[0]].z);
-            Vector3d last_point_b(points_surf_last[points_index[1]].x,
-                                  points_surf_last[points_index[1]].y,
-                                  points_surf_last[points_index[1]].z);
-            Vector3d last_point_c(points_surf_last[points_index[2]].x,
-                                  points_surf_last[points_index[2]].y,
-                                  points_surf_last[points_index[2]].z);
-            ceres::CostFunction *cost_function;
-            cost_function = LidarPlaneErrorYXY::Create(curr_point, last_point_a, last_point_b, last_point_c, map_frame->pose, para, frame->weights.lidar_surf);
-            problem.AddResidualBlock(ProblemType::LidarError, cost_function, loss_function, para, para + 3, para + 4);
-        }
+    ceres::CostFunction *cost_function = create_planes_error(frame->feature_lidar->points_surf, frame, map_frame, map_surf, start, end, para, {0, 3, 4}, frame->weights.lidar_surf, 0.1);
+    if (cost_function)
+    {
+        problem.AddResidualBlock(ProblemType::LidarError, cost_function, NULL, para, para + 3, para + 4);
     }
 
     if (!relocate)
     {
-        ceres::CostFunction *cost_function = PoseErrorYXY::Create(para, frame->features_left.size() * frame->weights.visual);
+        cost_function = PoseErrorYXY::Create(para, frame->features_left.size() * frame->weights.visual);
         problem.AddResidualBlock(ProblemType::Other, cost_function, NULL, para, para + 3, para + 4);
     }
 }
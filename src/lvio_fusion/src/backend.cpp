@@ -1,23 +1,40 @@
 #include "lvio_fusion/backend.h"
 #include "lvio_fusion/ceres/imu_error.hpp"
+#include "lvio_fusion/ceres/marginalization_error.hpp"
 #include "lvio_fusion/ceres/pose_error.hpp"
 #include "lvio_fusion/ceres/visual_error.hpp"
+#include "lvio_fusion/frame_store.h"
 #include "lvio_fusion/frontend.h"
 #include "lvio_fusion/imu/tools.h"
 #include "lvio_fusion/manager.h"
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/scheduler.h"
 #include "lvio_fusion/utility.h"
+#include "lvio_fusion/visual/covisibility.h"
 #include "lvio_fusion/visual/feature.h"
 #include "lvio_fusion/visual/landmark.h"
 
 namespace lvio_fusion
 {
 
-Backend::Backend(double window_size, bool update_weights)
-    : window_size_(window_size), update_weights_(update_weights)
+const double quick_fix_period = 2; // s
+
+Backend::Backend(double window_size, bool update_weights, bool parallel_build, bool marginalize, double latency, int min_covisible, int suite)
+    : window_size_(window_size), min_covisible_(min_covisible), update_weights_(update_weights), parallel_build_(parallel_build), marginalize_(marginalize), latency_(latency), suite_(suite)
 {
+    loss_function_.reset(new ceres::HuberLoss(1.0));
+    local_parameterization_.reset(new ceres::ProductParameterization(
+        new ceres::EigenQuaternionParameterization(),
+        new ceres::IdentityParameterization(3)));
+    problem_.reset(new adapt::Problem(ProblemOptions()));
     thread_ = std::thread(std::bind(&Backend::BackendLoop, this));
-    thread_global_ = std::thread(std::bind(&Backend::GlobalLoop, this));
+    // without navsat and loop closure, the global loop has nothing to do
+    if (suite_ & (WithNavsat | WithLoop))
+    {
+        global_events_ = EventBus::Instance().Subscribe({Event::KeyFrameFinished, Event::SectionClosed, Event::NavsatFixed});
+        thread_global_ = std::thread(std::bind(&Backend::GlobalLoop, this));
+    }
 }
 
 void Backend::UpdateMap()
@@ -27,6 +44,8 @@ void Backend::UpdateMap()
 
 void Backend::BackendLoop()
 {
+    Scheduler::Instance().Pin(Task::Backend);
+    static Histogram &histogram = Metrics::Instance().GetHistogram("backend");
     while (true)
     {
         std::unique_lock<std::mutex> lock(mutex);
@@ -36,22 +55,45 @@ void Backend::BackendLoop()
         auto t2 = std::chrono::steady_clock::now();
         auto time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
         LOG(INFO) << "Backend cost time: " << time_used.count() << " seconds.";
+        histogram.Record(time_used.count());
     }
 }
 
 void Backend::GlobalLoop()
 {
+    Scheduler::Instance().Pin(Task::Navsat);
     double start = 0;
+    bool fixed = false, more = false;
+    auto last_quick_fix = std::chrono::steady_clock::now();
     while (true)
     {
-        std::this_thread::sleep_for(std::chrono::seconds(2));
+        // quick fixes are expensive, fixes coming faster are merged
+        double wait = 0;
+        if (fixed)
+        {
+            auto since = std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::steady_clock::now() - last_quick_fix);
+            wait = std::max(epsilon, quick_fix_period - since.count());
+        }
+        // wait for new inputs, unless there are sections left
+        if (!more)
+        {
+            global_events_->Wait(wait);
+        }
+        global_events_->Take(Event::KeyFrameFinished);
+        global_events_->Take(Event::SectionClosed);
+        fixed = global_events_->Take(Event::NavsatFixed) || fixed;
+        if (localization_)
+            continue;
+        // sections of the prior map are optimized already
+        start = std::max(start, Map::Instance().prior);
         if (Map::Instance().end && !PoseGraph::Instance().turning)
         {
-            global_end_ = (--Map::Instance().keyframes.end())->first;
+            global_end_ = Map::Instance().GetSnapshot()->rbegin()->first;
             PoseGraph::Instance().AddSection(global_end_);
             Map::Instance().end = false;
         }
         auto sections = PoseGraph::Instance().GetSections(start, global_end_);
+        more = sections.size() > 1;
         if (!sections.empty())
         {
             // new section has nothing to do with backend's window, so run at the sametime.
@@ -60,81 +102,335 @@ void Backend::GlobalLoop()
             SE3d old_pose = Map::Instance().GetKeyFrame(start)->pose;
             if (Navsat::Num() && Navsat::Get()->initialized)
             {
-                Navsat::Get()->Optimize(new_section);
+                double moved = Navsat::Get()->Optimize(new_section);
+                if (moved)
                 {
-                    // update backend and frontend
-                    std::unique_lock<std::mutex> lock(mutex);
-                    SE3d new_pose = Map::Instance().GetKeyFrame(start)->pose;
-                    SE3d transform = new_pose * old_pose.inverse();
-                    PoseGraph::Instance().ForwardUpdate(transform, start + epsilon);
+                    PoseGraph::Instance().Moved(moved);
+                    {
+                        // update backend and frontend
+                        std::unique_lock<std::mutex> lock(mutex);
+                        SE3d new_pose = Map::Instance().GetKeyFrame(start)->pose;
+                        SE3d transform = new_pose * old_pose.inverse();
+                        PoseGraph::Instance().ForwardUpdate(transform, start + epsilon);
+                    }
+                    // only the moved keyframes are transformed again
+                    mapping_->ToWorld(moved);
                 }
-                mapping_->ToWorld(new_section.A);
             }
         }
+        if (!fixed || std::chrono::steady_clock::now() - last_quick_fix < std::chrono::duration<double>(quick_fix_period))
+            continue;
+        fixed = false;
+        last_quick_fix = std::chrono::steady_clock::now();
         if (Navsat::Num() && Navsat::Get()->initialized && global_end_ > 0)
         {
             // quick fix
-            std::unique_lock<std::mutex> lock(mutex);
+            double moved;
             {
+                std::unique_lock<std::mutex> lock(mutex);
                 SE3d old_pose = Map::Instance().GetKeyFrame(global_end_)->pose;
-                Navsat::Get()->QuickFix(start, global_end_);
-                SE3d new_pose = Map::Instance().GetKeyFrame(global_end_)->pose;
-                SE3d transform = new_pose * old_pose.inverse();
-                PoseGraph::Instance().ForwardUpdate(transform, global_end_ + epsilon);
+                moved = Navsat::Get()->QuickFix(start, global_end_);
+                if (moved)
+                {
+                    PoseGraph::Instance().Moved(moved);
+                    SE3d new_pose = Map::Instance().GetKeyFrame(global_end_)->pose;
+                    SE3d transform = new_pose * old_pose.inverse();
+                    PoseGraph::Instance().ForwardUpdate(transform, global_end_ + epsilon);
+                }
+            }
+            if (moved)
+            {
+                mapping_->ToWorld(moved);
             }
-            mapping_->ToWorld(start);
         }
     }
 }
 
-double Backend::BuildProblem(Frames &active_kfs, adapt::Problem &problem)
+// residual block waiting to be added into the problem
+struct VisualResidual
 {
-    ceres::LossFunction *loss_function = new ceres::HuberLoss(1.0);
-    ceres::LocalParameterization *local_parameterization = new ceres::ProductParameterization(
-        new ceres::EigenQuaternionParameterization(),
-        new ceres::IdentityParameterization(3));
+    ProblemType type;
+    ceres::CostFunction *cost_function;
+    double *para_inv_depth; // add as parameter block if not null
+    std::vector<double *> parameter_blocks;
+    visual::Feature::Ptr feature;
+    Frame::Ptr first_frame; // null if the block is rebuilt at every optimization
+};
+
+double build_visual_residuals(Frame::Ptr frame, double start_time, const std::map<double, double> &marginalized, const WindowFrame *kept, std::vector<VisualResidual> &residuals)
+{
+    double global_end = start_time;
+    double *para_kf = frame->pose.data();
+    residuals.reserve(frame->features_left.size());
+    for (auto &pair_feature : frame->features_left)
+    {
+        auto feature = pair_feature.second;
+        auto landmark = feature->landmark.lock();
+        // the block is still in the sliding problem
+        if (kept && kept->visual.find(landmark->id) != kept->visual.end())
+            continue;
+        auto first_frame = landmark->FirstFrame().lock();
+        auto type = Camera::Get()->Far(landmark->ToWorld(), frame->pose) ? ProblemType::WeakError : ProblemType::VisualError;
+        ceres::CostFunction *cost_function;
+        if (first_frame == frame)
+        {
+            double *para_inv_depth = &landmark->inv_depth;
+            cost_function = TwoCameraReprojectionError::Create(cv2eigen(feature->keypoint.pt), cv2eigen(landmark->first_observation->keypoint.pt), Camera::Get(0), Camera::Get(1), 5 * frame->weights.visual);
+            residuals.push_back({ProblemType::Other, cost_function, para_inv_depth, {para_inv_depth}, feature, frame});
+        }
+        else if (first_frame->time < start_time)
+        {
+            global_end = std::min(first_frame->last_keyframe ? first_frame->last_keyframe->time : 0, global_end);
+            // the observation is already in the prior
+            auto iter = marginalized.find(first_frame->time);
+            if (iter != marginalized.end() && frame->time <= iter->second)
+                continue;
+            cost_function = PoseOnlyReprojectionError::Create(cv2eigen(feature->keypoint.pt), landmark->ToWorld(), Camera::Get(), frame->weights.visual);
+            residuals.push_back({type, cost_function, nullptr, {para_kf}, feature, nullptr});
+        }
+        else
+        {
+            double *para_fist_kf = first_frame->pose.data();
+            double *para_inv_depth = &landmark->inv_depth;
+            // first ob is on right camera; current ob is on left camera;
+            cost_function = TwoFrameReprojectionError::Create(cv2eigen(landmark->first_observation->keypoint.pt), cv2eigen(feature->keypoint.pt), Camera::Get(0), Camera::Get(1), frame->weights.visual);
+            residuals.push_back({type, cost_function, para_inv_depth, {para_inv_depth, para_fist_kf, para_kf}, feature, first_frame});
+        }
+    }
+    return global_end;
+}
+
+// what the backend gives up at each level to meet the latency target
+struct Budget
+{
+    int max_iterations;
+    double window_scale;
+    bool weak;  // far landmarks
+    bool lidar; // scan to map
+};
+const Budget budgets[] = {{50, 1, true, true}, {10, 1, true, true}, {5, 0.75, false, true}, {3, 0.5, false, false}};
+const int max_level = sizeof(budgets) / sizeof(Budget) - 1;
+
+void Backend::UpdateLevel(double lag)
+{
+    if (latency_ <= 0)
+        return;
+    if (lag > latency_)
+    {
+        num_good_ = 0;
+        if (level_ < max_level)
+        {
+            level_++;
+            LOG(WARNING) << "Backend lags " << lag << " seconds, degrade to level " << level_;
+        }
+    }
+    else if (lag < latency_ / 2 && ++num_good_ >= 3 && level_ > 0)
+    {
+        num_good_ = 0;
+        level_--;
+        LOG(INFO) << "Backend catches up, restore to level " << level_;
+    }
+}
+
+ceres::Problem::Options Backend::ProblemOptions()
+{
+    // the loss function and the local parameterization are shared by all problems
+    ceres::Problem::Options options;
+    options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    options.local_parameterization_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    options.enable_fast_removal = true;
+    return options;
+}
+
+void Backend::Slide(Frames &active_kfs)
+{
+    const Budget &budget = budgets[level_];
+    adapt::Problem &problem = *problem_;
+    for (auto id : window_.transients)
+    {
+        problem.RemoveResidualBlock(id);
+    }
+    window_.transients.clear();
+
+    auto in_window = [&](const Frame::Ptr &frame) {
+        auto iter = active_kfs.find(frame->time);
+        return iter != active_kfs.end() && iter->second == frame;
+    };
+    bool imu = (suite_ & WithImu) && Imu::Get()->initialized;
+
+    // residual blocks of keyframes out of the window, rejected features and changed weights are removed,
+    // the blocks are removed explicitly, so that none of them is removed implicitly with its parameters.
+    int num_removed = 0;
+    for (auto &pair_kf : window_.frames)
+    {
+        WindowFrame &kept = pair_kf.second;
+        auto frame = kept.frame;
+        bool leave = !in_window(frame);
+        for (auto iter = kept.visual.begin(); iter != kept.visual.end();)
+        {
+            VisualBlock &block = iter->second;
+            auto landmark = block.feature->landmark.lock();
+            bool valid = !leave && landmark && block.weight == frame->weights.visual &&
+                         in_window(block.first_frame) && landmark->FirstFrame().lock() == block.first_frame;
+            if (valid)
+            {
+                auto feature = frame->features_left.find(iter->first);
+                valid = feature != frame->features_left.end() && feature->second == block.feature;
+            }
+            if (valid && block.type != ProblemType::Other)
+            {
+                auto type = Camera::Get()->Far(landmark->ToWorld(), frame->pose) ? ProblemType::WeakError : ProblemType::VisualError;
+                valid = type == block.type && (budget.weak || type != ProblemType::WeakError);
+            }
+            if (valid)
+            {
+                iter++;
+                continue;
+            }
+            problem.RemoveResidualBlock(block.id);
+            iter = kept.visual.erase(iter);
+            num_removed++;
+        }
+        if (kept.imu_error)
+        {
+            auto iter = active_kfs.find(frame->time);
+            bool valid = !leave && imu && frame->good_imu && frame->preintegration == kept.preintegration &&
+                         iter != active_kfs.begin() && std::prev(iter)->second == kept.last_frame && kept.last_frame->good_imu;
+            if (!valid)
+            {
+                problem.RemoveResidualBlock(kept.imu_error);
+                kept.imu_error = nullptr;
+                num_removed++;
+            }
+        }
+    }
+
+    // parameters of keyframes out of the window
+    for (auto iter = window_.frames.begin(); iter != window_.frames.end();)
+    {
+        WindowFrame &kept = iter->second;
+        auto frame = kept.frame;
+        bool leave = !in_window(frame);
+        for (auto iter_depth = kept.depths.begin(); iter_depth != kept.depths.end();)
+        {
+            if (leave || iter_depth->second->FirstFrame().lock() != frame)
+            {
+                if (problem.HasParameterBlock(iter_depth->first))
+                {
+                    problem.RemoveParameterBlock(iter_depth->first);
+                }
+                iter_depth = kept.depths.erase(iter_depth);
+            }
+            else
+            {
+                iter_depth++;
+            }
+        }
+        if (!leave)
+        {
+            iter++;
+            continue;
+        }
+        for (double *para : {frame->pose.data(), frame->Vw.data(), frame->bias.linearized_ba.data(), frame->bias.linearized_bg.data()})
+        {
+            if (problem.HasParameterBlock(para))
+            {
+                problem.RemoveParameterBlock(para);
+            }
+        }
+        iter = window_.frames.erase(iter);
+    }
+    static Histogram &histogram = Metrics::Instance().GetHistogram("backend_removed_blocks");
+    histogram.Record(num_removed);
+}
+
+double Backend::BuildProblem(Frames &active_kfs, adapt::Problem &problem, Window *window)
+{
+    // only the imu adds factors into the problem of the backend
+    if (suite_ & WithImu)
+        return BuildSuiteProblem<WithImu>(active_kfs, problem, window);
+    return BuildSuiteProblem<StereoOnly>(active_kfs, problem, window);
+}
+
+template <int suite>
+double Backend::BuildSuiteProblem(Frames &active_kfs, adapt::Problem &problem, Window *window)
+{
+    const Budget &budget = budgets[level_];
+    ceres::LossFunction *loss_function = loss_function_.get();
+    ceres::LocalParameterization *local_parameterization = local_parameterization_.get();
 
     double start_time = active_kfs.begin()->first;
     double global_end = start_time;
+    bool imu = SuiteTraits<suite>::imu && Imu::Get()->initialized;
     Frame::Ptr last_frame;
     double *para_last_kf;
+
+    // create visual residuals of every keyframe, the order of insertion is kept
+    // only blocks which are not in the sliding problem are created
+    std::vector<Frame::Ptr> frames;
+    std::vector<WindowFrame *> kept;
     for (auto &pair_kf : active_kfs)
     {
-        auto frame = pair_kf.second;
+        frames.push_back(pair_kf.second);
+        WindowFrame *kept_frame = nullptr;
+        if (window)
+        {
+            kept_frame = &window->frames[pair_kf.first];
+            kept_frame->frame = pair_kf.second;
+        }
+        kept.push_back(kept_frame);
+    }
+    std::vector<std::vector<VisualResidual>> visual_residuals(frames.size());
+    std::vector<double> global_ends(frames.size());
+    auto build = [&](int i) {
+        global_ends[i] = build_visual_residuals(frames[i], start_time, marginalized_, kept[i], visual_residuals[i]);
+    };
+    if (parallel_build_)
+    {
+        parallel_for(0, frames.size(), build);
+    }
+    else
+    {
+        for (int i = 0; i < frames.size(); i++)
+        {
+            build(i);
+        }
+    }
+
+    for (int i = 0; i < frames.size(); i++)
+    {
+        auto frame = frames[i];
         double *para_kf = frame->pose.data();
-        problem.AddParameterBlock(para_kf, SE3d::num_parameters, local_parameterization);
-        for (auto &pair_feature : frame->features_left)
+        if (!problem.HasParameterBlock(para_kf))
         {
-            auto feature = pair_feature.second;
-            auto landmark = feature->landmark.lock();
-            auto first_frame = landmark->FirstFrame().lock();
-            auto type = Camera::Get()->Far(landmark->ToWorld(), frame->pose) ? ProblemType::WeakError : ProblemType::VisualError;
-            ceres::CostFunction *cost_function;
-            if (first_frame == frame)
+            problem.AddParameterBlock(para_kf, SE3d::num_parameters, local_parameterization);
+        }
+        for (auto &residual : visual_residuals[i])
+        {
+            if (!budget.weak && residual.type == ProblemType::WeakError)
             {
-                double *para_inv_depth = &landmark->inv_depth;
-                problem.AddParameterBlock(para_inv_depth, 1);
-                cost_function = TwoCameraReprojectionError::Create(cv2eigen(feature->keypoint.pt), cv2eigen(landmark->first_observation->keypoint.pt), Camera::Get(0), Camera::Get(1), 5 * frame->weights.visual);
-                problem.AddResidualBlock(ProblemType::Other, cost_function, loss_function, para_inv_depth);
+                delete residual.cost_function;
+                continue;
             }
-            else if (first_frame->time < start_time)
+            if (residual.para_inv_depth)
             {
-                global_end = std::min(first_frame->last_keyframe ? first_frame->last_keyframe->time : 0, global_end);
-                cost_function = PoseOnlyReprojectionError::Create(cv2eigen(feature->keypoint.pt), landmark->ToWorld(), Camera::Get(), frame->weights.visual);
-                problem.AddResidualBlock(type, cost_function, loss_function, para_kf);
+                problem.AddParameterBlock(residual.para_inv_depth, 1);
             }
-            else
+            auto id = problem.AddResidualBlock(residual.type, residual.cost_function, loss_function, residual.parameter_blocks);
+            if (window && residual.first_frame)
             {
-                double *para_fist_kf = first_frame->pose.data();
-                double *para_inv_depth = &landmark->inv_depth;
-                problem.AddParameterBlock(para_inv_depth, 1);
-                // first ob is on right camera; current ob is on left camera;
-                cost_function = TwoFrameReprojectionError::Create(cv2eigen(landmark->first_observation->keypoint.pt), cv2eigen(feature->keypoint.pt), Camera::Get(0), Camera::Get(1), frame->weights.visual);
-                problem.AddResidualBlock(type, cost_function, loss_function, para_inv_depth, para_fist_kf, para_kf);
+                auto landmark = residual.feature->landmark.lock();
+                kept[i]->visual[landmark->id] = {id, residual.feature, residual.first_frame, residual.type, frame->weights.visual};
+                window->frames[residual.first_frame->time].depths[residual.para_inv_depth] = landmark;
+            }
+            else if (window)
+            {
+                window->transients.push_back(id);
             }
         }
+        global_end = std::min(global_ends[i], global_end);
 
-        if (Imu::Num() && Imu::Get()->initialized)
+        if (SuiteTraits<suite>::imu && imu)
         {
             if (frame->good_imu)
             {
@@ -144,13 +440,19 @@ double Backend::BuildProblem(Frames &active_kfs, adapt::Problem &problem)
                 problem.AddParameterBlock(para_v, 3);
                 problem.AddParameterBlock(para_ba, 3);
                 problem.AddParameterBlock(para_bg, 3);
-                if (last_frame && last_frame->good_imu)
+                if (last_frame && last_frame->good_imu && !(window && kept[i]->imu_error))
                 {
                     auto para_v_last = last_frame->Vw.data();
                     auto para_bg_last = last_frame->bias.linearized_bg.data();
                     auto para_ba_last = last_frame->bias.linearized_ba.data();
                     ceres::CostFunction *cost_function = ImuError::Create(frame->preintegration);
-                    problem.AddResidualBlock(ProblemType::ImuError, cost_function, NULL, para_last_kf, para_v_last, para_ba_last, para_bg_last, para_kf, para_v, para_ba, para_bg);
+                    auto id = problem.AddResidualBlock(ProblemType::ImuError, cost_function, NULL, para_last_kf, para_v_last, para_ba_last, para_bg_last, para_kf, para_v, para_ba, para_bg);
+                    if (window)
+                    {
+                        kept[i]->imu_error = id;
+                        kept[i]->preintegration = frame->preintegration;
+                        kept[i]->last_frame = last_frame;
+                    }
                 }
             }
         }
@@ -159,15 +461,20 @@ double Backend::BuildProblem(Frames &active_kfs, adapt::Problem &problem)
         auto num_types = problem.GetTypes(para_kf);
         if (!num_types[ProblemType::ImuError] && num_types[ProblemType::VisualError] < 20)
         {
+            ceres::ResidualBlockId id;
             if (last_frame)
             {
                 ceres::CostFunction *cost_function = PoseGraphError::Create(last_frame->pose, frame->pose, 100, 0);
-                problem.AddResidualBlock(ProblemType::Other, cost_function, NULL, para_last_kf, para_kf);
+                id = problem.AddResidualBlock(ProblemType::Other, cost_function, NULL, para_last_kf, para_kf);
             }
             else
             {
                 ceres::CostFunction *cost_function = PoseError::Create(frame->pose, 100, 0);
-                problem.AddResidualBlock(ProblemType::Other, cost_function, NULL, para_kf);
+                id = problem.AddResidualBlock(ProblemType::Other, cost_function, NULL, para_kf);
+            }
+            if (window)
+            {
+                window->transients.push_back(id);
             }
         }
         last_frame = frame;
@@ -185,6 +492,11 @@ double compute_reprojection_error(Vector2d ob, Vector3d pw, SE3d pose, Camera::P
 
 void Backend::Optimize()
 {
+    static Histogram &build_histogram = Metrics::Instance().GetHistogram("backend_build");
+    static Histogram &solve_histogram = Metrics::Instance().GetHistogram("backend_solve");
+    static Histogram &lag_histogram = Metrics::Instance().GetHistogram("backend_lag");
+    const Budget &budget = budgets[level_];
+    const double window_size = window_size_ * budget.window_scale;
     Frames active_kfs = Map::Instance().GetKeyFrames(finished);
     if (active_kfs.empty())
         return;
@@ -194,30 +506,100 @@ void Backend::Optimize()
     SE3d old_pose = (--active_kfs.end())->second->pose;
     SE3d start_pose = active_kfs.begin()->second->pose;
 
-    adapt::Problem problem;
-    global_end_ = BuildProblem(active_kfs, problem);
+    // the sliding problem keeps the blocks of the last optimization, only the difference is built
+    auto t1 = std::chrono::steady_clock::now();
+    adapt::Problem &problem = *problem_;
+    Slide(active_kfs);
+    global_end_ = BuildProblem(active_kfs, problem, &window_);
+    if (marginalization_)
+    {
+        if (marginalization_->Check(problem))
+        {
+            auto id = problem.AddResidualBlock(ProblemType::Other, MarginalizationError::Create(marginalization_), NULL, marginalization_->blocks);
+            window_.transients.push_back(id);
+        }
+        else
+        {
+            // the window is moved by others, e.g. loop closure
+            marginalization_ = nullptr;
+            marginalized_.clear();
+        }
+    }
+    auto t2 = std::chrono::steady_clock::now();
 
     ceres::Solver::Options options;
     options.linear_solver_type = ceres::SPARSE_SCHUR;
-    options.max_solver_time_in_seconds = (end - start) / active_kfs.size();
-    options.num_threads = num_threads;
+    options.max_num_iterations = budget.max_iterations;
+    options.max_solver_time_in_seconds = latency_ > 0 ? latency_ / 2 : (end - start) / active_kfs.size();
     ceres::Solver::Summary summary;
-    adapt::Solve(options, &problem, &summary);
-    if (Imu::Num() && Imu::Get()->initialized)
+    {
+        // released before the mapping takes its own lease
+        Scheduler::Lease lease(Task::Backend);
+        options.num_threads = lease.threads;
+        adapt::Solve(options, &problem, &summary);
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    auto build_time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
+    auto solve_time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t3 - t2);
+    LOG(INFO) << "Backend build problem cost time: " << build_time_used.count() << " seconds, solve cost time: " << solve_time_used.count() << " seconds.";
+    build_histogram.Record(build_time_used.count());
+    solve_histogram.Record(solve_time_used.count());
+    if ((suite_ & WithImu) && Imu::Get()->initialized)
     {
         imu::RecoverBias(active_kfs);
     }
 
+    // the window keeps the keyframes which still share enough landmarks with the newest one, up to twice the size
+    double boundary = end + epsilon - window_size;
+    if (min_covisible_ > 0)
+    {
+        double oldest = visual::Covisibility::Instance().Oldest(end, min_covisible_, end - 2 * window_size);
+        if (oldest > 0)
+        {
+            boundary = std::max(finished, std::min(boundary, oldest));
+        }
+    }
+
+    if (marginalize_)
+    {
+        Marginalize(active_kfs, problem, boundary, end);
+    }
+
     // update frontend
     SE3d new_pose = (--active_kfs.end())->second->pose;
     SE3d transform = new_pose * old_pose.inverse();
     UpdateFrontend(transform, end + epsilon);
-    finished = end + epsilon - window_size_;
+    finished = boundary;
+    EventBus::Instance().Publish(Event::KeyFrameFinished, finished);
+
+    // scan to map is deferred at the last level, and catches up later,
+    // keyframes whose lidar features are not ready yet are mapped by the next optimization
+    if ((suite_ & WithLidar) && mapping_ && budget.lidar)
+    {
+        Frames mapping_kfs = Map::Instance().GetKeyFrames(std::min(start, mapped_), end - window_size);
+        double processed = mapping_->Optimize(mapping_kfs);
+        mapped_ = std::max(mapped_, std::min(end - window_size, processed) + epsilon);
+    }
+
+    // lag of the backend behind the newest keyframe
+    double lag = Map::Instance().GetSnapshot()->rbegin()->first - end;
+    lag_histogram.Record(lag);
+    UpdateLevel(lag);
+    if (keyframe_policy_)
+    {
+        keyframe_policy_->SetLag(lag);
+    }
+
+    // spill old keyframes which are out of the window
+    FrameStore::Instance().Compact(start, (--active_kfs.end())->second->t());
 
-    if (Lidar::Num() && mapping_)
+    // archive the landmarks which neither the window nor the local map of frontend can see again,
+    // the relocator reads the features of the keyframes it has not added as places without the lock
+    if (Map::Instance().compact_landmarks)
     {
-        Frames mapping_kfs = Map::Instance().GetKeyFrames(start, end - window_size_);
-        mapping_->Optimize(mapping_kfs);
+        static std::atomic<long> &num_archived = Metrics::Instance().GetCounter("landmarks_archived");
+        double compact_end = std::min(std::min(start, frontend_.lock()->local_map.Oldest()), FrameStore::Instance().Held());
+        num_archived += Map::Instance().CompactLandmarks(compact_end);
     }
 
     // reject outliers and clean the map
@@ -239,6 +621,57 @@ void Backend::Optimize()
     }
 }
 
+void Backend::Marginalize(Frames &active_kfs, adapt::Problem &problem, double finished, double end)
+{
+    // keyframes which leave the window, with their landmarks
+    std::unordered_set<double *> drops;
+    std::vector<double> times;
+    for (auto &pair_kf : active_kfs)
+    {
+        auto frame = pair_kf.second;
+        if (frame->time >= finished)
+            break;
+        times.push_back(frame->time);
+        drops.insert(frame->pose.data());
+        drops.insert(frame->Vw.data());
+        drops.insert(frame->bias.linearized_ba.data());
+        drops.insert(frame->bias.linearized_bg.data());
+        for (auto &pair_feature : frame->features_left)
+        {
+            auto landmark = pair_feature.second->landmark.lock();
+            if (landmark->FirstFrame().lock() == frame)
+            {
+                drops.insert(&landmark->inv_depth);
+            }
+        }
+    }
+    if (times.empty())
+        return;
+
+    auto t1 = std::chrono::steady_clock::now();
+    marginalization_ = Marginalization::Create(problem, drops);
+    auto t2 = std::chrono::steady_clock::now();
+    auto time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
+    LOG(INFO) << "Backend marginalization cost time: " << time_used.count() << " seconds.";
+
+    // observations of these landmarks before end are in the prior now
+    for (auto iter = marginalized_.begin(); iter != marginalized_.end();)
+    {
+        iter = iter->second < finished ? marginalized_.erase(iter) : ++iter;
+    }
+    if (marginalization_)
+    {
+        for (double time : times)
+        {
+            marginalized_[time] = end;
+        }
+    }
+    else
+    {
+        marginalized_.clear();
+    }
+}
+
 void Backend::UpdateFrontend(SE3d transform, double time)
 {
     // perpare for active kfs
@@ -251,25 +684,28 @@ void Backend::UpdateFrontend(SE3d transform, double time)
     }
     PoseGraph::Instance().ForwardUpdate(transform, active_kfs);
 
-    adapt::Problem problem;
+    adapt::Problem problem(ProblemOptions());
     BuildProblem(active_kfs, problem);
     ceres::Solver::Options options;
     options.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
     options.max_num_iterations = 1;
-    options.num_threads = num_threads;
     ceres::Solver::Summary summary;
-    adapt::Solve(options, &problem, &summary);
-    if (Imu::Num() && Imu::Get()->initialized)
+    {
+        Scheduler::Lease lease(Task::Backend);
+        options.num_threads = lease.threads;
+        adapt::Solve(options, &problem, &summary);
+    }
+    if ((suite_ & WithImu) && Imu::Get()->initialized)
     {
         imu::RecoverBias(active_kfs);
     }
     // imu initialization
-    if (Imu::Num())
+    if (suite_ & WithImu)
     {
         initializer_->Initialize(frontend_.lock()->init_time, time);
     }
     // update imu
-    if (Imu::Num() && Imu::Get()->initialized)
+    if ((suite_ & WithImu) && Imu::Get()->initialized)
     {
         Frame::Ptr prior_frame = Map::Instance().GetKeyFrames(0, time, 1).begin()->second;
         imu::RePredictVel(active_kfs, prior_frame);
@@ -0,0 +1,86 @@
+#include "lvio_fusion/chunked_frames.h"
+
+#include <algorithm>
+
+namespace lvio_fusion
+{
+
+int ChunkedFrames::ChunkOf(double time, bool upper) const
+{
+    auto iter = std::lower_bound(chunks_.begin(), chunks_.end() - 1, time,
+                                 [upper](const Chunk &chunk, double time) {
+                                     double last = chunk->rbegin()->first;
+                                     return upper ? last <= time : last < time;
+                                 });
+    return iter - chunks_.begin();
+}
+
+ChunkedFrames::const_iterator ChunkedFrames::lower_bound(double time) const
+{
+    int i = ChunkOf(time, false);
+    return const_iterator(&chunks_, i, chunks_[i]->lower_bound(time));
+}
+
+ChunkedFrames::const_iterator ChunkedFrames::upper_bound(double time) const
+{
+    int i = ChunkOf(time, true);
+    return const_iterator(&chunks_, i, chunks_[i]->upper_bound(time));
+}
+
+ChunkedFrames::const_iterator ChunkedFrames::find(double time) const
+{
+    int i = ChunkOf(time, false);
+    auto iter = chunks_[i]->find(time);
+    return iter == chunks_[i]->end() ? end() : const_iterator(&chunks_, i, iter);
+}
+
+int ChunkedFrames::Insert(const Frames &frames, bool replace)
+{
+    int num_inserted = 0;
+    auto iter = frames.begin();
+    for (int i = 0; i < (int)chunks_.size() && iter != frames.end(); i++)
+    {
+        // keyframes up to the last one of a chunk go into it, the rest go into the last chunk
+        bool last = i + 1 == (int)chunks_.size();
+        auto end = last ? frames.end() : frames.upper_bound(chunks_[i]->rbegin()->first);
+        if (iter == end)
+            continue;
+        std::shared_ptr<Frames> chunk(new Frames(*chunks_[i]));
+        for (; iter != end; iter++)
+        {
+            auto result = chunk->insert(*iter);
+            if (result.second)
+            {
+                num_inserted++;
+            }
+            else if (replace)
+            {
+                result.first->second = iter->second;
+            }
+        }
+        if (chunk->size() <= 2 * chunk_size)
+        {
+            chunks_[i] = chunk;
+            continue;
+        }
+        // split a large chunk, the keyframes of the last piece keep being appended
+        std::vector<Chunk> pieces;
+        for (auto begin = chunk->begin(); begin != chunk->end();)
+        {
+            auto next = begin;
+            for (int k = 0; k < chunk_size && next != chunk->end(); k++)
+            {
+                next++;
+            }
+            pieces.push_back(Chunk(new Frames(begin, next)));
+            begin = next;
+        }
+        chunks_.erase(chunks_.begin() + i);
+        chunks_.insert(chunks_.begin() + i, pieces.begin(), pieces.end());
+        i += pieces.size() - 1;
+    }
+    size_ += num_inserted;
+    return num_inserted;
+}
+
+} // namespace lvio_fusion
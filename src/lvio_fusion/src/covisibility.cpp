@@ -0,0 +1,97 @@
+#include "lvio_fusion/visual/covisibility.h"
+
+namespace lvio_fusion
+{
+
+namespace visual
+{
+
+void Covisibility::Add(double a, double b)
+{
+    if (a == b)
+        return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    edges_[a][b]++;
+    edges_[b][a]++;
+}
+
+void Covisibility::Remove(double a, double b)
+{
+    if (a == b)
+        return;
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto remove = [this](double from, double to) {
+        auto iter = edges_.find(from);
+        if (iter == edges_.end())
+            return;
+        auto edge = iter->second.find(to);
+        if (edge != iter->second.end() && --edge->second <= 0)
+        {
+            iter->second.erase(edge);
+        }
+        // keyframes whose landmarks are all archived or removed leave the graph
+        if (iter->second.empty())
+        {
+            edges_.erase(iter);
+        }
+    };
+    remove(a, b);
+    remove(b, a);
+}
+
+int Covisibility::Weight(double a, double b)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto iter = edges_.find(a);
+    if (iter == edges_.end())
+        return 0;
+    auto edge = iter->second.find(b);
+    return edge == iter->second.end() ? 0 : edge->second;
+}
+
+std::vector<std::pair<double, int>> Covisibility::GetNeighbors(double time, int min_weight)
+{
+    std::vector<std::pair<double, int>> neighbors;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto iter = edges_.find(time);
+        if (iter == edges_.end())
+            return neighbors;
+        for (auto &pair : iter->second)
+        {
+            if (pair.second >= min_weight)
+            {
+                neighbors.push_back(pair);
+            }
+        }
+    }
+    // the newer one goes first if the weights are the same
+    std::sort(neighbors.begin(), neighbors.end(), [](const std::pair<double, int> &a, const std::pair<double, int> &b) {
+        return a.second > b.second || (a.second == b.second && a.first > b.first);
+    });
+    return neighbors;
+}
+
+double Covisibility::Oldest(double time, int min_weight, double start)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto iter = edges_.find(time);
+    if (iter == edges_.end())
+        return 0;
+    for (auto edge = iter->second.lower_bound(start); edge != iter->second.end(); edge++)
+    {
+        if (edge->second >= min_weight)
+            return edge->first;
+    }
+    return 0;
+}
+
+void Covisibility::Reset()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    edges_.clear();
+}
+
+} // namespace visual
+
+} // namespace lvio_fusion
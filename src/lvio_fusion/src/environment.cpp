@@ -2,6 +2,8 @@
 #include "lvio_fusion/ceres/imu_error.hpp"
 #include "lvio_fusion/ceres/lidar_error.hpp"
 #include "lvio_fusion/ceres/visual_error.hpp"
+#include "lvio_fusion/frame_store.h"
+#include "lvio_fusion/utility.h"
 
 namespace lvio_fusion
 {
@@ -15,19 +17,37 @@ Estimator::Ptr Environment::estimator_;
 int Environment::num_frames_per_env_ = 10;
 bool Environment::initialized_ = false;
 
-SE3d Environment::Optimize()
+// the mutable state of a keyframe, copied for every step instead of the whole keyframe
+struct Snapshot
+{
+    SE3d pose;
+    Vector3d Vw;
+    Bias bias;
+};
+
+inline Snapshot snapshot(Frame::Ptr frame)
+{
+    Snapshot state;
+    state.pose = frame->pose;
+    state.Vw = frame->Vw;
+    state.bias = frame->bias;
+    return state;
+}
+
+// the keyframes are shared by all environments, only the snapshots are optimized
+SE3d Environment::Optimize(Frame::Ptr frame, const Weights &weights)
 {
     int num_threads = 1;
     ceres::LocalParameterization *local_parameterization = new ceres::ProductParameterization(
         new ceres::EigenQuaternionParameterization(),
         new ceres::IdentityParameterization(3));
-    Frame::Ptr frame = Frame::Ptr(new Frame());
-    *frame = *(state_->second);
+    auto pin = FrameStore::Instance().Load(frame);
+    Snapshot state = snapshot(frame);
 
     // visual
     {
         adapt::Problem problem;
-        double *para = frame->pose.data();
+        double *para = state.pose.data();
         problem.AddParameterBlock(para, SE3d::num_parameters, local_parameterization);
         ceres::LossFunction *loss_function = new ceres::HuberLoss(1.0);
         for (auto &pair_feature : frame->features_left)
@@ -36,22 +56,23 @@ SE3d Environment::Optimize()
             auto landmark = feature->landmark.lock();
             auto first_frame = landmark->FirstFrame().lock();
             ceres::CostFunction *cost_function;
-            cost_function = PoseOnlyReprojectionError::Create(cv2eigen(feature->keypoint.pt), landmark->ToWorld(), Camera::Get(), frame->weights.visual);
+            cost_function = PoseOnlyReprojectionError::Create(cv2eigen(feature->keypoint.pt), landmark->ToWorld(), Camera::Get(), weights.visual);
             problem.AddResidualBlock(ProblemType::VisualError, cost_function, loss_function, para);
         }
 
         // imu
         Frame::Ptr last_frame = frame->last_keyframe;
+        Snapshot last_state;
         if (frame->good_imu && last_frame->good_imu)
         {
-            auto para_kf = frame->pose.data();
-            auto para_v = frame->Vw.data();
-            auto para_bg = frame->bias.linearized_bg.data();
-            auto para_ba = frame->bias.linearized_ba.data();
-            auto para_last_kf = last_frame->pose.data();
-            auto para_v_last = last_frame->Vw.data();
-            auto para_bg_last = last_frame->bias.linearized_bg.data();
-            auto para_ba_last = last_frame->bias.linearized_ba.data();
+            last_state = snapshot(last_frame);
+            auto para_v = state.Vw.data();
+            auto para_bg = state.bias.linearized_bg.data();
+            auto para_ba = state.bias.linearized_ba.data();
+            auto para_last_kf = last_state.pose.data();
+            auto para_v_last = last_state.Vw.data();
+            auto para_bg_last = last_state.bias.linearized_bg.data();
+            auto para_ba_last = last_state.bias.linearized_ba.data();
             problem.AddParameterBlock(para_v, 3);
             problem.AddParameterBlock(para_ba, 3);
             problem.AddParameterBlock(para_bg, 3);
@@ -78,18 +99,29 @@ SE3d Environment::Optimize()
     }
 
     // lidar
-    if (estimator_->mapping)
+    if (estimator_->mapping && frame->feature_lidar)
     {
+        // the lidar factors read a frame, give them a view which shares the features of the keyframe
+        Frame::Ptr view = Frame::Ptr(new Frame());
+        view->id = frame->id;
+        view->time = frame->time;
+        view->pose = state.pose;
+        view->weights = weights;
+        view->last_keyframe = frame->last_keyframe;
+        view->features_left = frame->features_left;
+        view->feature_lidar = frame->feature_lidar;
+        // the local map of mapping is shared, build and use it one environment at a time
+        std::unique_lock<std::mutex> lock(estimator_->mapping->mutex);
         auto map_frame = Frame::Ptr(new Frame());
-        estimator_->mapping->BuildMapFrame(frame, map_frame);
-        if (map_frame->feature_lidar && frame->feature_lidar)
+        estimator_->mapping->BuildMapFrame(view, map_frame);
+        if (map_frame->feature_lidar)
         {
             double rpyxyz[6];
-            se32rpyxyz(frame->pose * map_frame->pose.inverse(), rpyxyz); // relative_i_j
-            if (!map_frame->feature_lidar->points_ground.empty())
+            se32rpyxyz(view->pose * map_frame->pose.inverse(), rpyxyz); // relative_i_j
+            if (estimator_->mapping->map_ground.Size(0, map_frame->time) > 0)
             {
                 adapt::Problem problem;
-                estimator_->association->ScanToMapWithGround(frame, map_frame, rpyxyz, problem);
+                estimator_->association->ScanToMapWithGround(view, map_frame, estimator_->mapping->map_ground, 0, map_frame->time, rpyxyz, problem);
                 ceres::Solver::Options options;
                 options.linear_solver_type = ceres::DENSE_QR;
                 options.max_num_iterations = 4;
@@ -97,10 +129,10 @@ SE3d Environment::Optimize()
                 ceres::Solver::Summary summary;
                 adapt::Solve(options, &problem, &summary);
             }
-            if (!map_frame->feature_lidar->points_surf.empty())
+            if (estimator_->mapping->map_surf.Size(0, map_frame->time) > 0)
             {
                 adapt::Problem problem;
-                estimator_->association->ScanToMapWithSegmented(frame, map_frame, rpyxyz, problem);
+                estimator_->association->ScanToMapWithSegmented(view, map_frame, estimator_->mapping->map_surf, 0, map_frame->time, rpyxyz, problem);
                 ceres::Solver::Options options;
                 options.linear_solver_type = ceres::DENSE_QR;
                 options.max_num_iterations = 4;
@@ -110,8 +142,8 @@ SE3d Environment::Optimize()
             }
         }
     }
-    LOG(INFO) << "Weights:" << frame->weights.visual << "," << frame->weights.lidar_ground << "," << frame->weights.lidar_surf;
-    return frame->pose;
+    LOG(INFO) << "Weights:" << weights.visual << "," << weights.lidar_ground << "," << weights.lidar_surf;
+    return state.pose;
 }
 
 inline double compute_reward(SE3d result, SE3d ground_truth, SE3d base)
@@ -131,10 +163,23 @@ inline double compute_reward(SE3d result, SE3d ground_truth, SE3d base)
     return std::min(100.0, 1 / relative_error.norm());
 }
 
+void Environment::Step(const std::vector<int> &ids, std::vector<Weights> &weights, std::vector<Transition> &transitions)
+{
+    transitions.resize(ids.size());
+    parallel_for(0, ids.size(), [&](int i) {
+        Step(ids[i], weights[i], transitions[i].obs, &transitions[i].reward, &transitions[i].done);
+    });
+}
+
 void Environment::Step(Weights &weights, Observation &obs, float *reward, bool *done)
 {
-    state_->second->weights = weights;
-    SE3d result = Optimize();
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (state_ == frames_.end())
+    {
+        *done = true;
+        return;
+    }
+    SE3d result = Optimize(state_->second, weights);
     *reward = compute_reward(result, state_->second->pose, state_->second->last_keyframe->pose);
     LOG(INFO) << *reward;
     state_++;
@@ -1,9 +1,16 @@
 #include "lvio_fusion/estimator.h"
+#include "lvio_fusion/ceres/jacobian.hpp"
 #include "lvio_fusion/config.h"
+#include "lvio_fusion/event.h"
 #include "lvio_fusion/frame.h"
+#include "lvio_fusion/frame_store.h"
 #include "lvio_fusion/manager.h"
+#include "lvio_fusion/map_file.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/scheduler.h"
 
 #include <opencv2/core/eigen.hpp>
+#include <opencv2/core/ocl.hpp>
 #include <sys/sysinfo.h>
 
 const double epsilon = 1e-3;
@@ -14,6 +21,19 @@ namespace lvio_fusion
 
 Estimator::Estimator(std::string &config_path) : config_file_path_(config_path) {}
 
+Estimator::~Estimator()
+{
+    if (thread_tracking_.joinable())
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_frames_);
+            running_ = false;
+        }
+        cv_frames_.notify_all();
+        thread_tracking_.join();
+    }
+}
+
 bool Estimator::Init(int use_imu, int use_lidar, int use_navsat, int use_loop, int use_adapt)
 {
     LOG(INFO) << "System info:\n\tepsilon: " << epsilon << "\n\tnum_threads: " << num_threads;
@@ -84,19 +104,57 @@ bool Estimator::Init(int use_imu, int use_lidar, int use_navsat, int use_loop, i
     Camera::baseline = (t_body_to_cam0 - t_body_to_cam1).norm();
 
     // create components and links
+    bool opencl = Config::Get<int>("frontend_device") == 1;
+    if (opencl && !cv::ocl::haveOpenCL())
+    {
+        LOG(WARNING) << "Frontend: no opencl device, run on the cpu";
+        opencl = false;
+    }
     frontend = Frontend::Ptr(new Frontend(
         Config::Get<int>("num_features"),
         Config::Get<int>("num_features_init"),
         Config::Get<int>("num_features_tracking"),
         Config::Get<int>("num_features_tracking_bad"),
-        Config::Get<int>("num_features_needed_for_keyframe")));
+        opencl,
+        Config::Get<int>("debug_image") > 0,
+        Config::Get<int>("async_keyframe")));
 
+    keyframe_policy = KeyframePolicy::Ptr(new KeyframePolicy(
+        Config::Get<int>("num_features_needed_for_keyframe"),
+        Config::Get<double>("keyframe_interval"),
+        Config::Get<double>("keyframe_angle"),
+        use_lidar ? Config::Get<double>("spacing") : 0,
+        Config::Get<double>("backend_latency")));
+
+    pipeline_ = force_pipeline >= 0 ? force_pipeline : Config::Get<int>("pipeline");
+    if (pipeline_ > 0)
+    {
+        thread_tracking_ = std::thread(std::bind(&Estimator::TrackingLoop, this));
+    }
+
+    analytic_jacobians = Config::Get<int>("analytic_jacobians");
     backend = Backend::Ptr(new Backend(
         Config::Get<double>("windows_size"),
-        use_adapt));
+        use_adapt,
+        Config::Get<int>("parallel_build"),
+        Config::Get<int>("marginalization"),
+        Config::Get<double>("backend_latency"),
+        Config::Get<int>("covisibility_window"),
+        make_suite(use_imu, use_lidar, use_navsat, use_loop)));
+
+    Scheduler::Instance().Init(num_threads, Config::Get<std::string>("cpu_affinity"));
+
+    FrameStore::Instance().Open(
+        Config::Get<std::string>("spill_path"),
+        Config::Get<double>("max_memory"),
+        use_loop ? Config::Get<double>("threshold") : 0,
+        (ImagePolicy)Config::Get<int>("image_policy"));
+    Map::Instance().compact_landmarks = Config::Get<int>("compact_landmarks");
 
     frontend->SetBackend(backend);
+    frontend->SetKeyframePolicy(keyframe_policy);
     backend->SetFrontend(frontend);
+    backend->SetKeyframePolicy(keyframe_policy);
 
     PoseGraph::Instance().SetFrontend(frontend);
 
@@ -104,7 +162,9 @@ bool Estimator::Init(int use_imu, int use_lidar, int use_navsat, int use_loop, i
     {
         relocator = Relocator::Ptr(new Relocator(
             Config::Get<int>("relocator_mode"),
-            Config::Get<int>("threshold")));
+            Config::Get<int>("threshold"),
+            Config::Get<std::string>("vocabulary"),
+            (lidar::RegistrationMethod)Config::Get<int>("registration")));
         relocator->SetBackend(backend);
     }
 
@@ -118,6 +178,11 @@ bool Estimator::Init(int use_imu, int use_lidar, int use_navsat, int use_loop, i
     {
         initializer = Initializer::Ptr(new Initializer);
         backend->SetInitializer(initializer);
+        imu_state_ = Config::Get<std::string>("imu_state");
+        if (!imu_state_.empty())
+        {
+            initializer->Load(imu_state_);
+        }
 
         double acc_n = Config::Get<double>("acc_n");
         double gyr_n = Config::Get<double>("gyr_n");
@@ -125,6 +190,10 @@ bool Estimator::Init(int use_imu, int use_lidar, int use_navsat, int use_loop, i
         double gyr_w = Config::Get<double>("gyr_w");
         double g_norm = Config::Get<double>("g_norm");
         Imu::Create(SE3d(), acc_n, acc_w, gyr_n, gyr_w, g_norm);
+        imu::bias_threshold = Config::Get<double>("bias_threshold");
+
+        propagator = imu::Propagator::Ptr(new imu::Propagator);
+        frontend->SetPropagator(propagator);
     }
 
     if (use_lidar)
@@ -148,10 +217,10 @@ bool Estimator::Init(int use_imu, int use_lidar, int use_navsat, int use_loop, i
             Config::Get<double>("cycle_time"),
             Config::Get<double>("min_range"),
             Config::Get<double>("max_range"),
-            Config::Get<int>("deskew"),
-            Config::Get<int>("spacing")));
+            Config::Get<int>("deskew")));
+        association->SetKeyframePolicy(keyframe_policy);
 
-        mapping = Mapping::Ptr(new Mapping);
+        mapping = Mapping::Ptr(new Mapping(Config::Get<int>("lidar_tiles"), Config::Get<int>("parallel_mapping")));
         mapping->SetFeatureAssociation(association);
 
         backend->SetMapping(mapping);
@@ -161,6 +230,40 @@ bool Estimator::Init(int use_imu, int use_lidar, int use_navsat, int use_loop, i
             relocator->SetMapping(mapping);
         }
     }
+
+    std::string prior_map = Config::Get<std::string>("prior_map");
+    if (Config::Get<int>("localization"))
+    {
+        if (prior_map.empty())
+        {
+            LOG(ERROR) << "Localization needs a prior map";
+            return false;
+        }
+        backend->SetLocalization(true);
+        if (relocator)
+        {
+            relocator->SetLocalization(true);
+        }
+    }
+    if (!prior_map.empty())
+    {
+        // the prior map is fixed, the backend starts after it
+        double last = MapFile::Load(prior_map);
+        if (last == 0)
+            return false;
+        backend->finished = last + epsilon;
+        EventBus::Instance().Publish(Event::KeyFrameFinished, backend->finished);
+    }
+
+    std::string trace_path = Config::Get<std::string>("trace_path");
+    if (!trace_path.empty())
+    {
+        trace = TraceWriter::Ptr(new TraceWriter);
+        if (!trace->Open(trace_path))
+        {
+            trace = nullptr;
+        }
+    }
     return true;
 }
 
@@ -171,11 +274,33 @@ std::map<FrontendStatus, std::string> map_status = {
     {FrontendStatus::LOST, "Lost"}};
 void Estimator::InputImage(double time, cv::Mat &left_image, cv::Mat &right_image, SE3d init_odom)
 {
+    if (trace)
+    {
+        trace->WriteImage(time, left_image, right_image, init_odom);
+    }
     Frame::Ptr new_frame = Frame::Create();
     new_frame->time = time;
     new_frame->pose = init_odom;
-    cv::undistort(left_image, new_frame->image_left, Camera::Get(0)->K, Camera::Get(0)->D);
-    cv::undistort(right_image, new_frame->image_right, Camera::Get(1)->K, Camera::Get(1)->D);
+    FrameStore::Instance().Acquire(new_frame->image_left, left_image.size(), left_image.type());
+    FrameStore::Instance().Acquire(new_frame->image_right, right_image.size(), right_image.type());
+    Camera::Get(0)->Undistort(left_image, new_frame->image_left);
+    Camera::Get(1)->Undistort(right_image, new_frame->image_right);
+
+    if (pipeline_ > 0)
+    {
+        // hand off to the tracking thread, drop the oldest frame if tracking falls behind
+        std::unique_lock<std::mutex> lock(mutex_frames_);
+        if ((int)frames_.size() >= pipeline_)
+        {
+            frames_.pop();
+            static std::atomic<long> &num_dropped = Metrics::Instance().GetCounter("frames_dropped");
+            num_dropped++;
+            LOG_EVERY_N(WARNING, 10) << "Tracking falls behind, dropped " << ++num_dropped_ << " frames.";
+        }
+        frames_.push(new_frame);
+        cv_frames_.notify_one();
+        return;
+    }
 
     auto t1 = std::chrono::steady_clock::now();
     bool success = frontend->AddFrame(new_frame);
@@ -184,24 +309,70 @@ void Estimator::InputImage(double time, cv::Mat &left_image, cv::Mat &right_imag
     // LOG(INFO) << "Frontend status:" << map_status[frontend->status] << ", cost time: " << time_used.count() << " seconds.";
 }
 
+void Estimator::TrackingLoop()
+{
+    Scheduler::Instance().Pin(Task::Frontend);
+    while (true)
+    {
+        Frame::Ptr frame;
+        {
+            std::unique_lock<std::mutex> lock(mutex_frames_);
+            cv_frames_.wait(lock, [this] { return !frames_.empty() || !running_; });
+            if (!running_)
+                return;
+            frame = frames_.front();
+            frames_.pop();
+        }
+        frontend->AddFrame(frame);
+    }
+}
+
 void Estimator::InputPointCloud(double time, Point3Cloud::Ptr point_cloud)
 {
-    auto t1 = std::chrono::steady_clock::now();
+    if (trace)
+    {
+        trace->WritePointCloud(time, *point_cloud);
+    }
     association->AddScan(time, point_cloud);
-    auto t2 = std::chrono::steady_clock::now();
-    auto time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
-    if (time_used.count() > 1e-2)
-        LOG(INFO) << "Lidar Preprocessing cost time: " << time_used.count() << " seconds.";
+}
+
+void Estimator::InputPointCloud(const lidar::RawScan &scan)
+{
+    if (trace)
+    {
+        trace->WriteScan(scan);
+    }
+    association->AddScan(scan);
 }
 
 void Estimator::InputImu(double time, Vector3d acc, Vector3d gyr)
 {
+    if (trace)
+    {
+        trace->WriteImu(time, acc, gyr);
+    }
     frontend->AddImu(time, acc, gyr);
+    if (propagator)
+    {
+        propagator->Push(time, acc, gyr);
+    }
 }
 
 void Estimator::InputNavSat(double time, double x, double y, double z, Vector3d cov)
 {
+    if (trace)
+    {
+        trace->WriteNavsat(time, Vector3d(x, y, z), cov);
+    }
     Navsat::Get()->AddPoint(time, x, y, z, cov);
 }
 
+void Estimator::SaveImuState()
+{
+    if (initializer && !imu_state_.empty() && initializer->Save(imu_state_))
+    {
+        LOG(INFO) << "Estimator: imu state saved to " << imu_state_;
+    }
+}
+
 } // namespace lvio_fusion
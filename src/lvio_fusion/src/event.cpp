@@ -0,0 +1,62 @@
+#include "lvio_fusion/event.h"
+
+namespace lvio_fusion
+{
+
+bool Subscriber::Wait(double timeout)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto ready = [this] { return std::find(pending_, pending_ + (int)Event::Num, true) != pending_ + (int)Event::Num; };
+    if (timeout == 0)
+    {
+        cv_.wait(lock, ready);
+        return true;
+    }
+    return cv_.wait_for(lock, std::chrono::duration<double>(timeout), ready);
+}
+
+bool Subscriber::Take(Event event)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool pending = pending_[(int)event];
+    pending_[(int)event] = false;
+    return pending;
+}
+
+double Subscriber::Time(Event event)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return times_[(int)event];
+}
+
+void Subscriber::Notify(Event event, double time)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        pending_[(int)event] = true;
+        times_[(int)event] = std::max(times_[(int)event], time);
+    }
+    cv_.notify_one();
+}
+
+Subscriber::Ptr EventBus::Subscribe(std::initializer_list<Event> events)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto subscriber = Subscriber::Ptr(new Subscriber);
+    for (auto event : events)
+    {
+        subscribers_[(int)event].push_back(subscriber);
+    }
+    return subscriber;
+}
+
+void EventBus::Publish(Event event, double time)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto &subscriber : subscribers_[(int)event])
+    {
+        subscriber->Notify(event, time);
+    }
+}
+
+} // namespace lvio_fusion
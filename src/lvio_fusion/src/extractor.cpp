@@ -369,23 +369,35 @@ void Extractor::ComputeKeyPointsQuadTree(vector<vector<KeyPoint>> &all_kps)
 {
     all_kps.resize(num_levels);
 
+    // split every level into cells
+    struct Cell
+    {
+        int level, i, j;
+        Rect roi;
+        vector<KeyPoint> kps;
+    };
+    vector<Cell> cells;
+    vector<int> level_begin(num_levels + 1, 0);
+    vector<Size> level_cells(num_levels), level_grids(num_levels); // size of the cells and the number of cells of each level
+    vector<vector<int>> level_index(num_levels);                   // grid position -> cell, -1 if it is out of the border
     const float W = 30;
     for (int level = 0; level < num_levels; level++)
     {
+        level_begin[level] = cells.size();
         const int min_border_x = edge_thershold - 3;
         const int min_border_Y = min_border_x;
         const int max_border_X = image_pyramid_[level].cols - edge_thershold + 3;
         const int max_border_Y = image_pyramid_[level].rows - edge_thershold + 3;
 
-        vector<cv::KeyPoint> distribute_kps;
-        distribute_kps.reserve(num_features * 10);
-
         const float width = (max_border_X - min_border_x);
         const float height = (max_border_Y - min_border_Y);
         const int cols = width / W;
         const int rows = height / W;
         const int cell_width = ceil(width / cols);
         const int cell_height = ceil(height / rows);
+        level_cells[level] = Size(cell_width, cell_height);
+        level_grids[level] = Size(cols, rows);
+        level_index[level].assign(rows * cols, -1);
 
         for (int i = 0; i < rows; i++)
         {
@@ -406,50 +418,114 @@ void Extractor::ComputeKeyPointsQuadTree(vector<vector<KeyPoint>> &all_kps)
                 if (max_x > max_border_X)
                     max_x = max_border_X;
 
-                vector<cv::KeyPoint> cell_kps;
-                FAST(image_pyramid_[level].rowRange(init_y, max_y).colRange(init_x, max_x),
-                     cell_kps, init_FAST_thershold, true);
+                Cell cell;
+                cell.level = level;
+                cell.i = i * cell_height;
+                cell.j = j * cell_width;
+                cell.roi = Rect(Point((int)init_x, (int)init_y), Point((int)max_x, (int)max_y));
+                level_index[level][i * cols + j] = cells.size();
+                cells.push_back(cell);
+            }
+        }
+    }
+    level_begin[num_levels] = cells.size();
 
-                if (cell_kps.empty())
+    if (opencl)
+    {
+        // one FAST of a whole level on the device at the min threshold,
+        // then every cell keeps the corners above the init threshold, or all of them if there are none
+        for (int level = 0; level < num_levels; level++)
+        {
+            if (level_begin[level] == level_begin[level + 1])
+                continue;
+            Rect roi = cells[level_begin[level]].roi | cells[level_begin[level + 1] - 1].roi;
+            const Size &cell_size = level_cells[level], &grid = level_grids[level];
+            UMat image;
+            image_pyramid_[level](roi).copyTo(image);
+            vector<KeyPoint> kps;
+            FAST(image, kps, min_FAST_thershold, true);
+            for (auto &kp : kps)
+            {
+                int i = std::min((int)kp.pt.y / cell_size.height, grid.height - 1);
+                int j = std::min((int)kp.pt.x / cell_size.width, grid.width - 1);
+                int k = level_index[level][i * grid.width + j];
+                if (k >= 0)
+                {
+                    kp.pt.x -= cells[k].j;
+                    kp.pt.y -= cells[k].i;
+                    cells[k].kps.push_back(kp);
+                }
+            }
+        }
+        for (auto &cell : cells)
+        {
+            auto strong = std::partition(cell.kps.begin(), cell.kps.end(), [this](const KeyPoint &kp) { return kp.response >= init_FAST_thershold; });
+            if (strong != cell.kps.begin())
+            {
+                cell.kps.erase(strong, cell.kps.end());
+            }
+        }
+    }
+    else
+    {
+        // FAST in all cells of all levels in parallel
+        parallel_for_(Range(0, cells.size()), [&](const Range &range) {
+            for (int k = range.start; k < range.end; k++)
+            {
+                Cell &cell = cells[k];
+                Mat image = image_pyramid_[cell.level](cell.roi);
+                FAST(image, cell.kps, init_FAST_thershold, true);
+                if (cell.kps.empty())
                 {
-                    FAST(image_pyramid_[level].rowRange(init_y, max_y).colRange(init_x, max_x),
-                         cell_kps, min_FAST_thershold, true);
+                    FAST(image, cell.kps, min_FAST_thershold, true);
                 }
+            }
+        });
+    }
 
-                if (!cell_kps.empty())
+    // merge the cells in order, then distribute and compute orientations per level
+    parallel_for_(Range(0, num_levels), [&](const Range &range) {
+        for (int level = range.start; level < range.end; level++)
+        {
+            const int min_border_x = edge_thershold - 3;
+            const int min_border_Y = min_border_x;
+            const int max_border_X = image_pyramid_[level].cols - edge_thershold + 3;
+            const int max_border_Y = image_pyramid_[level].rows - edge_thershold + 3;
+
+            vector<cv::KeyPoint> distribute_kps;
+            distribute_kps.reserve(num_features * 10);
+            for (int k = level_begin[level]; k < level_begin[level + 1]; k++)
+            {
+                for (auto &kp : cells[k].kps)
                 {
-                    for (auto vit = cell_kps.begin(); vit != cell_kps.end(); vit++)
-                    {
-                        (*vit).pt.x += j * cell_width;
-                        (*vit).pt.y += i * cell_height;
-                        distribute_kps.push_back(*vit);
-                    }
+                    kp.pt.x += cells[k].j;
+                    kp.pt.y += cells[k].i;
+                    distribute_kps.push_back(kp);
                 }
             }
-        }
 
-        vector<KeyPoint> &level_kps = all_kps[level];
-        level_kps.reserve(num_features);
+            vector<KeyPoint> &level_kps = all_kps[level];
+            level_kps.reserve(num_features);
 
-        level_kps = DistributeQuadTree(distribute_kps, min_border_x, max_border_X,
-                                       min_border_Y, max_border_Y, num_desired_features_[level], level);
+            level_kps = DistributeQuadTree(distribute_kps, min_border_x, max_border_X,
+                                           min_border_Y, max_border_Y, num_desired_features_[level], level);
 
-        const int scaled_patch_size = patch_size * scale_factor_per_levels_[level];
+            const int scaled_patch_size = patch_size * scale_factor_per_levels_[level];
 
-        // Add border to coordinates and scale information
-        const int nkps = level_kps.size();
-        for (int i = 0; i < nkps; i++)
-        {
-            level_kps[i].pt.x += min_border_x;
-            level_kps[i].pt.y += min_border_Y;
-            level_kps[i].octave = level;
-            level_kps[i].size = scaled_patch_size;
-        }
-    }
+            // Add border to coordinates and scale information
+            const int nkps = level_kps.size();
+            for (int i = 0; i < nkps; i++)
+            {
+                level_kps[i].pt.x += min_border_x;
+                level_kps[i].pt.y += min_border_Y;
+                level_kps[i].octave = level;
+                level_kps[i].size = scaled_patch_size;
+            }
 
-    // compute orientations
-    for (int level = 0; level < num_levels; level++)
-        ComputeOrientation(image_pyramid_[level], all_kps[level]);
+            // compute orientations
+            ComputeOrientation(image_pyramid_[level], level_kps);
+        }
+    });
 }
 
 void Extractor::ComputePyramid(cv::Mat image)
@@ -50,11 +50,12 @@ Observation Frame::GetObservation()
     int height = image_left.rows, width = image_left.cols;
     for (auto &pair_feature : features_left)
     {
-        auto observations = pair_feature.second->landmark.lock()->observations;
-        if (observations.find(id - 1) != observations.end())
+        auto &observations = pair_feature.second->landmark.lock()->observations;
+        auto prev = observations.find(id - 1);
+        if (prev != observations.end())
         {
             auto pt = pair_feature.second->keypoint.pt;
-            auto prev_pt = observations[id - 1]->keypoint.pt;
+            auto prev_pt = prev->second->keypoint.pt;
             int row = (int)(pt.y / (height / obs_rows));
             int col = (int)(pt.x / (width / obs_cols));
             obs.at<cv::Vec3f>(row, col)[0] += 1;
@@ -0,0 +1,313 @@
+#include "lvio_fusion/frame_store.h"
+#include "lvio_fusion/buffer.h"
+#include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace lvio_fusion
+{
+
+inline size_t frame_bytes(Frame::Ptr frame)
+{
+    size_t bytes = mat_bytes(frame->image_left) + mat_bytes(frame->image_right) + mat_bytes(frame->descriptors);
+    if (frame->feature_lidar)
+    {
+        bytes += (frame->feature_lidar->points_surf.size() + frame->feature_lidar->points_ground.size()) * sizeof(PointI);
+    }
+    return bytes;
+}
+
+const int max_free_images = 8;
+
+// images of new keyframes are added by Map, the spill file is on disk
+struct StoreMemory
+{
+    MemoryAccount &images = Metrics::Instance().GetMemory("keyframe_images");
+    MemoryAccount &resident = Metrics::Instance().GetMemory("frame_store_resident");
+    MemoryAccount &compressed = Metrics::Instance().GetMemory("frame_store_compressed");
+    MemoryAccount &spilled = Metrics::Instance().GetMemory("frame_store_spilled");
+};
+
+inline StoreMemory &store_memory()
+{
+    static StoreMemory instance;
+    return instance;
+}
+
+inline size_t images_bytes(Frame::Ptr frame)
+{
+    return mat_bytes(frame->image_left) + mat_bytes(frame->image_right);
+}
+
+FrameStore::~FrameStore()
+{
+    if (data_)
+    {
+        munmap(data_, mapped_size_);
+    }
+    if (fd_ >= 0)
+    {
+        close(fd_);
+        unlink(path_.c_str());
+    }
+}
+
+bool FrameStore::Open(const std::string &path, double max_memory, double radius, ImagePolicy images)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    max_memory_ = max_memory * 1024 * 1024;
+    radius_ = radius;
+    images_ = images;
+    if (max_memory_ == 0)
+        return true;
+    path_ = path;
+    fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0)
+    {
+        LOG(ERROR) << "FrameStore: can not open spill file " << path_;
+        max_memory_ = 0;
+        return false;
+    }
+    LOG(INFO) << "FrameStore: spill file " << path_ << ", memory ceiling " << max_memory << " MB";
+    return true;
+}
+
+bool FrameStore::Remap(size_t size)
+{
+    if (size <= mapped_size_)
+        return true;
+    if (data_)
+    {
+        munmap(data_, mapped_size_);
+    }
+    void *data = mmap(NULL, file_size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (data == MAP_FAILED)
+    {
+        LOG(ERROR) << "FrameStore: can not map spill file " << path_;
+        data_ = nullptr;
+        mapped_size_ = 0;
+        return false;
+    }
+    data_ = (char *)data;
+    mapped_size_ = file_size_;
+    return true;
+}
+
+bool FrameStore::Evict(Frame::Ptr frame)
+{
+    // the spilled data never changes, so only write it once, unless lidar features come later
+    auto iter = records_.find(frame->time);
+    if (iter == records_.end() || (!iter->second.lidar && frame->feature_lidar))
+    {
+        std::vector<char> buffer;
+        write_mat(buffer, frame->image_left);
+        write_mat(buffer, frame->image_right);
+        write_mat(buffer, frame->descriptors);
+        if (frame->feature_lidar)
+        {
+            write_points(buffer, frame->feature_lidar->points_surf);
+            write_points(buffer, frame->feature_lidar->points_ground);
+        }
+        if (pwrite(fd_, buffer.data(), buffer.size(), file_size_) != (ssize_t)buffer.size())
+        {
+            LOG(ERROR) << "FrameStore: can not write spill file " << path_;
+            return false;
+        }
+        store_memory().spilled.Add(buffer.size(), iter == records_.end());
+        records_[frame->time] = {file_size_, buffer.size(), (bool)frame->feature_lidar};
+        file_size_ += buffer.size();
+    }
+    store_memory().images.Remove(images_bytes(frame), 0);
+    frame->image_left.release();
+    frame->image_right.release();
+    frame->descriptors.release();
+    if (records_[frame->time].lidar)
+    {
+        frame->feature_lidar->points_surf = PointICloud();
+        frame->feature_lidar->points_ground = PointICloud();
+    }
+    return true;
+}
+
+FrameStore::Pin::~Pin()
+{
+    if (pinned_)
+    {
+        FrameStore::Instance().Unpin(time_);
+    }
+}
+
+void FrameStore::Unpin(double time)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto iter = pinned_.find(time);
+    if (--iter->second == 0)
+    {
+        pinned_.erase(iter);
+    }
+}
+
+void FrameStore::Recycle(cv::Mat &image)
+{
+    // only reuse buffers that nobody else refers to
+    if (image.u && image.u->refcount == 1 && free_images_.size() < max_free_images)
+    {
+        free_images_.push_back(image);
+    }
+    image.release();
+}
+
+void FrameStore::Retain(Frame::Ptr frame)
+{
+    if (images_ == ImagePolicy::Compress && !frame->image_left.empty())
+    {
+        std::vector<uchar> &buffer = compressed_[frame->time];
+        cv::imencode(".png", frame->image_left, buffer);
+        compressed_size_ += buffer.size();
+        store_memory().compressed.Add(buffer.size());
+    }
+    store_memory().images.Remove(images_bytes(frame), 0);
+    Recycle(frame->image_left);
+    Recycle(frame->image_right);
+}
+
+void FrameStore::Acquire(cv::Mat &image, cv::Size size, int type)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto iter = free_images_.begin(); iter != free_images_.end(); iter++)
+    {
+        if (iter->size() == size && iter->type() == type)
+        {
+            image = *iter;
+            free_images_.erase(iter);
+            return;
+        }
+    }
+    image.create(size, type);
+}
+
+void FrameStore::Compact(double end, const Vector3d &position)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (max_memory_ == 0 && images_ == ImagePolicy::Keep)
+        return;
+
+    // keyframes before end will not be changed
+    end = std::min(end, held_);
+    auto old_kfs = Map::Instance().GetRange(scanned_, end);
+    for (auto &pair : old_kfs)
+    {
+        // scanned again by the next compaction
+        if (pair.first >= end || pinned_.count(pair.first))
+            break;
+        if (images_ != ImagePolicy::Keep)
+        {
+            Retain(pair.second);
+        }
+        size_t bytes = frame_bytes(pair.second);
+        resident_[pair.first] = bytes;
+        memory_ += bytes;
+        store_memory().resident.Add(bytes);
+        scanned_ = pair.first + epsilon;
+    }
+
+    // decoded images of far keyframes can be decoded again
+    for (auto iter = decoded_.begin(); iter != decoded_.end();)
+    {
+        auto frame = Map::Instance().GetKeyFrame(*iter);
+        if (frame->time == *iter && !pinned_.count(*iter) && (frame->t() - position).norm() > radius_)
+        {
+            store_memory().images.Remove(mat_bytes(frame->image_left), 0);
+            Recycle(frame->image_left);
+            iter = decoded_.erase(iter);
+        }
+        else
+        {
+            iter++;
+        }
+    }
+
+    if (max_memory_ == 0)
+        return;
+
+    int num_evicted = 0;
+    for (auto iter = resident_.begin(); iter != resident_.end() && memory_ > max_memory_;)
+    {
+        auto frame = Map::Instance().GetKeyFrame(iter->first);
+        if (frame->time == iter->first && !pinned_.count(iter->first) && (frame->t() - position).norm() > radius_ && Evict(frame))
+        {
+            memory_ -= iter->second;
+            store_memory().resident.Remove(iter->second);
+            iter = resident_.erase(iter);
+            num_evicted++;
+        }
+        else
+        {
+            iter++;
+        }
+    }
+    if (num_evicted)
+    {
+        this->num_evicted += num_evicted;
+        LOG(INFO) << "FrameStore: memory " << memory_ / 1024.0 / 1024.0 << " MB, ceiling " << max_memory_ / 1024.0 / 1024.0
+                  << " MB, evicted " << this->num_evicted << ", loaded " << num_loaded << ", spill file " << file_size_ / 1024.0 / 1024.0 << " MB";
+    }
+}
+
+void FrameStore::Hold(double time)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    held_ = time;
+}
+
+double FrameStore::Held()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return held_;
+}
+
+FrameStore::Pin FrameStore::Load(Frame::Ptr frame)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    pinned_[frame->time]++;
+    auto iter = records_.find(frame->time);
+    if (iter != records_.end() && resident_.find(frame->time) == resident_.end() && Remap(iter->second.offset + iter->second.size))
+    {
+        Record &record = iter->second;
+        const char *p = data_ + record.offset;
+        p = read_mat(p, frame->image_left);
+        p = read_mat(p, frame->image_right);
+        p = read_mat(p, frame->descriptors);
+        if (record.lidar && frame->feature_lidar)
+        {
+            p = read_points(p, frame->feature_lidar->points_surf);
+            p = read_points(p, frame->feature_lidar->points_ground);
+        }
+        size_t bytes = frame_bytes(frame);
+        resident_[frame->time] = bytes;
+        memory_ += bytes;
+        num_loaded++;
+        store_memory().resident.Add(bytes);
+        store_memory().images.Add(images_bytes(frame), 0);
+    }
+    // the decoded image is released again when the keyframe is far away
+    auto compressed = compressed_.find(frame->time);
+    if (compressed != compressed_.end() && frame->image_left.empty())
+    {
+        frame->image_left = cv::imdecode(compressed->second, cv::IMREAD_UNCHANGED);
+        decoded_.insert(frame->time);
+        store_memory().images.Add(mat_bytes(frame->image_left), 0);
+    }
+    return Pin(frame->time);
+}
+
+double FrameStore::Memory()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return (memory_ + compressed_size_) / 1024.0 / 1024.0;
+}
+
+} // namespace lvio_fusion
@@ -1,6 +1,7 @@
 #include "lvio_fusion/frontend.h"
 #include "lvio_fusion/backend.h"
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
 #include "lvio_fusion/navsat/navsat.h"
 #include "lvio_fusion/utility.h"
 #include "lvio_fusion/visual/camera.h"
@@ -10,17 +11,24 @@
 namespace lvio_fusion
 {
 
-Frontend::Frontend(int num_features, int init, int tracking, int tracking_bad, int need_for_keyframe)
-    : num_features_init_(init), num_features_tracking_bad_(tracking_bad), num_features_needed_for_keyframe_(need_for_keyframe), local_map(num_features)
+Frontend::Frontend(int num_features, int init, int tracking, int tracking_bad, bool opencl, bool record_tracking, bool async_keyframe)
+    : num_features_init_(init), num_features_tracking_bad_(tracking_bad), opencl_(opencl), record_tracking_(record_tracking), local_map(num_features, opencl, async_keyframe)
 {
 }
 
-cv::Mat img_track;
 bool Frontend::AddFrame(Frame::Ptr frame)
 {
+    static Histogram &histogram = Metrics::Instance().GetHistogram("frontend_tracking");
+    ScopedTimer timer(histogram);
     std::unique_lock<std::mutex> lock(mutex);
     current_frame = frame;
-    cv::cvtColor(current_frame->image_left, img_track, cv::COLOR_GRAY2RGB);
+    AcquireFlowImages();
+    if (record_tracking_)
+    {
+        tracking_ = Tracking();
+        tracking_.time = current_frame->time;
+        tracking_.image = current_frame->image_left;
+    }
     switch (status)
     {
     case FrontendStatus::BUILDING:
@@ -30,19 +38,38 @@ bool Frontend::AddFrame(Frame::Ptr frame)
     case FrontendStatus::TRACKING:
     case FrontendStatus::LOST:
         InitFrame();
+        if (auto merged = local_map.Merge())
+        {
+            untracked_kf_ = merged;
+        }
         Track();
         break;
     }
-    cv::imshow("tracking", img_track);
-    cv::waitKey(1);
+    if (record_tracking_)
+    {
+        for (auto &pair_feature : current_frame->features_left)
+        {
+            if (pair_feature.second->match)
+            {
+                tracking_.matched.push_back(pair_feature.second->keypoint.pt);
+            }
+        }
+        std::unique_lock<std::mutex> lock_tracking(mutex_tracking_);
+        std::swap(tracking_last_, tracking_);
+    }
+    ReleaseFlowImages();
     last_frame = current_frame;
     last_frame_pose_cache_ = last_frame->pose;
+    AnchorPropagator();
     return true;
 }
 
 void Frontend::AddImu(double time, Vector3d acc, Vector3d gyr)
 {
-    imu_buf_.push(ImuData(acc, gyr, time));
+    if (!imu_buf_.Push(ImuData(acc, gyr, time)))
+    {
+        LOG(WARNING) << "Imu buffer is full, drop imu data at " << std::fixed << time;
+    }
 }
 
 // only for temp
@@ -136,8 +163,13 @@ bool Frontend::Track()
         return false;
     }
 
-    if (num_inliers < num_features_needed_for_keyframe_ ||
-        current_frame->time - last_keyframe->time > 1.0)
+    KeyframeState state;
+    SE3d relative = last_keyframe->pose.inverse() * current_frame->pose;
+    state.dt = current_frame->time - last_keyframe->time;
+    state.distance = relative.translation().norm();
+    state.angle = relative.so3().log().norm();
+    state.num_tracked = num_inliers;
+    if (keyframe_policy_->NeedVisual(state))
     {
         CreateKeyframe();
     }
@@ -160,33 +192,82 @@ int Frontend::TrackLastFrame()
     // use LK flow to estimate points in the last image
     kps_last.reserve(last_frame->features_left.size());
     kps_perdict.reserve(last_frame->features_left.size());
+    landmarks.reserve(last_frame->features_left.size());
     for (auto &pair : last_frame->features_left)
     {
         // use project point
         auto feature = pair.second;
         auto landmark = feature->landmark.lock();
-        auto px = Camera::Get()->World2Pixel(local_map.position_cache[landmark->id], current_frame->pose);
+        auto px = Camera::Get()->World2Pixel(local_map.Position(landmark->id), current_frame->pose);
         kps_last.push_back(feature->keypoint.pt);
         kps_perdict.push_back(cv::Point2f(px[0], px[1]));
         landmarks.push_back(landmark);
     }
-    // if last frame is a key frame, use new landmarks
-    if (last_frame == last_keyframe)
+    // use new landmarks of the keyframe, they are tracked from the keyframe if it is not the last frame
+    std::vector<cv::Point2f> kps_kf, kps_kf_current, kps_kf_perdict;
+    std::vector<visual::Landmark::Ptr> landmarks_kf;
+    if (untracked_kf_)
     {
-        auto features = local_map.GetFeatures(last_frame->time);
-        kps_last.reserve(kps_last.size() + features.size());
-        kps_perdict.reserve(kps_perdict.size() + features.size());
+        bool last = untracked_kf_ == last_frame;
+        auto &kps = last ? kps_last : kps_kf;
+        auto &kps_perdict_new = last ? kps_perdict : kps_kf_perdict;
+        auto &landmarks_new = last ? landmarks : landmarks_kf;
+        auto features = local_map.GetFeatures(untracked_kf_->time);
         for (auto &feature : features)
         {
             auto landmark = feature->landmark.lock();
-            auto px = Camera::Get()->World2Pixel(local_map.position_cache[landmark->id], current_frame->pose);
-            kps_last.push_back(feature->keypoint.pt);
-            kps_perdict.push_back(cv::Point2f(px[0], px[1]));
-            landmarks.push_back(landmark);
+            auto px = Camera::Get()->World2Pixel(local_map.Position(landmark->id), current_frame->pose);
+            kps.push_back(feature->keypoint.pt);
+            kps_perdict_new.push_back(cv::Point2f(px[0], px[1]));
+            landmarks_new.push_back(landmark);
+        }
+        if (untracked_kf_->image_left.empty())
+        {
+            kps_kf.clear();
         }
     }
     kps_current = kps_perdict;
-    optical_flow(last_frame->image_left, current_frame->image_left, kps_last, kps_current, status);
+    kps_kf_current = kps_kf_perdict;
+    {
+        static Histogram &histogram_flow = Metrics::Instance().GetHistogram("frontend_optical_flow");
+        ScopedTimer timer(histogram_flow);
+        std::vector<uchar> status_kf;
+        if (opencl_)
+        {
+            if (last_frame->device_left.empty())
+            {
+                last_frame->image_left.copyTo(last_frame->device_left);
+            }
+            optical_flow(last_frame->device_left, current_frame->device_left, kps_last, kps_current, status);
+            if (!kps_kf.empty())
+            {
+                cv::UMat device_kf;
+                untracked_kf_->image_left.copyTo(device_kf);
+                optical_flow(device_kf, current_frame->device_left, kps_kf, kps_kf_current, status_kf);
+            }
+        }
+        else
+        {
+            if (last_frame->pyramid_left.empty())
+            {
+                build_pyramid(last_frame->image_left, last_frame->pyramid_left);
+            }
+            optical_flow(last_frame->pyramid_left, current_frame->pyramid_left, kps_last, kps_current, status);
+            if (!kps_kf.empty())
+            {
+                std::vector<cv::Mat> pyramid_kf;
+                build_pyramid(untracked_kf_->image_left, pyramid_kf);
+                optical_flow(pyramid_kf, current_frame->pyramid_left, kps_kf, kps_kf_current, status_kf);
+            }
+        }
+        if (!kps_kf.empty())
+        {
+            kps_current.insert(kps_current.end(), kps_kf_current.begin(), kps_kf_current.end());
+            kps_perdict.insert(kps_perdict.end(), kps_kf_perdict.begin(), kps_kf_perdict.end());
+            landmarks.insert(landmarks.end(), landmarks_kf.begin(), landmarks_kf.end());
+            status.insert(status.end(), status_kf.begin(), status_kf.end());
+        }
+    }
     // Solve PnP
     std::vector<cv::Point3f> points_3d_far, points_3d_near;
     std::vector<cv::Point2f> points_2d_far, points_2d_near;
@@ -210,25 +291,27 @@ int Frontend::TrackLastFrame()
         if (status[i])
         {
             deviations[i] -= avg_d;
-            if (Camera::Get()->Far(local_map.position_cache[landmarks[i]->id], current_frame->pose))
+            Vector3d pw = local_map.Position(landmarks[i]->id);
+            if (Camera::Get()->Far(pw, current_frame->pose))
             {
                 map_far.push_back(i);
                 points_2d_far.push_back(kps_current[i]);
-                Vector3d pw = local_map.position_cache[landmarks[i]->id];
                 points_3d_far.push_back(cv::Point3f(pw.x(), pw.y(), pw.z()));
             }
             else if (cv_distance(deviations[i]) < 30)
             {
                 map_near.push_back(i);
                 points_2d_near.push_back(kps_current[i]);
-                Vector3d pw = local_map.position_cache[landmarks[i]->id];
                 points_3d_near.push_back(cv::Point3f(pw.x(), pw.y(), pw.z()));
             }
-            else
+            else if (record_tracking_)
             {
-                cv::putText(img_track, "X", kps_current[i], cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 255));
+                tracking_.rejected.push_back(kps_current[i]);
+            }
+            if (record_tracking_)
+            {
+                tracking_.deviations.push_back(std::make_pair(kps_current[i], deviations[i]));
             }
-            cv::arrowedLine(img_track, kps_current[i], kps_current[i] + deviations[i], cv::Scalar(0, 255, 0), 1, 8, 0, 0.2);
         }
     }
 
@@ -238,8 +321,6 @@ int Frontend::TrackLastFrame()
         // near
         for (auto &i : map_near)
         {
-            // cv::arrowedLine(img_track, kps_current[i], kps_last[i], cv::Scalar(0, 255, 0), 1, 8, 0, 0.2);
-            cv::circle(img_track, kps_current[i], 2, cv::Scalar(0, 255, 0), cv::FILLED);
             auto feature = visual::Feature::Create(current_frame, cv::KeyPoint(kps_current[i], 1), landmarks[i]);
             current_frame->AddFeature(feature);
             num_good_pts++;
@@ -247,15 +328,22 @@ int Frontend::TrackLastFrame()
         // far
         for (auto &i : map_far)
         {
-            // cv::arrowedLine(img_track, kps_current[i], kps_last[i], cv::Scalar(0, 0, 255), 1, 8, 0, 0.2);
-            cv::circle(img_track, kps_current[i], 2, cv::Scalar(0, 0, 255), cv::FILLED);
             auto feature = visual::Feature::Create(current_frame, cv::KeyPoint(kps_current[i], 1), landmarks[i]);
             current_frame->AddFeature(feature);
             num_good_pts++;
         }
+        if (record_tracking_)
+        {
+            tracking_.near = points_2d_near;
+            tracking_.far = points_2d_far;
+        }
     }
 
     // LOG(INFO) << "Find " << num_good_pts << " in the last image.";
+    if (num_good_pts)
+    {
+        untracked_kf_ = nullptr;
+    }
     return num_good_pts;
 }
 
@@ -264,6 +352,7 @@ bool Frontend::InitMap()
     int num_new_features = local_map.Init(current_frame);
     if (num_new_features < num_features_init_)
         return false;
+    untracked_kf_ = current_frame;
 
     if (Imu::Num())
     {
@@ -285,6 +374,10 @@ bool Frontend::InitMap()
 
 void Frontend::CreateKeyframe()
 {
+    static Histogram &histogram = Metrics::Instance().GetHistogram("frontend_keyframe");
+    static std::atomic<long> &num_keyframes = Metrics::Instance().GetCounter("keyframes");
+    ScopedTimer timer(histogram);
+    num_keyframes++;
     // first, add new observations of old points
     for (auto &pair_feature : current_frame->features_left)
     {
@@ -293,7 +386,10 @@ void Frontend::CreateKeyframe()
         landmark->AddObservation(feature);
     }
     // detect new features, track in right image and triangulate map points
-    local_map.AddKeyFrame(current_frame);
+    if (local_map.AddKeyFrame(current_frame))
+    {
+        untracked_kf_ = current_frame;
+    }
     // insert!
     Map::Instance().InsertKeyFrame(current_frame);
     last_keyframe = current_frame;
@@ -303,16 +399,16 @@ void Frontend::CreateKeyframe()
     backend_.lock()->UpdateMap();
 }
 
-void Frontend::UpdateCache()
+void Frontend::UpdateCache(bool landmarks)
 {
-    local_map.UpdateCache();
+    local_map.UpdateCache(landmarks);
     for (auto &pair_feature : last_frame->features_left)
     {
         auto feature = pair_feature.second;
         auto landmark = feature->landmark.lock();
-        if (local_map.position_cache.find(landmark->id) == local_map.position_cache.end())
+        if (!local_map.Anchored(landmark->id))
         {
-            local_map.position_cache[landmark->id] = landmark->ToWorld();
+            local_map.Anchor(landmark);
         }
     }
     last_frame_pose_cache_ = last_frame->pose;
@@ -321,6 +417,7 @@ void Frontend::UpdateCache()
     {
         relative_i_j_ = se3_slerp(SE3d(), last_keyframe2->pose.inverse() * last_keyframe->pose, dt_ / (last_keyframe->time - last_keyframe2->time));
     }
+    AnchorPropagator();
 }
 
 void Frontend::UpdateImu(const Bias &bias_)
@@ -343,30 +440,27 @@ void Frontend::UpdateImu(const Bias &bias_)
         last_frame->SetPose(Rwb2, twb2);
         last_frame->SetVelocity(Vwb2);
     }
+    AnchorPropagator();
 }
 
 void Frontend::Preintegrate()
 {
     // get imu data fron last frame
     std::vector<ImuData> imu_from_last_frame;
-    int timeout = dt_ * 1e3; // 100ms
-    while (timeout)
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds((int)(dt_ * 1e3)); // 100ms
+    while (true)
     {
-        if (imu_buf_.empty())
-        {
-            std::this_thread::sleep_for(std::chrono::milliseconds(1));
-            timeout--;
-            continue;
-        }
-        ImuData imu_data = imu_buf_.front();
+        if (imu_buf_.Empty() && !imu_buf_.Wait(deadline - std::chrono::steady_clock::now()))
+            break;
+        ImuData imu_data = imu_buf_.Front();
         if (imu_data.t < last_frame->time - epsilon)
         {
-            imu_buf_.pop();
+            imu_buf_.Pop();
         }
         else if (imu_data.t < current_frame->time - epsilon)
         {
             imu_from_last_frame.push_back(imu_data);
-            imu_buf_.pop();
+            imu_buf_.Pop();
         }
         else
         {
@@ -421,8 +515,9 @@ void Frontend::Preintegrate()
             }
             if (tab == 0)
                 continue;
-            preintegration_last_kf_->Append(tstep, acc, ang_vel, acc0, ang_vel0);
-            preintegration_last_frame->Append(tstep, acc, ang_vel, acc0, ang_vel0);
+            auto sample = imu_samples_.Push(tstep, acc, ang_vel);
+            preintegration_last_kf_->Append(sample, acc0, ang_vel0);
+            preintegration_last_frame->Append(sample, acc0, ang_vel0);
         }
 
         if (Imu::Get()->initialized)
@@ -450,4 +545,46 @@ void Frontend::PredictState()
     current_frame->SetBias(last_frame->bias);
 }
 
+void Frontend::AnchorPropagator()
+{
+    if (propagator_ && last_frame && Imu::Get()->initialized)
+    {
+        propagator_->Anchor(last_frame->time, last_frame->pose, last_frame->Vw, last_frame->bias);
+    }
+}
+
+Tracking Frontend::GetTracking()
+{
+    std::unique_lock<std::mutex> lock(mutex_tracking_);
+    return tracking_last_;
+}
+
+void Frontend::AcquireFlowImages()
+{
+    if (opencl_)
+    {
+        cv::swap(current_frame->device_left, free_devices_[0]);
+        cv::swap(current_frame->device_right, free_devices_[1]);
+        current_frame->image_left.copyTo(current_frame->device_left);
+    }
+    else
+    {
+        current_frame->pyramid_left.swap(free_pyramids_[0]);
+        current_frame->pyramid_right.swap(free_pyramids_[1]);
+        build_pyramid(current_frame->image_left, current_frame->pyramid_left);
+    }
+}
+
+void Frontend::ReleaseFlowImages()
+{
+    // the right images are only used by the stereo matching of the new keyframe
+    free_pyramids_[1].swap(current_frame->pyramid_right);
+    cv::swap(free_devices_[1], current_frame->device_right);
+    if (last_frame)
+    {
+        free_pyramids_[0].swap(last_frame->pyramid_left);
+        cv::swap(free_devices_[0], last_frame->device_left);
+    }
+}
+
 } // namespace lvio_fusion
\ No newline at end of file
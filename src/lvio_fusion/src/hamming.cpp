@@ -0,0 +1,121 @@
+#include "lvio_fusion/visual/hamming.h"
+
+#include <climits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+namespace lvio_fusion
+{
+
+static_assert(sizeof(BRIEF) == 32, "BRIEF should be 256 bits");
+
+inline int hamming_scalar(const BRIEF &a, const BRIEF &b)
+{
+    const uint64_t *pa = reinterpret_cast<const uint64_t *>(&a);
+    const uint64_t *pb = reinterpret_cast<const uint64_t *>(&b);
+    return __builtin_popcountll(pa[0] ^ pb[0]) + __builtin_popcountll(pa[1] ^ pb[1]) +
+           __builtin_popcountll(pa[2] ^ pb[2]) + __builtin_popcountll(pa[3] ^ pb[3]);
+}
+
+template <typename Distance>
+inline int match_briefs_with(const BRIEF &query, const std::vector<const BRIEF *> &briefs, int &best, int &second, Distance distance)
+{
+    int index = -1;
+    best = second = INT_MAX;
+    for (int i = 0; i < briefs.size(); i++)
+    {
+        int d = distance(query, *briefs[i]);
+        if (d < best)
+        {
+            second = best;
+            best = d;
+            index = i;
+        }
+        else if (d < second)
+        {
+            second = d;
+        }
+    }
+    return index;
+}
+
+int match_briefs_scalar(const BRIEF &query, const std::vector<const BRIEF *> &briefs, int &best, int &second)
+{
+    return match_briefs_with(query, briefs, best, second, hamming_scalar);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("popcnt"))) int match_briefs_popcnt(const BRIEF &query, const std::vector<const BRIEF *> &briefs, int &best, int &second)
+{
+    return match_briefs_with(query, briefs, best, second, hamming_scalar);
+}
+
+__attribute__((target("avx2"))) inline int hamming_avx2(const __m256i &a, const BRIEF &b)
+{
+    // popcount by looking up the table of nibbles
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i x = _mm256_xor_si256(a, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&b)));
+    __m256i lo = _mm256_and_si256(x, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask);
+    __m256i count = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo), _mm256_shuffle_epi8(lookup, hi));
+    __m256i sum = _mm256_sad_epu8(count, _mm256_setzero_si256());
+    return _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1) +
+           _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+}
+
+__attribute__((target("avx2"))) int match_briefs_avx2(const BRIEF &query, const std::vector<const BRIEF *> &briefs, int &best, int &second)
+{
+    __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&query));
+    return match_briefs_with(query, briefs, best, second, [&q](const BRIEF &, const BRIEF &b) { return hamming_avx2(q, b); });
+}
+#elif defined(__ARM_NEON)
+inline int hamming_neon(const uint8x16_t &a0, const uint8x16_t &a1, const BRIEF &b)
+{
+    const uint8_t *pb = reinterpret_cast<const uint8_t *>(&b);
+    uint8x16_t c0 = vcntq_u8(veorq_u8(a0, vld1q_u8(pb)));
+    uint8x16_t c1 = vcntq_u8(veorq_u8(a1, vld1q_u8(pb + 16)));
+    return vaddlvq_u8(c0) + vaddlvq_u8(c1);
+}
+
+int match_briefs_neon(const BRIEF &query, const std::vector<const BRIEF *> &briefs, int &best, int &second)
+{
+    const uint8_t *pq = reinterpret_cast<const uint8_t *>(&query);
+    uint8x16_t q0 = vld1q_u8(pq), q1 = vld1q_u8(pq + 16);
+    return match_briefs_with(query, briefs, best, second, [&q0, &q1](const BRIEF &, const BRIEF &b) { return hamming_neon(q0, q1, b); });
+}
+#endif
+
+typedef int (*MatchBriefs)(const BRIEF &, const std::vector<const BRIEF *> &, int &, int &);
+
+// choose the kernel once at runtime
+MatchBriefs select_match_briefs()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return match_briefs_avx2;
+    if (__builtin_cpu_supports("popcnt"))
+        return match_briefs_popcnt;
+#elif defined(__ARM_NEON)
+    return match_briefs_neon;
+#endif
+    return match_briefs_scalar;
+}
+
+int hamming_distance(const BRIEF &a, const BRIEF &b)
+{
+    return hamming_scalar(a, b);
+}
+
+int match_briefs(const BRIEF &query, const std::vector<const BRIEF *> &briefs, int &best, int &second)
+{
+    static const MatchBriefs kernel = select_match_briefs();
+    return kernel(query, briefs, best, second);
+}
+
+} // namespace lvio_fusion
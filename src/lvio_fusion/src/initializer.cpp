@@ -7,9 +7,47 @@
 namespace lvio_fusion
 {
 
+// only the states of imu are copied, the preintegrations are copied too because they are relinearized
+inline Frames copy_keyframes(const Frames &frames)
+{
+    Frames copies;
+    Frame::Ptr last;
+    for (auto &pair : frames)
+    {
+        Frame::Ptr frame = pair.second, copy = Frame::Create();
+        copy->time = frame->time;
+        copy->pose = frame->pose;
+        copy->Vw = frame->Vw;
+        copy->bias = frame->bias;
+        copy->good_imu = frame->good_imu;
+        if (frame->preintegration)
+        {
+            copy->preintegration = imu::Preintegration::Ptr(new imu::Preintegration(*frame->preintegration));
+        }
+        if (!last && frame->last_keyframe)
+        {
+            last = Frame::Create();
+            last->time = frame->last_keyframe->time;
+            last->pose = frame->last_keyframe->pose;
+        }
+        copy->last_keyframe = last;
+        copies[pair.first] = copy;
+        last = copy;
+    }
+    return copies;
+}
+
+Initializer::~Initializer()
+{
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+}
+
 void Initializer::EstimateVelAndRwg(Frames frames)
 {
-    if (!Imu::Get()->initialized)
+    if (!initialized_)
     {
         Vector3d twg = Vector3d::Zero();
         Vector3d Vw;
@@ -19,45 +57,97 @@ void Initializer::EstimateVelAndRwg(Frames frames)
             twg += frame->last_keyframe->R() * frame->preintegration->GetUpdatedDeltaVelocity();
             Vw = (frame->t() - frame->last_keyframe->t()) / frame->preintegration->sum_dt;
             frame->SetVelocity(Vw);
-            frame->SetBias(Bias());
+            frame->SetBias(warm_ ? prior_bias_ : Bias());
         }
         if (step != 4)
         {
-            Rwg_ = get_R_from_vector(twg);
+            // the gravity of the last session is better than the one by a few keyframes, if the attitude is similar
+            bool similar = warm_ && vectors_degree_angle(twg, guess_up_) < 10;
+            Rwg_ = get_R_from_vector(similar ? guess_up_ : twg);
         }
     }
 }
 
 // make sure than every frame has last_frame and preintegrate
-bool Initializer::Initialize(Frames frames, double prior_a, double prior_g)
+void Initializer::Estimate(double prior_a, double prior_g)
 {
     // estimate velocity and gravity direction
-    EstimateVelAndRwg(frames);
+    EstimateVelAndRwg(copies_);
 
     // imu optimization (don't change gravity when step == 4)
     if (step != 4)
     {
-        if (!imu::InertialOptimization(frames, Rwg_, prior_a, prior_g))
-            return false;
+        success_ = imu::InertialOptimization(copies_, Rwg_, prior_a, prior_g);
         Rwg_ = get_R_from_vector(Rwg_ * Vector3d::UnitZ());
-        Map::Instance().ApplyGravityRotation(Rwg_.inverse());
     }
+    else
+    {
+        // the gravity is along z since the last initialization
+        Matrix3d Rwg = Matrix3d::Identity();
+        success_ = imu::InertialOptimization(copies_, Rwg, prior_a, prior_g, false);
+    }
+    done_ = true;
+}
 
-    for (auto &pair : frames)
+void Initializer::Apply()
+{
+    if (!success_)
     {
-        pair.second->good_imu = true;
+        step = step != 4 ? 1 : 4;
+        Imu::Get()->initialized = false;
+        LOG(INFO) << "Initializer Failed";
+        return;
     }
 
-    // imu optimization with visual
-    imu::FullBA(frames, prior_a, prior_g);
+    // the backend keeps optimizing the velocities and bias once imu is initialized,
+    // so only the changes by the initialization are added to its newer values
+    for (auto &pair : copies_)
+    {
+        Frame::Ptr frame = frames_[pair.first];
+        if (initialized_)
+        {
+            const State &start = starts_[pair.first];
+            Bias bias(frame->bias.linearized_ba + pair.second->bias.linearized_ba - start.bias.linearized_ba,
+                      frame->bias.linearized_bg + pair.second->bias.linearized_bg - start.bias.linearized_bg);
+            frame->SetVelocity(frame->Vw + pair.second->Vw - start.Vw);
+            frame->SetBias(bias);
+        }
+        else
+        {
+            frame->SetVelocity(pair.second->Vw);
+            frame->SetBias(pair.second->bias);
+        }
+        if (frame->preintegration)
+        {
+            frame->preintegration->Relinearize(frame->bias.linearized_ba, frame->bias.linearized_bg);
+            frame->good_imu = true;
+        }
+    }
+    // rotate all keyframes and the frontend as one correction
+    if (step != 4)
+    {
+        PoseGraph::Instance().ForwardUpdate(SE3d(Quaterniond(Rwg_.inverse()), Vector3d::Zero()), 0, false);
+    }
     Imu::Get()->initialized = true;
-    return true;
+    LOG(INFO) << "Initializer Finished";
 }
 
 // 3-step initialization
 void Initializer::Initialize(double init_time, double end_time)
 {
     static double last_init_time = 0;
+    if (thread_.joinable())
+    {
+        if (!done_)
+            return;
+        thread_.join();
+        Apply();
+        frames_.clear();
+        copies_.clear();
+        starts_.clear();
+        return;
+    }
+
     bool need_init = false;
     double prior_a = 1e4, prior_g = 1e2;
     if (Imu::Get()->initialized)
@@ -65,8 +155,9 @@ void Initializer::Initialize(double init_time, double end_time)
         double dt = last_init_time ? end_time - last_init_time : 0;
         if (dt > 5 && step == 2)
         {
+            // the second step is skipped with a warm start
             need_init = true;
-            step = 3;
+            step = warm_ ? 4 : 3;
         }
         else if (dt > 10 && step == 3)
         {
@@ -89,15 +180,13 @@ void Initializer::Initialize(double init_time, double end_time)
     }
 
     Frames frames_init;
-    SE3d old_pose, new_pose;
     if (need_init)
     {
         need_init = false;
         frames_init = Map::Instance().GetKeyFrames(init_time, end_time);
-        if (frames_init.size() >= num_frames_init &&
+        if (frames_init.size() >= (warm_ ? num_frames_init / 2 : num_frames_init) &&
             frames_init.begin()->second->preintegration)
         {
-            old_pose = (--frames_init.end())->second->pose;
             if (!Imu::Get()->initialized)
             {
                 last_init_time = (--frames_init.end())->second->time;
@@ -108,25 +197,65 @@ void Initializer::Initialize(double init_time, double end_time)
     if (need_init)
     {
         LOG(INFO) << "Initializer Start";
-        if (Initialize(frames_init, prior_a, prior_g))
+        initialized_ = Imu::Get()->initialized;
+        if (warm_)
         {
-            new_pose = (--frames_init.end())->second->pose;
-            SE3d transform = new_pose * old_pose.inverse();
-            PoseGraph::Instance().ForwardUpdate(transform, end_time, false);
-            for (auto &pair : frames_init)
-            {
-                if (pair.second->preintegration)
-                    pair.second->good_imu = true;
-            }
-            LOG(INFO) << "Initializer Finished";
+            guess_up_ = Map::Instance().GetSnapshot()->begin()->second->R() * prior_up_;
         }
-        else
+        frames_ = frames_init;
+        copies_ = copy_keyframes(frames_init);
+        for (auto &pair : copies_)
         {
-            step = step != 4 ? 1 : 4;
-            Imu::Get()->initialized = false;
-            LOG(INFO) << "Initializer Failed";
+            starts_[pair.first] = {pair.second->Vw, pair.second->bias};
         }
+        done_ = false;
+        thread_ = std::thread(std::bind(&Initializer::Estimate, this, prior_a, prior_g));
     }
 }
 
+bool Initializer::Load(const std::string &path)
+{
+    cv::FileStorage fs(path, cv::FileStorage::READ);
+    if (!fs.isOpened())
+    {
+        LOG(WARNING) << "Initializer: no warm start file " << path;
+        return false;
+    }
+    cv::Mat ba, bg, up;
+    fs["ba"] >> ba;
+    fs["bg"] >> bg;
+    fs["up"] >> up;
+    if (ba.empty() || bg.empty() || up.empty())
+    {
+        LOG(WARNING) << "Initializer: bad warm start file " << path;
+        return false;
+    }
+    cv::cv2eigen(ba, prior_bias_.linearized_ba);
+    cv::cv2eigen(bg, prior_bias_.linearized_bg);
+    cv::cv2eigen(up, prior_up_);
+    warm_ = true;
+    LOG(INFO) << "Initializer: warm start, ba " << prior_bias_.linearized_ba.transpose() << ", bg " << prior_bias_.linearized_bg.transpose();
+    return true;
+}
+
+bool Initializer::Save(const std::string &path)
+{
+    Map::Snapshot snapshot = Map::Instance().GetSnapshot();
+    if (!Imu::Get()->initialized || snapshot->empty())
+        return false;
+    cv::FileStorage fs(path, cv::FileStorage::WRITE);
+    if (!fs.isOpened())
+    {
+        LOG(ERROR) << "Initializer: can not write warm start file " << path;
+        return false;
+    }
+    Frame::Ptr first = snapshot->begin()->second, last = snapshot->rbegin()->second;
+    cv::Mat ba, bg, up;
+    cv::eigen2cv(last->bias.linearized_ba, ba);
+    cv::eigen2cv(last->bias.linearized_bg, bg);
+    cv::eigen2cv(Vector3d(first->R().transpose() * Vector3d::UnitZ()), up);
+    fs << "ba" << ba << "bg" << bg << "up" << up;
+    return true;
+}
+
 } // namespace lvio_fusion
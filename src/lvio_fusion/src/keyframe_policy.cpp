@@ -0,0 +1,32 @@
+#include "lvio_fusion/keyframe_policy.h"
+
+namespace lvio_fusion
+{
+
+// keyframes are spaced out twice at most
+const double max_scale = 2;
+
+double KeyframePolicy::Scale()
+{
+    if (latency_ <= 0)
+        return 1;
+    return std::min(std::max(lag_.load() / latency_, 1.0), max_scale);
+}
+
+bool KeyframePolicy::NeedVisual(const KeyframeState &state)
+{
+    double scale = Scale();
+    return state.num_tracked < num_features_ / scale ||
+           state.dt > max_interval_ * scale ||
+           (max_angle_ > 0 && state.angle > max_angle_);
+}
+
+bool KeyframePolicy::NeedLidar(const KeyframeState &state)
+{
+    // while lagging, lidar keyframes are also limited by time when the spacing is small
+    double scale = Scale();
+    bool moved = state.distance > spacing_ * scale || (max_angle_ > 0 && state.angle > max_angle_);
+    return moved && state.dt >= (scale - 1) * max_interval_;
+}
+
+} // namespace lvio_fusion
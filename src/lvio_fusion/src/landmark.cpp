@@ -4,6 +4,7 @@
 #include "lvio_fusion/map.h"
 #include "lvio_fusion/utility.h"
 #include "lvio_fusion/visual/camera.h"
+#include "lvio_fusion/visual/covisibility.h"
 
 namespace lvio_fusion
 {
@@ -20,7 +21,9 @@ Vector3d Landmark::ToWorld()
 
 visual::Landmark::Ptr Landmark::Create(double inv_depth)
 {
-    visual::Landmark::Ptr new_point(new Landmark);
+    // the landmark and its control block are both in the pool
+    void *memory = BlockPool<sizeof(Landmark)>::Instance().Allocate();
+    visual::Landmark::Ptr new_point(new (memory) Landmark, PoolDeleter<Landmark>(), PoolAllocator<Landmark>());
     new_point->inv_depth = inv_depth;
     return new_point;
 }
@@ -34,9 +37,10 @@ void Landmark::Clear()
     }
     auto right_feature = first_observation;
     right_feature->frame.lock()->features_right.erase(id);
+    RemoveCovisibility();
 
     int num = 0;
-    Frames a = Map::Instance().GetKeyFrames(FirstFrame().lock()->time);
+    auto a = Map::Instance().GetRange(FirstFrame().lock()->time);
     for (auto &i : a)
     {
         if (i.second->features_left.find(id) != i.second->features_left.end())
@@ -66,7 +70,15 @@ void Landmark::AddObservation(visual::Feature::Ptr feature)
     assert(feature->landmark.lock()->id == id);
     if (feature->is_on_left_image)
     {
-        observations[feature->frame.lock()->id] = feature;
+        auto frame = feature->frame.lock();
+        if (observations.find(frame->id) == observations.end())
+        {
+            for (auto &pair_feature : observations)
+            {
+                Covisibility::Instance().Add(pair_feature.second->frame.lock()->time, frame->time);
+            }
+        }
+        observations[frame->id] = feature;
     }
     else
     {
@@ -78,7 +90,25 @@ void Landmark::AddObservation(visual::Feature::Ptr feature)
 void Landmark::RemoveObservation(visual::Feature::Ptr feature)
 {
     assert(feature->is_on_left_image && feature != observations.begin()->second);
-    observations.erase(feature->frame.lock()->id);
+    auto frame = feature->frame.lock();
+    if (observations.erase(frame->id))
+    {
+        for (auto &pair_feature : observations)
+        {
+            Covisibility::Instance().Remove(pair_feature.second->frame.lock()->time, frame->time);
+        }
+    }
+}
+
+void Landmark::RemoveCovisibility()
+{
+    for (auto a = observations.begin(); a != observations.end(); a++)
+    {
+        for (auto b = std::next(a); b != observations.end(); b++)
+        {
+            Covisibility::Instance().Remove(a->second->frame.lock()->time, b->second->frame.lock()->time);
+        }
+    }
 }
 } // namespace visual
 
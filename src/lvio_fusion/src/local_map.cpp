@@ -1,8 +1,12 @@
 #include "lvio_fusion/visual/local_map.h"
 #include "lvio_fusion/ceres/visual_error.hpp"
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/scheduler.h"
 #include "lvio_fusion/utility.h"
 #include "lvio_fusion/visual/camera.h"
+#include "lvio_fusion/visual/covisibility.h"
+#include "lvio_fusion/visual/hamming.h"
 
 namespace lvio_fusion
 {
@@ -29,22 +33,71 @@ inline std::vector<BRIEF> mat2briefs(cv::Mat descriptors)
     return briefs;
 }
 
-inline cv::Mat briefs2mat(std::vector<BRIEF> briefs)
+Grid::Grid(const Level &features, double cell_size, int width, int height)
+    : cell_size_(cell_size), cols_(width / cell_size + 1), rows_(height / cell_size + 1)
 {
-    cv::Mat descriptors(briefs.size(), 32, CV_8U);
-    for (int i = 0; i < briefs.size(); i++)
+    cells_.resize(cols_ * rows_);
+    for (int i = 0; i < features.size(); i++)
+    {
+        int x = features[i]->keypoint.pt.x / cell_size_, y = features[i]->keypoint.pt.y / cell_size_;
+        if (x >= 0 && x < cols_ && y >= 0 && y < rows_)
+        {
+            cells_[y * cols_ + x].push_back(i);
+        }
+    }
+}
+
+void Grid::Query(const cv::Point2f &p, std::vector<int> &indices) const
+{
+    indices.clear();
+    int cx = std::floor(p.x / cell_size_), cy = std::floor(p.y / cell_size_);
+    for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, rows_ - 1); y++)
+    {
+        for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, cols_ - 1); x++)
+        {
+            auto &cell = cells_[y * cols_ + x];
+            indices.insert(indices.end(), cell.begin(), cell.end());
+        }
+    }
+    // keep the order of the level, so that ties are broken as before
+    std::sort(indices.begin(), indices.end());
+}
+
+void LocalMap::AnchorFrame(Frame::Ptr frame)
+{
+    if (anchor_frames_.find(frame->time) == anchor_frames_.end())
     {
-        brief2mat(briefs[i]).copyTo(descriptors.row(i));
+        anchor_frames_[frame->time] = frame;
+        pose_cache[frame->time] = frame->pose;
     }
-    return descriptors;
 }
 
-inline Vector3d LocalMap::ToWorld(visual::Feature::Ptr feature)
+void LocalMap::AnchorLandmark(visual::Landmark::Ptr landmark)
+{
+    auto frame = landmark->FirstFrame().lock();
+    AnchorFrame(frame);
+    AnchoredPoint &anchored = anchors_[landmark->id];
+    anchored.time = frame->time;
+    anchored.pb = Camera::Get(1)->Pixel2Robot(cv2eigen(landmark->first_observation->keypoint.pt), 1 / landmark->inv_depth);
+}
+
+void LocalMap::Anchor(visual::Landmark::Ptr landmark)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    AnchorLandmark(landmark);
+}
+
+LocalMap::~LocalMap()
 {
-    Vector3d pb = Camera::Get(1)->Pixel2Robot(
-        cv2eigen(feature->landmark.lock()->first_observation->keypoint.pt),
-        1 / feature->landmark.lock()->inv_depth);
-    return Camera::Get()->Robot2World(pb, pose_cache[feature->frame.lock()->time]);
+    if (thread_.joinable())
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_jobs_);
+            running_ = false;
+        }
+        cv_jobs_.notify_all();
+        thread_.join();
+    }
 }
 
 int LocalMap::Init(Frame::Ptr new_kf)
@@ -52,26 +105,42 @@ int LocalMap::Init(Frame::Ptr new_kf)
     // reset
     Reset();
     // get feature pyramid
+    Pyramid pyramid;
+    Grids grids;
+    visual::Landmarks new_landmarks;
+    GetFeaturePyramid(new_kf, pyramid);
+    GetNewLandmarks(new_kf, pyramid, grids, new_landmarks);
     {
         std::unique_lock<std::mutex> lock(mutex_);
-        local_features_[new_kf->time] = Pyramid();
-        GetFeaturePyramid(new_kf, local_features_[new_kf->time]);
-        GetNewLandmarks(new_kf, local_features_[new_kf->time]);
+        local_features_[new_kf->time] = std::move(pyramid);
+        local_grids_[new_kf->time] = std::move(grids);
+        InsertNewLandmarks(new_landmarks);
     }
     return GetFeatures(new_kf->time).size();
 }
 
 void LocalMap::Reset()
 {
+    {
+        // the worker may still be using the extractor
+        std::unique_lock<std::mutex> lock_jobs(mutex_jobs_);
+        jobs_.clear();
+        cv_jobs_.wait(lock_jobs, [this] { return !busy_; });
+        done_.clear();
+    }
     std::unique_lock<std::mutex> lock(mutex_);
     local_features_.clear();
+    local_grids_.clear();
     landmarks.clear();
-    position_cache.clear();
+    anchors_.clear();
+    anchor_frames_.clear();
     pose_cache.clear();
 }
 
-void LocalMap::AddKeyFrame(Frame::Ptr new_kf)
+bool LocalMap::AddKeyFrame(Frame::Ptr new_kf)
 {
+    static Histogram &histogram = Metrics::Instance().GetHistogram("local_map_add_keyframe");
+    ScopedTimer timer(histogram);
     std::unique_lock<std::mutex> lock(mutex_);
     // insert new landmarks
     for (auto &pair_feature : new_kf->features_left)
@@ -90,48 +159,133 @@ void LocalMap::AddKeyFrame(Frame::Ptr new_kf)
     // local BA
     // LocalBA(new_kf);
     // local features matching
-    if (new_kf->features_left.size() < num_features_ / 2)
-    {
-        // get feature pyramid
-        local_features_[new_kf->time] = Pyramid();
-        GetFeaturePyramid(new_kf, local_features_[new_kf->time]);
-        pose_cache[new_kf->time] = new_kf->pose;
-        GetNewLandmarks(new_kf, local_features_[new_kf->time]);
-        // search
-        std::vector<double> kfs = GetCovisibilityKeyFrames(new_kf);
-        Search(kfs, new_kf);
-        // remove old key frame and old landmarks
-        if (local_features_.size() > windows_size_)
+    if (new_kf->features_left.size() >= num_features_ / 2)
+        return false;
+
+    if (async_)
+    {
+        lock.unlock();
         {
-            for (auto &level : local_features_.begin()->second)
+            std::unique_lock<std::mutex> lock_jobs(mutex_jobs_);
+            jobs_.push_back(new_kf);
+        }
+        cv_jobs_.notify_all();
+        return false;
+    }
+    // get feature pyramid, detection and triangulation go without the lock
+    lock.unlock();
+    Job job;
+    job.frame = new_kf;
+    GetFeaturePyramid(new_kf, job.pyramid);
+    GetNewLandmarks(new_kf, job.pyramid, job.grids, job.landmarks);
+    lock.lock();
+    MergeKeyFrame(job);
+    return true;
+}
+
+Frame::Ptr LocalMap::Merge()
+{
+    std::deque<Job> done;
+    {
+        std::unique_lock<std::mutex> lock_jobs(mutex_jobs_);
+        std::swap(done, done_);
+    }
+    if (done.empty())
+        return nullptr;
+
+    static Histogram &histogram = Metrics::Instance().GetHistogram("local_map_merge");
+    ScopedTimer timer(histogram);
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto &job : done)
+    {
+        MergeKeyFrame(job);
+    }
+    return done.back().frame;
+}
+
+void LocalMap::MergeKeyFrame(Job &job)
+{
+    Frame::Ptr new_kf = job.frame;
+    local_features_[new_kf->time] = std::move(job.pyramid);
+    local_grids_[new_kf->time] = std::move(job.grids);
+    AnchorFrame(new_kf);
+    InsertNewLandmarks(job.landmarks);
+    // search
+    std::vector<double> kfs = GetCovisibilityKeyFrames(new_kf);
+    Search(kfs, new_kf);
+    // remove old key frame and old landmarks
+    if (local_features_.size() > windows_size_)
+    {
+        for (auto &level : local_features_.begin()->second)
+        {
+            for (auto &feature : level)
             {
-                for (auto &feature : level)
+                if (!feature->landmark.expired())
                 {
-                    if (!feature->landmark.expired())
-                    {
-                        landmarks.erase(feature->landmark.lock()->id);
-                    }
+                    landmarks.erase(feature->landmark.lock()->id);
                 }
             }
-            local_features_.erase(local_features_.begin());
         }
+        local_grids_.erase(local_features_.begin()->first);
+        local_features_.erase(local_features_.begin());
     }
 }
 
-void LocalMap::UpdateCache()
+void LocalMap::KeyFrameLoop()
+{
+    static Histogram &histogram = Metrics::Instance().GetHistogram("local_map_build");
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock_jobs(mutex_jobs_);
+            cv_jobs_.wait(lock_jobs, [this] { return !jobs_.empty() || !running_; });
+            if (!running_)
+                return;
+            job.frame = jobs_.front();
+            jobs_.pop_front();
+            busy_ = true;
+        }
+        {
+            ScopedTimer timer(histogram);
+            GetFeaturePyramid(job.frame, job.pyramid);
+            GetNewLandmarks(job.frame, job.pyramid, job.grids, job.landmarks);
+        }
+        {
+            std::unique_lock<std::mutex> lock_jobs(mutex_jobs_);
+            done_.push_back(std::move(job));
+            busy_ = false;
+        }
+        cv_jobs_.notify_all();
+    }
+}
+
+void LocalMap::UpdateCache(bool landmarks)
 {
     std::unique_lock<std::mutex> lock(mutex_);
-    pose_cache.clear();
-    position_cache.clear();
+    if (!landmarks)
+    {
+        for (auto &pair : anchor_frames_)
+        {
+            auto frame = pair.second.lock();
+            if (frame)
+            {
+                pose_cache[pair.first] = frame->pose;
+            }
+        }
+        return;
+    }
 
+    pose_cache.clear();
+    anchor_frames_.clear();
+    anchors_.clear();
     for (auto &pair : local_features_)
     {
-        pose_cache[pair.first] = Map::Instance().GetKeyFrame(pair.first)->pose;
+        AnchorFrame(Map::Instance().GetKeyFrame(pair.first));
     }
-
-    for (auto &pair : landmarks)
+    for (auto &pair : this->landmarks)
     {
-        position_cache[pair.first] = pair.second->ToWorld();
+        AnchorLandmark(pair.second);
     }
 }
 
@@ -139,8 +293,12 @@ void LocalMap::GetFeaturePyramid(Frame::Ptr frame, Pyramid &pyramid)
 {
     // we don't use a mask. new feature can overlap the old.
     // detect
+    static Histogram &histogram = Metrics::Instance().GetHistogram("frontend_detect");
     std::vector<std::vector<cv::KeyPoint>> kps;
-    extractor_.Detect(frame->image_left, kps);
+    {
+        ScopedTimer timer(histogram);
+        extractor_.Detect(frame->image_left, kps);
+    }
     // pyramid
     pyramid.clear();
     pyramid.resize(num_levels_);
@@ -175,12 +333,13 @@ void LocalMap::LocalBA(Frame::Ptr frame)
     ceres::Solver::Options options;
     options.linear_solver_type = ceres::DENSE_QR;
     options.max_num_iterations = 1;
-    options.num_threads = num_threads;
+    Scheduler::Lease lease(Task::Frontend);
+    options.num_threads = lease.threads;
     ceres::Solver::Summary summary;
     ceres::Solve(options, &problem, &summary);
 }
 
-void LocalMap::GetNewLandmarks(Frame::Ptr frame, Pyramid &pyramid)
+void LocalMap::GetNewLandmarks(Frame::Ptr frame, Pyramid &pyramid, Grids &grids, visual::Landmarks &new_landmarks)
 {
     // put all features into one level
     Level features;
@@ -192,7 +351,7 @@ void LocalMap::GetNewLandmarks(Frame::Ptr frame, Pyramid &pyramid)
         }
     }
     // triangulation
-    Triangulate(frame, features);
+    Triangulate(frame, features, new_landmarks);
     // remove all failed features
     for (auto &level : pyramid)
     {
@@ -228,9 +387,15 @@ void LocalMap::GetNewLandmarks(Frame::Ptr frame, Pyramid &pyramid)
             feature->brief = mat2brief(descriptors.row(j++));
         }
     }
+    // build grids for searching
+    grids.clear();
+    for (int i = 0; i < num_levels_; i++)
+    {
+        grids.push_back(Grid(pyramid[i], extractor_.patch_size * scale_factors_[i], frame->image_left.cols, frame->image_left.rows));
+    }
 }
 
-void LocalMap::Triangulate(Frame::Ptr frame, Level &features)
+void LocalMap::Triangulate(Frame::Ptr frame, Level &features, visual::Landmarks &new_landmarks)
 {
     std::vector<cv::Point2f> kps_left, kps_right;
     kps_left.resize(features.size());
@@ -242,110 +407,177 @@ void LocalMap::Triangulate(Frame::Ptr frame, Level &features)
         kps_right.push_back(pixel);
     }
     std::vector<uchar> status;
-    optical_flow(frame->image_left, frame->image_right, kps_left, kps_right, status);
-    // triangulate new points
+    if (async_)
+    {
+        // the flow buffers of the frame belong to the frontend
+        if (extractor_.opencl)
+        {
+            cv::UMat device_left, device_right;
+            frame->image_left.copyTo(device_left);
+            frame->image_right.copyTo(device_right);
+            optical_flow(device_left, device_right, kps_left, kps_right, status);
+        }
+        else
+        {
+            std::vector<cv::Mat> pyramid_left, pyramid_right;
+            build_pyramid(frame->image_left, pyramid_left);
+            build_pyramid(frame->image_right, pyramid_right);
+            optical_flow(pyramid_left, pyramid_right, kps_left, kps_right, status);
+        }
+    }
+    else if (!frame->device_left.empty())
+    {
+        frame->image_right.copyTo(frame->device_right);
+        optical_flow(frame->device_left, frame->device_right, kps_left, kps_right, status);
+    }
+    else
+    {
+        if (frame->pyramid_left.empty())
+        {
+            build_pyramid(frame->image_left, frame->pyramid_left);
+        }
+        build_pyramid(frame->image_right, frame->pyramid_right);
+        optical_flow(frame->pyramid_left, frame->pyramid_right, kps_left, kps_right, status);
+    }
+    // triangulate all tracked points at once
+    std::vector<int> tracked;
     for (int i = 0; i < kps_left.size(); ++i)
     {
         if (status[i])
         {
-            // triangulation
-            Vector2d kp_left = cv2eigen(kps_left[i]);
-            Vector2d kp_right = cv2eigen(kps_right[i]);
-            Vector3d pb = Vector3d::Zero();
-            triangulate(Camera::Get()->extrinsic.inverse(), Camera::Get(1)->extrinsic.inverse(), Camera::Get()->Pixel2Sensor(kp_left), Camera::Get(1)->Pixel2Sensor(kp_right), pb);
-            if (Camera::Get()->Robot2Sensor(pb).z() > 0)
-            {
-                auto new_landmark = visual::Landmark::Create(1 / Camera::Get(1)->Robot2Sensor(pb).z());
-                features[i]->landmark = new_landmark; // new left feature
-                auto new_right_feature = visual::Feature::Create(frame, cv::KeyPoint(kps_right[i], 1), new_landmark);
-                new_right_feature->is_on_left_image = false;
-                new_landmark->AddObservation(features[i]);
-                new_landmark->AddObservation(new_right_feature);
-                position_cache[new_landmark->id] = ToWorld(features[i]);
-                landmarks[new_landmark->id] = new_landmark;
-            }
+            tracked.push_back(i);
+        }
+    }
+    Matrix3Xd ps_left(3, tracked.size()), ps_right(3, tracked.size()), pbs;
+    for (int j = 0; j < tracked.size(); j++)
+    {
+        ps_left.col(j) = Camera::Get()->Pixel2Sensor(cv2eigen(kps_left[tracked[j]]));
+        ps_right.col(j) = Camera::Get(1)->Pixel2Sensor(cv2eigen(kps_right[tracked[j]]));
+    }
+    triangulate(Camera::Get()->extrinsic.inverse(), Camera::Get(1)->extrinsic.inverse(), ps_left, ps_right, pbs);
+    for (int j = 0; j < tracked.size(); j++)
+    {
+        int i = tracked[j];
+        Vector3d pb = pbs.col(j);
+        if (Camera::Get()->Robot2Sensor(pb).z() > 0)
+        {
+            auto new_landmark = visual::Landmark::Create(1 / Camera::Get(1)->Robot2Sensor(pb).z());
+            features[i]->landmark = new_landmark; // new left feature
+            auto new_right_feature = visual::Feature::Create(frame, cv::KeyPoint(kps_right[i], 1), new_landmark);
+            new_right_feature->is_on_left_image = false;
+            new_landmark->AddObservation(features[i]);
+            new_landmark->AddObservation(new_right_feature);
+            new_landmarks[new_landmark->id] = new_landmark;
         }
     }
 }
 
+void LocalMap::InsertNewLandmarks(const visual::Landmarks &new_landmarks)
+{
+    for (auto &pair : new_landmarks)
+    {
+        AnchorLandmark(pair.second);
+        landmarks[pair.first] = pair.second;
+    }
+}
+
 std::vector<double> LocalMap::GetCovisibilityKeyFrames(Frame::Ptr frame)
 {
+    // keyframes which share landmarks with frame, by the covisibility graph
     std::vector<double> kfs;
+    for (auto &pair : visual::Covisibility::Instance().GetNeighbors(frame->time))
+    {
+        if (local_features_.find(pair.first) != local_features_.end())
+        {
+            kfs.push_back(pair.first);
+        }
+    }
+    // then the others with close headings
+    std::vector<double> others;
     for (auto &pair : local_features_)
     {
         assert(pair.second.size() != 0);
-        if (pair.first == frame->time)
+        if (pair.first == frame->time || std::find(kfs.begin(), kfs.end(), pair.first) != kfs.end())
             continue;
         Vector3d last_heading = pose_cache[pair.first].so3() * Vector3d::UnitX();
         Vector3d heading = frame->pose.so3() * Vector3d::UnitX();
         double degree = vectors_degree_angle(last_heading, heading);
         if (degree < 30)
         {
-            kfs.push_back(pair.first);
+            others.push_back(pair.first);
         }
     }
-    std::sort(kfs.begin(), kfs.end(), std::greater<double>());
+    std::sort(others.begin(), others.end(), std::greater<double>());
+    kfs.insert(kfs.end(), others.begin(), others.end());
     return kfs;
 }
 
 void LocalMap::Search(std::vector<double> kfs, Frame::Ptr frame)
 {
-    for (int i = 0; i < kfs.size(); i++)
+    Pyramid &current_pyramid = local_features_[frame->time];
+    int num_features = 0, num_matched = 0;
+    for (auto &features : current_pyramid)
+    {
+        num_features += features.size();
+    }
+    for (int i = 0; i < kfs.size() && num_matched < num_features / 2; i++)
     {
-        Search(local_features_[kfs[i]], pose_cache[kfs[i]], local_features_[frame->time], frame);
+        num_matched += Search(local_features_[kfs[i]], local_grids_[kfs[i]], pose_cache[kfs[i]], current_pyramid, frame);
     }
 }
 
-void LocalMap::Search(Pyramid &last_pyramid, SE3d last_pose, Pyramid &current_pyramid, Frame::Ptr frame)
+int LocalMap::Search(Pyramid &last_pyramid, Grids &last_grids, SE3d last_pose, Pyramid &current_pyramid, Frame::Ptr frame)
 {
+    int num_matched = 0;
     for (auto &features : current_pyramid)
     {
         for (auto &feature : features)
         {
-            if (!feature->match)
+            if (!feature->match && Search(last_pyramid, last_grids, last_pose, feature, frame))
             {
-                Search(last_pyramid, last_pose, feature, frame);
+                num_matched++;
             }
         }
     }
+    return num_matched;
 }
 
-void LocalMap::Search(Pyramid &last_pyramid, SE3d last_pose, visual::Feature::Ptr feature, Frame::Ptr frame)
+bool LocalMap::Search(Pyramid &last_pyramid, Grids &last_grids, SE3d last_pose, visual::Feature::Ptr feature, Frame::Ptr frame)
 {
-    auto pc = Camera::Get()->World2Sensor(position_cache[feature->landmark.lock()->id], last_pose);
+    auto pc = Camera::Get()->World2Sensor(Position(feature->landmark.lock()->id), last_pose);
     if (pc.z() < 0)
-        return;
+        return false;
     cv::Point2f p_in_last_left = eigen2cv(Camera::Get()->Sensor2Pixel(pc));
     Level features_in_radius;
-    std::vector<BRIEF> briefs;
+    std::vector<const BRIEF *> briefs;
+    std::vector<int> indices;
     int min_level = feature->keypoint.octave, max_level = feature->keypoint.octave + 1;
     for (int i = min_level; i <= max_level && i < num_levels_; i++)
     {
         double radius = extractor_.patch_size * scale_factors_[i];
-        for (auto &last_feature : last_pyramid[i])
+        last_grids[i].Query(p_in_last_left, indices);
+        for (int j : indices)
         {
+            auto &last_feature = last_pyramid[i][j];
             double rotate = std::abs(last_feature->keypoint.angle - feature->keypoint.angle);
             if (rotate < 15)
             {
                 if (cv_distance(p_in_last_left, last_feature->keypoint.pt) < radius)
                 {
                     features_in_radius.push_back(last_feature);
-                    briefs.push_back(last_feature->brief);
+                    briefs.push_back(&last_feature->brief);
                 }
             }
         }
     }
 
-    cv::Mat descriptors_last = briefs2mat(briefs), descriptors_current = brief2mat(feature->brief);
-    std::vector<std::vector<cv::DMatch>> knn_matches;
-    matcher_->knnMatch(descriptors_current, descriptors_last, knn_matches, 2);
+    int best, second;
+    int index = match_briefs(feature->brief, briefs, best, second);
     const float ratio_threshold = 0.8;
     const float low_threshold = 50;
-    if (!features_in_radius.empty() && !knn_matches.empty() && knn_matches[0].size() == 2 &&
-        knn_matches[0][0].distance < low_threshold &&
-        knn_matches[0][0].distance < ratio_threshold * knn_matches[0][1].distance)
+    if (briefs.size() >= 2 && best < low_threshold && best < ratio_threshold * second)
     {
-        auto last_feature = features_in_radius[knn_matches[0][0].trainIdx];
+        auto last_feature = features_in_radius[index];
 
         // add feature
         feature->match = true;
@@ -363,8 +595,9 @@ void LocalMap::Search(Pyramid &last_pyramid, SE3d last_pose, visual::Feature::Pt
             last_frame->AddFeature(last_landmark->first_observation);
             Map::Instance().InsertLandmark(last_landmark);
         }
-        cv::circle(img_track, feature->keypoint.pt, 2, cv::Scalar(255, 0, 0), cv::FILLED);
+        return true;
     }
+    return false;
 }
 
 Level LocalMap::GetFeatures(double time)
@@ -392,7 +625,7 @@ PointRGBCloud LocalMap::GetLocalLandmarks()
     for (auto &pair : landmarks)
     {
         PointRGB point_color;
-        Vector3d pw = position_cache[pair.second->id];
+        Vector3d pw = Position(pair.second->id);
         point_color.x = pw.x();
         point_color.y = pw.y();
         point_color.z = pw.z();
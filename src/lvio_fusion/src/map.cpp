@@ -1,25 +1,94 @@
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/buffer.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/utility.h"
+#include "lvio_fusion/visual/camera.h"
 #include "lvio_fusion/visual/feature.h"
 
+#include <algorithm>
+
 namespace lvio_fusion
 {
 
+inline MemoryAccount &landmarks_memory()
+{
+    static MemoryAccount &memory = Metrics::Instance().GetMemory("landmarks");
+    return memory;
+}
+
+// the images are released by FrameStore later, and it keeps the account up to date
+inline void account_keyframe(Frame::Ptr frame, int sign)
+{
+    static MemoryAccount &keyframes = Metrics::Instance().GetMemory("keyframes");
+    static MemoryAccount &images = Metrics::Instance().GetMemory("keyframe_images");
+    keyframes.Add(sign * (long)sizeof(Frame), sign);
+    images.Add(sign * (long)(mat_bytes(frame->image_left) + mat_bytes(frame->image_right)), 0);
+}
+
 void Map::InsertKeyFrame(Frame::Ptr frame)
 {
-    std::unique_lock<std::mutex> lock(mutex_local_kfs);
+    std::unique_lock<std::mutex> lock(mutex_keyframes_);
     Frame::current_frame_id++;
-    keyframes[frame->time] = frame;
+    // copy on write, only the chunk of the new keyframe is copied
+    std::shared_ptr<ChunkedFrames> keyframes(new ChunkedFrames(*keyframes_));
+    Frames frames;
+    frames[frame->time] = frame;
+    if (keyframes->Insert(frames, true))
+    {
+        account_keyframe(frame, 1);
+    }
+    std::atomic_store(&keyframes_, Snapshot(keyframes));
+    version_++;
+}
+
+void Map::InsertKeyFrames(const Frames &frames)
+{
+    std::unique_lock<std::mutex> lock(mutex_keyframes_);
+    std::shared_ptr<ChunkedFrames> keyframes(new ChunkedFrames(*keyframes_));
+    for (auto &pair : frames)
+    {
+        if (keyframes->find(pair.first) == keyframes->end())
+        {
+            account_keyframe(pair.second, 1);
+        }
+    }
+    keyframes->Insert(frames, false);
+    std::atomic_store(&keyframes_, Snapshot(keyframes));
+    version_++;
+}
+
+void Map::Reset()
+{
+    std::unique_lock<std::mutex> lock(mutex_keyframes_);
+    for (auto &pair : *keyframes_)
+    {
+        account_keyframe(pair.second, -1);
+    }
+    landmarks_memory().Remove(landmarks.size() * sizeof(visual::Landmark), landmarks.size());
+    landmarks.clear();
+    archive.Clear();
+    visual::Covisibility::Instance().Reset();
+    lidar_kfs_.clear();
+    std::atomic_store(&keyframes_, Snapshot(new ChunkedFrames));
+    version_++;
 }
 
 void Map::InsertLandmark(visual::Landmark::Ptr landmark)
 {
     std::unique_lock<std::mutex> lock(mutex_local_kfs);
-    landmarks[landmark->id] = landmark;
+    auto &slot = landmarks[landmark->id];
+    if (!slot)
+    {
+        landmarks_memory().Add(sizeof(visual::Landmark));
+    }
+    slot = landmark;
 }
 
 // time < 0 or time > end: return the last one
 Frame::Ptr Map::GetKeyFrame(double time)
 {
+    Snapshot snapshot = GetSnapshot();
+    const ChunkedFrames &keyframes = *snapshot;
     if (time < 0)
         return (--keyframes.end())->second;
     auto iter = keyframes.lower_bound(time);
@@ -48,6 +117,8 @@ Frame::Ptr Map::GetKeyFrame(double time)
 // 4: [num -> end)
 Frames Map::GetKeyFrames(double start, double end, int num)
 {
+    Snapshot snapshot = GetSnapshot();
+    const ChunkedFrames &keyframes = *snapshot;
     if (end == 0 && num == 0)
     {
         auto start_iter = keyframes.lower_bound(start);
@@ -82,15 +153,112 @@ Frames Map::GetKeyFrames(double start, double end, int num)
     return Frames();
 }
 
+// 1: [start]
+// 2: [start -> end]
+Map::Range Map::GetRange(double start, double end)
+{
+    Snapshot snapshot = GetSnapshot();
+    auto start_iter = snapshot->lower_bound(start);
+    if (end == 0)
+        return Range(snapshot, start_iter, snapshot->end());
+    if (start > end)
+        return Range(snapshot, snapshot->end(), snapshot->end());
+    return Range(snapshot, start_iter, snapshot->upper_bound(end));
+}
+
+inline bool time_less(const std::pair<double, Frame::Ptr> &a, double b)
+{
+    return a.first < b;
+}
+
+void Map::InsertLidarKeyFrame(Frame::Ptr frame)
+{
+    std::unique_lock<std::mutex> lock(mutex_keyframes_);
+    auto iter = std::lower_bound(lidar_kfs_.begin(), lidar_kfs_.end(), frame->time, time_less);
+    if (iter != lidar_kfs_.end() && iter->first == frame->time)
+        return;
+    lidar_kfs_.insert(iter, std::make_pair(frame->time, frame));
+}
+
+// 3: (start -> num]
+// 4: [num -> end)
+Frames Map::GetLidarKeyFrames(double start, double end, int num)
+{
+    std::unique_lock<std::mutex> lock(mutex_keyframes_);
+    Frames frames;
+    if (end == 0)
+    {
+        // first one after start
+        auto iter = std::upper_bound(lidar_kfs_.begin(), lidar_kfs_.end(), start,
+                                     [](double a, const std::pair<double, Frame::Ptr> &b) { return a < b.first; });
+        auto end_iter = lidar_kfs_.end() - iter > num ? iter + num : lidar_kfs_.end();
+        frames.insert(iter, end_iter);
+    }
+    else if (start == 0)
+    {
+        // last one before end
+        auto iter = std::lower_bound(lidar_kfs_.begin(), lidar_kfs_.end(), end, time_less);
+        auto begin_iter = iter - lidar_kfs_.begin() > num ? iter - num : lidar_kfs_.begin();
+        frames.insert(begin_iter, iter);
+    }
+    return frames;
+}
+
 void Map::RemoveLandmark(visual::Landmark::Ptr landmark)
 {
     std::unique_lock<std::mutex> lock(mutex_local_kfs);
     landmark->Clear();
-    landmarks.erase(landmark->id);
+    if (landmarks.erase(landmark->id))
+    {
+        landmarks_memory().Remove(sizeof(visual::Landmark));
+    }
+}
+
+int Map::CompactLandmarks(double end)
+{
+    std::unique_lock<std::mutex> lock(mutex_local_kfs);
+    int num_archived = 0;
+    for (auto iter = landmarks.begin(); iter != landmarks.end();)
+    {
+        auto landmark = iter->second;
+        auto last_frame = landmark->LastFrame().lock();
+        if (last_frame->time >= end)
+        {
+            iter++;
+            continue;
+        }
+        auto first_frame = landmark->FirstFrame().lock();
+        Vector3d pb = Camera::Get(1)->Pixel2Robot(cv2eigen(landmark->first_observation->keypoint.pt), 1 / landmark->inv_depth);
+        archive.Insert(landmark->id, pb, landmark->observations.begin()->second->brief, first_frame->time);
+        // free the features in old keyframes, only the descriptors of keyframes are kept
+        for (auto &pair_feature : landmark->observations)
+        {
+            pair_feature.second->frame.lock()->features_left.erase(landmark->id);
+        }
+        first_frame->features_right.erase(landmark->id);
+        landmark->RemoveCovisibility();
+        landmark->observations.clear();
+        landmark->first_observation.reset();
+        iter = landmarks.erase(iter);
+        num_archived++;
+    }
+    landmarks_memory().Remove(num_archived * sizeof(visual::Landmark), num_archived);
+    return num_archived;
+}
+
+bool Map::GetArchivedPosition(unsigned long id, Vector3d &pw)
+{
+    int i = archive.Find(id);
+    if (i < 0)
+        return false;
+    pw = Camera::Get()->Robot2World(archive.positions[i].cast<double>(), GetKeyFrame(archive.anchors[i])->pose);
+    return true;
 }
 
 SE3d Map::ComputePose(double time)
 {
+    Snapshot snapshot = GetSnapshot();
+    const ChunkedFrames &keyframes = *snapshot;
     auto frame1 = keyframes.lower_bound(time)->second;
     auto frame2 = keyframes.upper_bound(time)->second;
     double d_t = time - frame1->time;
@@ -101,15 +269,4 @@ SE3d Map::ComputePose(double time)
     return SE3d(q, t);
 }
 
-void Map::ApplyGravityRotation(const Matrix3d &R)
-{
-    Quaterniond q(R);
-    for (auto pair : keyframes)
-    {
-        Frame::Ptr frame = pair.second;
-        frame->SetPose(q * frame->R(), q * frame->t());
-        frame->Vw = q * frame->Vw;
-    }
-}
-
 } // namespace lvio_fusion
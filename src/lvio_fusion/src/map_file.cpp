@@ -0,0 +1,827 @@
+#include "lvio_fusion/map_file.h"
+#include "lvio_fusion/buffer.h"
+#include "lvio_fusion/frame_store.h"
+#include "lvio_fusion/lidar/scan_context.h"
+#include "lvio_fusion/loop/pose_graph.h"
+#include "lvio_fusion/map.h"
+#include "lvio_fusion/navsat/navsat.h"
+#include "lvio_fusion/visual/landmark.h"
+
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <type_traits>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace lvio_fusion
+{
+
+const unsigned int MapFile::version;
+const char map_file_magic[8] = "LVIOMAP";
+
+// a reader skips chunks it does not know
+enum ChunkType
+{
+    FramesChunk = 1,    // FrameRecord of every keyframe, sorted by time
+    DataChunk = 2,      // features, descriptors and lidar points of keyframes
+    LandmarksChunk = 3, // LandmarkRecord of every landmark
+    AtlasChunk = 4,     // sections and submaps
+    NavsatChunk = 5     // raw points of navsat devices
+};
+
+enum FrameFlag
+{
+    GoodImu = 1,
+    WeightsUpdated = 2,
+    HasLidar = 4,
+    HasNavsat = 8,
+    LoopRelocated = 16,
+    LoopAppearance = 32
+};
+
+struct FileHeader
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int num_chunks;
+};
+
+struct ChunkEntry
+{
+    unsigned int type;
+    unsigned int reserved;
+    unsigned long offset;
+    unsigned long size;
+};
+
+typedef std::map<unsigned int, std::pair<const char *, size_t>> Chunks; // type -> (data, size)
+
+// fixed size, so keyframes of a region are found without touching their data
+struct FrameRecord
+{
+    double time;
+    unsigned long id;
+    double last_keyframe; // 0 = none
+    double pose[SE3d::num_parameters];
+    double Vw[3];
+    double ba[3], bg[3];
+    float weights[3];
+    int flags;
+    double navsat_time;
+    double navsat_cov[3];
+    double loop_old; // 0 = no loop
+    double loop_relative[SE3d::num_parameters];
+    double loop_score;
+    unsigned long offset; // data in the data chunk
+    unsigned long size;
+};
+
+struct FeatureRecord
+{
+    unsigned long landmark;
+    float x, y, size, angle, response;
+    int octave;
+    BRIEF brief;
+};
+static_assert(std::is_trivially_copyable<BRIEF>::value, "BRIEF is copied as raw memory");
+
+struct LandmarkRecord
+{
+    unsigned long id;
+    double inv_depth;
+    double first_frame;
+};
+
+struct SectionRecord
+{
+    double key, A, B, C, degree;
+};
+
+struct NavsatRecord
+{
+    double time, x, y, z;
+};
+
+inline void write_features(std::vector<char> &buffer, const visual::Features &features,
+                           std::unordered_map<unsigned long, visual::Landmark::Ptr> &landmarks)
+{
+    std::vector<FeatureRecord> records;
+    records.reserve(features.size());
+    for (auto &pair : features)
+    {
+        auto feature = pair.second;
+        auto landmark = feature->landmark.lock();
+        if (!landmark)
+            continue;
+        FeatureRecord record;
+        memset(&record, 0, sizeof(record));
+        record.landmark = landmark->id;
+        record.x = feature->keypoint.pt.x;
+        record.y = feature->keypoint.pt.y;
+        record.size = feature->keypoint.size;
+        record.angle = feature->keypoint.angle;
+        record.response = feature->keypoint.response;
+        record.octave = feature->keypoint.octave;
+        record.brief = feature->brief;
+        records.push_back(record);
+        landmarks[landmark->id] = landmark;
+    }
+    write_pod(buffer, records.size());
+    buffer.insert(buffer.end(), (char *)records.data(), (char *)(records.data() + records.size()));
+}
+
+inline const char *read_features(const char *p, Frame::Ptr frame, bool left,
+                                 std::unordered_map<unsigned long, visual::Landmark::Ptr> &landmarks)
+{
+    size_t size;
+    p = read_pod(p, size);
+    for (size_t i = 0; i < size; i++)
+    {
+        FeatureRecord record;
+        p = read_pod(p, record);
+        auto iter = landmarks.find(record.landmark);
+        if (iter == landmarks.end())
+            continue;
+        cv::KeyPoint keypoint(record.x, record.y, record.size, record.angle, record.response, record.octave);
+        auto feature = visual::Feature::Create(frame, keypoint, iter->second);
+        feature->brief = record.brief;
+        feature->insert = true;
+        feature->is_on_left_image = left;
+        frame->AddFeature(feature);
+        iter->second->AddObservation(feature);
+    }
+    return p;
+}
+
+inline bool write_chunks(const std::string &path, const std::vector<std::pair<unsigned int, std::vector<char>>> &chunks)
+{
+    std::ofstream out(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out)
+        return false;
+    FileHeader header;
+    memcpy(header.magic, map_file_magic, sizeof(header.magic));
+    header.version = MapFile::version;
+    header.num_chunks = chunks.size();
+    out.write((const char *)&header, sizeof(header));
+    unsigned long offset = sizeof(FileHeader) + chunks.size() * sizeof(ChunkEntry);
+    for (auto &chunk : chunks)
+    {
+        ChunkEntry entry = {chunk.first, 0, offset, chunk.second.size()};
+        out.write((const char *)&entry, sizeof(entry));
+        offset += chunk.second.size();
+    }
+    for (auto &chunk : chunks)
+    {
+        out.write(chunk.second.data(), chunk.second.size());
+    }
+    return out.good();
+}
+
+bool MapFile::Save(const std::string &path)
+{
+    auto snapshot = Map::Instance().GetSnapshot();
+    std::vector<char> frames_chunk, data_chunk, landmarks_chunk, atlas_chunk, navsat_chunk;
+    std::unordered_map<unsigned long, visual::Landmark::Ptr> landmarks;
+
+    frames_chunk.reserve(snapshot->size() * sizeof(FrameRecord));
+    for (auto &pair : *snapshot)
+    {
+        Frame::Ptr frame = pair.second;
+        // spilled data is needed
+        auto pin = FrameStore::Instance().Load(frame);
+        FrameRecord record;
+        memset(&record, 0, sizeof(record));
+        record.time = frame->time;
+        record.id = frame->id;
+        record.last_keyframe = frame->last_keyframe ? frame->last_keyframe->time : 0;
+        memcpy(record.pose, frame->pose.data(), sizeof(record.pose));
+        memcpy(record.Vw, frame->Vw.data(), sizeof(record.Vw));
+        memcpy(record.ba, frame->bias.linearized_ba.data(), sizeof(record.ba));
+        memcpy(record.bg, frame->bias.linearized_bg.data(), sizeof(record.bg));
+        record.weights[0] = frame->weights.visual;
+        record.weights[1] = frame->weights.lidar_ground;
+        record.weights[2] = frame->weights.lidar_surf;
+        record.flags = (frame->good_imu ? GoodImu : 0) | (frame->weights.updated ? WeightsUpdated : 0);
+        if (frame->feature_navsat)
+        {
+            record.flags |= HasNavsat;
+            record.navsat_time = frame->feature_navsat->time;
+            memcpy(record.navsat_cov, frame->feature_navsat->cov.data(), sizeof(record.navsat_cov));
+        }
+        if (frame->loop_closure && frame->loop_closure->frame_old)
+        {
+            record.flags |= (frame->loop_closure->relocated ? LoopRelocated : 0) | (frame->loop_closure->appearance ? LoopAppearance : 0);
+            record.loop_old = frame->loop_closure->frame_old->time;
+            memcpy(record.loop_relative, frame->loop_closure->relative_o_c.data(), sizeof(record.loop_relative));
+            record.loop_score = frame->loop_closure->score;
+        }
+
+        record.offset = data_chunk.size();
+        write_features(data_chunk, frame->features_left, landmarks);
+        write_features(data_chunk, frame->features_right, landmarks);
+        write_mat(data_chunk, frame->descriptors);
+        write_pod(data_chunk, frame->descriptor_ids.size());
+        data_chunk.insert(data_chunk.end(), (char *)frame->descriptor_ids.data(), (char *)(frame->descriptor_ids.data() + frame->descriptor_ids.size()));
+        if (frame->feature_lidar)
+        {
+            record.flags |= HasLidar;
+            write_points(data_chunk, frame->feature_lidar->points_surf);
+            write_points(data_chunk, frame->feature_lidar->points_ground);
+        }
+        record.size = data_chunk.size() - record.offset;
+        write_pod(frames_chunk, record);
+    }
+
+    for (auto &pair : landmarks)
+    {
+        auto landmark = pair.second;
+        if (!landmark->first_observation || landmark->first_observation->frame.expired())
+            continue;
+        LandmarkRecord record = {landmark->id, landmark->inv_depth, landmark->FirstFrame().lock()->time};
+        write_pod(landmarks_chunk, record);
+    }
+
+    Atlas sections, submaps;
+    PoseGraph::Instance().GetAtlas(sections, submaps);
+    for (Atlas *atlas : {&sections, &submaps})
+    {
+        write_pod(atlas_chunk, atlas->size());
+        for (auto &pair : *atlas)
+        {
+            SectionRecord record = {pair.first, pair.second.A, pair.second.B, pair.second.C, pair.second.degree};
+            write_pod(atlas_chunk, record);
+        }
+    }
+
+    write_pod(navsat_chunk, Navsat::Num());
+    for (int i = 0; i < Navsat::Num(); i++)
+    {
+        auto navsat = Navsat::Get(i);
+        write_pod(navsat_chunk, (int)navsat->initialized);
+        write_pod(navsat_chunk, navsat->fix);
+        write_pod(navsat_chunk, navsat->raw.size());
+        for (auto &pair : navsat->raw)
+        {
+            NavsatRecord record = {pair.first, pair.second.x(), pair.second.y(), pair.second.z()};
+            write_pod(navsat_chunk, record);
+        }
+    }
+
+    std::vector<std::pair<unsigned int, std::vector<char>>> chunks;
+    chunks.emplace_back(FramesChunk, std::move(frames_chunk));
+    chunks.emplace_back(DataChunk, std::move(data_chunk));
+    chunks.emplace_back(LandmarksChunk, std::move(landmarks_chunk));
+    chunks.emplace_back(AtlasChunk, std::move(atlas_chunk));
+    chunks.emplace_back(NavsatChunk, std::move(navsat_chunk));
+    if (!write_chunks(path, chunks))
+    {
+        LOG(ERROR) << "MapFile: can not write " << path;
+        return false;
+    }
+    LOG(INFO) << "MapFile: saved " << snapshot->size() << " keyframes, " << landmarks.size() << " landmarks to " << path;
+    return true;
+}
+
+// the caller checks the header
+inline double load_chunks(const Chunks &chunks, const Vector3d &center, double radius)
+{
+    auto frames_chunk = chunks.find(FramesChunk), data_chunk = chunks.find(DataChunk);
+    if (frames_chunk == chunks.end() || data_chunk == chunks.end())
+        return 0;
+    const char *data = data_chunk->second.first;
+    size_t data_size = data_chunk->second.second;
+
+    // keyframes in the region
+    std::vector<FrameRecord> records;
+    Frames frames;
+    size_t num_records = frames_chunk->second.second / sizeof(FrameRecord);
+    for (size_t i = 0; i < num_records; i++)
+    {
+        FrameRecord record;
+        read_pod(frames_chunk->second.first + i * sizeof(FrameRecord), record);
+        Vector3d position(record.pose[4], record.pose[5], record.pose[6]);
+        if ((radius > 0 && (position - center).norm() > radius) || record.offset + record.size > data_size)
+            continue;
+        Frame::Ptr frame = Frame::Create();
+        frame->id = record.id;
+        frame->time = record.time;
+        memcpy(frame->pose.data(), record.pose, sizeof(record.pose));
+        frame->Vw = Vector3d(record.Vw);
+        frame->bias = Bias(Vector3d(record.ba), Vector3d(record.bg));
+        frame->weights.visual = record.weights[0];
+        frame->weights.lidar_ground = record.weights[1];
+        frame->weights.lidar_surf = record.weights[2];
+        frame->weights.updated = record.flags & WeightsUpdated;
+        frame->good_imu = record.flags & GoodImu;
+        if (record.flags & HasNavsat)
+        {
+            frame->feature_navsat = navsat::Feature::Ptr(new navsat::Feature(record.navsat_time, Vector3d(record.navsat_cov)));
+        }
+        frames[frame->time] = frame;
+        records.push_back(record);
+    }
+    if (frames.empty())
+        return 0;
+
+    // landmarks observed first in the region
+    std::unordered_map<unsigned long, visual::Landmark::Ptr> landmarks;
+    unsigned long max_landmark_id = visual::Landmark::current_landmark_id;
+    auto landmarks_chunk = chunks.find(LandmarksChunk);
+    if (landmarks_chunk != chunks.end())
+    {
+        size_t num_landmarks = landmarks_chunk->second.second / sizeof(LandmarkRecord);
+        for (size_t i = 0; i < num_landmarks; i++)
+        {
+            LandmarkRecord record;
+            read_pod(landmarks_chunk->second.first + i * sizeof(LandmarkRecord), record);
+            if (frames.find(record.first_frame) == frames.end())
+                continue;
+            auto landmark = visual::Landmark::Create(record.inv_depth);
+            landmark->id = record.id;
+            landmarks[landmark->id] = landmark;
+            max_landmark_id = std::max(max_landmark_id, record.id);
+        }
+    }
+
+    // keyframes are in time order, so the first observation of a landmark comes first
+    unsigned long max_frame_id = Frame::current_frame_id;
+    for (auto &record : records)
+    {
+        auto frame = frames[record.time];
+        const char *p = data + record.offset;
+        p = read_features(p, frame, true, landmarks);
+        p = read_features(p, frame, false, landmarks);
+        p = read_mat(p, frame->descriptors);
+        size_t num_ids;
+        p = read_pod(p, num_ids);
+        frame->descriptor_ids.resize(num_ids);
+        memcpy(frame->descriptor_ids.data(), p, num_ids * sizeof(unsigned long));
+        p += num_ids * sizeof(unsigned long);
+        if (record.flags & HasLidar)
+        {
+            frame->feature_lidar = lidar::Feature::Create();
+            p = read_points(p, frame->feature_lidar->points_surf);
+            p = read_points(p, frame->feature_lidar->points_ground);
+            lidar::make_scan_context(*frame->feature_lidar);
+        }
+        auto last_keyframe = frames.find(record.last_keyframe);
+        if (last_keyframe != frames.end())
+        {
+            frame->last_keyframe = last_keyframe->second;
+        }
+        auto frame_old = frames.find(record.loop_old);
+        if (record.loop_old != 0 && frame_old != frames.end())
+        {
+            frame->loop_closure = loop::LoopClosure::Ptr(new loop::LoopClosure());
+            frame->loop_closure->frame_old = frame_old->second;
+            frame->loop_closure->relocated = record.flags & LoopRelocated;
+            frame->loop_closure->appearance = record.flags & LoopAppearance;
+            frame->loop_closure->score = record.loop_score;
+            memcpy(frame->loop_closure->relative_o_c.data(), record.loop_relative, sizeof(record.loop_relative));
+        }
+        max_frame_id = std::max(max_frame_id, record.id);
+    }
+
+    // landmarks without their first observation can not be located
+    for (auto iter = landmarks.begin(); iter != landmarks.end();)
+    {
+        auto landmark = iter->second;
+        if (!landmark->first_observation)
+        {
+            for (auto &pair : landmark->observations)
+            {
+                pair.second->frame.lock()->features_left.erase(landmark->id);
+            }
+            iter = landmarks.erase(iter);
+        }
+        else
+        {
+            iter++;
+        }
+    }
+
+    // set before inserting, so that other threads never take them as new keyframes
+    Map::Instance().prior = frames.rbegin()->first;
+    Map::Instance().InsertKeyFrames(frames);
+    for (auto &pair : frames)
+    {
+        if (pair.second->feature_lidar)
+        {
+            Map::Instance().InsertLidarKeyFrame(pair.second);
+        }
+    }
+    for (auto &pair : landmarks)
+    {
+        Map::Instance().InsertLandmark(pair.second);
+    }
+    Frame::current_frame_id = max_frame_id;
+    visual::Landmark::current_landmark_id = max_landmark_id;
+
+    // sections and submaps in the region
+    auto atlas_chunk = chunks.find(AtlasChunk);
+    if (atlas_chunk != chunks.end())
+    {
+        auto loaded = [&frames](double time) { return time == 0 || frames.find(time) != frames.end(); };
+        const char *p = atlas_chunk->second.first;
+        Atlas atlas[2];
+        for (int i = 0; i < 2; i++)
+        {
+            size_t size;
+            p = read_pod(p, size);
+            for (size_t j = 0; j < size; j++)
+            {
+                SectionRecord record;
+                p = read_pod(p, record);
+                if (!loaded(record.A) || !loaded(record.B) || !loaded(record.C))
+                    continue;
+                Section &section = atlas[i][record.key];
+                section.A = record.A;
+                section.B = record.B;
+                section.C = record.C;
+                section.degree = record.degree;
+            }
+        }
+        PoseGraph::Instance().SetAtlas(atlas[0], atlas[1]);
+    }
+
+    auto navsat_chunk = chunks.find(NavsatChunk);
+    if (navsat_chunk != chunks.end())
+    {
+        const char *p = navsat_chunk->second.first;
+        int num_devices;
+        p = read_pod(p, num_devices);
+        for (int i = 0; i < num_devices; i++)
+        {
+            int initialized;
+            Vector3d fix;
+            size_t size;
+            p = read_pod(p, initialized);
+            p = read_pod(p, fix);
+            p = read_pod(p, size);
+            if (i < Navsat::Num())
+            {
+                auto navsat = Navsat::Get(i);
+                navsat->initialized = initialized;
+                navsat->fix = fix;
+                for (size_t j = 0; j < size; j++)
+                {
+                    NavsatRecord record;
+                    read_pod(p + j * sizeof(NavsatRecord), record);
+                    navsat->raw[record.time] = Vector3d(record.x, record.y, record.z);
+                }
+            }
+            p += size * sizeof(NavsatRecord);
+        }
+    }
+
+    LOG(INFO) << "MapFile: loaded " << frames.size() << " of " << num_records << " keyframes, " << landmarks.size() << " landmarks";
+    return frames.rbegin()->first;
+}
+
+// a memory-mapped map file, unmapped when destroyed
+class MappedFile
+{
+public:
+    ~MappedFile()
+    {
+        if (mapped_ != MAP_FAILED)
+        {
+            munmap(mapped_, size_);
+        }
+    }
+
+    // map the file and find its chunks, errors are logged
+    bool Open(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            LOG(ERROR) << "MapFile: can not open " << path;
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(FileHeader))
+        {
+            size_ = st.st_size;
+            mapped_ = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (mapped_ == MAP_FAILED)
+        {
+            LOG(ERROR) << "MapFile: can not map " << path;
+            return false;
+        }
+
+        const char *base = (const char *)mapped_;
+        FileHeader header;
+        read_pod(base, header);
+        if (memcmp(header.magic, map_file_magic, sizeof(header.magic)) != 0)
+        {
+            LOG(ERROR) << "MapFile: " << path << " is not a map file";
+            return false;
+        }
+        if (header.version != MapFile::version)
+        {
+            LOG(ERROR) << "MapFile: version " << header.version << " of " << path << " is not supported, expected " << MapFile::version;
+            return false;
+        }
+        if (sizeof(FileHeader) + header.num_chunks * sizeof(ChunkEntry) > size_)
+        {
+            LOG(ERROR) << "MapFile: " << path << " is truncated";
+            return false;
+        }
+        for (unsigned int i = 0; i < header.num_chunks; i++)
+        {
+            ChunkEntry entry;
+            read_pod(base + sizeof(FileHeader) + i * sizeof(ChunkEntry), entry);
+            if (entry.offset + entry.size > size_)
+            {
+                LOG(ERROR) << "MapFile: " << path << " is truncated";
+                return false;
+            }
+            chunks[entry.type] = std::make_pair(base + entry.offset, (size_t)entry.size);
+        }
+        return true;
+    }
+
+    Chunks chunks;
+
+private:
+    void *mapped_ = MAP_FAILED;
+    size_t size_ = 0;
+};
+
+double MapFile::Load(const std::string &path, const Vector3d &center, double radius)
+{
+    if (Map::Instance().size() != 0)
+    {
+        LOG(ERROR) << "MapFile: the map is not empty";
+        return 0;
+    }
+    MappedFile file;
+    if (!file.Open(path))
+        return 0;
+    return load_chunks(file.chunks, center, radius);
+}
+
+inline const char *skip_features(const char *p)
+{
+    size_t size;
+    p = read_pod(p, size);
+    return p + size * sizeof(FeatureRecord);
+}
+
+bool MapFile::Read(const std::string &path, Session &session)
+{
+    MappedFile file;
+    if (!file.Open(path))
+        return false;
+    auto frames_chunk = file.chunks.find(FramesChunk), data_chunk = file.chunks.find(DataChunk);
+    if (frames_chunk == file.chunks.end() || data_chunk == file.chunks.end())
+    {
+        LOG(ERROR) << "MapFile: " << path << " has no keyframes";
+        return false;
+    }
+
+    session.path = path;
+    session.frames.clear();
+    session.sections.clear();
+    size_t num_records = frames_chunk->second.second / sizeof(FrameRecord);
+    for (size_t i = 0; i < num_records; i++)
+    {
+        FrameRecord record;
+        read_pod(frames_chunk->second.first + i * sizeof(FrameRecord), record);
+        if (record.offset + record.size > data_chunk->second.second)
+            continue;
+        SessionFrame &frame = session.frames[record.time];
+        frame.time = record.time;
+        memcpy(frame.pose.data(), record.pose, sizeof(record.pose));
+        const char *p = data_chunk->second.first + record.offset;
+        p = skip_features(p);
+        p = skip_features(p);
+        cv::Mat descriptors;
+        p = read_mat(p, descriptors);
+        frame.briefs.resize(descriptors.rows);
+        for (int j = 0; j < descriptors.rows; j++)
+        {
+            memcpy(&frame.briefs[j], descriptors.ptr(j), sizeof(BRIEF));
+        }
+        size_t num_ids;
+        p = read_pod(p, num_ids);
+        p += num_ids * sizeof(unsigned long);
+        if (record.flags & HasLidar)
+        {
+            frame.feature_lidar = lidar::Feature::Create();
+            p = read_points(p, frame.feature_lidar->points_surf);
+            p = read_points(p, frame.feature_lidar->points_ground);
+            lidar::make_scan_context(*frame.feature_lidar);
+        }
+    }
+
+    auto atlas_chunk = file.chunks.find(AtlasChunk);
+    if (atlas_chunk != file.chunks.end())
+    {
+        const char *p = atlas_chunk->second.first;
+        size_t size;
+        p = read_pod(p, size);
+        for (size_t i = 0; i < size; i++)
+        {
+            SectionRecord record;
+            p = read_pod(p, record);
+            session.sections.push_back(record.A);
+        }
+    }
+    return !session.frames.empty();
+}
+
+inline void copy_features(const char *&p, std::vector<char> &buffer, unsigned long landmark_base)
+{
+    size_t size;
+    p = read_pod(p, size);
+    write_pod(buffer, size);
+    for (size_t i = 0; i < size; i++)
+    {
+        FeatureRecord record;
+        p = read_pod(p, record);
+        record.landmark += landmark_base;
+        write_pod(buffer, record);
+    }
+}
+
+// times of a session in the merged file, 0 means none
+inline double shift(double time, double offset)
+{
+    return time == 0 ? 0 : time + offset;
+}
+
+int MapFile::Merge(const std::string &path, const std::vector<const Session *> &sessions, const std::vector<SessionLoop> &loops,
+                   const std::function<bool(const Vector3d &)> &inside)
+{
+    std::vector<char> frames_chunk, data_chunk, landmarks_chunk, atlas_chunk, navsat_chunk;
+    std::vector<SectionRecord> atlas[2];
+    // loops between sessions, by the session and the time of the current keyframe
+    std::map<std::pair<int, double>, const SessionLoop *> loop_index;
+    for (auto &loop : loops)
+    {
+        loop_index[std::make_pair(loop.session, loop.time)] = &loop;
+    }
+
+    int num_frames = 0;
+    unsigned long frame_base = 0, landmark_base = 0;
+    for (int i = 0; i < sessions.size(); i++)
+    {
+        const Session &session = *sessions[i];
+        MappedFile file;
+        if (!file.Open(session.path))
+            return 0;
+        auto frames = file.chunks.find(FramesChunk), data = file.chunks.find(DataChunk);
+        if (frames == file.chunks.end() || data == file.chunks.end())
+            continue;
+
+        std::unordered_set<double> written;
+        unsigned long max_frame_id = 0, max_landmark_id = 0;
+        size_t num_records = frames->second.second / sizeof(FrameRecord);
+        for (size_t j = 0; j < num_records; j++)
+        {
+            FrameRecord record;
+            read_pod(frames->second.first + j * sizeof(FrameRecord), record);
+            auto iter = session.frames.find(record.time);
+            if (iter == session.frames.end() || record.offset + record.size > data->second.second ||
+                (inside && !inside(iter->second.pose.translation())))
+                continue;
+            SE3d old_pose;
+            memcpy(old_pose.data(), record.pose, sizeof(record.pose));
+            SE3d correction = iter->second.pose * old_pose.inverse();
+            memcpy(record.pose, iter->second.pose.data(), sizeof(record.pose));
+            Vector3d Vw = correction.so3() * Vector3d(record.Vw);
+            memcpy(record.Vw, Vw.data(), sizeof(record.Vw));
+            max_frame_id = std::max(max_frame_id, record.id);
+            record.id += frame_base;
+            record.time = shift(record.time, session.offset);
+            record.last_keyframe = shift(record.last_keyframe, session.offset);
+            record.loop_old = shift(record.loop_old, session.offset);
+            if (i != 0)
+            {
+                record.flags &= ~HasNavsat;
+            }
+            auto loop = loop_index.find(std::make_pair(i, iter->first));
+            if (record.loop_old == 0 && loop != loop_index.end())
+            {
+                const SessionLoop &session_loop = *loop->second;
+                record.flags |= LoopRelocated;
+                record.loop_old = shift(session_loop.old_time, sessions[session_loop.old_session]->offset);
+                memcpy(record.loop_relative, session_loop.relative_o_c.data(), sizeof(record.loop_relative));
+                record.loop_score = session_loop.score;
+            }
+
+            // the ids of landmarks are renumbered, the rest of the data is copied
+            const char *p = data->second.first + record.offset, *end = p + record.size;
+            record.offset = data_chunk.size();
+            copy_features(p, data_chunk, landmark_base);
+            copy_features(p, data_chunk, landmark_base);
+            cv::Mat descriptors;
+            p = read_mat(p, descriptors);
+            write_mat(data_chunk, descriptors);
+            size_t num_ids;
+            p = read_pod(p, num_ids);
+            write_pod(data_chunk, num_ids);
+            for (size_t k = 0; k < num_ids; k++)
+            {
+                unsigned long id;
+                p = read_pod(p, id);
+                write_pod(data_chunk, id + landmark_base);
+            }
+            data_chunk.insert(data_chunk.end(), p, end);
+            record.size = data_chunk.size() - record.offset;
+            write_pod(frames_chunk, record);
+            written.insert(iter->first);
+            num_frames++;
+        }
+
+        auto landmarks = file.chunks.find(LandmarksChunk);
+        if (landmarks != file.chunks.end())
+        {
+            size_t num_landmarks = landmarks->second.second / sizeof(LandmarkRecord);
+            for (size_t j = 0; j < num_landmarks; j++)
+            {
+                LandmarkRecord record;
+                read_pod(landmarks->second.first + j * sizeof(LandmarkRecord), record);
+                max_landmark_id = std::max(max_landmark_id, record.id);
+                if (!written.count(record.first_frame))
+                    continue;
+                record.id += landmark_base;
+                record.first_frame = shift(record.first_frame, session.offset);
+                write_pod(landmarks_chunk, record);
+            }
+        }
+
+        // the loader drops the sections of missing keyframes
+        auto atlas_data = file.chunks.find(AtlasChunk);
+        if (atlas_data != file.chunks.end())
+        {
+            const char *p = atlas_data->second.first;
+            for (int k = 0; k < 2; k++)
+            {
+                size_t size;
+                p = read_pod(p, size);
+                for (size_t j = 0; j < size; j++)
+                {
+                    SectionRecord record;
+                    p = read_pod(p, record);
+                    record.key = shift(record.key, session.offset);
+                    record.A = shift(record.A, session.offset);
+                    record.B = shift(record.B, session.offset);
+                    record.C = shift(record.C, session.offset);
+                    atlas[k].push_back(record);
+                }
+            }
+        }
+
+        auto navsat = file.chunks.find(NavsatChunk);
+        if (i == 0 && navsat != file.chunks.end())
+        {
+            navsat_chunk.assign(navsat->second.first, navsat->second.first + navsat->second.second);
+        }
+        frame_base += max_frame_id + 1;
+        landmark_base += max_landmark_id + 1;
+    }
+    if (num_frames == 0)
+        return 0;
+
+    for (auto &records : atlas)
+    {
+        write_pod(atlas_chunk, records.size());
+        for (auto &record : records)
+        {
+            write_pod(atlas_chunk, record);
+        }
+    }
+    if (navsat_chunk.empty())
+    {
+        write_pod(navsat_chunk, (int)0);
+    }
+
+    // keyframes are sorted by time in the file
+    std::vector<FrameRecord> records(num_frames);
+    memcpy(records.data(), frames_chunk.data(), frames_chunk.size());
+    std::sort(records.begin(), records.end(), [](const FrameRecord &a, const FrameRecord &b) { return a.time < b.time; });
+    memcpy(frames_chunk.data(), records.data(), frames_chunk.size());
+
+    std::vector<std::pair<unsigned int, std::vector<char>>> chunks;
+    chunks.emplace_back(FramesChunk, std::move(frames_chunk));
+    chunks.emplace_back(DataChunk, std::move(data_chunk));
+    chunks.emplace_back(LandmarksChunk, std::move(landmarks_chunk));
+    chunks.emplace_back(AtlasChunk, std::move(atlas_chunk));
+    chunks.emplace_back(NavsatChunk, std::move(navsat_chunk));
+    if (!write_chunks(path, chunks))
+    {
+        LOG(ERROR) << "MapFile: can not write " << path;
+        return 0;
+    }
+    LOG(INFO) << "MapFile: merged " << num_frames << " keyframes of " << sessions.size() << " sessions to " << path;
+    return num_frames;
+}
+
+} // namespace lvio_fusion
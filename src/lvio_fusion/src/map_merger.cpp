@@ -0,0 +1,541 @@
+#include "lvio_fusion/loop/map_merger.h"
+#include "lvio_fusion/ceres/pose_error.hpp"
+#include "lvio_fusion/lidar/registration.h"
+
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <set>
+#include <thread>
+
+namespace lvio_fusion
+{
+
+const double merge_context_distance = 0.2;  // to be a loop candidate
+const double verify_context_distance = 0.4; // to try the registration
+const double merge_bow_score = 0.3;         // relative to the score with the last keyframe
+const int merge_neighbors = 5;              // keyframes on each side of the old keyframe in the target
+const double min_merge_score = 20;          // the base score of relocating by points
+const double max_merge_error_t = 1;         // m, two loops agree
+const double max_merge_error_r = 0.05;      // rad, two loops agree
+const int min_merge_inliers = 2;            // loops which agree to align a session
+const int max_training_images = 2000;
+
+MapMerger::MapMerger(const std::string &vocabulary, double resolution, int num_threads)
+    : resolution_(resolution), num_threads_(std::max(1, num_threads))
+{
+    if (!vocabulary.empty())
+    {
+        vocabulary_.Load(vocabulary);
+    }
+}
+
+void MapMerger::Parallel(int num_tasks, const std::function<void(int)> &task)
+{
+    std::atomic<int> next(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < std::min(num_threads_, num_tasks); i++)
+    {
+        threads.emplace_back([&]() {
+            for (int k = next++; k < num_tasks; k = next++)
+            {
+                task(k);
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+}
+
+bool MapMerger::Load(const std::vector<std::string> &paths)
+{
+    sessions_.assign(paths.size(), Session());
+    std::vector<int> success(paths.size(), 0);
+    Parallel(paths.size(), [&](int i) { success[i] = MapFile::Read(paths[i], sessions_[i]); });
+    for (int i = 0; i < paths.size(); i++)
+    {
+        if (!success[i])
+        {
+            LOG(ERROR) << "MapMerger: can not read " << paths[i];
+            return false;
+        }
+    }
+
+    if (vocabulary_.Empty())
+    {
+        // every few keyframes of all sessions
+        size_t num_images = 0;
+        for (auto &session : sessions_)
+        {
+            num_images += session.frames.size();
+        }
+        size_t step = std::max<size_t>(1, num_images / max_training_images), k = 0;
+        std::vector<std::vector<BRIEF>> images;
+        for (auto &session : sessions_)
+        {
+            for (auto &pair : session.frames)
+            {
+                if (k++ % step == 0 && !pair.second.briefs.empty())
+                {
+                    images.push_back(pair.second.briefs);
+                }
+            }
+        }
+        if (!images.empty())
+        {
+            vocabulary_.Train(images);
+        }
+    }
+
+    indices_ = std::vector<Index>(sessions_.size());
+    Parallel(sessions_.size(), [this](int i) { BuildIndex(i); });
+    loops_.clear();
+    merged_.assign(sessions_.size(), false);
+    return true;
+}
+
+void MapMerger::BuildIndex(int i)
+{
+    Index &index = indices_[i];
+    for (auto &pair : sessions_[i].frames)
+    {
+        const SessionFrame &frame = pair.second;
+        if (!vocabulary_.Empty() && !frame.briefs.empty())
+        {
+            loop::BowVector &bow = index.bows[pair.first];
+            vocabulary_.Transform(frame.briefs, bow);
+            index.database.Add(pair.first, bow);
+        }
+        if (frame.feature_lidar && frame.feature_lidar->ring_key.size() != 0)
+        {
+            index.contexts.Insert(pair.first, frame.feature_lidar->ring_key);
+        }
+    }
+}
+
+int MapMerger::DetectLoops(int shard, int num_shards)
+{
+    // the pairs of an old session are searched by one task, so its index is never shared by threads
+    std::vector<std::vector<SessionLoop>> found(sessions_.size());
+    Parallel(sessions_.size(), [&](int old_session) {
+        for (int i = old_session + 1; i < sessions_.size(); i++)
+        {
+            int pair = i * (i - 1) / 2 + old_session;
+            if (pair % num_shards == shard)
+            {
+                DetectLoops(old_session, i, found[old_session]);
+            }
+        }
+    });
+    int num_loops = 0;
+    for (auto &loops : found)
+    {
+        loops_.insert(loops_.end(), loops.begin(), loops.end());
+        num_loops += loops.size();
+    }
+    LOG(INFO) << "MapMerger: " << num_loops << " loops in shard " << shard << " of " << num_shards;
+    return num_loops;
+}
+
+void MapMerger::DetectLoops(int old_session, int i, std::vector<SessionLoop> &loops)
+{
+    Index &old_index = indices_[old_session], &index = indices_[i];
+    auto &old_frames = sessions_[old_session].frames;
+    double last_time = 0;
+    for (auto &pair : sessions_[i].frames)
+    {
+        const SessionFrame &frame = pair.second;
+        std::vector<double> candidates;
+        // the old keyframe with the most similar scan context
+        if (frame.feature_lidar && frame.feature_lidar->context.size() != 0)
+        {
+            std::vector<double> times;
+            old_index.contexts.Search(frame.feature_lidar->ring_key, 10, times);
+            double best = merge_context_distance, best_time = 0, yaw;
+            for (double time : times)
+            {
+                auto old_frame = old_frames.find(time);
+                if (old_frame == old_frames.end() || !old_frame->second.feature_lidar)
+                    continue;
+                double distance = lidar::scan_context_distance(frame.feature_lidar->context, old_frame->second.feature_lidar->context, yaw);
+                if (distance < best)
+                {
+                    best = distance;
+                    best_time = time;
+                }
+            }
+            if (best_time != 0)
+            {
+                candidates.push_back(best_time);
+            }
+        }
+        // the old keyframe which looks most like it
+        auto bow = index.bows.find(pair.first), last_bow = index.bows.find(last_time);
+        if (bow != index.bows.end() && last_bow != index.bows.end())
+        {
+            double base = loop::Vocabulary::Score(bow->second, last_bow->second);
+            std::vector<std::pair<double, double>> results;
+            if (base > 0 && old_index.database.Query(bow->second, DBL_MAX, 1, results) && results[0].first > merge_bow_score * base &&
+                (candidates.empty() || candidates[0] != results[0].second))
+            {
+                candidates.push_back(results[0].second);
+            }
+        }
+        last_time = pair.first;
+
+        // the poses of two sessions are unrelated, only registration can tell the relative pose
+        for (double old_time : candidates)
+        {
+            const SessionFrame &old_frame = old_frames.at(old_time);
+            double yaw;
+            if (!frame.feature_lidar || !old_frame.feature_lidar ||
+                lidar::scan_context_distance(frame.feature_lidar->context, old_frame.feature_lidar->context, yaw) >= verify_context_distance)
+                continue;
+            SessionLoop loop;
+            if (Verify(old_session, old_time, i, pair.first, yaw, loop))
+            {
+                loops.push_back(loop);
+                break;
+            }
+        }
+    }
+}
+
+inline void merge_points(const PointICloud &in, const SE3d &pose, PointICloud &out)
+{
+    Sophus::SE3f tf_se3 = pose.cast<float>();
+    float *tf = tf_se3.data();
+    for (auto &point_in : in)
+    {
+        PointI point_out;
+        ceres::SE3TransformPoint(tf, point_in.data, point_out.data);
+        point_out.intensity = point_in.intensity;
+        out.push_back(point_out);
+    }
+}
+
+bool MapMerger::Verify(int old_session, double old_time, int i, double time, double yaw, SessionLoop &loop)
+{
+    auto &old_frames = sessions_[old_session].frames;
+    auto old_iter = old_frames.find(old_time);
+    const SessionFrame &frame = sessions_[i].frames.at(time);
+
+    // the old keyframe and its neighbours, in the old keyframe
+    auto begin = old_iter, end = old_iter;
+    for (int k = 0; k < merge_neighbors && begin != old_frames.begin(); k++)
+    {
+        begin--;
+    }
+    for (int k = 0; k <= merge_neighbors && end != old_frames.end(); k++)
+    {
+        end++;
+    }
+    PointICloud old_ground, old_surf;
+    SE3d Tow = old_iter->second.pose.inverse();
+    for (auto iter = begin; iter != end; iter++)
+    {
+        if (!iter->second.feature_lidar)
+            continue;
+        merge_points(iter->second.feature_lidar->points_ground, Tow * iter->second.pose, old_ground);
+        merge_points(iter->second.feature_lidar->points_surf, Tow * iter->second.pose, old_surf);
+    }
+    lidar::Registration registration;
+    registration.AddTarget(old_ground, resolution_ * 10, 1, 0);
+    registration.AddTarget(old_surf, resolution_ * 5, 1, 0.1);
+
+    // the threads are used by the tasks
+    const PointICloud &points_ground = frame.feature_lidar->points_ground;
+    const PointICloud &points_surf = frame.feature_lidar->points_surf;
+    SE3d relative_o_c(SO3d::rotZ(yaw), Vector3d::Zero());
+    registration.Align({&points_ground, &points_surf}, relative_o_c, 1);
+
+    // the same score as relocating by points
+    double cost_ground, cost_surf, score = 0;
+    int num_ground = registration.Match(0, points_ground, relative_o_c, cost_ground);
+    int num_surf = registration.Match(1, points_surf, relative_o_c, cost_surf);
+    if (num_ground)
+    {
+        score += std::min(num_ground / 10.0, 20.0) - 2 * cost_ground / num_ground;
+    }
+    if (num_surf)
+    {
+        score += std::min(num_surf / 10.0, 30.0) - 2 * cost_surf / num_surf;
+    }
+    if (score <= min_merge_score)
+        return false;
+    loop.session = i;
+    loop.time = time;
+    loop.old_session = old_session;
+    loop.old_time = old_time;
+    loop.relative_o_c = relative_o_c;
+    loop.score = score;
+    return true;
+}
+
+bool MapMerger::ReadLoops(const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in.is_open())
+    {
+        LOG(ERROR) << "MapMerger: can not open " << path;
+        return false;
+    }
+    SessionLoop loop;
+    while (in >> loop.session >> loop.time >> loop.old_session >> loop.old_time)
+    {
+        for (int k = 0; k < SE3d::num_parameters; k++)
+        {
+            in >> loop.relative_o_c.data()[k];
+        }
+        in >> loop.score;
+        if (loop.session < 0 || loop.session >= sessions_.size() || loop.old_session < 0 || loop.old_session >= sessions_.size() ||
+            !sessions_[loop.session].frames.count(loop.time) || !sessions_[loop.old_session].frames.count(loop.old_time))
+        {
+            LOG(ERROR) << "MapMerger: loops of " << path << " are not of the sessions";
+            return false;
+        }
+        loops_.push_back(loop);
+    }
+    return true;
+}
+
+bool MapMerger::WriteLoops(const std::string &path)
+{
+    std::ofstream out(path, std::ios::out | std::ios::trunc);
+    if (!out.is_open())
+    {
+        LOG(ERROR) << "MapMerger: can not write " << path;
+        return false;
+    }
+    out.precision(std::numeric_limits<double>::max_digits10);
+    for (auto &loop : loops_)
+    {
+        out << loop.session << " " << loop.time << " " << loop.old_session << " " << loop.old_time;
+        for (int k = 0; k < SE3d::num_parameters; k++)
+        {
+            out << " " << loop.relative_o_c.data()[k];
+        }
+        out << " " << loop.score << std::endl;
+    }
+    return out.good();
+}
+
+SE3d MapMerger::Align(const SessionLoop &loop, int session, const std::vector<SE3d> &transforms)
+{
+    const SE3d &old_pose = sessions_[loop.old_session].frames.at(loop.old_time).pose;
+    const SE3d &pose = sessions_[loop.session].frames.at(loop.time).pose;
+    if (session == loop.session)
+        return transforms[loop.old_session] * old_pose * loop.relative_o_c * pose.inverse();
+    return transforms[loop.session] * pose * loop.relative_o_c.inverse() * old_pose.inverse();
+}
+
+bool MapMerger::Agree(const SessionLoop &loop, int session, const SE3d &transform, const std::vector<SE3d> &transforms)
+{
+    SE3d error = transform.inverse() * Align(loop, session, transforms);
+    return error.translation().norm() < max_merge_error_t && error.so3().log().norm() < max_merge_error_r;
+}
+
+int MapMerger::Optimize()
+{
+    int n = sessions_.size();
+    if (n == 0)
+        return 0;
+
+    // a session is aligned by the loop which most loops to the merged sessions agree with
+    std::vector<SE3d> transforms(n);
+    merged_.assign(n, false);
+    merged_[0] = true;
+    while (true)
+    {
+        int best_session = -1, best_inliers = 0;
+        SE3d best_transform;
+        for (int i = 0; i < n; i++)
+        {
+            if (merged_[i])
+                continue;
+            std::vector<const SessionLoop *> candidates;
+            for (auto &loop : loops_)
+            {
+                if ((loop.session == i && merged_[loop.old_session]) || (loop.old_session == i && merged_[loop.session]))
+                {
+                    candidates.push_back(&loop);
+                }
+            }
+            for (auto a : candidates)
+            {
+                SE3d transform = Align(*a, i, transforms);
+                int inliers = 0;
+                for (auto b : candidates)
+                {
+                    inliers += Agree(*b, i, transform, transforms);
+                }
+                if (inliers > best_inliers)
+                {
+                    best_session = i;
+                    best_inliers = inliers;
+                    best_transform = transform;
+                }
+            }
+        }
+        if (best_inliers < min_merge_inliers)
+            break;
+        transforms[best_session] = best_transform;
+        merged_[best_session] = true;
+    }
+
+    // wrong loops would tear the graph apart
+    std::vector<SessionLoop> loops;
+    for (auto &loop : loops_)
+    {
+        if (merged_[loop.session] && merged_[loop.old_session] && Agree(loop, loop.session, transforms[loop.session], transforms))
+        {
+            loops.push_back(loop);
+        }
+    }
+    loops_ = loops;
+
+    // nodes are the first keyframe and the A of sections of each session, keyframes move with the last node before them
+    std::vector<std::map<double, SE3d>> nodes(n), old_nodes(n);
+    for (int i = 0; i < n; i++)
+    {
+        if (!merged_[i])
+            continue;
+        auto &frames = sessions_[i].frames;
+        std::vector<double> times = sessions_[i].sections;
+        times.push_back(frames.begin()->first);
+        for (double time : times)
+        {
+            auto iter = frames.find(time);
+            if (iter == frames.end())
+                continue;
+            old_nodes[i][time] = iter->second.pose;
+            nodes[i][time] = transforms[i] * iter->second.pose;
+        }
+    }
+    auto node_of = [&nodes](int i, double time) { return --nodes[i].upper_bound(time); };
+
+    ceres::Problem problem;
+    ceres::LocalParameterization *local_parameterization = new ceres::ProductParameterization(
+        new ceres::EigenQuaternionParameterization(),
+        new ceres::IdentityParameterization(3));
+    for (int i = 0; i < n; i++)
+    {
+        double *para_last = nullptr, last_time = 0;
+        for (auto &pair : nodes[i])
+        {
+            double *para = pair.second.data();
+            problem.AddParameterBlock(para, SE3d::num_parameters, local_parameterization);
+            if (para_last)
+            {
+                ceres::CostFunction *cost_function = PoseGraphError::Create(old_nodes[i][last_time], old_nodes[i][pair.first]);
+                problem.AddResidualBlock(cost_function, NULL, para_last, para);
+            }
+            para_last = para;
+            last_time = pair.first;
+        }
+    }
+    problem.SetParameterBlockConstant(nodes[0].begin()->second.data());
+    for (auto &loop : loops_)
+    {
+        // relative poses of the keyframes in their nodes are fixed
+        auto old_node = node_of(loop.old_session, loop.old_time);
+        auto node = node_of(loop.session, loop.time);
+        SE3d old_in_node = old_nodes[loop.old_session][old_node->first].inverse() * sessions_[loop.old_session].frames.at(loop.old_time).pose;
+        SE3d in_node = old_nodes[loop.session][node->first].inverse() * sessions_[loop.session].frames.at(loop.time).pose;
+        ceres::CostFunction *cost_function = PoseGraphError::Create(old_in_node * loop.relative_o_c * in_node.inverse());
+        problem.AddResidualBlock(cost_function, new ceres::HuberLoss(1), old_node->second.data(), node->second.data());
+    }
+    ceres::Solver::Options options;
+    options.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
+    options.num_threads = num_threads_;
+    ceres::Solver::Summary summary;
+    ceres::Solve(options, &problem, &summary);
+
+    // the times of the merged sessions are made disjoint in order
+    int num_merged = 0;
+    double end = -DBL_MAX;
+    for (int i = 0; i < n; i++)
+    {
+        if (!merged_[i])
+            continue;
+        auto &frames = sessions_[i].frames;
+        for (auto &pair : frames)
+        {
+            auto node = node_of(i, pair.first);
+            pair.second.pose = node->second * old_nodes[i][node->first].inverse() * pair.second.pose;
+        }
+        sessions_[i].offset = std::max(0.0, end + 1 - frames.begin()->first);
+        end = frames.rbegin()->first + sessions_[i].offset;
+        num_merged++;
+    }
+    LOG(INFO) << "MapMerger: merged " << num_merged << " of " << n << " sessions with " << loops_.size() << " loops";
+    return num_merged;
+}
+
+int MapMerger::Write(const std::string &path, const std::function<bool(const Vector3d &)> &inside)
+{
+    std::vector<const Session *> sessions;
+    std::vector<int> index(sessions_.size(), -1);
+    for (int i = 0; i < sessions_.size(); i++)
+    {
+        if (merged_[i])
+        {
+            index[i] = sessions.size();
+            sessions.push_back(&sessions_[i]);
+        }
+    }
+    std::vector<SessionLoop> loops;
+    for (auto loop : loops_)
+    {
+        if (index[loop.session] >= 0 && index[loop.old_session] >= 0)
+        {
+            loop.session = index[loop.session];
+            loop.old_session = index[loop.old_session];
+            loops.push_back(loop);
+        }
+    }
+    if (sessions.empty())
+        return 0;
+    return MapFile::Merge(path, sessions, loops, inside);
+}
+
+bool MapMerger::Save(const std::string &path)
+{
+    return Write(path, nullptr) > 0;
+}
+
+std::vector<std::string> MapMerger::SaveTiles(const std::string &directory, double size, double overlap)
+{
+    std::set<std::pair<int, int>> keys;
+    for (int i = 0; i < sessions_.size(); i++)
+    {
+        if (!merged_[i])
+            continue;
+        for (auto &pair : sessions_[i].frames)
+        {
+            Vector3d p = pair.second.pose.translation();
+            keys.insert(std::make_pair((int)std::floor(p.x() / size), (int)std::floor(p.y() / size)));
+        }
+    }
+
+    // tiles are written in parallel, each of them reads the sessions again
+    std::vector<std::pair<int, int>> tiles(keys.begin(), keys.end());
+    std::vector<std::string> paths(tiles.size());
+    Parallel(tiles.size(), [&](int k) {
+        double min_x = tiles[k].first * size - overlap, max_x = (tiles[k].first + 1) * size + overlap;
+        double min_y = tiles[k].second * size - overlap, max_y = (tiles[k].second + 1) * size + overlap;
+        std::string path = directory + "/tile_" + std::to_string(tiles[k].first) + "_" + std::to_string(tiles[k].second) + ".map";
+        auto inside = [=](const Vector3d &p) { return p.x() >= min_x && p.x() < max_x && p.y() >= min_y && p.y() < max_y; };
+        if (Write(path, inside) > 0)
+        {
+            paths[k] = path;
+        }
+    });
+    paths.erase(std::remove(paths.begin(), paths.end(), std::string()), paths.end());
+    return paths;
+}
+
+} // namespace lvio_fusion
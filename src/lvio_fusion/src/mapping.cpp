@@ -1,13 +1,14 @@
 #include "lvio_fusion/lidar/mapping.h"
 #include "lvio_fusion/adapt/problem.h"
 #include "lvio_fusion/ceres/lidar_error.hpp"
+#include "lvio_fusion/frame_store.h"
 #include "lvio_fusion/lidar/lidar.h"
 #include "lvio_fusion/loop/pose_graph.h"
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/scheduler.h"
 #include "lvio_fusion/utility.h"
 
-#include <pcl/filters/voxel_grid.h>
-
 namespace lvio_fusion
 {
 
@@ -37,53 +38,24 @@ inline void Mapping::Color(const PointICloud &points_ground, const PointICloud &
     }
 }
 
-Frames get_lidar_frames(double start, double end, int num)
+void Mapping::AddToMap(Frame::Ptr frame, lidar::VoxelMap &surf, lidar::VoxelMap &ground)
 {
-    auto keyframes = Map::Instance().keyframes;
-    if (end == 0)
-    {
-        auto iter = keyframes.upper_bound(start);
-        Frames frames;
-        int i = 0;
-        while (i < num && iter != keyframes.end())
-        {
-            if (iter->second->feature_lidar)
-            {
-                frames.insert(*iter);
-                i++;
-            }
-            iter++;
-        }
-        return frames;
-    }
-    else if (start == 0)
-    {
-        auto iter = keyframes.lower_bound(end);
-        Frames frames;
-        int i = 0;
-        while (i < num && iter != keyframes.begin())
-        {
-            --iter;
-            if (iter->second->feature_lidar)
-            {
-                frames.insert(*iter);
-                i++;
-            }
-        }
-        return frames;
-    }
-    return Frames();
+    std::unique_lock<std::mutex> lock(mutex_clouds_);
+    WorldCloud &cloud = GetWorldCloud(frame);
+    // the ground of a keyframe is segmented once when it is extracted
+    surf.Insert(frame->time, cloud.surf);
+    ground.Insert(frame->time, cloud.ground);
 }
 
-void Mapping::BuildOldMapFrame(Frame::Ptr old_frame, Frame::Ptr map_frame)
+Frames Mapping::GetOldFrames(Frame::Ptr old_frame)
 {
     Frames old_frames;
-    Frames prev_old_frames = get_lidar_frames(0, old_frame->time, 1);
+    Frames prev_old_frames = Map::Instance().GetLidarKeyFrames(0, old_frame->time, 1);
     if (!prev_old_frames.empty())
     {
         old_frames.insert(*prev_old_frames.begin());
     }
-    Frames subs_old_frames = get_lidar_frames(old_frame->time, 0, 1);
+    Frames subs_old_frames = Map::Instance().GetLidarKeyFrames(old_frame->time, 0, 1);
     if (!subs_old_frames.empty())
     {
         old_frames.insert(*subs_old_frames.begin());
@@ -92,94 +64,94 @@ void Mapping::BuildOldMapFrame(Frame::Ptr old_frame, Frame::Ptr map_frame)
     {
         old_frames[old_frame->time] = old_frame;
     }
+    return old_frames;
+}
 
-    PointICloud points_surf_merged;
-    PointICloud points_ground_merged;
+void Mapping::BuildOldMapFrame(Frame::Ptr old_frame, Frame::Ptr map_frame, lidar::VoxelMap &old_map_surf, lidar::VoxelMap &old_map_ground)
+{
+    Frames old_frames = GetOldFrames(old_frame);
     for (auto &pair : old_frames)
     {
-        points_surf_merged += pointclouds_surf[pair.first];
-        points_ground_merged += pointclouds_ground[pair.first];
+        AddToMap(pair.second, old_map_surf, old_map_ground);
     }
 
-    association_->SegmentGround(points_ground_merged);
-
     map_frame->id = old_frames.begin()->second->id;
     map_frame->time = old_frames.begin()->second->time;
     map_frame->pose = old_frames.begin()->second->pose;
     map_frame->feature_lidar = lidar::Feature::Create();
-    map_frame->feature_lidar->points_surf = points_surf_merged;
-    map_frame->feature_lidar->points_ground = points_ground_merged;
 }
 
-void Mapping::BuildMapFrame(Frame::Ptr frame, Frame::Ptr map_frame)
+Frames Mapping::GetLastFrames(Frame::Ptr frame)
 {
     double start_time = frame->time;
     static int num_last_frames = 3;
-    Frames last_frames = get_lidar_frames(0, start_time, num_last_frames);
+    Frames last_frames = Map::Instance().GetLidarKeyFrames(0, start_time, num_last_frames);
+    // the prior map is not continuous with this session
+    if (start_time > Map::Instance().prior)
+    {
+        last_frames.erase(last_frames.begin(), last_frames.upper_bound(Map::Instance().prior));
+    }
+    return last_frames;
+}
+
+void Mapping::BuildMapFrame(Frame::Ptr frame, Frame::Ptr map_frame)
+{
+    Frames last_frames = GetLastFrames(frame);
     if (last_frames.empty())
         return;
-    PointICloud points_surf_merged;
-    PointICloud points_ground_merged;
+
+    // frames leave the window
+    map_surf.EraseBefore(last_frames.begin()->first);
+    map_ground.EraseBefore(last_frames.begin()->first);
     for (auto &pair : last_frames)
     {
-        points_surf_merged += pointclouds_surf[pair.first];
-        points_ground_merged += pointclouds_ground[pair.first];
+        if (!map_surf.Contains(pair.first))
+        {
+            AddToMap(pair.second, map_surf, map_ground);
+        }
     }
 
-    association_->SegmentGround(points_ground_merged);
-
     map_frame->id = (--last_frames.end())->second->id;
     map_frame->time = (--last_frames.end())->second->time;
     map_frame->pose = (--last_frames.end())->second->pose;
     map_frame->feature_lidar = lidar::Feature::Create();
-    map_frame->feature_lidar->points_surf = points_surf_merged;
-    map_frame->feature_lidar->points_ground = points_ground_merged;
 }
 
-void Mapping::Optimize(Frames &active_kfs)
+double Mapping::Optimize(Frames &active_kfs)
 {
+    static Histogram &histogram = Metrics::Instance().GetHistogram("mapping");
+    // lidar features are extracted in the lidar thread, the caller holds the mutex of backend
+    double processed = association_->Processed();
+    if (active_kfs.empty())
+        return processed;
+    std::vector<Frame::Ptr> frames;
     // NOTE: some place is good, don't need optimize too much.
     for (auto &pair : active_kfs)
     {
+        if (pair.first > processed)
+            break;
         if (!pair.second->feature_lidar)
             continue;
+        if (parallel_)
+        {
+            frames.push_back(pair.second);
+            continue;
+        }
         auto t1 = std::chrono::steady_clock::now();
         SE3d old_pose = pair.second->pose;
         {
+            std::unique_lock<std::mutex> lock(mutex);
             auto map_frame = Frame::Ptr(new Frame());
             BuildMapFrame(pair.second, map_frame);
             if (map_frame->feature_lidar && pair.second->feature_lidar)
             {
-                double rpyxyz[6];
-                se32rpyxyz(map_frame->pose.inverse() * pair.second->pose, rpyxyz); // relative_i_j
-                if (!map_frame->feature_lidar->points_ground.empty())
-                {
-                    adapt::Problem problem;
-                    association_->ScanToMapWithGround(pair.second, map_frame, rpyxyz, problem);
-                    ceres::Solver::Options options;
-                    options.linear_solver_type = ceres::DENSE_QR;
-                    options.max_num_iterations = 4;
-                    options.num_threads = num_threads;
-                    ceres::Solver::Summary summary;
-                    adapt::Solve(options, &problem, &summary);
-                    pair.second->pose = map_frame->pose * rpyxyz2se3(rpyxyz);
-                }
-                if (!map_frame->feature_lidar->points_surf.empty())
-                {
-                    adapt::Problem problem;
-                    association_->ScanToMapWithSegmented(pair.second, map_frame, rpyxyz, problem);
-                    ceres::Solver::Options options;
-                    options.linear_solver_type = ceres::DENSE_QR;
-                    options.max_num_iterations = 4;
-                    options.num_threads = num_threads;
-                    ceres::Solver::Summary summary;
-                    adapt::Solve(options, &problem, &summary);
-                    pair.second->pose = map_frame->pose * rpyxyz2se3(rpyxyz);
-                }
+                Scheduler::Lease lease(Task::Mapping);
+                Register(pair.second, map_frame, map_surf, map_ground, lease.threads);
             }
         }
         SE3d new_pose = pair.second->pose;
         SE3d transform = new_pose * old_pose.inverse();
+        PoseGraph::Instance().Moved(pair.first);
         PoseGraph::Instance().ForwardUpdate(transform, pair.first + epsilon);
 
         ToWorld(pair.second);
@@ -187,6 +159,93 @@ void Mapping::Optimize(Frames &active_kfs)
         auto t2 = std::chrono::steady_clock::now();
         auto time_used = std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
         LOG(INFO) << "Mapping cost time: " << time_used.count() << " seconds.";
+        histogram.Record(time_used.count());
+    }
+    if (!frames.empty())
+    {
+        OptimizeParallel(frames);
+    }
+    return processed;
+}
+
+void Mapping::Register(Frame::Ptr frame, Frame::Ptr map_frame, lidar::VoxelMap &surf, lidar::VoxelMap &ground, int num_threads)
+{
+    double rpyxyz[6];
+    se32rpyxyz(map_frame->pose.inverse() * frame->pose, rpyxyz); // relative_i_j
+    if (ground.Size(0, map_frame->time) > 0)
+    {
+        adapt::Problem problem;
+        association_->ScanToMapWithGround(frame, map_frame, ground, 0, map_frame->time, rpyxyz, problem);
+        ceres::Solver::Options options;
+        options.linear_solver_type = ceres::DENSE_QR;
+        options.max_num_iterations = 4;
+        options.num_threads = num_threads;
+        ceres::Solver::Summary summary;
+        adapt::Solve(options, &problem, &summary);
+        frame->pose = map_frame->pose * rpyxyz2se3(rpyxyz);
+    }
+    if (surf.Size(0, map_frame->time) > 0)
+    {
+        adapt::Problem problem;
+        association_->ScanToMapWithSegmented(frame, map_frame, surf, 0, map_frame->time, rpyxyz, problem);
+        ceres::Solver::Options options;
+        options.linear_solver_type = ceres::DENSE_QR;
+        options.max_num_iterations = 4;
+        options.num_threads = num_threads;
+        ceres::Solver::Summary summary;
+        adapt::Solve(options, &problem, &summary);
+        frame->pose = map_frame->pose * rpyxyz2se3(rpyxyz);
+    }
+}
+
+void Mapping::OptimizeParallel(const std::vector<Frame::Ptr> &frames)
+{
+    static Histogram &histogram = Metrics::Instance().GetHistogram("mapping_batch");
+    ScopedTimer timer(histogram);
+    // every keyframe is aligned to its last lidar keyframes at their current poses,
+    // the result is kept relative to the newest of them
+    std::vector<double> anchors(frames.size(), 0);
+    std::vector<SE3d> relatives(frames.size());
+    parallel_for(0, frames.size(), [&](int i) {
+        Frames last_frames = GetLastFrames(frames[i]);
+        if (last_frames.empty())
+            return;
+        lidar::VoxelMap surf(map_surf.resolution), ground(map_ground.resolution);
+        for (auto &pair : last_frames)
+        {
+            AddToMap(pair.second, surf, ground);
+        }
+        auto map_frame = Frame::Ptr(new Frame());
+        map_frame->id = last_frames.rbegin()->second->id;
+        map_frame->time = last_frames.rbegin()->first;
+        map_frame->pose = last_frames.rbegin()->second->pose;
+        map_frame->feature_lidar = lidar::Feature::Create();
+        // the registration reads the pose of the frame, give it a view
+        Frame::Ptr view = Frame::Ptr(new Frame());
+        view->id = frames[i]->id;
+        view->time = frames[i]->time;
+        view->pose = frames[i]->pose;
+        view->weights = frames[i]->weights;
+        view->features_left = frames[i]->features_left;
+        view->feature_lidar = frames[i]->feature_lidar;
+        Register(view, map_frame, surf, ground, 1);
+        anchors[i] = map_frame->time;
+        relatives[i] = map_frame->pose.inverse() * view->pose;
+    });
+
+    // the anchors are moved by the corrections before them, as in the sequential mapping
+    for (int i = 0; i < frames.size(); i++)
+    {
+        Frame::Ptr frame = frames[i];
+        if (anchors[i] > 0)
+        {
+            SE3d old_pose = frame->pose;
+            frame->pose = Map::Instance().GetKeyFrame(anchors[i])->pose * relatives[i];
+            SE3d transform = frame->pose * old_pose.inverse();
+            PoseGraph::Instance().Moved(frame->time);
+            PoseGraph::Instance().ForwardUpdate(transform, frame->time + epsilon);
+        }
+        ToWorld(frame);
     }
 }
 
@@ -203,53 +262,146 @@ void Mapping::MergeScan(const PointICloud &in, SE3d Twc, PointICloud &out)
     }
 }
 
+inline MemoryAccount &world_clouds_memory()
+{
+    static MemoryAccount &memory = Metrics::Instance().GetMemory("mapping_world_clouds");
+    return memory;
+}
+
+inline long cloud_bytes(const PointICloud &surf, const PointICloud &ground)
+{
+    return (surf.size() + ground.size()) * sizeof(PointI);
+}
+
+const double tile_size = 100; // m
+
+// the caller holds mutex_clouds_
+void Mapping::TouchTile(double time, WorldCloud &cloud, const Vector3d &position)
+{
+    static std::atomic<long> &num_evicted = Metrics::Instance().GetCounter("tiles_evicted");
+    // shift the bits of x as unsigned, a negative signed value can not be shifted
+    long long key = (long long)(((unsigned long long)(unsigned int)(int)std::floor(position.x() / tile_size) << 32) | (unsigned int)(int)std::floor(position.y() / tile_size));
+    auto iter = tiles_.find(cloud.tile);
+    if (cloud.tile != key && iter != tiles_.end() && iter->second.frames.erase(time) && iter->second.frames.empty())
+    {
+        lru_.erase(iter->second.lru);
+        tiles_.erase(iter);
+    }
+    cloud.tile = key;
+    iter = tiles_.find(key);
+    if (iter == tiles_.end())
+    {
+        lru_.push_front(key);
+        iter = tiles_.insert(std::make_pair(key, Tile())).first;
+        iter->second.lru = lru_.begin();
+    }
+    else
+    {
+        lru_.splice(lru_.begin(), lru_, iter->second.lru);
+    }
+    iter->second.frames.insert(time);
+
+    // world points can be computed again from the keyframes, which are spilled by FrameStore
+    while (max_tiles_ > 0 && (int)tiles_.size() > max_tiles_)
+    {
+        auto last = tiles_.find(lru_.back());
+        for (double frame : last->second.frames)
+        {
+            auto evicted = world_clouds_.find(frame);
+            if (evicted != world_clouds_.end())
+            {
+                world_clouds_memory().Remove(cloud_bytes(evicted->second.surf, evicted->second.ground));
+                world_clouds_.erase(evicted);
+            }
+        }
+        tiles_.erase(last);
+        lru_.pop_back();
+        num_evicted++;
+    }
+}
+
+// the caller holds mutex_clouds_
+Mapping::WorldCloud &Mapping::GetWorldCloud(Frame::Ptr frame)
+{
+    size_t size = world_clouds_.size();
+    WorldCloud &cloud = world_clouds_[frame->time];
+    if (world_clouds_.size() > size)
+    {
+        world_clouds_memory().Add(0);
+    }
+    if (!cloud.valid || cloud.pose.params() != frame->pose.params())
+    {
+        auto pin = FrameStore::Instance().Load(frame);
+        world_clouds_memory().Remove(cloud_bytes(cloud.surf, cloud.ground), 0);
+        cloud.surf.clear();
+        cloud.ground.clear();
+        if (frame->feature_lidar)
+        {
+            MergeScan(frame->feature_lidar->points_surf, frame->pose, cloud.surf);
+            MergeScan(frame->feature_lidar->points_ground, frame->pose, cloud.ground);
+        }
+        world_clouds_memory().Add(cloud_bytes(cloud.surf, cloud.ground), 0);
+        cloud.pose = frame->pose;
+        cloud.valid = true;
+    }
+    TouchTile(frame->time, cloud, cloud.pose.translation());
+    return cloud;
+}
+
 void Mapping::ToWorld(Frame::Ptr frame)
 {
-    PointICloud pointcloud_surf;
-    PointICloud pointcloud_ground;
-    PointRGBCloud pointcloud_color;
-    if (frame->feature_lidar)
+    // the global map is updated when it is needed
     {
-        MergeScan(frame->feature_lidar->points_surf, frame->pose, pointcloud_surf);
-        MergeScan(frame->feature_lidar->points_ground, frame->pose, pointcloud_ground);
-        Color(pointcloud_ground, pointcloud_surf, frame, pointcloud_color);
+        std::unique_lock<std::mutex> lock(mutex_clouds_);
+        moved_[frame->time] = frame;
+    }
+
+    // only keep the frames in the local map up to date, the older ones are added when needed
+    std::unique_lock<std::mutex> lock(mutex);
+    if (map_surf.Contains(frame->time) || frame->time > map_surf.Latest())
+    {
+        AddToMap(frame, map_surf, map_ground);
     }
-    pointclouds_surf[frame->time] = pointcloud_surf;
-    pointclouds_ground[frame->time] = pointcloud_ground;
-    pointclouds_color[frame->time] = pointcloud_color;
 }
 
 void Mapping::ToWorld(double start)
 {
-    auto active_kfs = Map::Instance().GetKeyFrames(start);
-    for (auto &pair : active_kfs)
+    for (auto &pair : Map::Instance().GetRange(start))
     {
         ToWorld(pair.second);
     }
 }
 
-PointRGBCloud Mapping::GetGlobalMap()
+void Mapping::UpdateGlobalMap()
 {
-    PointRGBCloud global_map;
-    for (auto &pair_pc : pointclouds_color)
-    {
-        auto &pointcloud = pair_pc.second;
-        global_map.insert(global_map.end(), pointcloud.begin(), pointcloud.end());
-    }
-    if (global_map.size() > 0)
+    std::unique_lock<std::mutex> lock(mutex_clouds_);
+    for (auto &pair : moved_)
     {
-        PointRGBCloud::Ptr temp(new PointRGBCloud());
-        pcl::VoxelGrid<PointRGB> voxel_filter;
-        pcl::copyPointCloud(global_map, *temp);
-        voxel_filter.setInputCloud(temp);
-        voxel_filter.setLeafSize(Lidar::Get()->resolution * 2, Lidar::Get()->resolution * 2, Lidar::Get()->resolution * 2);
-        voxel_filter.filter(global_map);
+        WorldCloud &cloud = GetWorldCloud(pair.second);
+        PointRGBCloud pointcloud_color;
+        Color(cloud.ground, cloud.surf, pair.second, pointcloud_color);
+        global_map.Insert(pair.first, pointcloud_color);
     }
-    return global_map;
+    moved_.clear();
+}
+
+PointRGBCloud Mapping::GetGlobalMap()
+{
+    UpdateGlobalMap();
+    return global_map.Get();
+}
+
+std::vector<lidar::GlobalMap::ChunkUpdate> Mapping::GetGlobalMapUpdate()
+{
+    UpdateGlobalMap();
+    return global_map.GetDirty();
 }
 
 int Mapping::Relocate(Frame::Ptr last_frame, Frame::Ptr current_frame, SE3d &relative_o_c)
 {
+    if (registration_ == lidar::RegistrationMethod::VGICP)
+        return RelocateByRegistration(last_frame, current_frame, relative_o_c);
+
     // init relative pose
     Frame::Ptr clone_frame = Frame::Ptr(new Frame());
     *clone_frame = *current_frame;
@@ -257,41 +409,44 @@ int Mapping::Relocate(Frame::Ptr last_frame, Frame::Ptr current_frame, SE3d &rel
 
     // build two pointclouds
     Frame::Ptr map_frame = Frame::Ptr(new Frame());
-    BuildOldMapFrame(last_frame, map_frame);
+    lidar::VoxelMap old_map_surf(map_surf.resolution), old_map_ground(map_ground.resolution);
+    BuildOldMapFrame(last_frame, map_frame, old_map_surf, old_map_ground);
 
     // optimize
-    double score_ground, score_surf;
+    double score_ground = 0, score_surf = 0;
     for (int i = 0; i < 4; i++)
     {
         double rpyxyz[6];
         se32rpyxyz(map_frame->pose.inverse() * clone_frame->pose, rpyxyz); // relative_i_j
-        if (!map_frame->feature_lidar->points_ground.empty())
+        if (!old_map_ground.Empty())
         {
             adapt::Problem problem;
-            association_->ScanToMapWithGround(clone_frame, map_frame, rpyxyz, problem, true);
+            association_->ScanToMapWithGround(clone_frame, map_frame, old_map_ground, 0, 0, rpyxyz, problem, true);
             ceres::Solver::Options options;
             options.linear_solver_type = ceres::DENSE_QR;
             options.max_num_iterations = 4;
-            options.num_threads = num_threads;
+            Scheduler::Lease lease(Task::Relocator);
+            options.num_threads = lease.threads;
             ceres::Solver::Summary summary;
             ceres::Solve(options, &problem, &summary);
             clone_frame->pose = map_frame->pose * rpyxyz2se3(rpyxyz);
-            score_ground = std::min((double)summary.num_residual_blocks_reduced / 10, 20.0);
-            score_ground -= 2 * summary.final_cost / summary.num_residual_blocks_reduced;
+            score_ground = std::min((double)summary.num_residuals_reduced / 10, 20.0);
+            score_ground -= 2 * summary.final_cost / summary.num_residuals_reduced;
         }
-        if (!map_frame->feature_lidar->points_surf.empty())
+        if (!old_map_surf.Empty())
         {
             adapt::Problem problem;
-            association_->ScanToMapWithSegmented(clone_frame, map_frame, rpyxyz, problem, true);
+            association_->ScanToMapWithSegmented(clone_frame, map_frame, old_map_surf, 0, 0, rpyxyz, problem, true);
             ceres::Solver::Options options;
             options.linear_solver_type = ceres::DENSE_QR;
             options.max_num_iterations = 4;
-            options.num_threads = num_threads;
+            Scheduler::Lease lease(Task::Relocator);
+            options.num_threads = lease.threads;
             ceres::Solver::Summary summary;
             ceres::Solve(options, &problem, &summary);
             clone_frame->pose = map_frame->pose * rpyxyz2se3(rpyxyz);
-            score_surf = std::min((double)summary.num_residual_blocks_reduced / 10, 30.0);
-            score_surf -= 2 * summary.final_cost / summary.num_residual_blocks_reduced;
+            score_surf = std::min((double)summary.num_residuals_reduced / 10, 30.0);
+            score_surf -= 2 * summary.final_cost / summary.num_residuals_reduced;
         }
     }
 
@@ -299,4 +454,47 @@ int Mapping::Relocate(Frame::Ptr last_frame, Frame::Ptr current_frame, SE3d &rel
     return score_ground + score_surf;
 }
 
+int Mapping::RelocateByRegistration(Frame::Ptr last_frame, Frame::Ptr current_frame, SE3d &relative_o_c)
+{
+    SE3d pose = last_frame->pose * current_frame->loop_closure->relative_o_c;
+
+    // distributions of the old map, computed once
+    lidar::Registration registration;
+    {
+        PointICloud old_ground, old_surf;
+        std::unique_lock<std::mutex> lock(mutex_clouds_);
+        for (auto &pair : GetOldFrames(last_frame))
+        {
+            WorldCloud &cloud = GetWorldCloud(pair.second);
+            old_ground += cloud.ground;
+            old_surf += cloud.surf;
+        }
+        registration.AddTarget(old_ground, map_ground.resolution, current_frame->weights.lidar_ground, 0);
+        registration.AddTarget(old_surf, map_surf.resolution, current_frame->weights.lidar_surf, 0.1);
+    }
+
+    // ground and surface points are aligned at the same time
+    const PointICloud &points_ground = current_frame->feature_lidar->points_ground;
+    const PointICloud &points_surf = current_frame->feature_lidar->points_surf;
+    {
+        Scheduler::Lease lease(Task::Relocator);
+        registration.Align({&points_ground, &points_surf}, pose, lease.threads);
+    }
+
+    // the same score as scan to map
+    double cost_ground, cost_surf, score_ground = 0, score_surf = 0;
+    int num_ground = registration.Match(0, points_ground, pose, cost_ground);
+    int num_surf = registration.Match(1, points_surf, pose, cost_surf);
+    if (num_ground)
+    {
+        score_ground = std::min(num_ground / 10.0, 20.0) - 2 * cost_ground / num_ground;
+    }
+    if (num_surf)
+    {
+        score_surf = std::min(num_surf / 10.0, 30.0) - 2 * cost_surf / num_surf;
+    }
+    relative_o_c = last_frame->pose.inverse() * pose;
+    return score_ground + score_surf;
+}
+
 } // namespace lvio_fusion
@@ -0,0 +1,157 @@
+#include "lvio_fusion/metrics.h"
+
+#include <fstream>
+
+namespace lvio_fusion
+{
+
+Histogram::Histogram()
+{
+    for (auto &bucket : buckets_)
+    {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+inline int bucket_index(long us)
+{
+    if (us < 1)
+        us = 1;
+    int e = 63 - __builtin_clzl(us);
+    int sub = e >= 4 ? (us >> (e - 4)) & 15 : (us << (4 - e)) & 15;
+    return std::min(e * 16 + sub, 32 * 16 - 1);
+}
+
+// the middle of the bucket (us)
+inline double bucket_value(int index)
+{
+    int e = index / 16, sub = index % 16;
+    return std::ldexp(16 + sub + 0.5, e - 4);
+}
+
+void Histogram::Record(double seconds)
+{
+    long us = seconds * 1e6;
+    buckets_[bucket_index(us)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(us, std::memory_order_relaxed);
+    long max = max_.load(std::memory_order_relaxed);
+    while (us > max && !max_.compare_exchange_weak(max, us, std::memory_order_relaxed))
+    {
+    }
+}
+
+double Histogram::Mean() const
+{
+    long count = Count();
+    return count ? sum_.load(std::memory_order_relaxed) * 1e-6 / count : 0;
+}
+
+double Histogram::Percentile(double p) const
+{
+    long count = Count();
+    if (count == 0)
+        return 0;
+    long rank = std::ceil(p / 100 * count), sum = 0;
+    for (int i = 0; i < num_buckets; i++)
+    {
+        sum += buckets_[i].load(std::memory_order_relaxed);
+        if (sum >= rank)
+            return std::min(bucket_value(i), (double)max_.load(std::memory_order_relaxed)) * 1e-6;
+    }
+    return Max();
+}
+
+Histogram &Metrics::GetHistogram(const std::string &name)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto &histogram = histograms_[name];
+    if (!histogram)
+    {
+        histogram.reset(new Histogram);
+    }
+    return *histogram;
+}
+
+std::atomic<long> &Metrics::GetCounter(const std::string &name)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto &counter = counters_[name];
+    if (!counter)
+    {
+        counter.reset(new std::atomic<long>(0));
+    }
+    return *counter;
+}
+
+MemoryAccount &Metrics::GetMemory(const std::string &name)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto &account = memory_[name];
+    if (!account)
+    {
+        account.reset(new MemoryAccount);
+    }
+    return *account;
+}
+
+std::vector<Metrics::Stat> Metrics::GetStats()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::vector<Stat> stats;
+    for (auto &pair : histograms_)
+    {
+        auto &histogram = *pair.second;
+        stats.push_back({pair.first, histogram.Count(), histogram.Mean(), histogram.Percentile(50), histogram.Percentile(99), histogram.Max()});
+    }
+    return stats;
+}
+
+std::map<std::string, long> Metrics::GetCounters()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::map<std::string, long> counters;
+    for (auto &pair : counters_)
+    {
+        counters[pair.first] = pair.second->load(std::memory_order_relaxed);
+    }
+    return counters;
+}
+
+std::vector<Metrics::MemoryStat> Metrics::GetMemoryStats()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::vector<MemoryStat> stats;
+    for (auto &pair : memory_)
+    {
+        stats.push_back({pair.first, pair.second->Bytes(), pair.second->Objects()});
+    }
+    return stats;
+}
+
+bool Metrics::Dump(const std::string &path)
+{
+    std::ofstream out(path);
+    if (!out.is_open())
+    {
+        LOG(ERROR) << "Metrics: can not open " << path;
+        return false;
+    }
+    out << "name,count,mean,p50,p99,max" << std::endl;
+    for (auto &stat : GetStats())
+    {
+        out << stat.name << "," << stat.count << "," << stat.mean << "," << stat.p50 << "," << stat.p99 << "," << stat.max << std::endl;
+    }
+    for (auto &pair : GetCounters())
+    {
+        out << pair.first << "," << pair.second << ",,,," << std::endl;
+    }
+    for (auto &stat : GetMemoryStats())
+    {
+        out << "memory." << stat.name << ".bytes," << stat.bytes << ",,,," << std::endl;
+        out << "memory." << stat.name << ".objects," << stat.objects << ",,,," << std::endl;
+    }
+    return true;
+}
+
+} // namespace lvio_fusion
@@ -1,43 +1,79 @@
 #include "lvio_fusion/navsat/navsat.h"
 #include "lvio_fusion/ceres/navsat_error.hpp"
 #include "lvio_fusion/ceres/pose_error.hpp"
+#include "lvio_fusion/event.h"
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
 #include "lvio_fusion/utility.h"
 
 namespace lvio_fusion
 {
 
+// smaller corrections are not propagated to the following keyframes
+const double min_moved_translation = 1e-3;
+const double min_moved_rotation = 1e-4;
+
 void Navsat::AddPoint(double time, double x, double y, double z, Vector3d cov)
 {
-    raw[time] = Vector3d(x, y, z);
-
-    static double finished = 0;
-    Frames new_kfs = Map::Instance().GetKeyFrames(finished);
-    for (auto &pair : new_kfs)
+    static MemoryAccount &memory = Metrics::Instance().GetMemory("navsat_raw");
     {
-        auto this_iter = raw.lower_bound(pair.first);
-        auto last_iter = this_iter;
-        last_iter--;
-        if (this_iter == raw.begin() || this_iter == raw.end() || std::fabs(this_iter->first - pair.first) > 1)
-            continue;
-
-        double t1 = pair.first - last_iter->first,
-               t2 = this_iter->first - pair.first;
-        auto p = (this_iter->second * t1 + last_iter->second * t2) / (t1 + t2);
-        raw[pair.first] = p;
-        pair.second->feature_navsat = navsat::Feature::Ptr(new navsat::Feature(pair.first, cov));
-        finished = pair.first + epsilon;
+        std::unique_lock<std::mutex> lock(mutex_);
+        size_t size = raw.size();
+        raw[time] = Vector3d(x, y, z);
+        memory.Add((raw.size() - size) * (sizeof(double) + sizeof(Vector3d)), raw.size() - size);
+        Associate(cov);
     }
-    if (!initialized && !Map::Instance().keyframes.empty() && frames_distance(0, -1) > trust_distance_pitch_)
+    if (!initialized && Map::Instance().size() > 0 && frames_distance(0, -1) > trust_distance_pitch_)
     {
         Initialize();
     }
 }
 
+// keyframes and fixes are both sorted by time, so walk them together once,
+// keyframes not covered by a fix within 1s are skipped and never scanned again.
+void Navsat::Associate(const Vector3d &cov)
+{
+    auto new_kfs = Map::Instance().GetRange(finished_);
+    auto iter = raw.lower_bound(finished_);
+    for (auto &pair : new_kfs)
+    {
+        // wait for the next fix
+        if (pair.first > (raw.end() - 1)->first)
+            break;
+        while (iter->first < pair.first)
+        {
+            iter++;
+        }
+        if (iter != raw.begin() && iter->first - pair.first <= 1)
+        {
+            pair.second->feature_navsat = navsat::Feature::Ptr(new navsat::Feature(pair.first, cov));
+            dirty_ = true;
+            EventBus::Instance().Publish(Event::NavsatFixed, pair.first);
+        }
+        finished_ = pair.first + epsilon;
+    }
+}
+
+// interpolate between the fixes around time
 Vector3d Navsat::GetRawPoint(double time)
 {
-    assert(raw.find(time) != raw.end());
-    return raw[time];
+    std::unique_lock<std::mutex> lock(mutex_);
+    assert(!raw.empty());
+    auto this_iter = raw.lower_bound(time);
+    if (this_iter == raw.end())
+        return (raw.end() - 1)->second;
+    if (this_iter == raw.begin() || this_iter->first == time)
+        return this_iter->second;
+    auto last_iter = this_iter - 1;
+    double t1 = time - last_iter->first,
+           t2 = this_iter->first - time;
+    return (this_iter->second * t1 + last_iter->second * t2) / (t1 + t2);
+}
+
+std::vector<std::pair<double, Vector3d>> Navsat::GetRawPoints(double start)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return std::vector<std::pair<double, Vector3d>>(raw.upper_bound(start), raw.end());
 }
 
 Vector3d Navsat::GetFixPoint(Frame::Ptr frame)
@@ -63,6 +99,7 @@ Vector3d Navsat::GetPoint(double time)
 
 Vector3d Navsat::GetAroundPoint(double time)
 {
+    std::unique_lock<std::mutex> lock(mutex_);
     if (raw.empty())
         return Vector3d::Zero();
     auto iter = raw.lower_bound(time);
@@ -74,6 +111,7 @@ Vector3d Navsat::GetAroundPoint(double time)
 // make sure time > begin
 bool Navsat::EstimatePose(double time, SE3d &pose)
 {
+    std::unique_lock<std::mutex> lock(mutex_);
     auto iter1 = raw.lower_bound(time);
     auto iter2 = iter1--;
     if (iter2 != raw.begin() && iter2 != raw.end())
@@ -99,7 +137,8 @@ bool Navsat::EstimatePose(double time, SE3d &pose)
 
 void Navsat::Initialize()
 {
-    Frames keyframes = Map::Instance().keyframes;
+    auto snapshot = Map::Instance().GetSnapshot();
+    const ChunkedFrames &keyframes = *snapshot;
 
     ceres::Problem problem;
     double para[6] = {0, 0, 0, 0, 0, 0};
@@ -132,8 +171,14 @@ void Navsat::Initialize()
     initialized = true;
 }
 
-void Navsat::Optimize(const Section &section)
+void Navsat::Moved(double time)
+{
+    moved_ = moved_ ? std::min(moved_, time) : time;
+}
+
+double Navsat::Optimize(const Section &section)
 {
+    moved_ = 0;
     current_section = section;
     A = Map::Instance().GetKeyFrame(section.A);
     B = Map::Instance().GetKeyFrame(section.B);
@@ -153,13 +198,25 @@ void Navsat::Optimize(const Section &section)
         auto frame = pair.second;
         OptimizeBC(frame, frame->time + epsilon, 0b110111);
     }
+    return moved_;
 }
 
-void Navsat::QuickFix(double start, double end)
+double Navsat::QuickFix(double start, double end)
 {
+    // only new fixes can change the result
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!dirty_)
+            return 0;
+    }
     if (PoseGraph::Instance().turning ||
         frames_distance(PoseGraph::Instance().current_section.B, end) < trust_distance_yaw_)
-        return;
+        return 0;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        dirty_ = false;
+    }
+    moved_ = 0;
     current_section = PoseGraph::Instance().current_section;
     A = Map::Instance().GetKeyFrame(start);
     B = Map::Instance().GetKeyFrame(PoseGraph::Instance().current_section.B);
@@ -186,6 +243,7 @@ void Navsat::QuickFix(double start, double end)
     //         PoseGraph::Instance().AddSection(end);
     //     }
     // }
+    return moved_;
 }
 
 // mode: zyxrpy
@@ -265,6 +323,10 @@ void Navsat::OptimizeBC(Frame::Ptr frame, double end, unsigned char mode)
     frame->pose = frame->pose * rpyxyz2se3(para);
     SE3d new_pose = frame->pose;
     SE3d transform = new_pose * old_pose.inverse();
+    if (transform.translation().norm() < min_moved_translation &&
+        transform.so3().log().norm() < min_moved_rotation)
+        return;
+    Moved(frame->time);
     PoseGraph::Instance().ForwardUpdate(transform, Map::Instance().GetKeyFrames(frame->time + epsilon, C->time));
 }
 
@@ -304,6 +366,7 @@ void Navsat::OptimizeAB()
     options.linear_solver_type = ceres::DENSE_QR;
     ceres::Solver::Summary summary;
     ceres::Solve(options, &problem, &summary);
+    Moved(A->time + epsilon);
 }
 
 } // namespace lvio_fusion
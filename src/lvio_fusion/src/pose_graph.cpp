@@ -1,10 +1,14 @@
 #include "lvio_fusion/loop/pose_graph.h"
 #include "lvio_fusion/ceres/pose_error.hpp"
+#include "lvio_fusion/event.h"
+#include "lvio_fusion/scheduler.h"
 #include "lvio_fusion/utility.h"
 
 namespace lvio_fusion
 {
 
+const size_t max_corrections = 1000;
+
 Section &PoseGraph::AddSubMap(double old_time, double start_time, double end_time)
 {
     Section new_submap;
@@ -118,6 +122,7 @@ void PoseGraph::UpdateSections(double time)
                 {
                     current_section.C = last_buf.back();
                     sections_[current_section.A] = current_section;
+                    EventBus::Instance().Publish(Event::SectionClosed, current_section.C);
                     current_section.A = last_buf.back();
                     current_section.B = current_section.A;
                     current_section.degree = degree;
@@ -139,9 +144,21 @@ Atlas PoseGraph::GetSections(double start, double end)
     return Atlas(start_iter, end_iter);
 }
 
+void PoseGraph::GetAtlas(Atlas &sections, Atlas &submaps)
+{
+    sections = sections_;
+    submaps = submaps_;
+}
+
+void PoseGraph::SetAtlas(const Atlas &sections, const Atlas &submaps)
+{
+    sections_ = sections;
+    submaps_ = submaps;
+}
+
 Section PoseGraph::GetSection(double time)
 {
-    assert(time >= Map::Instance().keyframes.begin()->first);
+    assert(time >= Map::Instance().GetSnapshot()->begin()->first);
     return (--sections_.upper_bound(time))->second;
 }
 
@@ -152,6 +169,7 @@ bool PoseGraph::AddSection(double time)
     {
         current_section.C = time;
         sections_[current_section.A] = current_section;
+        EventBus::Instance().Publish(Event::SectionClosed, time);
         current_section.A = time;
         current_section.B = time;
         current_section.degree = 0;
@@ -200,27 +218,39 @@ void PoseGraph::Optimize(Atlas &sections, Section &submap, adapt::Problem &probl
     if (sections.empty())
         return;
 
+    // the graph is a chain of sections, the solution of the last loop is the initial value
     ceres::Solver::Options options;
     options.linear_solver_type = ceres::SPARSE_NORMAL_CHOLESKY;
+    Scheduler::Lease lease(Task::Relocator);
+    options.num_threads = lease.threads;
     ceres::Solver::Summary summary;
     ceres::Solve(options, &problem, &summary);
+    {
+        std::unique_lock<std::mutex> lock(mutex_corrected_);
+        corrected_ = std::min(corrected_, sections.begin()->first);
+    }
+    Moved(sections.begin()->first);
 
-    Section last_section;
-    double last_time = 0;
+    // keyframes inside a section move with its A, propagate all sections in one pass over the map
+    std::vector<std::pair<double, SE3d>> transforms;
     for (auto &pair : sections)
     {
-        if (last_time)
+        transforms.push_back(std::make_pair(pair.first, Map::Instance().GetKeyFrame(pair.first)->pose * pair.second.old_A.inverse()));
+    }
+    auto forward_kfs = Map::Instance().GetRange(sections.begin()->first + epsilon, submap.B - epsilon);
+    int i = 0;
+    for (auto &pair : forward_kfs)
+    {
+        while (i + 1 < transforms.size() && pair.first >= transforms[i + 1].first - epsilon)
         {
-            SE3d transfrom = Map::Instance().GetKeyFrame(last_time)->pose * last_section.old_A.inverse();
-            Frames forward_kfs = Map::Instance().GetKeyFrames(last_time + epsilon, pair.first - epsilon);
-            ForwardUpdate(transfrom, forward_kfs);
+            i++;
         }
-        last_time = pair.first;
-        last_section = pair.second;
+        // A is optimized directly
+        if (std::fabs(pair.first - transforms[i].first) < epsilon)
+            continue;
+        pair.second->pose = transforms[i].second * pair.second->pose;
+        pair.second->Vw = transforms[i].second.unit_quaternion() * pair.second->Vw;
     }
-    SE3d transfrom = Map::Instance().GetKeyFrame(last_time)->pose * last_section.old_A.inverse();
-    Frames forward_kfs = Map::Instance().GetKeyFrames(last_time + epsilon, submap.B - epsilon);
-    ForwardUpdate(transfrom, forward_kfs);
 }
 
 // new pose = transform * old pose;
@@ -238,17 +268,66 @@ void PoseGraph::ForwardUpdate(SE3d transform, double start_time, bool need_lock)
         forward_kfs[last_frame->time] = last_frame;
     }
     ForwardUpdate(transform, forward_kfs);
-    frontend_->UpdateCache();
+    // depths are not changed, only move the anchor keyframes
+    frontend_->UpdateCache(false);
 }
 
 // new pose = transform * old pose;
 void PoseGraph::ForwardUpdate(SE3d transform, const Frames &forward_kfs)
 {
+    // move the poses before publishing, a reader of the correction sees the new poses
     for (auto &pair : forward_kfs)
     {
         pair.second->pose = transform * pair.second->pose;
         pair.second->Vw = transform.unit_quaternion() * pair.second->Vw;
     }
+    if (!forward_kfs.empty())
+    {
+        std::unique_lock<std::mutex> lock(mutex_corrected_);
+        corrected_ = std::min(corrected_, forward_kfs.begin()->first);
+    }
+    if (!forward_kfs.empty())
+    {
+        std::unique_lock<std::mutex> lock(mutex_corrections_);
+        Correction correction;
+        correction.start = forward_kfs.begin()->first;
+        correction.end = forward_kfs.rbegin()->first;
+        correction.transform = transform;
+        corrections_.push_back(correction);
+        // nobody takes them, fall back to resending the moved poses
+        if (corrections_.size() > max_corrections)
+        {
+            for (auto &c : corrections_)
+            {
+                moved_ = std::min(moved_, c.start);
+            }
+            corrections_.clear();
+        }
+    }
+}
+
+double PoseGraph::TakeCorrected()
+{
+    std::unique_lock<std::mutex> lock(mutex_corrected_);
+    double corrected = corrected_;
+    corrected_ = DBL_MAX;
+    return corrected;
+}
+
+void PoseGraph::Moved(double time)
+{
+    std::unique_lock<std::mutex> lock(mutex_corrections_);
+    moved_ = std::min(moved_, time);
+}
+
+double PoseGraph::TakeCorrections(std::vector<Correction> &corrections)
+{
+    std::unique_lock<std::mutex> lock(mutex_corrections_);
+    corrections.swap(corrections_);
+    corrections_.clear();
+    double moved = moved_;
+    moved_ = DBL_MAX;
+    return moved;
 }
 
-} // namespace lvio_fusion
\ No newline at end of file
+} // namespace lvio_fusion
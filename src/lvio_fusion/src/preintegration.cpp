@@ -11,6 +11,7 @@ namespace imu
 //NOTE:translation,rotation,velocity,ba,bg,para_pose(rotation,translation)
 int O_T = 0, O_R = 3, O_V = 6, O_BA = 9, O_BG = 12, O_PR = 0, O_PT = 4;
 Vector3d g(0, 0, 9.81007);
+double bias_threshold = 0;
 
 Preintegration::Preintegration(const Vector3d &_linearized_ba, const Vector3d &_linearized_bg)
     : linearized_ba{_linearized_ba}, linearized_bg{_linearized_bg},
@@ -18,6 +19,11 @@ Preintegration::Preintegration(const Vector3d &_linearized_ba, const Vector3d &_
       sum_dt{0.0}, delta_p{Vector3d::Zero()}, delta_q{Quaterniond::Identity()}, delta_v{Vector3d::Zero()}
 {
     delta_bias = Matrix<double, 6, 1>::Zero();
+    propagated_ba = linearized_ba;
+    propagated_bg = linearized_bg;
+    propagated_delta_p = delta_p;
+    propagated_delta_q = delta_q;
+    propagated_delta_v = delta_v;
     noise = Matrix<double, 18, 18>::Zero();
     noise.block<3, 3>(0, 0) = (Imu::Get()->ACC_N * Imu::Get()->ACC_N) * Matrix3d::Identity();
     noise.block<3, 3>(3, 3) = (Imu::Get()->GYR_N * Imu::Get()->GYR_N) * Matrix3d::Identity();
@@ -124,6 +130,11 @@ void Preintegration::Propagate(double _dt, const Vector3d &_acc_1, const Vector3
     sum_dt += dt;
     acc0 = acc1;
     gyr0 = gyr1;
+    propagated_ba = linearized_ba;
+    propagated_bg = linearized_bg;
+    propagated_delta_p = delta_p;
+    propagated_delta_q = delta_q;
+    propagated_delta_v = delta_v;
 }
 void Preintegration::Repropagate(const Vector3d &_linearized_ba, const Vector3d &_linearized_bg)
 {
@@ -137,8 +148,37 @@ void Preintegration::Repropagate(const Vector3d &_linearized_ba, const Vector3d
     linearized_bg = _linearized_bg;
     jacobian.setIdentity();
     covariance.setZero();
-    for (int i = 0; i < static_cast<int>(dt_buf.size()); i++)
-        Propagate(dt_buf[i], acc_buf[i], gyr_buf[i]);
+    for (int i = begin_, end = begin_ + size_; i < end; i++)
+    {
+        const Samples::Block &block = *blocks_[i / Samples::block_size];
+        int j = i % Samples::block_size;
+        Propagate(block.dt[j], block.acc[j], block.gyr[j]);
+    }
+}
+
+void Preintegration::Relinearize(const Vector3d &_linearized_ba, const Vector3d &_linearized_bg)
+{
+    Vector3d dba = _linearized_ba - propagated_ba;
+    Vector3d dbg = _linearized_bg - propagated_bg;
+    if (dba.norm() >= bias_threshold || dbg.norm() >= bias_threshold)
+    {
+        static std::atomic<long> &num_repropagated = Metrics::Instance().GetCounter("preintegrations_repropagated");
+        Repropagate(_linearized_ba, _linearized_bg);
+        num_repropagated++;
+        return;
+    }
+    Matrix3d dp_dba = jacobian.block<3, 3>(O_T, O_BA);
+    Matrix3d dp_dbg = jacobian.block<3, 3>(O_T, O_BG);
+    Matrix3d dq_dbg = jacobian.block<3, 3>(O_R, O_BG);
+    Matrix3d dv_dba = jacobian.block<3, 3>(O_V, O_BA);
+    Matrix3d dv_dbg = jacobian.block<3, 3>(O_V, O_BG);
+    delta_p = propagated_delta_p + dp_dba * dba + dp_dbg * dbg;
+    delta_v = propagated_delta_v + dv_dba * dba + dv_dbg * dbg;
+    delta_q = (propagated_delta_q * q_delta(dq_dbg * dbg)).normalized();
+    linearized_ba = _linearized_ba;
+    linearized_bg = _linearized_bg;
+    static std::atomic<long> &num_corrected = Metrics::Instance().GetCounter("preintegrations_corrected");
+    num_corrected++;
 }
 
 Matrix<double, 15, 1> Preintegration::Evaluate(
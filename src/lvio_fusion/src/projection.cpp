@@ -1,6 +1,7 @@
 #include "lvio_fusion/lidar/projection.h"
 #include "lvio_fusion/utility.h"
 
+#include <climits>
 #include <pcl/filters/voxel_grid.h>
 
 #define OUTLIER_LABEL 999999
@@ -10,9 +11,13 @@ namespace lvio_fusion
 
 void ImageProjection::Clear()
 {
-    range_mat = cv::Mat(num_scans_, horizon_scan_, CV_32F, cv::Scalar::all(FLT_MAX));
-    ground_mat = cv::Mat(num_scans_, horizon_scan_, CV_8S, cv::Scalar::all(0));
-    label_mat = cv::Mat(num_scans_, horizon_scan_, CV_32S, cv::Scalar::all(0));
+    // the images are allocated once and reused by every scan
+    range_mat.create(num_scans_, horizon_scan_, CV_32F);
+    ground_mat.create(num_scans_, horizon_scan_, CV_8S);
+    label_mat.create(num_scans_, horizon_scan_, CV_32S);
+    range_mat.setTo(cv::Scalar::all(FLT_MAX));
+    ground_mat.setTo(cv::Scalar::all(0));
+    label_mat.setTo(cv::Scalar::all(0));
     label_count = 1;
     PointI nan; // fill in fullCloud at each iteration
     nan.x = std::numeric_limits<float>::quiet_NaN();
@@ -22,13 +27,19 @@ void ImageProjection::Clear()
     std::fill(points_full.points.begin(), points_full.points.end(), nan);
 }
 
-SegmentedInfo ImageProjection::Process(PointICloud &points, PointICloud &points_segmented)
+SegmentedInfo ImageProjection::Process(PointICloud &points, const std::vector<int16_t> &rings, PointICloud &points_segmented)
 {
     SegmentedInfo segmented_info(num_scans_, horizon_scan_);
 
     FindStartEndAngle(segmented_info, points);
 
-    ProjectPointCloud(segmented_info, points);
+    static const std::vector<int16_t> no_rings;
+    bool use_rings = rings.size() == points.size();
+    if (use_rings && !ring_order_)
+    {
+        FindRingOrder(points, rings);
+    }
+    ProjectPointCloud(segmented_info, points, use_rings && ring_order_ ? rings : no_rings);
 
     RemoveGround(segmented_info);
 
@@ -54,86 +65,129 @@ void ImageProjection::FindStartEndAngle(SegmentedInfo &segmented_info, PointIClo
     segmented_info.orientation_diff = segmented_info.end_orientation - segmented_info.start_orientation;
 }
 
-void ImageProjection::ProjectPointCloud(SegmentedInfo &segmented_info, PointICloud &points)
+void ImageProjection::FindRingOrder(PointICloud &points, const std::vector<int16_t> &rings)
 {
-    // range image projection
-    float vertical_angle, horizon_angle, range;
-    int row_ind, column_ind, index, size;
-    PointI point;
-
-    size = points.points.size();
-
-    for (int i = 0; i < size; ++i)
+    int min_ring = INT_MAX, max_ring = -1;
+    for (int16_t ring : rings)
     {
-        point.x = points[i].x;
-        point.y = points[i].y;
-        point.z = points[i].z;
-        // find the row and column index in the image for this point
+        if (ring >= 0)
+        {
+            min_ring = std::min(min_ring, (int)ring);
+            max_ring = std::max(max_ring, (int)ring);
+        }
+    }
+    if (max_ring <= min_ring)
+        return;
+    double angle_min = 0, angle_max = 0;
+    for (int i = 0; i < points.size(); ++i)
+    {
+        const PointI &point = points[i];
+        if (rings[i] == min_ring || rings[i] == max_ring)
+        {
+            double angle = atan2(point.z, sqrt(point.x * point.x + point.y * point.y));
+            (rings[i] == min_ring ? angle_min : angle_max) += angle;
+        }
+    }
+    ring_order_ = angle_max > angle_min ? 1 : -1;
+    LOG(INFO) << "ImageProjection: ring 0 is the " << (ring_order_ > 0 ? "lowest" : "highest") << " beam";
+}
 
-        vertical_angle = atan2(point.z, sqrt(point.x * point.x + point.y * point.y)) * 180 / M_PI;
-        row_ind = (vertical_angle + ang_bottom_) / ang_res_y_;
+void ImageProjection::ProjectPointCloud(SegmentedInfo &segmented_info, PointICloud &points, const std::vector<int16_t> &rings)
+{
+    // range image projection
+    int size = points.points.size();
+    std::vector<int> indices(size);
+    std::vector<float> ranges(size);
 
-        if (row_ind < 0 || row_ind >= num_scans_)
-            continue;
+    // the trigonometry is independent for each point
+    cv::parallel_for_(cv::Range(0, size), [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; ++i)
+        {
+            const PointI &point = points[i];
+            indices[i] = -1;
+            // find the row and column index in the image for this point, the row is the ring if it is known
+            int row_ind;
+            if (!rings.empty() && rings[i] >= 0)
+            {
+                row_ind = ring_order_ > 0 ? rings[i] : num_scans_ - 1 - rings[i];
+            }
+            else
+            {
+                float vertical_angle = fast_atan2(point.z, sqrt(point.x * point.x + point.y * point.y)) * 180 / M_PI;
+                row_ind = (vertical_angle + ang_bottom_) / ang_res_y_;
+            }
 
-        horizon_angle = atan2(point.x, point.y) * 180 / M_PI;
+            if (row_ind < 0 || row_ind >= num_scans_)
+                continue;
 
-        column_ind = -round((horizon_angle - 90.0) / ang_res_x_) + horizon_scan_ / 2;
-        if (column_ind >= horizon_scan_)
-            column_ind -= horizon_scan_;
+            float horizon_angle = fast_atan2(point.x, point.y) * 180 / M_PI;
 
-        if (column_ind < 0 || column_ind >= horizon_scan_)
-            continue;
+            int column_ind = -round((horizon_angle - 90.0) / ang_res_x_) + horizon_scan_ / 2;
+            if (column_ind >= horizon_scan_)
+                column_ind -= horizon_scan_;
 
-        range = sqrt(point.x * point.x + point.y * point.y + point.z * point.z);
+            if (column_ind < 0 || column_ind >= horizon_scan_)
+                continue;
 
-        range_mat.at<float>(row_ind, column_ind) = range;
+            indices[i] = column_ind + row_ind * horizon_scan_;
+            ranges[i] = sqrt(point.x * point.x + point.y * point.y + point.z * point.z);
+        }
+    });
 
+    // scatter in order, the last point of a cell wins as before
+    for (int i = 0; i < size; ++i)
+    {
+        int index = indices[i];
+        if (index < 0)
+            continue;
+        int row_ind = index / horizon_scan_, column_ind = index % horizon_scan_;
+        range_mat.at<float>(row_ind, column_ind) = ranges[i];
+        PointI &point = points_full[index];
+        point.x = points[i].x;
+        point.y = points[i].y;
+        point.z = points[i].z;
         point.intensity = (float)row_ind + (float)column_ind / 10000.0;
-
-        index = column_ind + row_ind * horizon_scan_;
-        points_full[index] = point;
     }
 }
 
 void ImageProjection::RemoveGround(SegmentedInfo &segmented_info)
 {
-    int lower_ind, upper_ind;
-    float dx, dy, dz, angle;
     // groundMat
     // -1, no valid info to check if ground of not
     //  0, initial value, after validation, means not ground
     //  1, ground
-    for (int j = 0; j < horizon_scan_; ++j)
-    {
-        for (int i = 0; i < ground_rows_; ++i)
+    // columns are independent
+    cv::parallel_for_(cv::Range(0, horizon_scan_), [&](const cv::Range &range) {
+        for (int j = range.start; j < range.end; ++j)
         {
-
-            lower_ind = j + (i)*horizon_scan_;
-            upper_ind = j + (i + 1) * horizon_scan_;
-
-            if (points_full[lower_ind].intensity == -1 ||
-                points_full[upper_ind].intensity == -1)
+            for (int i = 0; i < ground_rows_; ++i)
             {
-                // no info to check, invalid points
-                ground_mat.at<int8_t>(i, j) = -1;
-                continue;
-            }
+                int lower_ind = j + (i)*horizon_scan_;
+                int upper_ind = j + (i + 1) * horizon_scan_;
 
-            dx = points_full[upper_ind].x - points_full[lower_ind].x;
-            dy = points_full[upper_ind].y - points_full[lower_ind].y;
-            dz = points_full[upper_ind].z - points_full[lower_ind].z;
+                if (points_full[lower_ind].intensity == -1 ||
+                    points_full[upper_ind].intensity == -1)
+                {
+                    // no info to check, invalid points
+                    ground_mat.at<int8_t>(i, j) = -1;
+                    continue;
+                }
 
-            angle = atan2(dz, sqrt(dx * dx + dy * dy)) * 180 / M_PI;
+                float dx = points_full[upper_ind].x - points_full[lower_ind].x;
+                float dy = points_full[upper_ind].y - points_full[lower_ind].y;
+                float dz = points_full[upper_ind].z - points_full[lower_ind].z;
 
-            //NOTE: mount angle
-            if (abs(angle) <= 10)
-            {
-                ground_mat.at<int8_t>(i, j) = 1;
-                ground_mat.at<int8_t>(i + 1, j) = 1;
+                float angle = atan2(dz, sqrt(dx * dx + dy * dy)) * 180 / M_PI;
+
+                //NOTE: mount angle
+                if (abs(angle) <= 10)
+                {
+                    ground_mat.at<int8_t>(i, j) = 1;
+                    ground_mat.at<int8_t>(i + 1, j) = 1;
+                }
             }
         }
-    }
+    });
     // extract ground cloud (groundMat == 1)
     // mark entry that doesn't need to label (ground and invalid point) for segmentation
     // note that ground remove is from 0~num_scans_-1, need rangeMat for mark label matrix for the 16th scan
@@ -152,10 +206,7 @@ void ImageProjection::RemoveGround(SegmentedInfo &segmented_info)
 void ImageProjection::Segment(SegmentedInfo &segmented_info, PointICloud &points_segmented)
 {
     // segmentation process
-    for (int i = 0; i < num_scans_; ++i)
-        for (int j = 0; j < horizon_scan_; ++j)
-            if (label_mat.at<int>(i, j) == 0)
-                LabelComponents(i, j);
+    LabelComponents();
 
     int num_segmented = 0;
     // extract segmented cloud for lidar odometry
@@ -196,126 +247,127 @@ void ImageProjection::Segment(SegmentedInfo &segmented_info, PointICloud &points
     }
 }
 
-void ImageProjection::LabelComponents(int row, int col)
+// union find over the cells of the range image, the root is the first cell of its component in row-major order
+inline int find_root(std::vector<int> &parent, int i)
 {
-    static uint16_t *all_pushed_ind_X = new uint16_t[num_scans_ * horizon_scan_]; // array for tracking points of a segmented object
-    static uint16_t *all_pushed_ind_y = new uint16_t[num_scans_ * horizon_scan_];
-    static uint16_t *queue_ind_x = new uint16_t[num_scans_ * horizon_scan_]; // array for breadth-first search process of segmentation, for speed
-    static uint16_t *queue_ind_y = new uint16_t[num_scans_ * horizon_scan_];
-    static std::vector<std::pair<int8_t, int8_t>> neighbors; // neighbor iterator for segmentaiton process
-    if (neighbors.empty())
+    while (parent[i] != i)
     {
-        std::pair<int8_t, int8_t> neighbor;
-        neighbor.first = -1;
-        neighbor.second = 0;
-        neighbors.push_back(neighbor);
-        neighbor.first = 0;
-        neighbor.second = 1;
-        neighbors.push_back(neighbor);
-        neighbor.first = 0;
-        neighbor.second = -1;
-        neighbors.push_back(neighbor);
-        neighbor.first = 1;
-        neighbor.second = 0;
-        neighbors.push_back(neighbor);
+        parent[i] = parent[parent[i]];
+        i = parent[i];
     }
+    return i;
+}
 
-    // use std::queue std::vector std::deque will slow the program down greatly
-    float d1, d2, alpha, angle;
-    int from_ind_x, from_ind_y, this_ind_x, this_ind_y;
-    std::vector<bool> line_count_flag(num_scans_, false);
-
-    queue_ind_x[0] = row;
-    queue_ind_y[0] = col;
-    int queue_size = 1;
-    int queue_start_ind = 0;
-    int queue_end_ind = 1;
+inline void unite(std::vector<int> &parent, int a, int b)
+{
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
 
-    all_pushed_ind_X[0] = row;
-    all_pushed_ind_y[0] = col;
-    int all_pushed_ind_size = 1;
+// neighbours are on the same object if the angle between the beam and the line through them is larger than theta
+inline bool same_object(float range_a, float range_b, float sin_alpha, float cos_alpha, float tan_theta)
+{
+    float d1 = std::max(range_a, range_b), d2 = std::min(range_a, range_b);
+    float x = d1 - d2 * cos_alpha;
+    return x <= 0 || d2 * sin_alpha > tan_theta * x;
+}
 
-    while (queue_size > 0)
-    {
-        // Pop point
-        from_ind_x = queue_ind_x[queue_start_ind];
-        from_ind_y = queue_ind_y[queue_start_ind];
-        --queue_size;
-        ++queue_start_ind;
-        // Mark popped point
-        label_mat.at<int>(from_ind_x, from_ind_y) = label_count;
-        // Loop through all the neighboring grids of popped grid
-        for (auto iter = neighbors.begin(); iter != neighbors.end(); ++iter)
+void ImageProjection::LabelComponents()
+{
+    const int *labels = label_mat.ptr<int>();
+    const float *ranges = range_mat.ptr<float>();
+    float sin_x = sin(segment_alpha_x_), cos_x = cos(segment_alpha_x_);
+    float sin_y = sin(segment_alpha_y_), cos_y = cos(segment_alpha_y_);
+    float tan_theta = tan(theta);
+    auto link = [&](int a, int b, float sin_alpha, float cos_alpha) {
+        if (labels[a] == 0 && labels[b] == 0 && same_object(ranges[a], ranges[b], sin_alpha, cos_alpha, tan_theta))
         {
-            // new index
-            this_ind_x = from_ind_x + (*iter).first;
-            this_ind_y = from_ind_y + (*iter).second;
-            // index should be within the boundary
-            if (this_ind_x < 0 || this_ind_x >= num_scans_)
-                continue;
-            // at range image margin (left or right side)
-            if (this_ind_y < 0)
-                this_ind_y = horizon_scan_ - 1;
-            if (this_ind_y >= horizon_scan_)
-                this_ind_y = 0;
-            // prevent infinite loop (caused by put already examined point back)
-            if (label_mat.at<int>(this_ind_x, this_ind_y) != 0)
-                continue;
-
-            d1 = std::max(range_mat.at<float>(from_ind_x, from_ind_y),
-                          range_mat.at<float>(this_ind_x, this_ind_y));
-            d2 = std::min(range_mat.at<float>(from_ind_x, from_ind_y),
-                          range_mat.at<float>(this_ind_x, this_ind_y));
-
-            if ((*iter).first == 0)
-                alpha = segment_alpha_x_;
-            else
-                alpha = segment_alpha_y_;
-
-            angle = atan2(d2 * sin(alpha), (d1 - d2 * cos(alpha)));
-
-            if (angle > theta)
+            unite(parent_, a, b);
+        }
+    };
+    auto link_row = [&](int i, bool up) {
+        int row = i * horizon_scan_;
+        for (int j = 0; j < horizon_scan_; ++j)
+        {
+            parent_[row + j] = row + j;
+        }
+        for (int j = 0; j < horizon_scan_; ++j)
+        {
+            if (j > 0)
+                link(row + j - 1, row + j, sin_x, cos_x);
+            if (up)
+                link(row + j - horizon_scan_, row + j, sin_y, cos_y);
+        }
+        // at range image margin (left or right side)
+        link(row + horizon_scan_ - 1, row, sin_x, cos_x);
+    };
+
+    // first pass, bands of rows are linked in parallel, then the bands are linked together
+    int num_bands = std::max(1, std::min(num_scans_ / 8, cv::getNumThreads()));
+    cv::parallel_for_(cv::Range(0, num_bands), [&](const cv::Range &range) {
+        for (int band = range.start; band < range.end; ++band)
+        {
+            int begin = band * num_scans_ / num_bands, end = (band + 1) * num_scans_ / num_bands;
+            for (int i = begin; i < end; ++i)
             {
-
-                queue_ind_x[queue_end_ind] = this_ind_x;
-                queue_ind_y[queue_end_ind] = this_ind_y;
-                ++queue_size;
-                ++queue_end_ind;
-
-                label_mat.at<int>(this_ind_x, this_ind_y) = label_count;
-                line_count_flag[this_ind_x] = true;
-
-                all_pushed_ind_X[all_pushed_ind_size] = this_ind_x;
-                all_pushed_ind_y[all_pushed_ind_size] = this_ind_y;
-                ++all_pushed_ind_size;
+                link_row(i, i > begin);
             }
         }
+    });
+    for (int band = 1; band < num_bands; ++band)
+    {
+        int row = band * num_scans_ / num_bands * horizon_scan_;
+        for (int j = 0; j < horizon_scan_; ++j)
+        {
+            link(row + j - horizon_scan_, row + j, sin_y, cos_y);
+        }
     }
 
-    // check if this segment is valid
-    bool feasible_segment = false;
-    if (all_pushed_ind_size >= 30)
-        feasible_segment = true;
-    else if (all_pushed_ind_size >= num_segment_valid_points_)
+    // second pass, the size and lines of every component,
+    // the row of the first cell only counts if the component has other cells in it, the same as breadth-first search
+    int size = num_scans_ * horizon_scan_;
+    for (int k = 0; k < size; ++k)
     {
-        int count = 0;
-        for (int i = 0; i < num_scans_; ++i)
-            if (line_count_flag[i] == true)
-                ++count;
-        if (count >= num_segment_valid_lines_)
-            feasible_segment = true;
+        if (labels[k] != 0)
+            continue;
+        int root = find_root(parent_, k), row = k / horizon_scan_;
+        if (root == k)
+        {
+            num_points_[root] = 0;
+            num_lines_[root] = 0;
+            last_row_[root] = -1;
+            num_first_row_[root] = 0;
+        }
+        num_points_[root]++;
+        if (row != last_row_[root])
+        {
+            num_lines_[root]++;
+            last_row_[root] = row;
+        }
+        if (row == root / horizon_scan_)
+        {
+            num_first_row_[root]++;
+        }
     }
-    // segment is valid, mark these points
-    if (feasible_segment == true)
+
+    // components are labelled in the order of their first cells, invalid components are outliers
+    for (int k = 0; k < size; ++k)
     {
-        ++label_count;
-    }
-    else
-    { // segment is invalid, mark these points
-        for (int i = 0; i < all_pushed_ind_size; ++i)
+        if (labels[k] != 0)
+            continue;
+        int root = find_root(parent_, k);
+        if (root == k)
         {
-            label_mat.at<int>(all_pushed_ind_X[i], all_pushed_ind_y[i]) = OUTLIER_LABEL;
+            int num_lines = num_lines_[root] - (num_first_row_[root] == 1 ? 1 : 0);
+            bool feasible_segment = num_points_[root] >= 30 ||
+                                    (num_points_[root] >= num_segment_valid_points_ && num_lines >= num_segment_valid_lines_);
+            num_points_[root] = feasible_segment ? label_count++ : OUTLIER_LABEL;
         }
+        label_mat.at<int>(k / horizon_scan_, k % horizon_scan_) = num_points_[root];
     }
 }
 
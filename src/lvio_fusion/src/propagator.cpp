@@ -0,0 +1,88 @@
+#include "lvio_fusion/imu/propagator.h"
+
+namespace lvio_fusion
+{
+
+namespace imu
+{
+
+const int max_samples = 2000;
+
+void Propagator::Anchor(double time, const SE3d &pose, const Vector3d &Vw, const Bias &bias)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    anchor_.time = time;
+    anchor_.pose = pose;
+    anchor_.Vw = Vw;
+    state_ = anchor_;
+    bias_ = bias;
+    if (!integration_)
+    {
+        integration_ = Preintegration::Create(bias);
+    }
+    delta_p_ = Vector3d::Zero();
+    delta_v_ = Vector3d::Zero();
+    delta_q_ = Quaterniond::Identity();
+    anchored_ = true;
+    while (!samples_.empty() && samples_.front().t <= time)
+    {
+        samples_.pop_front();
+    }
+    last_sample_.t = -1;
+    for (auto &sample : samples_)
+    {
+        Integrate(sample);
+    }
+}
+
+bool Propagator::Push(double time, const Vector3d &acc, const Vector3d &gyr)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!samples_.empty() && time <= samples_.back().t)
+        return false;
+    if (samples_.size() == max_samples)
+    {
+        samples_.pop_front();
+    }
+    samples_.push_back(ImuData(acc, gyr, time));
+    if (!anchored_ || time <= anchor_.time)
+        return false;
+    Integrate(samples_.back());
+    return true;
+}
+
+bool Propagator::Get(State &state)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    state = state_;
+    return anchored_;
+}
+
+void Propagator::Integrate(const ImuData &sample)
+{
+    // the first sample after the anchor is held back to the anchor
+    const ImuData &sample0 = last_sample_.t < 0 ? sample : last_sample_;
+    double dt = sample.t - (last_sample_.t < 0 ? anchor_.time : last_sample_.t);
+    Vector3d delta_p, delta_v, ba, bg;
+    Quaterniond delta_q;
+    integration_->MidPointIntegration(dt, sample0.a, sample0.w, sample.a, sample.w,
+                                      delta_p_, delta_q_, delta_v_, bias_.linearized_ba, bias_.linearized_bg,
+                                      delta_p, delta_q, delta_v, ba, bg, false);
+    delta_p_ = delta_p;
+    delta_q_ = delta_q.normalized();
+    delta_v_ = delta_v;
+    last_sample_ = sample;
+
+    // same as the prediction of the frontend
+    Vector3d G(0, 0, -Imu::Get()->G);
+    double sum_dt = sample.t - anchor_.time;
+    Matrix3d Rwb1 = anchor_.pose.rotationMatrix();
+    state_.time = sample.t;
+    state_.pose = SE3d(anchor_.pose.so3() * SO3d(delta_q_),
+                       anchor_.pose.translation() + anchor_.Vw * sum_dt + 0.5 * sum_dt * sum_dt * G + Rwb1 * delta_p_);
+    state_.Vw = anchor_.Vw + G * sum_dt + Rwb1 * delta_v_;
+}
+
+} // namespace imu
+
+} // namespace lvio_fusion
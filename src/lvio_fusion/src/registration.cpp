@@ -0,0 +1,163 @@
+#include "lvio_fusion/lidar/registration.h"
+#include "lvio_fusion/utility.h"
+
+#include <Eigen/Eigenvalues>
+
+namespace lvio_fusion
+{
+
+namespace lidar
+{
+
+const int min_voxel_points = 5;
+const double plane_epsilon = 1e-3; // information of the directions in the plane
+const int num_levels = 3;          // resolution, 2 * resolution, 4 * resolution
+const double min_step = 1e-5;
+
+typedef Matrix<double, 6, 6> Matrix6d;
+typedef Matrix<double, 6, 1> Vector6d;
+
+void Registration::AddTarget(const PointICloud &target, double resolution, double weight, double delta)
+{
+    struct Sum
+    {
+        Vector3d sum = Vector3d::Zero();
+        Matrix3d sum_sq = Matrix3d::Zero();
+        int n = 0;
+    };
+
+    Target result;
+    result.weight = weight;
+    result.delta = delta;
+    for (int l = 0; l < num_levels; l++)
+    {
+        Level level;
+        level.resolution = resolution * (1 << l);
+        std::unordered_map<VoxelKey, Sum, VoxelKeyHash> sums;
+        double inv_resolution = 1 / level.resolution;
+        for (auto &point : target)
+        {
+            Vector3d p = point.getVector3fMap().cast<double>();
+            Sum &sum = sums[VoxelKey(std::floor(p.x() * inv_resolution), std::floor(p.y() * inv_resolution), std::floor(p.z() * inv_resolution))];
+            sum.sum += p;
+            sum.sum_sq += p * p.transpose();
+            sum.n++;
+        }
+        for (auto &pair : sums)
+        {
+            const Sum &sum = pair.second;
+            if (sum.n < min_voxel_points)
+                continue;
+            Distribution distribution;
+            distribution.mean = sum.sum / sum.n;
+            Matrix3d covariance = sum.sum_sq / sum.n - distribution.mean * distribution.mean.transpose();
+            // as gicp, the distribution is a plane whatever it is, the smallest eigenvector is the normal
+            SelfAdjointEigenSolver<Matrix3d> solver(covariance);
+            Matrix3d V = solver.eigenvectors();
+            distribution.normal = V.col(0);
+            distribution.information = V * Vector3d(1, plane_epsilon, plane_epsilon).asDiagonal() * V.transpose();
+            level.voxels[pair.first] = distribution;
+        }
+        result.levels.push_back(level);
+    }
+    targets_.push_back(result);
+}
+
+double Registration::Step(const std::vector<const PointICloud *> &sources, SE3d &pose, int level, int num_threads)
+{
+    // one block of points for each thread
+    int num_blocks = std::max(1, num_threads);
+    // left perturbation of rotation and translation
+    Matrix3d R = pose.rotationMatrix();
+    Vector3d t = pose.translation();
+    std::vector<Matrix6d> Hs(num_blocks, Matrix6d::Zero());
+    std::vector<Vector6d> gs(num_blocks, Vector6d::Zero());
+    std::vector<int> nums(num_blocks, 0);
+    for (int i = 0; i < sources.size() && i < targets_.size(); i++)
+    {
+        const PointICloud &source = *sources[i];
+        const Target &target = targets_[i];
+        const Level &voxels = target.levels[level];
+        int block_size = (source.size() + num_blocks - 1) / num_blocks;
+        parallel_for(0, num_blocks, [&](int b) {
+            for (int j = b * block_size; j < std::min((int)source.size(), (b + 1) * block_size); j++)
+            {
+                Vector3d R_p = R * source[j].getVector3fMap().cast<double>();
+                const Distribution *distribution = voxels.Find(R_p + t);
+                if (!distribution)
+                    continue;
+                Vector3d e = R_p + t - distribution->mean;
+                double distance = target.weight * std::sqrt(e.dot(distribution->information * e));
+                double w = target.weight * target.weight;
+                if (target.delta > 0 && distance > target.delta)
+                {
+                    w *= target.delta / distance;
+                }
+                Matrix<double, 3, 6> J;
+                J.leftCols<3>() = -skew_symmetric(R_p);
+                J.rightCols<3>() = Matrix3d::Identity();
+                Matrix<double, 6, 3> Jt_information = J.transpose() * distribution->information;
+                Hs[b] += w * Jt_information * J;
+                gs[b] += w * Jt_information * e;
+                nums[b]++;
+            }
+        });
+    }
+    Matrix6d H = Matrix6d::Zero();
+    Vector6d g = Vector6d::Zero();
+    int num = 0;
+    for (int b = 0; b < num_blocks; b++)
+    {
+        H += Hs[b];
+        g += gs[b];
+        num += nums[b];
+    }
+    if (num < 6)
+        return -1;
+
+    Vector6d dx = -(H + 1e-6 * Matrix6d::Identity()).ldlt().solve(g);
+    pose = SE3d(SO3d::exp(dx.head<3>()) * pose.so3(), t + dx.tail<3>());
+    return dx.norm();
+}
+
+bool Registration::Align(const std::vector<const PointICloud *> &sources, SE3d &pose, int num_threads, int max_iterations)
+{
+    bool converged = false;
+    for (int level = num_levels - 1; level >= 0; level--)
+    {
+        converged = false;
+        for (int iteration = 0; iteration < max_iterations && !converged; iteration++)
+        {
+            double step = Step(sources, pose, level, num_threads);
+            if (step < 0)
+                break;
+            converged = step < min_step;
+        }
+    }
+    return converged;
+}
+
+int Registration::Match(int i, const PointICloud &source, const SE3d &pose, double &cost)
+{
+    const Target &target = targets_[i];
+    const Level &voxels = target.levels[0];
+    Matrix3d R = pose.rotationMatrix();
+    Vector3d t = pose.translation();
+    int num = 0;
+    cost = 0;
+    for (auto &point : source)
+    {
+        Vector3d p = R * point.getVector3fMap().cast<double>() + t;
+        const Distribution *distribution = voxels.Find(p);
+        if (!distribution)
+            continue;
+        double r = target.weight * std::abs(distribution->normal.dot(p - distribution->mean));
+        cost += target.delta > 0 && r > target.delta ? 0.5 * (2 * target.delta * r - target.delta * target.delta) : 0.5 * r * r;
+        num++;
+    }
+    return num;
+}
+
+} // namespace lidar
+
+} // namespace lvio_fusion
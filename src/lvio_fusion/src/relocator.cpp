@@ -1,27 +1,42 @@
 #include "lvio_fusion/loop/relocator.h"
 #include "lvio_fusion/ceres/pose_error.hpp"
+#include "lvio_fusion/frame_store.h"
 #include "lvio_fusion/manager.h"
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/scheduler.h"
 #include "lvio_fusion/utility.h"
+#include "lvio_fusion/visual/camera.h"
+#include "lvio_fusion/visual/hamming.h"
 
 #include <iomanip>
 #include <iostream>
 #include <opencv2/core/eigen.hpp>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/io/pcd_io.h>
-#include <pcl/registration/icp.h>
 
 namespace lvio_fusion
 {
 
-Relocator::Relocator(int mode, double threshold)
-    : mode_((Mode)mode), threshold_(threshold)
+Relocator::Relocator(int mode, double threshold, const std::string &vocabulary, lidar::RegistrationMethod registration)
+    : index_(threshold), mode_((Mode)mode), registration_(registration), threshold_(threshold)
 {
+    if (!vocabulary.empty())
+    {
+        vocabulary_.Load(vocabulary);
+    }
+    events_ = EventBus::Instance().Subscribe({Event::KeyFrameFinished});
+    // the descriptors of places are computed from the images
+    if (mode_ == Mode::VisualOnly || mode_ == Mode::VisualAndLidar)
+    {
+        FrameStore::Instance().Hold(0);
+    }
     thread_ = std::thread(std::bind(&Relocator::DetectorLoop, this));
 }
 
 void Relocator::DetectorLoop()
 {
+    Scheduler::Instance().Pin(Task::Relocator);
     static double finished = 0;
     static double old_time = DBL_MAX;
     static double start_time = DBL_MAX;
@@ -29,15 +44,48 @@ void Relocator::DetectorLoop()
     static Frame::Ptr last_frame;
     while (true)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        // TODO
-        double end = backend_->finished;
-        auto new_kfs = Map::Instance().GetKeyFrames(finished, end);
+        events_->Wait();
+        events_->Take(Event::KeyFrameFinished);
+        // keyframes of the prior map are only candidates
+        if (finished < Map::Instance().prior)
+        {
+            for (auto &pair : Map::Instance().GetRange(finished, Map::Instance().prior))
+            {
+                if (mode_ == Mode::VisualOnly || mode_ == Mode::VisualAndLidar)
+                {
+                    AddPlace(pair.second);
+                }
+            }
+            finished = Map::Instance().prior + epsilon;
+            if (mode_ == Mode::VisualOnly || mode_ == Mode::VisualAndLidar)
+            {
+                FrameStore::Instance().Hold(finished);
+            }
+        }
+        double end = events_->Time(Event::KeyFrameFinished);
+        auto new_kfs = Map::Instance().GetRange(finished, end);
         if (new_kfs.empty())
             continue;
         for (auto &pair : new_kfs)
         {
             Frame::Ptr frame = pair.second, old_frame;
+            if (mode_ == Mode::VisualOnly || mode_ == Mode::VisualAndLidar)
+            {
+                AddPlace(frame);
+            }
+            if (localization_)
+            {
+                if (DetectLoop(frame, old_frame))
+                {
+                    Relocalize(frame);
+                }
+                // only the places of the last keyframes are queried
+                if (frame->last_keyframe)
+                {
+                    places_.erase(places_.upper_bound(Map::Instance().prior), places_.lower_bound(frame->last_keyframe->time));
+                }
+                continue;
+            }
             // if last is loop and this is not loop, then correct all new loops
             if (DetectLoop(frame, old_frame))
             {
@@ -53,7 +101,7 @@ void Relocator::DetectorLoop()
                     last_frame = frame;
                 }
                 if (section != loop_section ||
-                    (Map::Instance().end && frame == (--Map::Instance().keyframes.end())->second))
+                    (Map::Instance().end && frame == Map::Instance().GetSnapshot()->rbegin()->second))
                 {
                     // new old section, new loop
                     LOG(INFO) << std::setiosflags(std::ios::fixed) << std::setprecision(5) << "1Detected new loop, and correct it now. old_time:" << old_time << ";start_time:" << start_time << ";end_time:" << last_frame->time;
@@ -81,44 +129,44 @@ void Relocator::DetectorLoop()
             }
         }
         finished = (--new_kfs.end())->first + epsilon;
+        if (mode_ == Mode::VisualOnly || mode_ == Mode::VisualAndLidar)
+        {
+            FrameStore::Instance().Hold(finished);
+        }
     }
 }
 
 bool Relocator::DetectLoop(Frame::Ptr frame, Frame::Ptr &old_frame)
 {
-    static double finished = 0;
-    static PointICloud points;
-    static std::unordered_map<int, double> map;
-    Frames active_kfs = Map::Instance().GetKeyFrames(finished, frame->time - 30);
-    finished = frame->time - 30 + epsilon;
-    for (auto pair : active_kfs)
+    // keyframes moved by corrections are hashed again
+    index_.Update(PoseGraph::Instance().TakeCorrected());
+    double candidates_end = localization_ ? Map::Instance().prior : frame->time - 30;
+    Frames active_kfs = Map::Instance().GetKeyFrames(indexed_, candidates_end);
+    indexed_ = std::max(indexed_, candidates_end + epsilon);
+    for (auto &pair : active_kfs)
     {
-        PointI p;
-        p.x = pair.second->t().x();
-        p.y = pair.second->t().y();
-        p.z = 0;
-        p.intensity = pair.second->id;
-        map[p.intensity] = pair.first;
-        points.push_back(p);
+        index_.Insert(pair.second);
+        if (pair.second->feature_lidar && pair.second->feature_lidar->ring_key.size())
+        {
+            contexts_.Insert(pair.first, pair.second->feature_lidar->ring_key);
+        }
     }
-    if (points.empty())
-        return false;
-    PointI p;
-    p.x = frame->t().x();
-    p.y = frame->t().y();
-    p.z = 0;
-    std::vector<int> points_index;
-    std::vector<float> points_distance;
-    pcl::KdTreeFLANN<PointI> kdtree;
-    kdtree.setInputCloud(boost::make_shared<PointICloud>(points));
-    kdtree.nearestKSearch(p, 3, points_index, points_distance);
-    double threshold = threshold_ * threshold_;
-    if (points_index[0] < points.size() && points_distance[0] < threshold &&
-        points_index[1] < points.size() && points_distance[1] < threshold &&
-        points_index[2] < points.size() && points_distance[2] < threshold)
+    std::vector<Frame::Ptr> candidates;
+    if (index_.Search(frame->t(), 3, threshold_, candidates) == 3)
+    {
+        old_frame = candidates[0];
+    }
+    // the pose may drift too much to find the loop by position
+    bool appearance = false;
+    if (!old_frame && (mode_ == Mode::VisualOnly || mode_ == Mode::VisualAndLidar))
     {
-        double time = map[points[points_index[0]].intensity];
-        old_frame = Map::Instance().GetKeyFrame(time);
+        old_frame = QueryPlace(frame);
+        appearance = (bool)old_frame;
+    }
+    if (!old_frame && (mode_ == Mode::LidarOnly || mode_ == Mode::VisualAndLidar) && Lidar::Num())
+    {
+        old_frame = QueryContext(frame);
+        appearance = (bool)old_frame;
     }
 
     if (old_frame)
@@ -126,14 +174,44 @@ bool Relocator::DetectLoop(Frame::Ptr frame, Frame::Ptr &old_frame)
         loop::LoopClosure::Ptr loop_closure = loop::LoopClosure::Ptr(new loop::LoopClosure());
         loop_closure->frame_old = old_frame;
         loop_closure->relocated = false;
+        loop_closure->appearance = appearance;
         frame->loop_closure = loop_closure;
         return true;
     }
     return false;
 }
 
+const double max_context_distance = 0.4;  // to try scan-to-map matching
+const double loop_context_distance = 0.2; // to be a loop candidate
+
+Frame::Ptr Relocator::QueryContext(Frame::Ptr frame)
+{
+    if (!frame->feature_lidar || frame->feature_lidar->context.size() == 0)
+        return nullptr;
+    std::vector<double> times;
+    contexts_.Search(frame->feature_lidar->ring_key, 10, times);
+    Frame::Ptr best_frame;
+    double best = loop_context_distance, yaw;
+    for (double time : times)
+    {
+        Frame::Ptr old_frame = Map::Instance().GetKeyFrame(time);
+        if (!old_frame || !old_frame->feature_lidar)
+            continue;
+        double distance = lidar::scan_context_distance(frame->feature_lidar->context, old_frame->feature_lidar->context, yaw);
+        if (distance < best)
+        {
+            best = distance;
+            best_frame = old_frame;
+        }
+    }
+    return best_frame;
+}
+
 bool Relocator::Relocate(Frame::Ptr frame, Frame::Ptr old_frame)
 {
+    // both keyframes stay in memory until the relocation is done
+    auto pin = FrameStore::Instance().Load(frame);
+    auto old_pin = FrameStore::Instance().Load(old_frame);
     frame->loop_closure->score = 0;
     // put it on the same level
     SE3d init_pose = frame->pose;
@@ -146,13 +224,24 @@ bool Relocator::Relocate(Frame::Ptr frame, Frame::Ptr old_frame)
     rpy_o_i[0] = rpyxyz_i[0] - rpyxyz_o[0];
     rpy_o_i[1] = rpyxyz_i[1] - rpyxyz_o[1];
     rpy_o_i[2] = rpyxyz_i[2] - rpyxyz_o[2];
-    if ((mode_ == Mode::VisualOnly || mode_ == Mode::VisualAndLidar) && Vector3d(rpy_o_i[0], rpy_o_i[1], rpy_o_i[2]).norm() < 0.1)
+    bool relocated_by_image = false;
+    if ((mode_ == Mode::VisualOnly || mode_ == Mode::VisualAndLidar) &&
+        (frame->loop_closure->appearance || Vector3d(rpy_o_i[0], rpy_o_i[1], rpy_o_i[2]).norm() < 0.1))
     {
-        RelocateByImage(frame, old_frame);
+        relocated_by_image = RelocateByImage(frame, old_frame);
     }
     if ((mode_ == Mode::LidarOnly || mode_ == Mode::VisualAndLidar) && Lidar::Num() && mapping_ && frame->feature_lidar && old_frame->feature_lidar)
     {
-        RelocateByPoints(frame, old_frame);
+        // scan contexts reject hopeless candidates before the expensive scan-to-map matching
+        double yaw;
+        if (lidar::scan_context_distance(frame->feature_lidar->context, old_frame->feature_lidar->context, yaw) < max_context_distance)
+        {
+            if (frame->loop_closure->appearance && !relocated_by_image)
+            {
+                frame->loop_closure->relative_o_c = SE3d(SO3d::rotZ(yaw), Vector3d::Zero());
+            }
+            RelocateByPoints(frame, old_frame);
+        }
     }
     if (mode_ == Mode::None || frame->loop_closure->score > 0) // 0 is the base score
     {
@@ -161,14 +250,159 @@ bool Relocator::Relocate(Frame::Ptr frame, Frame::Ptr old_frame)
     return false;
 }
 
+const int min_training_descriptors = 20000;
+const double min_bow_score = 0.3; // relative to the score with the last keyframe
+
+void Relocator::AddPlace(Frame::Ptr frame)
+{
+    static cv::Ptr<cv::ORB> orb = cv::ORB::create();
+    auto pin = FrameStore::Instance().Load(frame);
+    // keyframes of a map file have descriptors but no images
+    if (frame->image_left.empty() && (frame->descriptors.empty() || frame->descriptors.rows != (int)frame->descriptor_ids.size()))
+        return;
+    if (frame->features_left.empty())
+        return;
+    if (!frame->image_left.empty())
+    {
+        std::vector<cv::KeyPoint> keypoints;
+        std::vector<unsigned long> ids;
+        for (auto &pair : frame->features_left)
+        {
+            cv::KeyPoint keypoint = pair.second->keypoint;
+            keypoint.class_id = ids.size();
+            keypoints.push_back(keypoint);
+            ids.push_back(pair.first);
+        }
+        // orb may drop or reorder the keypoints, class_id tells which feature a descriptor belongs to
+        orb->compute(frame->image_left, keypoints, frame->descriptors);
+        frame->descriptor_ids.clear();
+        for (auto &keypoint : keypoints)
+        {
+            frame->descriptor_ids.push_back(ids[keypoint.class_id]);
+        }
+    }
+    Place &place = places_[frame->time];
+    std::vector<BRIEF> briefs(frame->descriptors.rows);
+    for (int i = 0; i < frame->descriptors.rows; i++)
+    {
+        memcpy(&briefs[i], frame->descriptors.ptr(i), sizeof(BRIEF));
+    }
+    // new keyframes are not loop candidates in localization
+    bool candidate = !localization_ || frame->time <= Map::Instance().prior;
+
+    if (!vocabulary_.Empty())
+    {
+        vocabulary_.Transform(briefs, place.bow);
+        if (candidate)
+        {
+            database_.Add(frame->time, place.bow);
+        }
+        return;
+    }
+    if (!candidate)
+        return;
+    // no vocabulary is given, train it with the first keyframes
+    num_training_ += briefs.size();
+    training_.push_back(std::make_pair(frame->time, std::move(briefs)));
+    if (num_training_ < min_training_descriptors)
+        return;
+    std::vector<std::vector<BRIEF>> images;
+    for (auto &pair : training_)
+    {
+        images.push_back(pair.second);
+    }
+    vocabulary_.Train(images);
+    for (auto &pair : training_)
+    {
+        Place &place = places_[pair.first];
+        vocabulary_.Transform(pair.second, place.bow);
+        database_.Add(pair.first, place.bow);
+    }
+    training_.clear();
+}
+
+Frame::Ptr Relocator::QueryPlace(Frame::Ptr frame)
+{
+    auto iter = places_.find(frame->time);
+    if (iter == places_.end() || iter->second.bow.empty() || !frame->last_keyframe)
+        return nullptr;
+    auto last_iter = places_.find(frame->last_keyframe->time);
+    if (last_iter == places_.end() || last_iter->second.bow.empty())
+        return nullptr;
+    double base = loop::Vocabulary::Score(iter->second.bow, last_iter->second.bow);
+    std::vector<std::pair<double, double>> results;
+    double candidates_end = localization_ ? Map::Instance().prior : frame->time - 30;
+    if (base > 0 && database_.Query(iter->second.bow, candidates_end, 1, results) && results[0].first > min_bow_score * base)
+    {
+        return Map::Instance().GetKeyFrame(results[0].second);
+    }
+    return nullptr;
+}
+
 bool Relocator::RelocateByImage(Frame::Ptr frame, Frame::Ptr old_frame)
 {
-    // int score = matcher_.Relocate(old_frame, frame, frame->loop_closure->relative_o_c);
-    // frame->loop_closure->score += score - 20;
-    // if (score > 0)
-    // {
-    //     return true;
-    // }
+    auto iter = places_.find(frame->time), old_iter = places_.find(old_frame->time);
+    if (iter == places_.end() || old_iter == places_.end() || frame->descriptors.empty() || old_frame->descriptors.empty())
+        return false;
+    // landmarks of the old frame in its body frame
+    std::vector<const BRIEF *> old_briefs;
+    std::vector<Vector3d> old_points;
+    SE3d Tow = old_frame->pose.inverse();
+    {
+        // the landmarks of old keyframes may be archived at the same time
+        std::unique_lock<std::mutex> lock(Map::Instance().mutex_local_kfs);
+        for (int i = 0; i < old_frame->descriptor_ids.size(); i++)
+        {
+            Vector3d pw;
+            auto feature = old_frame->features_left.find(old_frame->descriptor_ids[i]);
+            if (feature != old_frame->features_left.end() && !feature->second->landmark.expired())
+            {
+                pw = feature->second->landmark.lock()->ToWorld();
+            }
+            else if (!Map::Instance().GetArchivedPosition(old_frame->descriptor_ids[i], pw))
+            {
+                continue;
+            }
+            old_briefs.push_back(reinterpret_cast<const BRIEF *>(old_frame->descriptors.ptr(i)));
+            old_points.push_back(Tow * pw);
+        }
+    }
+    // match the tracked features of frame to them
+    std::vector<cv::Point3f> points_3d;
+    std::vector<cv::Point2f> points_2d;
+    for (int i = 0; i < frame->descriptor_ids.size(); i++)
+    {
+        auto feature = frame->features_left.find(frame->descriptor_ids[i]);
+        if (feature == frame->features_left.end())
+            continue;
+        int best, second;
+        int index = match_briefs(*reinterpret_cast<const BRIEF *>(frame->descriptors.ptr(i)), old_briefs, best, second);
+        if (index >= 0 && best < 50 && best < 0.8 * second)
+        {
+            points_3d.push_back(eigen2cv(old_points[index]));
+            points_2d.push_back(feature->second->keypoint.pt);
+        }
+    }
+    if (points_3d.size() < 20)
+        return false;
+    // geometric verification
+    cv::Mat rvec, tvec, cv_R;
+    std::vector<int> inliers;
+    if (!cv::solvePnPRansac(points_3d, points_2d, Camera::Get()->K, cv::Mat(), rvec, tvec, false, 100, 4.0, 0.99, inliers))
+        return false;
+    int score = inliers.size();
+    frame->loop_closure->score += score - 20;
+    if (score > 20)
+    {
+        cv::Rodrigues(rvec, cv_R);
+        Matrix3d R;
+        Vector3d t;
+        cv::cv2eigen(cv_R, R);
+        cv::cv2eigen(tvec, t);
+        SE3d Tco(Quaterniond(R).normalized(), t);
+        frame->loop_closure->relative_o_c = Tco.inverse() * Camera::Get()->extrinsic.inverse();
+        return true;
+    }
     return false;
 }
 
@@ -183,26 +417,46 @@ bool Relocator::RelocateByPoints(Frame::Ptr frame, Frame::Ptr old_frame)
     return false;
 }
 
+const double confident_score = 20; // stop relocating other candidates
+
 void Relocator::CorrectLoop(double old_time, double start_time, double end_time)
 {
+    static Histogram &histogram = Metrics::Instance().GetHistogram("relocation");
+    ScopedTimer timer(histogram);
     std::unique_lock<std::mutex> lock(backend_->mutex, std::defer_lock);
     Frames new_submap_kfs = Map::Instance().GetKeyFrames(start_time, end_time);
 
     // update frames
     SE3d old_pose = (--new_submap_kfs.end())->second->pose;
     {
-        double max_score = -1;
-        Frame::Ptr best_frame;
+        // candidates are independent, relocate them concurrently and stop once one is good enough
+        std::vector<Frame::Ptr> candidates;
         for (auto &pair : new_submap_kfs)
         {
-            if (Relocate(pair.second, pair.second->loop_closure->frame_old))
+            candidates.push_back(pair.second);
+        }
+        std::vector<char> success(candidates.size(), 0);
+        std::atomic<bool> confident(false);
+        cv::parallel_for_(cv::Range(0, candidates.size()), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end && !confident; i++)
             {
-                if (pair.second->loop_closure->score >= max_score)
+                success[i] = Relocate(candidates[i], candidates[i]->loop_closure->frame_old);
+                if (success[i] && candidates[i]->loop_closure->score >= confident_score)
                 {
-                    max_score = pair.second->loop_closure->score;
-                    best_frame = pair.second;
+                    confident = true;
                 }
             }
+        }, candidates.size());
+
+        double max_score = -1;
+        Frame::Ptr best_frame;
+        for (int i = 0; i < candidates.size(); i++)
+        {
+            if (success[i] && candidates[i]->loop_closure->score >= max_score)
+            {
+                max_score = candidates[i]->loop_closure->score;
+                best_frame = candidates[i];
+            }
         }
 
         if (best_frame)
@@ -244,6 +498,28 @@ void Relocator::CorrectLoop(double old_time, double start_time, double end_time)
     }
 }
 
+void Relocator::Relocalize(Frame::Ptr frame)
+{
+    static Histogram &histogram = Metrics::Instance().GetHistogram("relocalization");
+    ScopedTimer timer(histogram);
+    if (!Relocate(frame, frame->loop_closure->frame_old))
+    {
+        frame->loop_closure.reset();
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(backend_->mutex);
+        SE3d new_pose = frame->loop_closure->frame_old->pose * frame->loop_closure->relative_o_c;
+        SE3d transform = new_pose * frame->pose.inverse();
+        PoseGraph::Instance().ForwardUpdate(transform, frame->time);
+    }
+    frame->loop_closure->relocated = true;
+    if (Lidar::Num() && mapping_)
+    {
+        mapping_->ToWorld(frame->time);
+    }
+}
+
 void Relocator::UpdateNewSubmap(Frame::Ptr best_frame, Frames &new_submap_kfs)
 {
     // optimize the best frame's rotation
@@ -0,0 +1,215 @@
+#include "lvio_fusion/lidar/scan_buffer.h"
+#include "lvio_fusion/metrics.h"
+
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+
+namespace lvio_fusion
+{
+
+inline MemoryAccount &scan_buffer_memory()
+{
+    static MemoryAccount &memory = Metrics::Instance().GetMemory("scan_buffer");
+    return memory;
+}
+
+const size_t slot_bytes = sizeof(PointI) + sizeof(double) + sizeof(int16_t);
+
+namespace lidar
+{
+
+ScanBuffer::ScanBuffer(double cycle_time, size_t capacity) : cycle_time_(cycle_time)
+{
+    size_t size = 2;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+    points_.resize(size);
+    times_.resize(size);
+    rings_.resize(size);
+    mask_ = size - 1;
+    scan_buffer_memory().Add(size * slot_bytes);
+}
+
+ScanBuffer::~ScanBuffer()
+{
+    scan_buffer_memory().Remove((mask_ + 1) * slot_bytes);
+}
+
+void ScanBuffer::Grow(size_t size)
+{
+    if (size <= mask_ + 1)
+        return;
+    size_t capacity = mask_ + 1;
+    while (capacity < size)
+    {
+        capacity <<= 1;
+    }
+    std::vector<PointI> points(capacity);
+    std::vector<double> times(capacity);
+    std::vector<int16_t> rings(capacity);
+    for (size_t i = head_; i < tail_; i++)
+    {
+        points[i & (capacity - 1)] = points_[i & mask_];
+        times[i & (capacity - 1)] = times_[i & mask_];
+        rings[i & (capacity - 1)] = rings_[i & mask_];
+    }
+    points_.swap(points);
+    times_.swap(times);
+    rings_.swap(rings);
+    scan_buffer_memory().Add((capacity - mask_ - 1) * slot_bytes, 0);
+    mask_ = capacity - 1;
+}
+
+template <typename T>
+inline double read_as(const uint8_t *p)
+{
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+inline double read_field(const uint8_t *point, const Field &field)
+{
+    const uint8_t *p = point + field.offset;
+    switch (field.type)
+    {
+    case FieldType::Int8:
+        return read_as<int8_t>(p);
+    case FieldType::Uint8:
+        return read_as<uint8_t>(p);
+    case FieldType::Int16:
+        return read_as<int16_t>(p);
+    case FieldType::Uint16:
+        return read_as<uint16_t>(p);
+    case FieldType::Int32:
+        return read_as<int32_t>(p);
+    case FieldType::Uint32:
+        return read_as<uint32_t>(p);
+    case FieldType::Float32:
+        return read_as<float>(p);
+    case FieldType::Float64:
+        return read_as<double>(p);
+    default:
+        return 0;
+    }
+}
+
+void ScanBuffer::Push(const RawScan &scan)
+{
+    double start = scan.time - cycle_time_ / 2;
+    if (start < end_ - cycle_time_ / 2)
+    {
+        LOG(WARNING) << "ScanBuffer: scan out of order, drop it.";
+        return;
+    }
+    const ScanLayout &layout = scan.layout;
+    const uint8_t *data = scan.data.get();
+    size_t size = scan.size;
+    Grow(Size() + size);
+
+    // times since the first point, within the cycle
+    offsets_.resize(size);
+    bool sorted = true;
+    if (layout.time.type != FieldType::None && size > 0)
+    {
+        double first = DBL_MAX;
+        for (size_t j = 0; j < size; j++)
+        {
+            offsets_[j] = read_field(data + j * layout.point_step, layout.time);
+            first = std::min(first, offsets_[j]);
+        }
+        for (size_t j = 0; j < size; j++)
+        {
+            offsets_[j] = std::min((offsets_[j] - first) * layout.time_scale, cycle_time_);
+            sorted = sorted && (j == 0 || offsets_[j] >= offsets_[j - 1]);
+        }
+    }
+    else
+    {
+        double dt = size ? cycle_time_ / size : 0;
+        for (size_t j = 0; j < size; j++)
+        {
+            offsets_[j] = j * dt;
+        }
+    }
+
+    // organized clouds are stored ring by ring, restore the firing order
+    order_.resize(size);
+    std::iota(order_.begin(), order_.end(), 0);
+    if (!sorted)
+    {
+        std::stable_sort(order_.begin(), order_.end(), [this](uint32_t a, uint32_t b) { return offsets_[a] < offsets_[b]; });
+    }
+
+    bool has_ring = layout.ring.type != FieldType::None;
+    for (uint32_t j : order_)
+    {
+        const uint8_t *p = data + j * layout.point_step;
+        float x = read_field(p, layout.x), y = read_field(p, layout.y), z = read_field(p, layout.z);
+        if (!std::isfinite(x) || !std::isfinite(y) || !std::isfinite(z))
+            continue;
+        size_t slot = tail_ & mask_;
+        PointI &point = points_[slot];
+        point.x = x;
+        point.y = y;
+        point.z = z;
+        point.intensity = 0;
+        rings_[slot] = has_ring ? (int16_t)read_field(p, layout.ring) : -1;
+        times_[slot] = start + offsets_[j];
+        tail_++;
+    }
+    end_ = scan.time + cycle_time_ / 2;
+}
+
+size_t ScanBuffer::LowerBound(double time)
+{
+    size_t low = head_, high = tail_;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (times_[middle & mask_] < time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+bool ScanBuffer::Slice(double start, double end, PointICloud &out, std::vector<int16_t> *rings)
+{
+    if (head_ == tail_ || times_[head_ & mask_] > start || end_ < end)
+        return false;
+    size_t begin = LowerBound(start), finish = LowerBound(end);
+    out.resize(finish - begin);
+    if (rings)
+    {
+        rings->resize(finish - begin);
+    }
+    // at most two contiguous parts
+    size_t i = begin, k = 0;
+    while (i < finish)
+    {
+        size_t slot = i & mask_;
+        size_t n = std::min(finish - i, mask_ + 1 - slot);
+        std::copy(points_.begin() + slot, points_.begin() + slot + n, out.points.begin() + k);
+        if (rings)
+        {
+            std::copy(rings_.begin() + slot, rings_.begin() + slot + n, rings->begin() + k);
+        }
+        i += n;
+        k += n;
+    }
+    return true;
+}
+
+void ScanBuffer::DropBefore(double time)
+{
+    head_ = LowerBound(time);
+}
+
+} // namespace lidar
+
+} // namespace lvio_fusion
@@ -0,0 +1,173 @@
+#include "lvio_fusion/lidar/scan_context.h"
+
+namespace lvio_fusion
+{
+
+namespace lidar
+{
+
+const int num_rings = 20;
+const int num_sectors = 60;
+const double max_radius = 80;
+const int search_radius = 6;   // sectors searched around the coarse yaw
+const int rebuild_interval = 50;
+
+void make_scan_context(Feature &feature)
+{
+    // heights are measured from the ground, so that they don't depend on the mounting of the lidar
+    double ground = 0;
+    if (!feature.points_ground.empty())
+    {
+        for (auto &point : feature.points_ground)
+        {
+            ground += point.z;
+        }
+        ground /= feature.points_ground.size();
+    }
+    else
+    {
+        ground = DBL_MAX;
+        for (auto &point : feature.points_surf)
+        {
+            ground = std::min(ground, (double)point.z);
+        }
+    }
+
+    feature.context = Eigen::MatrixXf::Zero(num_rings, num_sectors);
+    auto add = [&](const PointICloud &points) {
+        for (auto &point : points)
+        {
+            double range = std::hypot(point.x, point.y);
+            if (range >= max_radius)
+                continue;
+            int ring = std::min((int)(range / max_radius * num_rings), num_rings - 1);
+            int sector = std::min((int)((std::atan2(point.y, point.x) + M_PI) / (2 * M_PI) * num_sectors), num_sectors - 1);
+            float &bin = feature.context(ring, sector);
+            bin = std::max(bin, (float)(point.z - ground));
+        }
+    };
+    add(feature.points_ground);
+    add(feature.points_surf);
+    feature.ring_key = feature.context.rowwise().mean();
+}
+
+inline double shifted_distance(const Eigen::MatrixXf &a, const Eigen::MatrixXf &b, int shift)
+{
+    double sum = 0;
+    int num = 0;
+    for (int j = 0; j < num_sectors; j++)
+    {
+        auto col_a = a.col(j), col_b = b.col((j + shift) % num_sectors);
+        double norm = col_a.norm() * col_b.norm();
+        if (norm > 0)
+        {
+            sum += 1 - col_a.dot(col_b) / norm;
+            num++;
+        }
+    }
+    return num ? sum / num : 1;
+}
+
+double scan_context_distance(const Eigen::MatrixXf &a, const Eigen::MatrixXf &b, double &yaw)
+{
+    yaw = 0;
+    if (a.size() == 0 || b.size() == 0)
+        return 1;
+    // coarse yaw from the sector keys
+    Eigen::RowVectorXf key_a = a.colwise().mean(), key_b = b.colwise().mean();
+    int coarse = 0;
+    double best = DBL_MAX;
+    for (int shift = 0; shift < num_sectors; shift++)
+    {
+        double d = 0;
+        for (int j = 0; j < num_sectors; j++)
+        {
+            double diff = key_a(j) - key_b((j + shift) % num_sectors);
+            d += diff * diff;
+        }
+        if (d < best)
+        {
+            best = d;
+            coarse = shift;
+        }
+    }
+    // fine search around it
+    int best_shift = coarse;
+    best = DBL_MAX;
+    for (int i = -search_radius; i <= search_radius; i++)
+    {
+        int shift = (coarse + i + num_sectors) % num_sectors;
+        double d = shifted_distance(a, b, shift);
+        if (d < best)
+        {
+            best = d;
+            best_shift = shift;
+        }
+    }
+    // column j of a is column j + shift of b
+    yaw = best_shift * 2 * M_PI / num_sectors;
+    if (yaw > M_PI)
+    {
+        yaw -= 2 * M_PI;
+    }
+    return best;
+}
+
+void ScanContextIndex::Insert(double time, const Eigen::VectorXf &ring_key)
+{
+    cv::Mat row(1, ring_key.size(), CV_32F);
+    for (int i = 0; i < ring_key.size(); i++)
+    {
+        row.at<float>(0, i) = ring_key(i);
+    }
+    keys_.push_back(row);
+    times_.push_back(time);
+    if (keys_.rows - num_indexed_ >= rebuild_interval)
+    {
+        Rebuild();
+    }
+}
+
+void ScanContextIndex::Rebuild()
+{
+    tree_ = std::make_shared<cv::flann::Index>(keys_, cv::flann::KDTreeIndexParams(1));
+    num_indexed_ = keys_.rows;
+}
+
+int ScanContextIndex::Search(const Eigen::VectorXf &ring_key, int k, std::vector<double> &times)
+{
+    times.clear();
+    if (keys_.empty() || ring_key.size() != keys_.cols)
+        return 0;
+    cv::Mat query(1, ring_key.size(), CV_32F);
+    for (int i = 0; i < ring_key.size(); i++)
+    {
+        query.at<float>(0, i) = ring_key(i);
+    }
+    std::vector<std::pair<float, int>> candidates;
+    if (tree_)
+    {
+        int n = std::min(k, num_indexed_);
+        cv::Mat indices(1, n, CV_32S), distances(1, n, CV_32F);
+        tree_->knnSearch(query, indices, distances, n, cv::flann::SearchParams(-1));
+        for (int i = 0; i < n; i++)
+        {
+            candidates.push_back(std::make_pair(distances.at<float>(0, i), indices.at<int>(0, i)));
+        }
+    }
+    for (int i = num_indexed_; i < keys_.rows; i++)
+    {
+        candidates.push_back(std::make_pair((float)cv::norm(query, keys_.row(i), cv::NORM_L2SQR), i));
+    }
+    k = std::min(k, (int)candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end());
+    for (int i = 0; i < k; i++)
+    {
+        times.push_back(times_[candidates[i].second]);
+    }
+    return k;
+}
+
+} // namespace lidar
+
+} // namespace lvio_fusion
@@ -0,0 +1,143 @@
+#include "lvio_fusion/scheduler.h"
+
+#include <sstream>
+
+namespace lvio_fusion
+{
+
+const char *task_names[] = {"frontend", "backend", "mapping", "relocator", "navsat", "lidar"};
+
+inline bool critical(Task task)
+{
+    return task == Task::Frontend || task == Task::Backend;
+}
+
+// "0-1;3" -> {0, 1, 3}, ranges are separated by ';' since ',' separates tasks
+inline std::vector<int> parse_cpus(const std::string &list)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ';'))
+    {
+        int first, last;
+        char dash;
+        std::stringstream range(item);
+        if (!(range >> first))
+            continue;
+        last = (range >> dash >> last) ? last : first;
+        for (int cpu = first; cpu <= last; cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+void Scheduler::Init(int num_threads, const std::string &affinity)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    total_ = std::max(1, num_threads);
+    reserved_ = total_ / 2;
+    // "frontend:0-1,backend:2-3", a task may also have several ranges, "mapping:4;6"
+    std::stringstream ss(affinity);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        auto colon = item.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string name = item.substr(0, colon);
+        name.erase(0, name.find_first_not_of(' '));
+        for (int i = 0; i < (int)Task::Num; i++)
+        {
+            if (name == task_names[i])
+            {
+                cpus_[i] = parse_cpus(item.substr(colon + 1));
+                for (auto thread : threads_[i])
+                {
+                    Apply(thread, (Task)i);
+                }
+            }
+        }
+    }
+    cv_.notify_all();
+}
+
+void Scheduler::Pin(Task task)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    threads_[(int)task].push_back(pthread_self());
+    Apply(pthread_self(), task);
+}
+
+void Scheduler::Apply(pthread_t thread, Task task)
+{
+    auto &cpus = cpus_[(int)task];
+    if (cpus.empty())
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+    {
+        CPU_SET(cpu, &set);
+    }
+    if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0)
+    {
+        LOG(WARNING) << "Scheduler: can not pin " << task_names[(int)task] << " to the cpus";
+    }
+}
+
+int Scheduler::Available(Task task)
+{
+    for (int i = 0; i < (int)task; i++)
+    {
+        if (waiting_[i])
+            return 0;
+    }
+    int available = total_ - in_use_;
+    if (!critical(task))
+    {
+        // leave the reserved threads for frontend and backend
+        available -= std::max(0, reserved_ - critical_in_use_);
+    }
+    return std::max(0, available);
+}
+
+int Scheduler::Acquire(Task task)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    // never oversubscribe, wait for a release instead
+    int threads = 0;
+    waiting_[(int)task]++;
+    cv_.wait(lock, [&] { return (threads = Available(task)) > 0; });
+    waiting_[(int)task]--;
+    in_use_ += threads;
+    // the tasks of lower priority may take what is left
+    cv_.notify_all();
+    if (critical(task))
+    {
+        critical_in_use_ += threads;
+    }
+    return threads;
+}
+
+void Scheduler::Release(Task task, int threads)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    in_use_ -= threads;
+    if (critical(task))
+    {
+        critical_in_use_ -= threads;
+    }
+    cv_.notify_all();
+}
+
+Scheduler::Lease::Lease(Task task) : task(task), threads(Scheduler::Instance().Acquire(task)) {}
+
+Scheduler::Lease::~Lease()
+{
+    Scheduler::Instance().Release(task, threads);
+}
+
+} // namespace lvio_fusion
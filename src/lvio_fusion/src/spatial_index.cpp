@@ -0,0 +1,81 @@
+#include "lvio_fusion/loop/spatial_index.h"
+
+namespace lvio_fusion
+{
+
+namespace loop
+{
+
+void SpatialIndex::Insert(Frame::Ptr frame)
+{
+    long long key = Key(Cell(frame->t().x()), Cell(frame->t().y()));
+    auto iter = entries_.find(frame->time);
+    if (iter != entries_.end())
+    {
+        Remove(frame->time, iter->second.key);
+    }
+    entries_[frame->time] = {frame, key};
+    cells_[key].push_back(frame->time);
+}
+
+void SpatialIndex::Remove(double time, long long key)
+{
+    auto &times = cells_[key];
+    times.erase(std::remove(times.begin(), times.end(), time), times.end());
+    if (times.empty())
+    {
+        cells_.erase(key);
+    }
+}
+
+void SpatialIndex::Update(double start)
+{
+    for (auto iter = entries_.lower_bound(start); iter != entries_.end(); iter++)
+    {
+        Entry &entry = iter->second;
+        long long key = Key(Cell(entry.frame->t().x()), Cell(entry.frame->t().y()));
+        if (key != entry.key)
+        {
+            Remove(iter->first, entry.key);
+            cells_[key].push_back(iter->first);
+            entry.key = key;
+        }
+    }
+}
+
+int SpatialIndex::Search(const Vector3d &position, int k, double radius, std::vector<Frame::Ptr> &result)
+{
+    result.clear();
+    std::vector<std::pair<double, Frame::Ptr>> candidates;
+    int x = Cell(position.x()), y = Cell(position.y()), r = (int)std::ceil(radius / cell_size_);
+    double radius2 = radius * radius;
+    for (int i = x - r; i <= x + r; i++)
+    {
+        for (int j = y - r; j <= y + r; j++)
+        {
+            auto iter = cells_.find(Key(i, j));
+            if (iter == cells_.end())
+                continue;
+            for (double time : iter->second)
+            {
+                Frame::Ptr frame = entries_[time].frame;
+                double distance2 = (frame->t() - position).head<2>().squaredNorm();
+                if (distance2 < radius2)
+                {
+                    candidates.push_back(std::make_pair(distance2, frame));
+                }
+            }
+        }
+    }
+    k = std::min(k, (int)candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end(),
+                      [](const std::pair<double, Frame::Ptr> &a, const std::pair<double, Frame::Ptr> &b) { return a.first < b.first; });
+    for (int i = 0; i < k; i++)
+    {
+        result.push_back(candidates[i].second);
+    }
+    return k;
+}
+
+} // namespace loop
+} // namespace lvio_fusion
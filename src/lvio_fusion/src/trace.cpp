@@ -0,0 +1,163 @@
+#include "lvio_fusion/trace.h"
+#include "lvio_fusion/buffer.h"
+
+namespace lvio_fusion
+{
+
+const char trace_magic[8] = "LVIOTRC";
+
+// size, type, offset and time
+const size_t trace_header = sizeof(uint32_t) + sizeof(TraceType) + 2 * sizeof(double);
+
+inline std::vector<char> trace_buffer()
+{
+    return std::vector<char>(trace_header);
+}
+
+bool TraceWriter::Open(const std::string &path)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    out_.open(path, std::ios::binary | std::ios::trunc);
+    if (!out_)
+    {
+        LOG(ERROR) << "TraceWriter: can not open " << path;
+        return false;
+    }
+    out_.write(trace_magic, sizeof(trace_magic));
+    LOG(INFO) << "TraceWriter: recording inputs to " << path;
+    return true;
+}
+
+void TraceWriter::Write(TraceType type, double time, std::vector<char> &buffer)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!out_.is_open())
+        return;
+    auto now = std::chrono::steady_clock::now();
+    if (!started_)
+    {
+        start_ = now;
+        started_ = true;
+    }
+    double offset = std::chrono::duration<double>(now - start_).count();
+    char *p = buffer.data();
+    uint32_t size = buffer.size();
+    memcpy(p, &size, sizeof(size));
+    p += sizeof(size);
+    memcpy(p, &type, sizeof(type));
+    p += sizeof(type);
+    memcpy(p, &offset, sizeof(offset));
+    p += sizeof(offset);
+    memcpy(p, &time, sizeof(time));
+    out_.write(buffer.data(), buffer.size());
+}
+
+void TraceWriter::WriteImage(double time, const cv::Mat &left, const cv::Mat &right, const SE3d &init_odom)
+{
+    std::vector<char> buffer = trace_buffer();
+    write_mat(buffer, left);
+    write_mat(buffer, right);
+    write_pod(buffer, init_odom);
+    Write(TraceType::Image, time, buffer);
+}
+
+void TraceWriter::WriteImu(double time, const Vector3d &acc, const Vector3d &gyr)
+{
+    std::vector<char> buffer = trace_buffer();
+    write_pod(buffer, acc);
+    write_pod(buffer, gyr);
+    Write(TraceType::Imu, time, buffer);
+}
+
+void TraceWriter::WritePointCloud(double time, const Point3Cloud &point_cloud)
+{
+    std::vector<char> buffer = trace_buffer();
+    size_t size = point_cloud.size();
+    write_pod(buffer, size);
+    buffer.insert(buffer.end(), (const char *)point_cloud.points.data(), (const char *)point_cloud.points.data() + size * sizeof(Point3));
+    Write(TraceType::PointCloud, time, buffer);
+}
+
+void TraceWriter::WriteScan(const lidar::RawScan &scan)
+{
+    std::vector<char> buffer = trace_buffer();
+    write_pod(buffer, scan.layout);
+    write_pod(buffer, scan.size);
+    const char *data = (const char *)scan.data.get();
+    buffer.insert(buffer.end(), data, data + scan.size * scan.layout.point_step);
+    Write(TraceType::Scan, scan.time, buffer);
+}
+
+void TraceWriter::WriteNavsat(double time, const Vector3d &position, const Vector3d &cov)
+{
+    std::vector<char> buffer = trace_buffer();
+    write_pod(buffer, position);
+    write_pod(buffer, cov);
+    Write(TraceType::Navsat, time, buffer);
+}
+
+bool TraceReader::Open(const std::string &path)
+{
+    in_.open(path, std::ios::binary);
+    char magic[sizeof(trace_magic)];
+    if (!in_ || !in_.read(magic, sizeof(magic)) || memcmp(magic, trace_magic, sizeof(magic)) != 0)
+    {
+        LOG(ERROR) << "TraceReader: not a trace " << path;
+        return false;
+    }
+    return true;
+}
+
+bool TraceReader::Next(TraceRecord &record)
+{
+    uint32_t size;
+    if (!in_.read((char *)&size, sizeof(size)) || size < trace_header)
+        return false;
+    buffer_.resize(size - sizeof(size));
+    if (!in_.read(buffer_.data(), buffer_.size()))
+        return false;
+
+    const char *p = buffer_.data();
+    p = read_pod(p, record.type);
+    p = read_pod(p, record.offset);
+    p = read_pod(p, record.time);
+    switch (record.type)
+    {
+    case TraceType::Image:
+        p = read_mat(p, record.left);
+        p = read_mat(p, record.right);
+        p = read_pod(p, record.init_odom);
+        break;
+    case TraceType::Imu:
+    case TraceType::Navsat:
+        p = read_pod(p, record.v1);
+        p = read_pod(p, record.v2);
+        break;
+    case TraceType::PointCloud:
+    {
+        size_t num;
+        p = read_pod(p, num);
+        record.point_cloud = Point3Cloud::Ptr(new Point3Cloud);
+        record.point_cloud->resize(num);
+        memcpy(record.point_cloud->points.data(), p, num * sizeof(Point3));
+        break;
+    }
+    case TraceType::Scan:
+    {
+        p = read_pod(p, record.scan.layout);
+        p = read_pod(p, record.scan.size);
+        size_t bytes = record.scan.size * record.scan.layout.point_step;
+        std::shared_ptr<uint8_t> data(new uint8_t[bytes], std::default_delete<uint8_t[]>());
+        memcpy(data.get(), p, bytes);
+        record.scan.data = data;
+        record.scan.time = record.time;
+        break;
+    }
+    default:
+        LOG(ERROR) << "TraceReader: unknown record " << (int)record.type;
+        return false;
+    }
+    return true;
+}
+
+} // namespace lvio_fusion
@@ -1,9 +1,12 @@
 #include "lvio_fusion/utility.h"
 #include "lvio_fusion/ceres/base.hpp"
+#include "lvio_fusion/ceres/jacobian.hpp"
 
 namespace lvio_fusion
 {
 
+bool analytic_jacobians = true;
+
 void triangulate(const SE3d &pose0, const SE3d &pose1, const Vector3d &p0, const Vector3d &p1, Vector3d &p_3d)
 {
     Matrix4d A = Matrix4d::Zero();
@@ -17,6 +20,32 @@ void triangulate(const SE3d &pose0, const SE3d &pose1, const Vector3d &p0, const
     p_3d = (p_norm / p_norm(3)).head<3>();
 }
 
+void triangulate(const SE3d &pose0, const SE3d &pose1, const Matrix3Xd &p0, const Matrix3Xd &p1, Matrix3Xd &p_3d)
+{
+    // closest points of rays c0 + s * d0 and c1 + u * d1
+    Vector3d c0 = pose0.inverse().translation(), c1 = pose1.inverse().translation();
+    Matrix3Xd d0 = pose0.so3().inverse().matrix() * p0;
+    Matrix3Xd d1 = pose1.so3().inverse().matrix() * p1;
+    Vector3d w = c0 - c1;
+    ArrayXd a = d0.colwise().squaredNorm().transpose().array();
+    ArrayXd b = (d0.array() * d1.array()).colwise().sum().transpose();
+    ArrayXd c = d1.colwise().squaredNorm().transpose().array();
+    ArrayXd d = (d0.transpose() * w).array();
+    ArrayXd e = (d1.transpose() * w).array();
+    ArrayXd denom = a * c - b * b;
+    ArrayXd s = (b * e - c * d) / denom;
+    ArrayXd u = (a * e - b * d) / denom;
+    p_3d = 0.5 * ((d0.array().rowwise() * s.transpose()) + (d1.array().rowwise() * u.transpose())).matrix();
+    p_3d.colwise() += 0.5 * (c0 + c1);
+    for (int i = 0; i < p_3d.cols(); i++)
+    {
+        if (!(denom(i) > 1e-12 * a(i) * c(i)))
+        {
+            p_3d.col(i) = c0;
+        }
+    }
+}
+
 double cv_distance(cv::Point2f pt1, cv::Point2f pt2)
 {
     double dx = pt1.x - pt2.x;
@@ -52,23 +81,33 @@ SE3d get_pose_from_two_points(const Vector3d &a, const Vector3d &b)
     return rpyxyz2se3(rpyxyz);
 }
 
-void optical_flow(cv::Mat &prevImg, cv::Mat &nextImg,
+const cv::Size lk_window(21, 21);
+const int lk_levels = 3;
+
+void build_pyramid(const cv::Mat &image, std::vector<cv::Mat> &pyramid)
+{
+    cv::buildOpticalFlowPyramid(image, pyramid, lk_window, lk_levels, true);
+}
+
+// prev and next are both pyramids or both images
+void optical_flow(cv::InputArray prev, cv::InputArray next, cv::Size size,
                   std::vector<cv::Point2f> &prevPts, std::vector<cv::Point2f> &nextPts,
                   std::vector<uchar> &status)
 {
     if (prevPts.empty())
         return;
 
+    // the backward pass uses a smaller window and fewer levels of the same pyramids
     cv::Mat err;
     cv::calcOpticalFlowPyrLK(
-        prevImg, nextImg, prevPts, nextPts, status, err, cv::Size(21, 21), 3,
+        prev, next, prevPts, nextPts, status, err, lk_window, lk_levels,
         cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 30, 0.01),
         cv::OPTFLOW_USE_INITIAL_FLOW);
 
     std::vector<uchar> reverse_status;
     std::vector<cv::Point2f> reverse_pts = prevPts;
     cv::calcOpticalFlowPyrLK(
-        nextImg, prevImg, nextPts, reverse_pts, reverse_status, err, cv::Size(3, 3), 1,
+        next, prev, nextPts, reverse_pts, reverse_status, err, cv::Size(3, 3), 1,
         cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 30, 0.01),
         cv::OPTFLOW_USE_INITIAL_FLOW);
 
@@ -77,8 +116,8 @@ void optical_flow(cv::Mat &prevImg, cv::Mat &nextImg,
     {
         if (status[i] && reverse_status[i] &&
             cv_distance(prevPts[i], reverse_pts[i]) <= 0.5 &&
-            nextPts[i].x >= 0 && nextPts[i].x < prevImg.cols &&
-            nextPts[i].y >= 0 && nextPts[i].y < prevImg.rows)
+            nextPts[i].x >= 0 && nextPts[i].x < size.width &&
+            nextPts[i].y >= 0 && nextPts[i].y < size.height)
         {
             status[i] = 1;
             num_success_pts++;
@@ -88,6 +127,20 @@ void optical_flow(cv::Mat &prevImg, cv::Mat &nextImg,
     }
 }
 
+void optical_flow(const std::vector<cv::Mat> &prevPyr, const std::vector<cv::Mat> &nextPyr,
+                  std::vector<cv::Point2f> &prevPts, std::vector<cv::Point2f> &nextPts,
+                  std::vector<uchar> &status)
+{
+    optical_flow(prevPyr, nextPyr, prevPyr[0].size(), prevPts, nextPts, status);
+}
+
+void optical_flow(const cv::UMat &prevImg, const cv::UMat &nextImg,
+                  std::vector<cv::Point2f> &prevPts, std::vector<cv::Point2f> &nextPts,
+                  std::vector<uchar> &status)
+{
+    optical_flow(prevImg, nextImg, prevImg.size(), prevPts, nextPts, status);
+}
+
 Vector3d R2ypr(const Matrix3d &R)
 {
     Vector3d n = R.col(0);
@@ -0,0 +1,292 @@
+#include "lvio_fusion/loop/vocabulary.h"
+#include "lvio_fusion/visual/hamming.h"
+
+#include <climits>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+namespace lvio_fusion
+{
+
+namespace loop
+{
+
+bool Vocabulary::Load(const std::string &path)
+{
+    std::ifstream in(path);
+    if (!in.is_open())
+    {
+        LOG(ERROR) << "Vocabulary: can not open " << path;
+        return false;
+    }
+    std::string line;
+    std::getline(in, line); // k, levels, scoring, weighting
+    nodes_.assign(1, Node());
+    words_.clear();
+    weights_.clear();
+    while (std::getline(in, line))
+    {
+        std::stringstream ss(line);
+        int parent, leaf;
+        if (!(ss >> parent >> leaf) || parent < 0 || parent >= (int)nodes_.size())
+            continue;
+        Node node;
+        unsigned char *data = reinterpret_cast<unsigned char *>(&node.descriptor);
+        for (int i = 0; i < 32; i++)
+        {
+            int value;
+            ss >> value;
+            data[i] = value;
+        }
+        double weight;
+        ss >> weight;
+        if (leaf)
+        {
+            node.word = words_.size();
+            words_.push_back(nodes_.size());
+            weights_.push_back(weight);
+        }
+        nodes_[parent].children.push_back(nodes_.size());
+        nodes_.push_back(node);
+    }
+    LOG(INFO) << "Vocabulary: loaded " << words_.size() << " words from " << path;
+    return !words_.empty();
+}
+
+inline BRIEF median(const std::vector<const BRIEF *> &descriptors)
+{
+    int counts[256] = {0};
+    for (auto descriptor : descriptors)
+    {
+        const uint64_t *p = reinterpret_cast<const uint64_t *>(descriptor);
+        for (int i = 0; i < 256; i++)
+        {
+            counts[i] += (p[i >> 6] >> (i & 63)) & 1;
+        }
+    }
+    BRIEF result;
+    for (int i = 0; i < 256; i++)
+    {
+        result[i] = counts[i] * 2 > (int)descriptors.size();
+    }
+    return result;
+}
+
+void Vocabulary::Cluster(int parent, const std::vector<const BRIEF *> &descriptors, int k, int level, int levels)
+{
+    std::vector<std::vector<const BRIEF *>> clusters;
+    std::vector<BRIEF> centers;
+    if ((int)descriptors.size() <= k)
+    {
+        for (auto descriptor : descriptors)
+        {
+            centers.push_back(*descriptor);
+            clusters.push_back({descriptor});
+        }
+    }
+    else
+    {
+        // spread the initial centers over the descriptors
+        for (int i = 0; i < k; i++)
+        {
+            centers.push_back(*descriptors[i * descriptors.size() / k]);
+        }
+        std::vector<int> assignments(descriptors.size(), -1);
+        for (int iteration = 0; iteration < 10; iteration++)
+        {
+            bool changed = false;
+            clusters.assign(k, std::vector<const BRIEF *>());
+            for (int i = 0; i < descriptors.size(); i++)
+            {
+                int best = INT_MAX, index = 0;
+                for (int j = 0; j < k; j++)
+                {
+                    int d = hamming_distance(*descriptors[i], centers[j]);
+                    if (d < best)
+                    {
+                        best = d;
+                        index = j;
+                    }
+                }
+                changed = changed || assignments[i] != index;
+                assignments[i] = index;
+                clusters[index].push_back(descriptors[i]);
+            }
+            if (!changed)
+                break;
+            for (int j = 0; j < k; j++)
+            {
+                if (!clusters[j].empty())
+                {
+                    centers[j] = median(clusters[j]);
+                }
+            }
+        }
+    }
+
+    for (int j = 0; j < centers.size(); j++)
+    {
+        if (clusters[j].empty())
+            continue;
+        int id = nodes_.size();
+        nodes_.push_back(Node());
+        nodes_[id].descriptor = centers[j];
+        nodes_[parent].children.push_back(id);
+        if (level + 1 < levels && (int)clusters[j].size() > 1)
+        {
+            Cluster(id, clusters[j], k, level + 1, levels);
+        }
+        else
+        {
+            nodes_[id].word = words_.size();
+            words_.push_back(id);
+        }
+    }
+}
+
+void Vocabulary::Train(const std::vector<std::vector<BRIEF>> &images, int k, int levels)
+{
+    std::vector<const BRIEF *> descriptors;
+    for (auto &image : images)
+    {
+        for (auto &descriptor : image)
+        {
+            descriptors.push_back(&descriptor);
+        }
+    }
+    nodes_.assign(1, Node());
+    words_.clear();
+    Cluster(0, descriptors, k, 0, levels);
+
+    // idf = log(N / N_i)
+    std::vector<int> counts(words_.size(), 0);
+    for (auto &image : images)
+    {
+        std::set<int> words;
+        for (auto &descriptor : image)
+        {
+            words.insert(Word(descriptor));
+        }
+        for (int word : words)
+        {
+            counts[word]++;
+        }
+    }
+    weights_.resize(words_.size());
+    for (int i = 0; i < words_.size(); i++)
+    {
+        weights_[i] = counts[i] ? std::log((double)images.size() / counts[i]) : 0;
+    }
+    LOG(INFO) << "Vocabulary: trained " << words_.size() << " words from " << descriptors.size() << " descriptors";
+}
+
+int Vocabulary::Word(const BRIEF &descriptor) const
+{
+    int id = 0;
+    while (!nodes_[id].children.empty())
+    {
+        int best = INT_MAX, next = nodes_[id].children[0];
+        for (int child : nodes_[id].children)
+        {
+            int d = hamming_distance(descriptor, nodes_[child].descriptor);
+            if (d < best)
+            {
+                best = d;
+                next = child;
+            }
+        }
+        id = next;
+    }
+    return nodes_[id].word;
+}
+
+void Vocabulary::Transform(const std::vector<BRIEF> &descriptors, BowVector &bow) const
+{
+    bow.clear();
+    if (Empty())
+        return;
+    for (auto &descriptor : descriptors)
+    {
+        int word = Word(descriptor);
+        if (word >= 0 && weights_[word] > 0)
+        {
+            bow[word] += weights_[word];
+        }
+    }
+    double sum = 0;
+    for (auto &pair : bow)
+    {
+        sum += pair.second;
+    }
+    if (sum > 0)
+    {
+        for (auto &pair : bow)
+        {
+            pair.second /= sum;
+        }
+    }
+}
+
+double Vocabulary::Score(const BowVector &a, const BowVector &b)
+{
+    double score = 0;
+    auto i = a.begin(), j = b.begin();
+    while (i != a.end() && j != b.end())
+    {
+        if (i->first < j->first)
+        {
+            i++;
+        }
+        else if (j->first < i->first)
+        {
+            j++;
+        }
+        else
+        {
+            score += i->second + j->second - std::fabs(i->second - j->second);
+            i++;
+            j++;
+        }
+    }
+    return score / 2;
+}
+
+void Database::Add(double time, const BowVector &bow)
+{
+    for (auto &pair : bow)
+    {
+        index_[pair.first].push_back(std::make_pair(time, pair.second));
+    }
+    size_++;
+}
+
+int Database::Query(const BowVector &bow, double max_time, int k, std::vector<std::pair<double, double>> &results) const
+{
+    results.clear();
+    std::unordered_map<double, double> scores;
+    for (auto &pair : bow)
+    {
+        auto iter = index_.find(pair.first);
+        if (iter == index_.end())
+            continue;
+        for (auto &entry : iter->second)
+        {
+            if (entry.first < max_time)
+            {
+                scores[entry.first] += pair.second + entry.second - std::fabs(pair.second - entry.second);
+            }
+        }
+    }
+    for (auto &pair : scores)
+    {
+        results.push_back(std::make_pair(pair.second / 2, pair.first));
+    }
+    k = std::min(k, (int)results.size());
+    std::partial_sort(results.begin(), results.begin() + k, results.end(), std::greater<std::pair<double, double>>());
+    results.resize(k);
+    return k;
+}
+
+} // namespace loop
+} // namespace lvio_fusion
@@ -0,0 +1,298 @@
+#include "lvio_fusion/lidar/voxel_map.h"
+#include "lvio_fusion/metrics.h"
+
+#include <algorithm>
+
+namespace lvio_fusion
+{
+
+namespace lidar
+{
+
+inline bool in_window(double time, double start, double end)
+{
+    return time >= start && (end == 0 || time <= end);
+}
+
+void VoxelMap::Insert(double time, const PointICloud &points)
+{
+    Erase(time);
+    auto &frame = frames_[time];
+    for (auto &point : points)
+    {
+        VoxelKey key = Key(point.data);
+        auto &voxel = voxels_[key];
+        if (voxel.empty() || voxel.back().time != time)
+        {
+            frame.first.push_back(key);
+        }
+        voxel.push_back({point, time});
+    }
+    frame.second = points.size();
+}
+
+void VoxelMap::Erase(double time)
+{
+    auto iter = frames_.find(time);
+    if (iter == frames_.end())
+        return;
+    for (auto &key : iter->second.first)
+    {
+        auto voxel = voxels_.find(key);
+        if (voxel == voxels_.end())
+            continue;
+        auto &entries = voxel->second;
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [time](const Entry &entry) { return entry.time == time; }), entries.end());
+        if (entries.empty())
+        {
+            voxels_.erase(voxel);
+        }
+    }
+    frames_.erase(iter);
+}
+
+void VoxelMap::EraseBefore(double time)
+{
+    while (!frames_.empty() && frames_.begin()->first < time)
+    {
+        Erase(frames_.begin()->first);
+    }
+}
+
+int VoxelMap::Size(double start, double end)
+{
+    int size = 0;
+    for (auto iter = frames_.lower_bound(start); iter != frames_.end() && in_window(iter->first, start, end); iter++)
+    {
+        size += iter->second.second;
+    }
+    return size;
+}
+
+int VoxelMap::Search(const PointI &point, int k, std::vector<PointI> &result, double start, double end)
+{
+    const float max_distance = resolution * resolution; // squared
+    std::vector<std::pair<float, const PointI *>> candidates;
+    VoxelKey center = Key(point.data);
+    for (int dx = -1; dx <= 1; dx++)
+        for (int dy = -1; dy <= 1; dy++)
+            for (int dz = -1; dz <= 1; dz++)
+            {
+                auto voxel = voxels_.find(VoxelKey(center.x + dx, center.y + dy, center.z + dz));
+                if (voxel == voxels_.end())
+                    continue;
+                for (auto &entry : voxel->second)
+                {
+                    if (!in_window(entry.time, start, end))
+                        continue;
+                    float distance = (entry.point.getVector3fMap() - point.getVector3fMap()).squaredNorm();
+                    if (distance < max_distance)
+                    {
+                        candidates.push_back(std::make_pair(distance, &entry.point));
+                    }
+                }
+            }
+
+    int num = std::min(k, (int)candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + num, candidates.end(),
+                      [](const std::pair<float, const PointI *> &a, const std::pair<float, const PointI *> &b) { return a.first < b.first; });
+    result.clear();
+    for (int i = 0; i < num; i++)
+    {
+        result.push_back(*candidates[i].second);
+    }
+    return num;
+}
+
+void VoxelMap::Search(const PointICloud &points, int k, std::vector<int> &nums, std::vector<PointI> &nearest, double start, double end)
+{
+    const float max_distance = resolution * resolution; // squared
+    nums.assign(points.size(), 0);
+    nearest.resize(points.size() * k);
+    std::unordered_map<VoxelKey, std::vector<int>, VoxelKeyHash> groups;
+    for (int i = 0; i < points.size(); i++)
+    {
+        groups[Key(points[i].data)].push_back(i);
+    }
+
+    std::vector<const PointI *> neighbourhood;
+    std::vector<std::pair<float, const PointI *>> candidates;
+    for (auto &group : groups)
+    {
+        const VoxelKey &center = group.first;
+        neighbourhood.clear();
+        for (int dx = -1; dx <= 1; dx++)
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dz = -1; dz <= 1; dz++)
+                {
+                    auto voxel = voxels_.find(VoxelKey(center.x + dx, center.y + dy, center.z + dz));
+                    if (voxel == voxels_.end())
+                        continue;
+                    for (auto &entry : voxel->second)
+                    {
+                        if (in_window(entry.time, start, end))
+                        {
+                            neighbourhood.push_back(&entry.point);
+                        }
+                    }
+                }
+
+        for (int i : group.second)
+        {
+            candidates.clear();
+            for (auto candidate : neighbourhood)
+            {
+                float distance = (candidate->getVector3fMap() - points[i].getVector3fMap()).squaredNorm();
+                if (distance < max_distance)
+                {
+                    candidates.push_back(std::make_pair(distance, candidate));
+                }
+            }
+            int num = std::min(k, (int)candidates.size());
+            std::partial_sort(candidates.begin(), candidates.begin() + num, candidates.end(),
+                              [](const std::pair<float, const PointI *> &a, const std::pair<float, const PointI *> &b) { return a.first < b.first; });
+            for (int j = 0; j < num; j++)
+            {
+                nearest[i * k + j] = *candidates[j].second;
+            }
+            nums[i] = num;
+        }
+    }
+}
+
+inline MemoryAccount &global_map_memory()
+{
+    static MemoryAccount &memory = Metrics::Instance().GetMemory("lidar_global_map");
+    return memory;
+}
+
+void GlobalMap::Insert(double time, const PointRGBCloud &points)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    EraseUnlocked(time);
+    auto &frame = frames_[time];
+    for (auto &point : points)
+    {
+        VoxelKey key = Key(point);
+        auto &cells = voxels_[key];
+        if (cells.empty() || cells.back().time != time)
+        {
+            cells.push_back({time, 0, 0, 0, 0, 0, 0, 0});
+            frame.push_back(key);
+            VoxelKey chunk = Chunk(key);
+            chunks_[chunk].insert(key);
+            dirty_.insert(chunk);
+        }
+        Cell &cell = cells.back();
+        cell.x += point.x;
+        cell.y += point.y;
+        cell.z += point.z;
+        cell.r += point.r;
+        cell.g += point.g;
+        cell.b += point.b;
+        cell.n++;
+    }
+    global_map_memory().Add(frame.size() * (sizeof(Cell) + sizeof(VoxelKey)));
+}
+
+void GlobalMap::Erase(double time)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    EraseUnlocked(time);
+}
+
+void GlobalMap::EraseUnlocked(double time)
+{
+    auto iter = frames_.find(time);
+    if (iter == frames_.end())
+        return;
+    for (auto &key : iter->second)
+    {
+        auto voxel = voxels_.find(key);
+        if (voxel == voxels_.end())
+            continue;
+        auto &cells = voxel->second;
+        cells.erase(std::remove_if(cells.begin(), cells.end(), [time](const Cell &cell) { return cell.time == time; }), cells.end());
+        VoxelKey chunk = Chunk(key);
+        dirty_.insert(chunk);
+        if (cells.empty())
+        {
+            voxels_.erase(voxel);
+            auto chunk_iter = chunks_.find(chunk);
+            chunk_iter->second.erase(key);
+            if (chunk_iter->second.empty())
+            {
+                chunks_.erase(chunk_iter);
+            }
+        }
+    }
+    global_map_memory().Remove(iter->second.size() * (sizeof(Cell) + sizeof(VoxelKey)));
+    frames_.erase(iter);
+}
+
+inline void GlobalMap::Centroid(const std::vector<Cell> &cells, PointRGBCloud &out)
+{
+    float x = 0, y = 0, z = 0, r = 0, g = 0, b = 0;
+    int n = 0;
+    for (auto &cell : cells)
+    {
+        x += cell.x;
+        y += cell.y;
+        z += cell.z;
+        r += cell.r;
+        g += cell.g;
+        b += cell.b;
+        n += cell.n;
+    }
+    PointRGB point;
+    point.x = x / n;
+    point.y = y / n;
+    point.z = z / n;
+    point.r = r / n;
+    point.g = g / n;
+    point.b = b / n;
+    out.push_back(point);
+}
+
+PointRGBCloud GlobalMap::Get()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    PointRGBCloud out;
+    out.reserve(voxels_.size());
+    for (auto &pair : voxels_)
+    {
+        Centroid(pair.second, out);
+    }
+    return out;
+}
+
+std::vector<GlobalMap::ChunkUpdate> GlobalMap::GetDirty()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::vector<ChunkUpdate> updates;
+    updates.reserve(dirty_.size());
+    for (auto &chunk : dirty_)
+    {
+        // a chunk which became empty is sent without points, so that it is removed
+        updates.push_back({chunk, PointRGBCloud()});
+        auto iter = chunks_.find(chunk);
+        if (iter == chunks_.end())
+            continue;
+        for (auto &key : iter->second)
+        {
+            Centroid(voxels_[key], updates.back().points);
+        }
+    }
+    dirty_.clear();
+    return updates;
+}
+
+bool GlobalMap::Dirty()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return !dirty_.empty();
+}
+
+} // namespace lidar
+
+} // namespace lvio_fusion
@@ -15,12 +15,20 @@
 #include "lvio_fusion/adapt/environment.h"
 #include "lvio_fusion/common.h"
 #include "lvio_fusion/estimator.h"
+#include "lvio_fusion/event.h"
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/map_file.h"
+#include "lvio_fusion/metrics.h"
+#include "lvio_fusion/spsc_queue.h"
 #include "lvio_fusion/utility.h"
 #include "lvio_fusion_node/CreateEnv.h"
 #include "lvio_fusion_node/Init.h"
+#include "lvio_fusion_node/Memory.h"
+#include "lvio_fusion_node/RebuildPath.h"
 #include "lvio_fusion_node/Step.h"
+#include "lvio_fusion_node/StepBatch.h"
 #include "lvio_fusion_node/UpdateWeights.h"
+#include "lvio_fusion_node/UpdateWeightsBatch.h"
 #include "parameters.h"
 #include "visualization.h"
 
@@ -32,14 +40,14 @@ Estimator::Ptr estimator;
 
 ros::Subscriber sub_imu, sub_lidar, sub_navsat, sub_img0, sub_img1, sub_objects, sub_eskf;
 ros::Publisher pub_detector;
-ros::ServiceServer svr_create_env, svr_step;
-ros::ServiceClient clt_init, clt_update_weights;
+ros::ServiceServer svr_create_env, svr_step, svr_step_batch, svr_rebuild_path, svr_memory;
+ros::ServiceClient clt_init, clt_update_weights, clt_update_weights_batch;
 
-queue<sensor_msgs::ImageConstPtr> img0_buf;
-queue<sensor_msgs::ImageConstPtr> img1_buf;
+lvio_fusion::SPSCQueue<sensor_msgs::ImageConstPtr> img0_buf(64);
+lvio_fusion::SPSCQueue<sensor_msgs::ImageConstPtr> img1_buf(64);
 queue<geometry_msgs::PoseStamped> odom_buf;
 GeographicLib::LocalCartesian geo_converter;
-mutex m_img_buf, m_odom_buf;
+mutex m_odom_buf;
 double delta_time = 0;
 double init_time = 0;
 
@@ -51,16 +59,18 @@ void img0_callback(const sensor_msgs::ImageConstPtr &img_msg)
         delta_time = ros::Time::now().toSec() - img_msg->header.stamp.toSec();
         init_time = img_msg->header.stamp.toSec();
     }
-    m_img_buf.lock();
-    img0_buf.push(img_msg);
-    m_img_buf.unlock();
+    if (!img0_buf.Push(img_msg))
+    {
+        ROS_WARN("img0 buffer is full, throw img0");
+    }
 }
 
 void img1_callback(const sensor_msgs::ImageConstPtr &img_msg)
 {
-    m_img_buf.lock();
-    img1_buf.push(img_msg);
-    m_img_buf.unlock();
+    if (!img1_buf.Push(img_msg))
+    {
+        ROS_WARN("img1 buffer is full, throw img1");
+    }
 }
 
 cv::Mat get_image_from_msg(const sensor_msgs::ImageConstPtr &img_msg)
@@ -128,54 +138,80 @@ SE3d get_pose_from_path(double timestamp)
 // extract images with same timestamp from two topics
 void sync_process()
 {
-    int n = 0;
     while (ros::ok())
     {
+        // wake up as soon as both images arrive
+        if (!img0_buf.Wait(chrono::milliseconds(100)) || !img1_buf.Wait(chrono::milliseconds(100)))
+            continue;
         cv::Mat image0, image1;
         std_msgs::Header header;
         double time = 0;
-        if (!img0_buf.empty() && !img1_buf.empty())
+        double time0 = img0_buf.Front()->header.stamp.toSec();
+        double time1 = img1_buf.Front()->header.stamp.toSec();
+        if (time0 < time1 - 5 * epsilon)
         {
-            m_img_buf.lock();
-            double time0 = img0_buf.front()->header.stamp.toSec();
-            double time1 = img1_buf.front()->header.stamp.toSec();
-            if (time0 < time1 - 5 * epsilon)
-            {
-                img0_buf.pop();
-                printf("throw img0\n");
-                m_img_buf.unlock();
-            }
-            else if (time0 > time1 + 5 * epsilon)
-            {
-                img1_buf.pop();
-                printf("throw img1\n");
-                m_img_buf.unlock();
-            }
-            else
-            {
-                time = img0_buf.front()->header.stamp.toSec();
-                header = img0_buf.front()->header;
-                image0 = get_image_from_msg(img0_buf.front());
-                image1 = get_image_from_msg(img1_buf.front());
-                img0_buf.pop();
-                img1_buf.pop();
-                m_img_buf.unlock();
-                estimator->InputImage(time, image0, image1, get_pose_from_path(time));
-                publish_car_model(estimator, time);
-            }
+            img0_buf.Pop();
+            printf("throw img0\n");
+        }
+        else if (time0 > time1 + 5 * epsilon)
+        {
+            img1_buf.Pop();
+            printf("throw img1\n");
         }
-        chrono::milliseconds dura(2);
-        this_thread::sleep_for(dura);
+        else
+        {
+            time = img0_buf.Front()->header.stamp.toSec();
+            header = img0_buf.Front()->header;
+            image0 = get_image_from_msg(img0_buf.Front());
+            image1 = get_image_from_msg(img1_buf.Front());
+            img0_buf.Pop();
+            img1_buf.Pop();
+            estimator->InputImage(time, image0, image1, get_pose_from_path(time));
+            publish_car_model(estimator, time);
+        }
+    }
+}
+
+// find the fields of the lidar once, the layout of a topic never changes
+lidar::ScanLayout scan_layout(const sensor_msgs::PointCloud2 &lidar_msg)
+{
+    lidar::ScanLayout layout;
+    layout.point_step = lidar_msg.point_step;
+    for (auto &field : lidar_msg.fields)
+    {
+        lidar::Field f = {(int)field.offset, (lidar::FieldType)field.datatype};
+        if (field.name == "x")
+            layout.x = f;
+        else if (field.name == "y")
+            layout.y = f;
+        else if (field.name == "z")
+            layout.z = f;
+        else if (!RING_FIELD.empty() && field.name == RING_FIELD)
+            layout.ring = f;
+        else if (!TIME_FIELD.empty() && field.name == TIME_FIELD)
+            layout.time = f;
+    }
+    // float times are seconds (velodyne), integer times are nanoseconds (ouster)
+    layout.time_scale = layout.time.type == lidar::FieldType::Float32 || layout.time.type == lidar::FieldType::Float64 ? 1 : 1e-9;
+    if (lidar_msg.is_bigendian)
+    {
+        ROS_WARN("big endian point cloud is not supported");
     }
+    ROS_INFO("lidar fields: ring %s, time %s", layout.ring.type == lidar::FieldType::None ? "no" : "yes",
+             layout.time.type == lidar::FieldType::None ? "no" : "yes");
+    return layout;
 }
 
 void lidar_callback(const sensor_msgs::PointCloud2ConstPtr &lidar_msg)
 {
-    double t = lidar_msg->header.stamp.toSec();
-    Point3Cloud point_cloud;
-    pcl::fromROSMsg(*lidar_msg, point_cloud);
-    Point3Cloud::Ptr laser_cloud_in_ptr(new Point3Cloud(point_cloud));
-    estimator->InputPointCloud(t, laser_cloud_in_ptr);
+    static lidar::ScanLayout layout = scan_layout(*lidar_msg);
+    lidar::RawScan scan;
+    scan.time = lidar_msg->header.stamp.toSec();
+    // the message is kept until the lidar thread decodes it
+    scan.data = std::shared_ptr<const uint8_t>(lidar_msg->data.data(), [lidar_msg](const uint8_t *) {});
+    scan.size = lidar_msg->width * lidar_msg->height;
+    scan.layout = layout;
+    estimator->InputPointCloud(scan);
 }
 
 void imu_callback(const sensor_msgs::ImuConstPtr &imu_msg)
@@ -190,6 +226,7 @@ void imu_callback(const sensor_msgs::ImuConstPtr &imu_msg)
     Vector3d acc(dx, dy, dz);
     Vector3d gyr(rx, ry, rz);
     estimator->InputImu(t, acc, gyr);
+    publish_imu_odometry(estimator);
     return;
 }
 
@@ -244,6 +281,35 @@ void navsat_timer_callback(const ros::TimerEvent &timer_event)
     publish_navsat(estimator, timer_event.current_real.toSec() - delta_time);
 }
 
+void metrics_timer_callback(const ros::TimerEvent &timer_event)
+{
+    publish_metrics(estimator, timer_event.current_real.toSec() - delta_time);
+}
+
+void tracking_timer_callback(const ros::TimerEvent &timer_event)
+{
+    publish_tracking(estimator, debug_image == 2);
+}
+
+bool rebuild_path_callback(lvio_fusion_node::RebuildPath::Request &req,
+                           lvio_fusion_node::RebuildPath::Response &res)
+{
+    res.num_poses = publish_path(estimator, ros::Time::now().toSec() - delta_time);
+    return true;
+}
+
+bool memory_callback(lvio_fusion_node::Memory::Request &req,
+                     lvio_fusion_node::Memory::Response &res)
+{
+    for (auto &stat : Metrics::Instance().GetMemoryStats())
+    {
+        res.names.push_back(stat.name);
+        res.bytes.push_back(stat.bytes);
+        res.objects.push_back(stat.objects);
+    }
+    return true;
+}
+
 bool create_env_callback(lvio_fusion_node::CreateEnv::Request &req,
                          lvio_fusion_node::CreateEnv::Response &res)
 {
@@ -263,6 +329,35 @@ bool step_callback(lvio_fusion_node::Step::Request &req,
     return true;
 }
 
+bool step_batch_callback(lvio_fusion_node::StepBatch::Request &req,
+                         lvio_fusion_node::StepBatch::Response &res)
+{
+    std::vector<int> ids(req.id.begin(), req.id.end());
+    std::vector<Weights> weights(ids.size());
+    for (int i = 0; i < ids.size(); i++)
+    {
+        weights[i].visual = req.visual[i];
+        weights[i].lidar_ground = req.lidar_ground[i];
+        weights[i].lidar_surf = req.lidar_surf[i];
+    }
+    std::vector<Transition> transitions;
+    Environment::Step(ids, weights, transitions);
+    // observations of done environments are empty
+    res.obs_size = 0;
+    for (auto &transition : transitions)
+    {
+        res.obs_size = std::max(res.obs_size, (int)transition.obs.size());
+    }
+    for (auto &transition : transitions)
+    {
+        transition.obs.resize(res.obs_size, 0);
+        res.obs.insert(res.obs.end(), transition.obs.begin(), transition.obs.end());
+        res.reward.push_back(transition.reward);
+        res.done.push_back(transition.done);
+    }
+    return true;
+}
+
 // For non-blocking keyboard inputs
 int getch(void)
 {
@@ -298,7 +393,7 @@ void write_result(Estimator::Ptr estimator)
     ofstream out(result_path, ios::out);
     out.setf(ios::fixed, ios::floatfield);
     out.precision(5);
-    for (auto &pair : lvio_fusion::Map::Instance().keyframes)
+    for (auto &pair : *lvio_fusion::Map::Instance().GetSnapshot())
     {
         out << pair.first - init_time << ",";
         SE3d pose = pair.second->pose;
@@ -313,6 +408,12 @@ void write_result(Estimator::Ptr estimator)
             << R.w() << endl;
     }
     out.close();
+    if (!map_path.empty())
+    {
+        ROS_WARN("Writing map file: %s", map_path.c_str());
+        lvio_fusion::MapFile::Save(map_path);
+    }
+    estimator->SaveImuState();
     ROS_WARN("Finished!!!");
 }
 
@@ -323,7 +424,7 @@ void read_ground_truth()
     string line;
     stringstream ss;
     double time, x, y, z, qx, qy, qz, qw;
-    double dt = lvio_fusion::Map::Instance().keyframes.begin()->first;
+    double dt = lvio_fusion::Map::Instance().GetSnapshot()->begin()->first;
     Matrix3d R_tf;
     R_tf << 0, 0, 1,
         -1, 0, 0,
@@ -386,9 +487,11 @@ void keyboard_process()
             break;
         case 'e':
         {
-            double end_time = (--lvio_fusion::Map::Instance().keyframes.end())->first;
+            double end_time = lvio_fusion::Map::Instance().GetSnapshot()->rbegin()->first;
             lvio_fusion::Map::Instance().end = true;
             estimator->backend->UpdateMap();
+            // the last section is closed by the global loop
+            lvio_fusion::EventBus::Instance().Publish(lvio_fusion::Event::SectionClosed, end_time);
         }
             ROS_WARN("Final Navsat Optimization!");
             break;
@@ -401,7 +504,7 @@ void keyboard_process()
 class RealCore : public lvio_fusion::Core
 {
 public:
-    virtual void Update(Observation &obs, Weights &weights)
+    virtual void UpdateWeights(Observation &obs, Weights &weights)
     {
         lvio_fusion_node::UpdateWeights srv;
         srv.request.obs = obs;
@@ -415,6 +518,28 @@ public:
         weights.lidar_surf = srv.response.lidar_surf;
         weights.updated = true;
     }
+
+    // one round trip for the whole batch
+    virtual void UpdateWeights(std::vector<Observation> &batch, std::vector<Weights> &weights)
+    {
+        lvio_fusion_node::UpdateWeightsBatch srv;
+        srv.request.num = batch.size();
+        for (auto &obs : batch)
+        {
+            srv.request.obs.insert(srv.request.obs.end(), obs.begin(), obs.end());
+        }
+        if (!clt_update_weights_batch.call(srv) || srv.response.visual.size() != batch.size())
+        {
+            ROS_ERROR("Error: can not update weights.");
+            return;
+        }
+        for (int i = 0; i < batch.size(); i++)
+        {
+            weights[i].visual = srv.response.visual[i];
+            weights[i].lidar_ground = srv.response.lidar_ground[i];
+            weights[i].lidar_surf = srv.response.lidar_surf[i];
+        }
+    }
 };
 
 int main(int argc, char **argv)
@@ -449,13 +574,27 @@ int main(int argc, char **argv)
     read_parameters(config_file);
     estimator = Estimator::Ptr(new Estimator(config_file));
     assert(estimator->Init(use_imu, use_lidar, use_navsat, use_loop, use_adapt) == true);
+    // environments and map files need the features of old keyframes
+    if (train || !map_path.empty())
+    {
+        lvio_fusion::Map::Instance().compact_landmarks = false;
+    }
     ROS_WARN("Waiting for images...");
     register_pub(n);
     ros::Timer tf_timer = n.createTimer(ros::Duration(0.0001), tf_timer_callback);
     ros::Timer od_timer = n.createTimer(ros::Duration(1), od_timer_callback);
+    svr_rebuild_path = n.advertiseService("/lvio_fusion_node/rebuild_path", rebuild_path_callback);
+    svr_memory = n.advertiseService("/lvio_fusion_node/memory", memory_callback);
     ros::Timer lm_timer = n.createTimer(ros::Duration(0.1), lm_timer_callback);
+    ros::Timer metrics_timer = n.createTimer(ros::Duration(5), metrics_timer_callback);
     ros::Timer pc_timer;
     ros::Timer navsat_timer;
+    ros::Timer tracking_timer;
+    if (debug_image)
+    {
+        // drawn at a low rate in the ros thread, the frontend only records the features
+        tracking_timer = n.createTimer(ros::Duration(0.1), tracking_timer_callback);
+    }
 
     cout << "image0:" << IMAGE0_TOPIC << endl;
     sub_img0 = n.subscribe(IMAGE0_TOPIC, 10, img0_callback);
@@ -484,18 +623,25 @@ int main(int argc, char **argv)
     }
     if (use_adapt)
     {
-        clt_update_weights = n.serviceClient<lvio_fusion_node::UpdateWeights>("/lvio_fusion_node/update_weight");
-        Agent::SetCore(new RealCore());
+        clt_update_weights = n.serviceClient<lvio_fusion_node::UpdateWeights>("/lvio_fusion_node/update_weights");
+        clt_update_weights_batch = n.serviceClient<lvio_fusion_node::UpdateWeightsBatch>("/lvio_fusion_node/update_weights_batch");
+        Agent::SetCore(new RealCore(), adapt_deadline, adapt_batch);
     }
     if (train)
     {
         clt_init = n.serviceClient<lvio_fusion_node::Init>("/lvio_fusion_node/init");
         svr_create_env = n.advertiseService("/lvio_fusion_node/create_env", create_env_callback);
         svr_step = n.advertiseService("/lvio_fusion_node/step", step_callback);
+        svr_step_batch = n.advertiseService("/lvio_fusion_node/step_batch", step_batch_callback);
     }
     thread sync_thread{sync_process};
     thread control_thread{keyboard_process};
     ros::spin();
+    if (!metrics_path.empty())
+    {
+        ROS_WARN("Writing metrics file: %s", metrics_path.c_str());
+        Metrics::Instance().Dump(metrics_path);
+    }
     sync_thread.join();
     control_thread.join();
     return 0;
@@ -0,0 +1,103 @@
+#include <ros/ros.h>
+
+#include "lvio_fusion/loop/map_merger.h"
+#include "lvio_fusion_node/GetTile.h"
+#include "lvio_fusion_node/Merge.h"
+
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+using namespace lvio_fusion;
+
+// merges the sessions of vehicles into one map, and serves the tiles of it to the vehicles for localization,
+// a vehicle writes its tile to a file and starts with it as prior_map.
+
+string vocabulary;
+double resolution = 0.2;
+int num_threads = 0;
+std::mutex mutex_tiles;
+string tiles_directory;
+double tiles_size = 0;
+
+bool merge_callback(lvio_fusion_node::Merge::Request &req,
+                    lvio_fusion_node::Merge::Response &res)
+{
+    MapMerger merger(vocabulary, resolution, num_threads);
+    if (req.sessions.empty() || !merger.Load(req.sessions))
+    {
+        ROS_ERROR("Can not read the sessions");
+        return false;
+    }
+    merger.DetectLoops();
+    res.num_merged = merger.Optimize();
+    res.num_loops = merger.Loops().size();
+    for (int i = 0; i < req.sessions.size(); i++)
+    {
+        if (!merger.Merged()[i])
+        {
+            ROS_WARN("Session %s is not connected to %s", req.sessions[i].c_str(), req.sessions[0].c_str());
+        }
+    }
+    if (!req.output.empty() && !merger.Save(req.output))
+    {
+        ROS_ERROR("Can not write %s", req.output.c_str());
+        return false;
+    }
+    if (!req.tiles.empty() && req.tile_size > 0)
+    {
+        res.tile_paths = merger.SaveTiles(req.tiles, req.tile_size);
+        std::unique_lock<std::mutex> lock(mutex_tiles);
+        tiles_directory = req.tiles;
+        tiles_size = req.tile_size;
+    }
+    ROS_INFO("Merged %d of %d sessions with %d loops", res.num_merged, (int)req.sessions.size(), res.num_loops);
+    return true;
+}
+
+bool get_tile_callback(lvio_fusion_node::GetTile::Request &req,
+                       lvio_fusion_node::GetTile::Response &res)
+{
+    string directory;
+    double size;
+    {
+        std::unique_lock<std::mutex> lock(mutex_tiles);
+        directory = tiles_directory;
+        size = tiles_size;
+    }
+    if (directory.empty())
+        return false;
+    // the same names as MapMerger::SaveTiles
+    res.name = "tile_" + to_string((int)floor(req.x / size)) + "_" + to_string((int)floor(req.y / size)) + ".map";
+    ifstream in(directory + "/" + res.name, ios::in | ios::binary);
+    if (in)
+    {
+        res.data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    ros::init(argc, argv, "map_server");
+    ros::NodeHandle n("~");
+    ros::console::set_logger_level(ROSCONSOLE_DEFAULT_NAME, ros::console::levels::Info);
+
+    n.param<string>("vocabulary", vocabulary, "");
+    n.param<double>("resolution", resolution, 0.2);
+    n.param<int>("threads", num_threads, std::thread::hardware_concurrency());
+    // tiles merged before, served until the next merge
+    n.param<string>("tiles", tiles_directory, "");
+    n.param<double>("tile_size", tiles_size, 200);
+
+    // a merge may take long, tiles are served meanwhile
+    ros::ServiceServer svr_merge = n.advertiseService("/map_server/merge", merge_callback);
+    ros::ServiceServer svr_get_tile = n.advertiseService("/map_server/get_tile", get_tile_callback);
+    ros::AsyncSpinner spinner(2);
+    spinner.start();
+    ros::waitForShutdown();
+    return 0;
+}
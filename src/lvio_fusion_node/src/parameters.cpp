@@ -2,10 +2,14 @@
 
 string IMU_TOPIC;
 string LIDAR_TOPIC;
+string RING_FIELD, TIME_FIELD;
 string NAVSAT_TOPIC;
 string IMAGE0_TOPIC, IMAGE1_TOPIC;
-string result_path, ground_truth_path;
+string result_path, ground_truth_path, metrics_path, map_path;
 int use_imu, use_lidar, use_navsat, use_loop, use_eskf, use_adapt, train;
+double adapt_deadline;
+int adapt_batch;
+int debug_image;
 
 void read_parameters(string config_file)
 {
@@ -30,8 +34,16 @@ void read_parameters(string config_file)
     settings["use_loop"] >> use_loop;
     settings["use_eskf"] >> use_eskf;
     settings["use_adapt"] >> use_adapt;
+    if (use_adapt)
+    {
+        settings["adapt_deadline"] >> adapt_deadline;
+        settings["adapt_batch"] >> adapt_batch;
+    }
+    settings["debug_image"] >> debug_image;
     settings["result_path"] >> result_path;
     settings["ground_truth_path"] >> ground_truth_path;
+    settings["metrics_path"] >> metrics_path;
+    settings["map_path"] >> map_path;
     settings["image0_topic"] >> IMAGE0_TOPIC;
     settings["image1_topic"] >> IMAGE1_TOPIC;
     if (use_imu)
@@ -41,6 +53,11 @@ void read_parameters(string config_file)
     if (use_lidar)
     {
         settings["lidar_topic"] >> LIDAR_TOPIC;
+        string lidar_fields;
+        settings["lidar_fields"] >> lidar_fields;
+        size_t comma = lidar_fields.find(',');
+        RING_FIELD = lidar_fields.substr(0, comma);
+        TIME_FIELD = comma == string::npos ? "" : lidar_fields.substr(comma + 1);
     }
     if (use_navsat)
     {
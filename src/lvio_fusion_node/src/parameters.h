@@ -8,14 +8,18 @@ using namespace std;
 
 extern string IMU_TOPIC;
 extern string LIDAR_TOPIC;
+extern string RING_FIELD, TIME_FIELD;
 extern string NAVSAT_TOPIC;
 extern string IMAGE0_TOPIC, IMAGE1_TOPIC;
-extern string result_path, ground_truth_path;
+extern string result_path, ground_truth_path, metrics_path, map_path;
 extern int use_imu;
 extern int use_lidar;
 extern int use_navsat;
 extern int use_loop;
 extern int use_adapt;
+extern double adapt_deadline;
+extern int adapt_batch;
+extern int debug_image;
 extern int use_eskf;
 extern int train;
 
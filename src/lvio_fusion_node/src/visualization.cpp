@@ -1,15 +1,25 @@
 #include "visualization.h"
 #include "camera_pose.h"
 #include "lvio_fusion/map.h"
+#include "lvio_fusion/metrics.h"
 #include "lvio_fusion/visual/camera.h"
+#include "lvio_fusion_node/MapUpdate.h"
+#include "lvio_fusion_node/PathCorrection.h"
 
+#include <cv_bridge/cv_bridge.h>
 #include <pcl_conversions/pcl_conversions.h>
 
 ros::Publisher pub_path;
+ros::Publisher pub_path_increment;
+ros::Publisher pub_path_correction;
 ros::Publisher pub_navsat;
 ros::Publisher pub_points_cloud;
+ros::Publisher pub_points_cloud_update;
 ros::Publisher pub_local_map;
 ros::Publisher pub_car_model;
+ros::Publisher pub_metrics;
+ros::Publisher pub_tracking;
+ros::Publisher pub_imu_odometry;
 nav_msgs::Path path, navsat_path;
 
 ros::Publisher pub_camera_pose_visual;
@@ -19,10 +29,16 @@ CameraPoseVisualization cameraposevisual(1, 0, 0, 1);
 void register_pub(ros::NodeHandle &n)
 {
     pub_path = n.advertise<nav_msgs::Path>("path", 1000);
+    pub_path_increment = n.advertise<nav_msgs::Path>("path_increment", 1000);
+    pub_path_correction = n.advertise<lvio_fusion_node::PathCorrection>("path_correction", 1000);
     pub_navsat = n.advertise<nav_msgs::Path>("navsat_path", 1000);
     pub_points_cloud = n.advertise<sensor_msgs::PointCloud2>("point_cloud", 1000);
+    pub_points_cloud_update = n.advertise<lvio_fusion_node::MapUpdate>("point_cloud_update", 1000);
     pub_local_map = n.advertise<sensor_msgs::PointCloud2>("local_map", 1000);
     pub_car_model = n.advertise<visualization_msgs::Marker>("car_model", 1000);
+    pub_metrics = n.advertise<diagnostic_msgs::DiagnosticArray>("metrics", 10);
+    pub_tracking = n.advertise<sensor_msgs::Image>("tracking", 10);
+    pub_imu_odometry = n.advertise<nav_msgs::Odometry>("imu_odometry", 100);
 
     pub_camera_pose_visual = n.advertise<visualization_msgs::MarkerArray>("camera_pose_visual", 1000);
 
@@ -30,26 +46,75 @@ void register_pub(ros::NodeHandle &n)
     cameraposevisual.setLineWidth(0.01);
 }
 
+geometry_msgs::PoseStamped to_pose_stamped(double time, const SE3d &pose)
+{
+    geometry_msgs::PoseStamped pose_stamped;
+    pose_stamped.header.stamp = ros::Time(time);
+    pose_stamped.header.frame_id = "world";
+    pose_stamped.pose.position.x = pose.translation().x();
+    pose_stamped.pose.position.y = pose.translation().y();
+    pose_stamped.pose.position.z = pose.translation().z();
+    pose_stamped.pose.orientation.w = pose.unit_quaternion().w();
+    pose_stamped.pose.orientation.x = pose.unit_quaternion().x();
+    pose_stamped.pose.orientation.y = pose.unit_quaternion().y();
+    pose_stamped.pose.orientation.z = pose.unit_quaternion().z();
+    return pose_stamped;
+}
+
 void publish_odometry(Estimator::Ptr estimator, double time)
+{
+    // keyframes before the last finished time are only moved by the corrections,
+    // so the published poses of them are still valid after the corrections.
+    static double finished = 0;
+    std::vector<Correction> corrections;
+    double moved = PoseGraph::Instance().TakeCorrections(corrections);
+    for (auto &correction : corrections)
+    {
+        lvio_fusion_node::PathCorrection msg;
+        msg.header.stamp = ros::Time(time);
+        msg.header.frame_id = "world";
+        msg.start = ros::Time(correction.start);
+        msg.end = ros::Time(correction.end);
+        Quaterniond q = correction.transform.unit_quaternion();
+        Vector3d t = correction.transform.translation();
+        msg.transform.translation.x = t.x();
+        msg.transform.translation.y = t.y();
+        msg.transform.translation.z = t.z();
+        msg.transform.rotation.w = q.w();
+        msg.transform.rotation.x = q.x();
+        msg.transform.rotation.y = q.y();
+        msg.transform.rotation.z = q.z();
+        pub_path_correction.publish(msg);
+    }
+
+    // new keyframes, keyframes in the window of backend, and keyframes moved non-rigidly,
+    // the receiver replaces its poses with the same stamps.
+    nav_msgs::Path increment;
+    for (auto &pair : lvio_fusion::Map::Instance().GetKeyFrames(std::min(moved, finished)))
+    {
+        increment.poses.push_back(to_pose_stamped(pair.first, pair.second->pose));
+    }
+    finished = estimator->backend->finished;
+    if (increment.poses.empty() && corrections.empty())
+        return;
+    increment.header.stamp = ros::Time(time);
+    increment.header.frame_id = "world";
+    pub_path_increment.publish(increment);
+}
+
+int publish_path(Estimator::Ptr estimator, double time)
 {
     auto &&submap = PoseGraph::Instance().GetSections(0, 0);
     submap[PoseGraph::Instance().current_section.A] = PoseGraph::Instance().current_section;
     path.poses.clear();
     cameraposevisual.reset();
-    for (auto &pair : lvio_fusion::Map::Instance().keyframes)
+    int num_poses = 0;
+    for (auto &pair : *lvio_fusion::Map::Instance().GetSnapshot())
     {
         auto pose = pair.second->pose;
-        geometry_msgs::PoseStamped pose_stamped;
-        pose_stamped.header.stamp = ros::Time(pair.first);
-        pose_stamped.header.frame_id = "world";
-        pose_stamped.pose.position.x = pose.translation().x();
-        pose_stamped.pose.position.y = pose.translation().y();
-        pose_stamped.pose.position.z = pose.translation().z();
-        pose_stamped.pose.orientation.w = pose.unit_quaternion().w();
-        pose_stamped.pose.orientation.x = pose.unit_quaternion().x();
-        pose_stamped.pose.orientation.y = pose.unit_quaternion().y();
-        pose_stamped.pose.orientation.z = pose.unit_quaternion().z();
+        geometry_msgs::PoseStamped pose_stamped = to_pose_stamped(pair.first, pose);
         path.poses.push_back(pose_stamped);
+        num_poses++;
         if (pair.first == submap.begin()->first)
         {
             geometry_msgs::PoseStamped pose_stamped_sec;
@@ -83,6 +148,7 @@ void publish_odometry(Estimator::Ptr estimator, double time)
     path.header.frame_id = "world";
     pub_path.publish(path);
     cameraposevisual.publish_by(pub_camera_pose_visual, path.header);
+    return num_poses;
 }
 
 void publish_navsat(Estimator::Ptr estimator, double time)
@@ -92,14 +158,14 @@ void publish_navsat(Estimator::Ptr estimator, double time)
     static int i = 0;
     if (navsat->initialized)
     {
-        auto iter = navsat->raw.upper_bound(finished);
-        while (++iter != navsat->raw.end())
+        auto points = navsat->GetRawPoints(finished);
+        for (auto &pair : points)
         {
             if (++i % 10 == 0)
             {
                 geometry_msgs::PoseStamped pose_stamped;
-                Vector3d point = navsat->GetPoint(iter->first);
-                pose_stamped.header.stamp = ros::Time(iter->first);
+                Vector3d point = navsat->GetPoint(pair.first);
+                pose_stamped.header.stamp = ros::Time(pair.first);
                 pose_stamped.header.frame_id = "world";
                 pose_stamped.pose.position.x = point.x();
                 pose_stamped.pose.position.y = point.y();
@@ -107,7 +173,10 @@ void publish_navsat(Estimator::Ptr estimator, double time)
                 navsat_path.poses.push_back(pose_stamped);
             }
         }
-        finished = (--iter)->first;
+        if (!points.empty())
+        {
+            finished = points.back().first;
+        }
         navsat_path.header.stamp = ros::Time(time);
         navsat_path.header.frame_id = "world";
         pub_navsat.publish(navsat_path);
@@ -146,11 +215,33 @@ void publish_tf(Estimator::Ptr estimator, double time)
 
 void publish_point_cloud(Estimator::Ptr estimator, double time)
 {
+    // only the changed chunks, each one replaces the chunk of the subscribers
+    auto updates = estimator->mapping->GetGlobalMapUpdate();
+    if (updates.empty())
+        return;
+    lvio_fusion_node::MapUpdate msg;
+    msg.header.stamp = ros::Time(time);
+    msg.header.frame_id = "world";
+    msg.chunk_size = estimator->mapping->global_map.ChunkSize();
+    for (auto &update : updates)
+    {
+        lvio_fusion_node::MapChunk chunk;
+        chunk.x = update.chunk.x;
+        chunk.y = update.chunk.y;
+        chunk.z = update.chunk.z;
+        pcl::toROSMsg(update.points, chunk.points);
+        chunk.points.header = msg.header;
+        msg.chunks.push_back(chunk);
+    }
+    pub_points_cloud_update.publish(msg);
     sensor_msgs::PointCloud2 ros_cloud;
-    pcl::toROSMsg(estimator->mapping->GetGlobalMap(), ros_cloud);
-    ros_cloud.header.stamp = ros::Time(time);
-    ros_cloud.header.frame_id = "world";
-    pub_points_cloud.publish(ros_cloud);
+    if (pub_points_cloud.getNumSubscribers() > 0)
+    {
+        pcl::toROSMsg(estimator->mapping->GetGlobalMap(), ros_cloud);
+        ros_cloud.header.stamp = ros::Time(time);
+        ros_cloud.header.frame_id = "world";
+        pub_points_cloud.publish(ros_cloud);
+    }
 }
 
 void publish_local_map(Estimator::Ptr estimator, double time)
@@ -198,4 +289,119 @@ void publish_car_model(Estimator::Ptr estimator, double time)
     car_mesh.scale.z = major_scale;
 
     pub_car_model.publish(car_mesh);
-}
\ No newline at end of file
+}
+
+diagnostic_msgs::KeyValue key_value(const string &key, double value)
+{
+    diagnostic_msgs::KeyValue kv;
+    kv.key = key;
+    kv.value = to_string(value);
+    return kv;
+}
+
+void publish_metrics(Estimator::Ptr estimator, double time)
+{
+    diagnostic_msgs::DiagnosticArray array;
+    array.header.stamp = ros::Time(time);
+    for (auto &stat : Metrics::Instance().GetStats())
+    {
+        // latency in ms
+        diagnostic_msgs::DiagnosticStatus status;
+        status.level = diagnostic_msgs::DiagnosticStatus::OK;
+        status.name = stat.name;
+        status.values.push_back(key_value("count", stat.count));
+        status.values.push_back(key_value("mean", stat.mean * 1e3));
+        status.values.push_back(key_value("p50", stat.p50 * 1e3));
+        status.values.push_back(key_value("p99", stat.p99 * 1e3));
+        status.values.push_back(key_value("max", stat.max * 1e3));
+        array.status.push_back(status);
+    }
+    diagnostic_msgs::DiagnosticStatus counters;
+    counters.level = diagnostic_msgs::DiagnosticStatus::OK;
+    counters.name = "counters";
+    for (auto &pair : Metrics::Instance().GetCounters())
+    {
+        counters.values.push_back(key_value(pair.first, pair.second));
+    }
+    array.status.push_back(counters);
+    diagnostic_msgs::DiagnosticStatus memory;
+    memory.level = diagnostic_msgs::DiagnosticStatus::OK;
+    memory.name = "memory";
+    for (auto &stat : Metrics::Instance().GetMemoryStats())
+    {
+        memory.values.push_back(key_value(stat.name + ".bytes", stat.bytes));
+        memory.values.push_back(key_value(stat.name + ".objects", stat.objects));
+    }
+    array.status.push_back(memory);
+    pub_metrics.publish(array);
+}
+
+void publish_tracking(Estimator::Ptr estimator, bool show)
+{
+    static double published = 0;
+    Tracking tracking = estimator->frontend->GetTracking();
+    if (tracking.image.empty() || tracking.time == published)
+        return;
+    published = tracking.time;
+
+    cv_bridge::CvImage image;
+    image.header.stamp = ros::Time(tracking.time);
+    image.header.frame_id = "world";
+    image.encoding = sensor_msgs::image_encodings::BGR8;
+    cv::cvtColor(tracking.image, image.image, cv::COLOR_GRAY2BGR);
+    for (auto &pair : tracking.deviations)
+    {
+        cv::arrowedLine(image.image, pair.first, pair.first + pair.second, cv::Scalar(0, 255, 0), 1, 8, 0, 0.2);
+    }
+    for (auto &pt : tracking.rejected)
+    {
+        cv::putText(image.image, "X", pt, cv::FONT_HERSHEY_SIMPLEX, 0.5, cv::Scalar(0, 0, 255));
+    }
+    for (auto &pt : tracking.near)
+    {
+        cv::circle(image.image, pt, 2, cv::Scalar(0, 255, 0), cv::FILLED);
+    }
+    for (auto &pt : tracking.far)
+    {
+        cv::circle(image.image, pt, 2, cv::Scalar(0, 0, 255), cv::FILLED);
+    }
+    for (auto &pt : tracking.matched)
+    {
+        cv::circle(image.image, pt, 2, cv::Scalar(255, 0, 0), cv::FILLED);
+    }
+    pub_tracking.publish(image.toImageMsg());
+    if (show)
+    {
+        cv::imshow("tracking", image.image);
+        cv::waitKey(1);
+    }
+}
+
+void publish_imu_odometry(Estimator::Ptr estimator)
+{
+    static double published = 0;
+    imu::Propagator::State state;
+    if (!estimator->propagator || !estimator->propagator->Get(state) || state.time <= published)
+        return;
+    published = state.time;
+
+    nav_msgs::Odometry odometry;
+    odometry.header.stamp = ros::Time(state.time);
+    odometry.header.frame_id = "world";
+    odometry.child_frame_id = "base_link";
+    Quaterniond q = state.pose.unit_quaternion();
+    Vector3d t = state.pose.translation();
+    // the twist is in the child frame
+    Vector3d v = q.inverse() * state.Vw;
+    odometry.pose.pose.position.x = t.x();
+    odometry.pose.pose.position.y = t.y();
+    odometry.pose.pose.position.z = t.z();
+    odometry.pose.pose.orientation.w = q.w();
+    odometry.pose.pose.orientation.x = q.x();
+    odometry.pose.pose.orientation.y = q.y();
+    odometry.pose.pose.orientation.z = q.z();
+    odometry.twist.twist.linear.x = v.x();
+    odometry.twist.twist.linear.y = v.y();
+    odometry.twist.twist.linear.z = v.z();
+    pub_imu_odometry.publish(odometry);
+}
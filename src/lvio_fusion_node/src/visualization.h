@@ -15,6 +15,7 @@
 #include <visualization_msgs/Marker.h>
 #include <visualization_msgs/MarkerArray.h>
 #include <tf/transform_broadcaster.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 
 #include "lvio_fusion/estimator.h"
 
@@ -22,8 +23,12 @@ using namespace lvio_fusion;
 
 void register_pub(ros::NodeHandle &n);
 
+// new and moved poses of keyframes, and rigid corrections of the published poses
 void publish_odometry(Estimator::Ptr estimator, double time);
 
+// rebuild the whole path with sections, loops and camera poses, return the number of keyframes
+int publish_path(Estimator::Ptr estimator, double time);
+
 void publish_navsat(Estimator::Ptr estimator, double time);
 
 void publish_point_cloud(Estimator::Ptr estimator, double time);
@@ -34,4 +39,12 @@ void publish_tf(Estimator::Ptr estimator, double time);
 
 void publish_car_model(Estimator::Ptr estimator, double time);
 
+void publish_metrics(Estimator::Ptr estimator, double time);
+
+// pose and velocity propagated by the latest imu sample
+void publish_imu_odometry(Estimator::Ptr estimator);
+
+// draw the recorded features of the last frame, show = also show it in a window
+void publish_tracking(Estimator::Ptr estimator, bool show);
+
 #endif // lvio_fusion_VISUALIZATION_H
\ No newline at end of file
@@ -3,6 +3,7 @@ import numpy as np
 from gym import spaces
 from numpy.core.numeric import Inf
 from std_msgs.msg import Float32
+from tianshou.env import DummyVectorEnv
 
 
 class LvioFusionEnv(gym.Env):
@@ -11,6 +12,7 @@ class LvioFusionEnv(gym.Env):
     obs_cols = None
     client_create_env = None
     client_step = None
+    client_step_batch = None
 
     def __init__(self):
         self.action_space = spaces.Box(
@@ -23,15 +25,18 @@ class LvioFusionEnv(gym.Env):
         err_msg = "%r (%s) invalid" % (action, type(action))
         assert self.action_space.contains(action), err_msg
         resp = LvioFusionEnv.client_step(self.id, 1, action[0], action[1])
-        obs = np.array(resp.obs)
-        if obs.size == 0 or resp.done:
+        return self.result(resp.obs, resp.reward, resp.done)
+
+    def result(self, obs, reward, done):
+        obs = np.array(obs)
+        if obs.size == 0 or done:
             obs = np.zeros(shape=(LvioFusionEnv.obs_rows,
                                   LvioFusionEnv.obs_cols, 3), dtype=np.float32)
-            resp.done = True
+            done = True
         else:
             obs = obs.reshape(LvioFusionEnv.obs_rows,
                               LvioFusionEnv.obs_cols, 3)
-        return obs, resp.reward, resp.done, {}
+        return obs, reward, done, {}
 
     def reset(self):
         resp = LvioFusionEnv.client_create_env()
@@ -39,3 +44,23 @@ class LvioFusionEnv(gym.Env):
         obs = np.array(resp.obs).reshape(
             LvioFusionEnv.obs_rows, LvioFusionEnv.obs_cols, 3)
         return obs
+
+
+class LvioFusionVectorEnv(DummyVectorEnv):
+    """step all environments in one service call, lvio_fusion_node runs them in parallel"""
+
+    def step(self, action, id=None):
+        if id is None:
+            id = range(self.env_num)
+        elif np.isscalar(id):
+            id = [id]
+        envs = [self.workers[i].env for i in id]
+        resp = LvioFusionEnv.client_step_batch(
+            [env.id for env in envs], [1] * len(envs),
+            [a[0] for a in action], [a[1] for a in action])
+        results = []
+        for i, env in enumerate(envs):
+            obs = resp.obs[i * resp.obs_size:(i + 1) * resp.obs_size]
+            results.append(env.result(obs, resp.reward[i], resp.done[i]))
+        obs, rew, done, info = zip(*results)
+        return np.stack(obs), np.stack(rew), np.stack(done), np.array(info)
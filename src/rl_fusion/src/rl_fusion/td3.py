@@ -14,7 +14,7 @@ from tianshou.utils.net.common import Net
 from tianshou.utils.net.continuous import Actor, Critic
 from torch.utils.tensorboard import SummaryWriter
 
-from rl_fusion.env import LvioFusionEnv
+from rl_fusion.env import LvioFusionEnv, LvioFusionVectorEnv
 from lvio_fusion_node.srv import *
 
 save_net_path = '/home/jyp/Projects/lvio_fusion/misc/td3.pt'
@@ -61,10 +61,10 @@ def train_td3(args=get_args()):
     args.max_action = env.action_space.high[0]
     # you can also use tianshou.env.SubprocVectorEnv
     # train_envs = gym.make(args.task)
-    train_envs = DummyVectorEnv(
+    train_envs = LvioFusionVectorEnv(
         [lambda: gym.make(args.task) for _ in range(args.training_num)])
     # test_envs = gym.make(args.task)
-    test_envs = DummyVectorEnv(
+    test_envs = LvioFusionVectorEnv(
         [lambda: gym.make(args.task) for _ in range(args.test_num)])
     # seed
     np.random.seed(args.seed)
@@ -136,3 +136,9 @@ def get_weights(obs):
     batch = Batch(obs=[obs], info='')  # the first dimension is batch-size
     act = agent_policy(batch).act[0]  # policy.forward return a batch, use ".act" to extract the action
     return act
+
+def get_weights_batch(obs):
+    global agent_policy
+    batch = Batch(obs=obs, info='')  # one forward pass for all observations
+    act = agent_policy(batch).act
+    return [a for a in act]